@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "affinity.h"
+
+
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 		 49
+#endif
+
+
+
+/* Memory policy mode from <linux/mempolicy.h>, allocations are
+ * served from the node of the CPU that triggers them
+ */
+#define MPOL_LOCAL 				  4
+
+
+
+int32_t get_worker_cpu(int32_t worker_index) {
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		return -1;
+	}
+
+	int32_t allowed_count = CPU_COUNT(&allowed);
+	if(allowed_count == 0) {
+		return -1;
+	}
+
+	int32_t wanted = worker_index % allowed_count;
+
+	for(int32_t cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if(!CPU_ISSET(cpu, &allowed)) {
+			continue;
+		}
+
+		if(wanted == 0) {
+			return cpu;
+		}
+
+		wanted--;
+	}
+
+	return -1;
+}
+
+
+
+int32_t pin_to_cpu(int32_t cpu) {
+	cpu_set_t target;
+	CPU_ZERO(&target);
+	CPU_SET(cpu, &target);
+
+	if(sched_setaffinity(0, sizeof(target), &target) < 0) {
+		return -1;
+	}
+
+	/* Default policy is already local on most systems, but the process may
+	 * have been started under numactl --interleave or similar. Failure
+	 * (kernel without NUMA support) leaves the default policy in place.
+	 */
+	syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0);
+
+	return 0;
+}
+
+
+
+void steer_incoming_cpu(int32_t socket_desc, int32_t cpu) {
+	if(setsockopt(socket_desc, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+		fprintf(stderr, "setsockopt SO_INCOMING_CPU: %s\n", strerror(errno));
+	}
+}
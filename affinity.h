@@ -0,0 +1,36 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+
+
+#include <stdint.h>
+
+
+
+/* Returns the CPU assigned to the worker with passed index: workers are
+ * spread round-robin over the CPUs the server process is allowed to run on.
+ * Returns -1 if the allowed CPU set can not be obtained.
+ */
+int32_t get_worker_cpu(int32_t);
+
+
+
+/* Pins calling process to the passed CPU and makes its memory policy
+ * prefer the NUMA node local to that CPU, so that memory first touched
+ * afterwards is allocated on the owning node. Returns 0 on success and
+ * -1 on failure.
+ */
+int32_t pin_to_cpu(int32_t);
+
+
+
+/* Sets SO_INCOMING_CPU on passed (SO_REUSEPORT) listening socket, so that
+ * the kernel hands connections whose packets are processed on that CPU
+ * (its NIC RSS queue) to this socket. Failures are reported on stderr
+ * but are not fatal.
+ */
+void steer_incoming_cpu(int32_t, int32_t);
+
+
+
+#endif /* AFFINITY_H */
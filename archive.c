@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "archive.h"
+
+
+
+struct archive_t {
+	int32_t fd;
+
+	/* Mapped index of the archive
+	 */
+	char *index;
+	size_t index_size;
+
+	const struct archive_header *header;
+	const uint32_t *displacements;
+	const uint32_t *slots;
+	const struct archive_entry *entries;
+};
+
+
+
+uint64_t hash_archived_path(const char *path, size_t length, uint64_t seed) {
+	uint64_t hash = 14695981039346656037ull ^ seed;
+
+	for(size_t i = 0; i < length; ++i) {
+		hash ^= (unsigned char) path[i];
+		hash *= 1099511628211ull;
+	}
+
+	/* Final mix spreads the bits of short paths
+	 * over the whole hash
+	 */
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+
+
+uint32_t get_archive_slot(uint64_t hash, uint32_t displacement, uint32_t slots_count) {
+	uint64_t mixed = hash + displacement * 0x9e3779b97f4a7c15ull;
+
+	mixed ^= mixed >> 31;
+	mixed *= 0xc4ceb9fe1a85ec53ull;
+	mixed ^= mixed >> 29;
+
+	return (uint32_t) (mixed % slots_count);
+}
+
+
+
+bool is_archive_path(const char *path) {
+	struct stat statbuf;
+
+	return (stat(path, &statbuf) == 0 && S_ISREG(statbuf.st_mode));
+}
+
+
+
+/* Checks whether range of passed offset and length lies within
+ * passed size
+ */
+static
+bool is_within(uint64_t offset, uint64_t length, uint64_t size) {
+	return (offset <= size && length <= size - offset);
+}
+
+
+
+/* Checks that the tables and every entry of the index lie within the
+ * archive of passed size, so that lookups need no further checks
+ */
+static
+bool is_index_valid(const archive_t *archive, uint64_t archive_size) {
+	const struct archive_header *header = archive->header;
+	uint64_t index_size = archive->index_size;
+
+	if(!is_within(header->displacements_offset, (uint64_t) header->buckets_count * sizeof(uint32_t), index_size) ||
+	   !is_within(header->slots_offset, (uint64_t) header->slots_count * sizeof(uint32_t), index_size) ||
+	   !is_within(header->entries_offset, (uint64_t) header->entries_count * sizeof(struct archive_entry), index_size) ||
+	   header->displacements_offset % sizeof(uint32_t) != 0 || header->slots_offset % sizeof(uint32_t) != 0 ||
+	   header->entries_offset % sizeof(uint64_t) != 0) {
+
+		return false;
+	}
+
+	if(header->entries_count > 0 && (header->buckets_count == 0 || header->slots_count < header->entries_count)) {
+		return false;
+	}
+
+	for(uint32_t i = 0; i < header->slots_count; ++i) {
+		if(archive->slots[i] != ARCHIVE_EMPTY_SLOT && archive->slots[i] >= header->entries_count) {
+			return false;
+		}
+	}
+
+	for(uint32_t i = 0; i < header->entries_count; ++i) {
+		const struct archive_entry *entry = &archive->entries[i];
+
+		if(!is_within(entry->path_offset, entry->path_length, index_size) ||
+		   !is_within(entry->head_offset, entry->head_length, index_size) ||
+		   !is_within(entry->body_offset, entry->body_length, archive_size)) {
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+
+archive_t *open_archive(const char *path) {
+	int32_t fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if(fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	struct stat statbuf;
+	struct archive_header header;
+
+	if(fstat(fd, &statbuf) < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	   memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)) != 0 ||
+	   header.index_size < sizeof(header) || header.index_size > (uint64_t) statbuf.st_size) {
+
+		fprintf(stderr, "%s: not a valid archive\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	archive_t *archive = malloc(sizeof(archive_t));
+
+	if(archive == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	/* Only the index is mapped, bodies are sent with sendfile()
+	 */
+	void *index = mmap(NULL, header.index_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if(index == MAP_FAILED) {
+		perror(path);
+		free(archive);
+		close(fd);
+		return NULL;
+	}
+
+	madvise(index, header.index_size, MADV_WILLNEED);
+
+	archive->fd = fd;
+	archive->index = index;
+	archive->index_size = header.index_size;
+	archive->header = index;
+	archive->displacements = (const uint32_t *) (archive->index + header.displacements_offset);
+	archive->slots = (const uint32_t *) (archive->index + header.slots_offset);
+	archive->entries = (const struct archive_entry *) (archive->index + header.entries_offset);
+
+	if(!is_index_valid(archive, statbuf.st_size)) {
+		fprintf(stderr, "%s: corrupted archive index\n", path);
+		close_archive(archive);
+		return NULL;
+	}
+
+	return archive;
+}
+
+
+
+void close_archive(archive_t *archive) {
+	munmap(archive->index, archive->index_size);
+	close(archive->fd);
+	free(archive);
+}
+
+
+
+bool find_archived_file(const archive_t *archive, const char *path, size_t length, archived_file_t *file) {
+	const struct archive_header *header = archive->header;
+
+	if(header->entries_count == 0) {
+		return false;
+	}
+
+	uint64_t hash = hash_archived_path(path, length, header->seed);
+	uint32_t displacement = archive->displacements[(hash >> 32) % header->buckets_count];
+	uint32_t index = archive->slots[get_archive_slot(hash, displacement, header->slots_count)];
+
+	if(index == ARCHIVE_EMPTY_SLOT) {
+		return false;
+	}
+
+	/* Paths which are not in the archive hash to slots
+	 * of other paths as well
+	 */
+	const struct archive_entry *entry = &archive->entries[index];
+
+	if(entry->path_length != length || memcmp(archive->index + entry->path_offset, path, length) != 0) {
+		return false;
+	}
+
+	file->fd = archive->fd;
+	file->offset = entry->body_offset;
+	file->length = entry->body_length;
+	file->head = archive->index + entry->head_offset;
+	file->head_length = entry->head_length;
+
+	return true;
+}
@@ -0,0 +1,134 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+
+/* Catalogue packed into a single file by serwer-pack. The index (header,
+ * perfect hash table of paths, entries, paths and precomputed response
+ * headers) is followed by the bodies of the files. Bodies of at least a page
+ * are page aligned, smaller ones are cache line aligned and never cross
+ * a page boundary. Integers are stored in the byte order of the host
+ * which packed the archive.
+ */
+#define ARCHIVE_MAGIC 				 "SIKPACK1"
+#define ARCHIVE_PAGE 				 4096
+#define ARCHIVE_LINE 				 64
+
+
+
+/* Slot of the path table which no path hashes to
+ */
+#define ARCHIVE_EMPTY_SLOT 			 UINT32_MAX
+
+
+
+/* Beginning of the archive. Path hashes to the bucket (upper half of the
+ * hash modulo buckets_count) whose displacement selects its slot, which
+ * stores index of its entry.
+ */
+struct archive_header {
+	char magic[8];
+	uint32_t entries_count;
+	uint32_t buckets_count;
+	uint32_t slots_count;
+	uint32_t reserved;
+	uint64_t seed;
+
+	/* Offsets of uint32_t displacements[buckets_count], uint32_t
+	 * slots[slots_count] and struct archive_entry entries[entries_count],
+	 * and size of the index (offset of the first body)
+	 */
+	uint64_t displacements_offset;
+	uint64_t slots_offset;
+	uint64_t entries_offset;
+	uint64_t index_size;
+};
+
+
+
+struct archive_entry {
+	/* Path (starting with '/', as requested) and response headers following
+	 * the Date header (up to the empty line), both within the index
+	 */
+	uint64_t path_offset;
+	uint64_t head_offset;
+
+	uint64_t body_offset;
+	uint64_t body_length;
+
+	uint32_t path_length;
+	uint32_t head_length;
+};
+
+
+
+/* Hashes path of passed length with passed seed of the archive
+ */
+uint64_t hash_archived_path(const char *, size_t, uint64_t);
+
+
+
+/* Returns slot of the path table for passed path hash, displacement
+ * of its bucket and number of slots
+ */
+uint32_t get_archive_slot(uint64_t, uint32_t, uint32_t);
+
+
+
+/* Archive opened by the server
+ */
+typedef struct archive_t archive_t;
+
+
+
+/* File found in the archive. Body is sent from the descriptor of the
+ * archive, head points into its index.
+ */
+typedef struct archived_file_t archived_file_t;
+
+
+
+struct archived_file_t {
+	int32_t fd;
+	off_t offset;
+	off_t length;
+
+	const char *head;
+	size_t head_length;
+};
+
+
+
+/* Checks whether catalogue of passed path is a packed archive
+ * (regular file) rather than a directory
+ */
+bool is_archive_path(const char *);
+
+
+
+/* Opens archive of passed path and maps its index into memory. Returns NULL
+ * if it can not be opened or is not a valid archive (reason is printed).
+ */
+archive_t *open_archive(const char *);
+
+
+
+void close_archive(archive_t *);
+
+
+
+/* Looks up file of passed path of passed length (as requested, starting
+ * with '/') in the archive. Returns false if the archive has none.
+ */
+bool find_archived_file(const archive_t *, const char *, size_t, archived_file_t *);
+
+
+
+#endif /* ARCHIVE_H */
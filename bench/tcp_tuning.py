@@ -0,0 +1,206 @@
+#!/usr/bin/env python3
+"""
+Measures every socket tuning option (-t) against the default profile. The
+server is started with the defaults and then with one option toggled at a
+time, and each start is driven by three workloads over loopback:
+
+  connect   new connection per small request (sent in the SYN with TFO
+            when fastopen is on), latency of the whole exchange
+  keepalive small requests on persistent connections, latency per request
+  bulk      large file over persistent connections, throughput
+
+Loopback hides propagation delay, so options which trade round trips
+(defer_accept, fastopen) show smaller differences than over a real
+network. Run from the directory holding the serwer binary:
+
+  make bench
+  python3 bench/tcp_tuning.py --duration 10 --clients 8
+"""
+
+import argparse
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+# Each option toggled away from the default profile of tcp_tuning.c, the
+# defaults are measured again last to show the run to run noise
+TOGGLES = [
+    ("defaults", ""),
+    ("defer_accept off", "defer_accept=0"),
+    ("fastopen off", "fastopen=0"),
+    ("nodelay off", "nodelay=0"),
+    ("cork off", "cork=0"),
+    ("sndbuf 64k", "sndbuf=65536"),
+    ("sndbuf 4m", "sndbuf=4194304"),
+    ("rcvbuf 64k", "rcvbuf=65536"),
+    ("busy_poll 50us", "busy_poll=50"),
+    ("defaults again", ""),
+]
+
+SMALL_SIZE = 512
+BULK_SIZE = 16 * 1024 * 1024
+
+
+def read_response(sock, buffer):
+    """Reads one response with Content-Length body, returns bytes left after it."""
+    while b"\r\n\r\n" not in buffer:
+        chunk = sock.recv(1 << 20)
+        if not chunk:
+            raise ConnectionError("closed before response head")
+        buffer += chunk
+
+    head, _, buffer = buffer.partition(b"\r\n\r\n")
+    length = 0
+
+    for line in head.split(b"\r\n")[1:]:
+        name, _, value = line.partition(b":")
+        if name.strip().lower() == b"content-length":
+            length = int(value)
+
+    while len(buffer) < length:
+        chunk = sock.recv(1 << 20)
+        if not chunk:
+            raise ConnectionError("closed in response body")
+        buffer += chunk
+
+    return buffer[length:]
+
+
+def connect_workload(port, deadline, fastopen, results):
+    request = b"GET /small.bin HTTP/1.1\r\nConnection: close\r\n\r\n"
+
+    while time.monotonic() < deadline:
+        started = time.monotonic()
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+
+        if fastopen:
+            sock.sendto(request, socket.MSG_FASTOPEN, ("127.0.0.1", port))
+        else:
+            sock.connect(("127.0.0.1", port))
+            sock.sendall(request)
+
+        read_response(sock, b"")
+        sock.close()
+        results.append(time.monotonic() - started)
+
+
+def keepalive_workload(port, deadline, fastopen, results):
+    with socket.create_connection(("127.0.0.1", port)) as sock:
+        buffer = b""
+
+        while time.monotonic() < deadline:
+            started = time.monotonic()
+            sock.sendall(b"GET /small.bin HTTP/1.1\r\n\r\n")
+            buffer = read_response(sock, buffer)
+            results.append(time.monotonic() - started)
+
+
+def bulk_workload(port, deadline, fastopen, results):
+    with socket.create_connection(("127.0.0.1", port)) as sock:
+        while time.monotonic() < deadline:
+            sock.sendall(b"GET /bulk.bin HTTP/1.1\r\n\r\n")
+            read_response(sock, b"")
+            results.append(BULK_SIZE)
+
+
+def run_workload(workload, port, clients, duration, fastopen):
+    results = []
+    deadline = time.monotonic() + duration
+    threads = [threading.Thread(target=workload, args=(port, deadline, fastopen, results))
+               for _ in range(clients)]
+
+    for thread in threads:
+        thread.start()
+
+    for thread in threads:
+        thread.join()
+
+    return results
+
+
+def percentile(values, fraction):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * fraction))] if values else 0.0
+
+
+def measure(server, options, catalogue, corelated, args):
+    port = args.port
+    command = [server, "-w", "1"] + (["-t", options] if options else []) + [catalogue, corelated, f"127.0.0.1:{port}"]
+    process = subprocess.Popen(command, stdout=subprocess.DEVNULL)
+
+    try:
+        for _ in range(100):
+            try:
+                socket.create_connection(("127.0.0.1", port), timeout=1).close()
+                break
+            except OSError:
+                time.sleep(0.05)
+
+        fastopen = "fastopen=0" not in options
+        connect = run_workload(connect_workload, port, args.clients, args.duration, fastopen)
+        keepalive = run_workload(keepalive_workload, port, args.clients, args.duration, fastopen)
+        bulk = run_workload(bulk_workload, port, args.clients, args.duration, fastopen)
+    finally:
+        process.terminate()
+        process.wait()
+
+    return {
+        "connect p50": percentile(connect, 0.5) * 1e6,
+        "connect p99": percentile(connect, 0.99) * 1e6,
+        "keepalive p50": percentile(keepalive, 0.5) * 1e6,
+        "keepalive p99": percentile(keepalive, 0.99) * 1e6,
+        "bulk MB/s": sum(bulk) / args.duration / 1e6,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Per-option benchmark of the socket tuning profile")
+    parser.add_argument("--server", default="./serwer")
+    parser.add_argument("--duration", type=float, default=5, help="seconds of every workload")
+    parser.add_argument("--clients", type=int, default=4)
+    parser.add_argument("--port", type=int, default=18480)
+    args = parser.parse_args()
+
+    root = tempfile.mkdtemp(prefix="serwer-bench-")
+    catalogue = os.path.join(root, "catalogue")
+    corelated = os.path.join(root, "corelated.txt")
+    os.makedirs(catalogue)
+
+    with open(os.path.join(catalogue, "small.bin"), "wb") as f:
+        f.write(os.urandom(SMALL_SIZE))
+    with open(os.path.join(catalogue, "bulk.bin"), "wb") as f:
+        f.write(os.urandom(BULK_SIZE))
+    with open(corelated, "w"):
+        pass
+
+    try:
+        rows = [(name, measure(args.server, options, catalogue, corelated, args)) for name, options in TOGGLES]
+    finally:
+        shutil.rmtree(root, ignore_errors=True)
+
+    baseline = rows[0][1]
+    columns = list(baseline)
+
+    print(f"{'':18}" + "".join(f"{column:>22}" for column in columns))
+
+    # Latencies in microseconds, change against the defaults in parentheses
+    for name, result in rows:
+        cells = []
+
+        for column in columns:
+            change = (result[column] / baseline[column] - 1) * 100 if baseline[column] else 0.0
+            cells.append(f"{result[column]:12.1f} ({change:+6.1f}%)")
+
+        print(f"{name:18}" + "".join(f"{cell:>22}" for cell in cells))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
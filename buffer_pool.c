@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <string.h>
+#include "buffer_pool.h"
+
+
+
+/* Maximum number of idle buffers kept by the pool, buffers
+ * released above it are freed
+ */
+#define MAX_IDLE_BUFFERS 		 64
+
+
+
+/* Buffers are page aligned so that reads into them can be
+ * served without bounce copies by the kernel
+ */
+#define COPY_BUFFER_ALIGNMENT 	 4096
+
+
+
+static size_t buffer_size = DEFAULT_COPY_BUFFER_SIZE;
+
+static char *idle_buffers[MAX_IDLE_BUFFERS];
+static size_t idle_count = 0;
+
+
+
+int32_t set_copy_buffer_size(size_t size) {
+	if(size < MIN_COPY_BUFFER_SIZE || size > MAX_COPY_BUFFER_SIZE) {
+		return -1;
+	}
+
+	/* Keep buffers page sized, aligned_alloc() requires size
+	 * to be a multiple of the alignment
+	 */
+	buffer_size = (size + COPY_BUFFER_ALIGNMENT - 1) & ~((size_t) COPY_BUFFER_ALIGNMENT - 1);
+	return 0;
+}
+
+
+
+size_t get_copy_buffer_size(void) {
+	return buffer_size;
+}
+
+
+
+char *take_copy_buffer(void) {
+	if(idle_count > 0) {
+		idle_count--;
+		return idle_buffers[idle_count];
+	}
+
+	/* Buffer is touched by the worker which owns it, so that its
+	 * pages come from the worker's NUMA node
+	 */
+	char *buffer = aligned_alloc(COPY_BUFFER_ALIGNMENT, buffer_size);
+
+	if(buffer != NULL) {
+		memset(buffer, 0, buffer_size);
+	}
+
+	return buffer;
+}
+
+
+
+void release_copy_buffer(char *buffer) {
+	if(idle_count < MAX_IDLE_BUFFERS) {
+		idle_buffers[idle_count] = buffer;
+		idle_count++;
+	}
+	else {
+		free(buffer);
+	}
+}
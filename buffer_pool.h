@@ -0,0 +1,45 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+
+/* Bounds and default size of body copy buffers
+ */
+#define MIN_COPY_BUFFER_SIZE 		 (64 << 10)
+#define MAX_COPY_BUFFER_SIZE 		 (1 << 20)
+#define DEFAULT_COPY_BUFFER_SIZE 	 (256 << 10)
+
+
+
+/* Sets the size of buffers handed out by the pool. Has to be called before
+ * the first buffer is taken. Returns -1 if the size is out of bounds.
+ */
+int32_t set_copy_buffer_size(size_t);
+
+
+
+/* Returns the size of buffers handed out by the pool
+ */
+size_t get_copy_buffer_size(void);
+
+
+
+/* Takes a buffer from the pool, allocating a new one if there is no idle
+ * buffer. Returns NULL on memory error.
+ */
+char *take_copy_buffer(void);
+
+
+
+/* Returns the buffer to the pool
+ */
+void release_copy_buffer(char *);
+
+
+
+#endif /* BUFFER_POOL_H */
@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+
+
+/* Maximum number of entries of a single worker, every entry
+ * keeps its file open
+ */
+#define MAX_CACHE_ENTRIES 		 256
+
+
+
+/* Number of buckets of the cache index
+ */
+#define CACHE_BUCKETS 			 1024
+
+
+
+/* Entry may take at most this part of worker's size budget
+ */
+#define ENTRY_BUDGET_DIVISOR 		 4
+
+
+
+static const char *entry_prefix = "entry-";
+static const char *temp_prefix = "tmp-";
+
+
+
+static char *cache_directory = NULL;
+static long long cache_size = DEFAULT_CACHE_SIZE;
+static long long cache_ttl = DEFAULT_CACHE_TTL;
+
+
+
+/* Directory, size budget and index of the calling worker, the directory
+ * path leaves room for file names within PATH_MAX
+ */
+static char worker_directory[PATH_MAX - 64];
+static off_t worker_budget = 0;
+static off_t stored_size = 0;
+static int32_t entries_count = 0;
+
+static cache_entry_t *buckets[CACHE_BUCKETS];
+
+
+
+/* Least recently used list, most recently used entry at the head
+ */
+static cache_entry_t *lru_head = NULL;
+static cache_entry_t *lru_tail = NULL;
+
+
+
+/* Sequence number giving unique names to files of the worker
+ */
+static uint64_t file_sequence = 0;
+
+
+
+enum {
+	OPTION_DIR = 0,
+	OPTION_SIZE,
+	OPTION_TTL
+};
+
+
+
+static char *const option_names[] = {
+	[OPTION_DIR] = "dir",
+	[OPTION_SIZE] = "size",
+	[OPTION_TTL] = "ttl",
+	NULL
+};
+
+
+
+static
+int32_t parse_option_number(const char *value, long long *target) {
+	if(value == NULL || *value == '\0') {
+		return -1;
+	}
+
+	char *end = NULL;
+	errno = 0;
+	long long parsed = strtoll(value, &end, 10);
+
+	if(errno != 0 || *end != '\0' || parsed < 0) {
+		return -1;
+	}
+
+	*target = parsed;
+	return 0;
+}
+
+
+
+int32_t parse_cache_options(char *options) {
+	char *value = NULL;
+
+	while(*options != '\0') {
+		int32_t status = -1;
+
+		switch(getsubopt(&options, option_names, &value)) {
+			case OPTION_DIR:
+				if(value != NULL && *value != '\0') {
+					cache_directory = value;
+					status = 0;
+				}
+				break;
+			case OPTION_SIZE:
+				status = parse_option_number(value, &cache_size);
+				break;
+			case OPTION_TTL:
+				status = parse_option_number(value, &cache_ttl);
+				break;
+			default:
+				fprintf(stderr, "Unknown cache option: %s\n", value);
+				return -1;
+		}
+
+		if(status < 0) {
+			fprintf(stderr, "Invalid cache option value: %s\n", value == NULL ? "(none)" : value);
+			return -1;
+		}
+	}
+
+	if(cache_directory == NULL) {
+		fprintf(stderr, "Cache directory (dir=<path>) has to be specified\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+bool is_cache_enabled(void) {
+	return (cache_directory != NULL);
+}
+
+
+
+static
+time_t current_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+	return now.tv_sec;
+}
+
+
+
+static
+bool has_prefix(const char *name, const char *prefix) {
+	return (strncmp(name, prefix, strlen(prefix)) == 0);
+}
+
+
+
+/* Removes files left in the directory by previous instance of the worker
+ */
+static
+void clean_directory(const char *path) {
+	DIR *directory = opendir(path);
+
+	if(directory == NULL) {
+		return;
+	}
+
+	struct dirent *dir_entry;
+
+	while((dir_entry = readdir(directory)) != NULL) {
+		if(has_prefix(dir_entry->d_name, entry_prefix) || has_prefix(dir_entry->d_name, temp_prefix)) {
+			unlinkat(dirfd(directory), dir_entry->d_name, 0);
+		}
+	}
+
+	closedir(directory);
+}
+
+
+
+int32_t init_cache(int32_t worker_index, int32_t workers_count) {
+	if(mkdir(cache_directory, 0700) < 0 && errno != EEXIST) {
+		perror("Creating cache directory");
+		return -1;
+	}
+
+	/* Single unpinned worker (index -1) uses the directory of the first one
+	 */
+	int32_t length = snprintf(worker_directory, sizeof(worker_directory), "%s/worker-%d", cache_directory,
+							  (worker_index < 0) ? 0 : worker_index);
+
+	if(length < 0 || (size_t) length >= sizeof(worker_directory)) {
+		fprintf(stderr, "Cache directory path too long\n");
+		return -1;
+	}
+
+	if(mkdir(worker_directory, 0700) < 0 && errno != EEXIST) {
+		perror("Creating cache directory");
+		return -1;
+	}
+
+	clean_directory(worker_directory);
+
+	worker_budget = cache_size / workers_count;
+	memset(buckets, 0, sizeof(buckets));
+
+	return 0;
+}
+
+
+
+static
+uint32_t hash_key(const char *key) {
+	uint32_t hash = 2166136261u;
+
+	for(; *key != '\0'; ++key) {
+		hash ^= (unsigned char) *key;
+		hash *= 16777619u;
+	}
+
+	return hash % CACHE_BUCKETS;
+}
+
+
+
+static
+void unlink_lru(cache_entry_t *entry) {
+	if(entry->lru_prev != NULL) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	}
+	else {
+		lru_head = entry->lru_next;
+	}
+
+	if(entry->lru_next != NULL) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	}
+	else {
+		lru_tail = entry->lru_prev;
+	}
+
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+
+
+static
+void push_lru(cache_entry_t *entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = lru_head;
+
+	if(lru_head != NULL) {
+		lru_head->lru_prev = entry;
+	}
+	else {
+		lru_tail = entry;
+	}
+
+	lru_head = entry;
+}
+
+
+
+cache_entry_t *find_cache_entry(const char *key) {
+	for(cache_entry_t *entry = buckets[hash_key(key)]; entry != NULL; entry = entry->bucket_next) {
+		if(strcmp(entry->key, key) == 0) {
+			unlink_lru(entry);
+			push_lru(entry);
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+
+
+bool is_cache_entry_fresh(cache_entry_t *entry) {
+	return (current_time() - entry->validated_at < cache_ttl);
+}
+
+
+
+void refresh_cache_entry(cache_entry_t *entry) {
+	entry->validated_at = current_time();
+}
+
+
+
+void remove_cache_entry(cache_entry_t *entry) {
+	cache_entry_t **link = &buckets[hash_key(entry->key)];
+
+	while(*link != entry) {
+		link = &(*link)->bucket_next;
+	}
+
+	*link = entry->bucket_next;
+	unlink_lru(entry);
+
+	/* Responses being sent from the entry hold their own descriptors
+	 */
+	unlink(entry->file_name);
+	close(entry->fd);
+
+	stored_size -= entry->size;
+	entries_count--;
+
+	free(entry->key);
+	free(entry->content_type);
+	free(entry->etag);
+	free(entry->file_name);
+	free(entry);
+}
+
+
+
+bool is_cacheable_size(off_t size) {
+	return (size <= worker_budget / ENTRY_BUDGET_DIVISOR);
+}
+
+
+
+static
+char *make_file_name(const char *prefix) {
+	char *name = malloc(PATH_MAX);
+
+	if(name != NULL) {
+		snprintf(name, PATH_MAX, "%s/%s%llu", worker_directory, prefix, (unsigned long long) file_sequence++);
+	}
+
+	return name;
+}
+
+
+
+int32_t open_cache_file(char **path) {
+	*path = make_file_name(temp_prefix);
+
+	if(*path == NULL) {
+		return -1;
+	}
+
+	int32_t fd = open(*path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+	if(fd < 0) {
+		free(*path);
+		*path = NULL;
+	}
+
+	return fd;
+}
+
+
+
+void discard_cache_file(int32_t fd, char *path) {
+	close(fd);
+	unlink(path);
+	free(path);
+}
+
+
+
+/* Evicts least recently used entries (except the ones being validated)
+ * until an entry of passed size fits
+ */
+static
+void make_room(off_t size) {
+	cache_entry_t *entry = lru_tail;
+
+	while(entry != NULL && (stored_size + size > worker_budget || entries_count >= MAX_CACHE_ENTRIES)) {
+		cache_entry_t *previous = entry->lru_prev;
+
+		if(!entry->validating) {
+			remove_cache_entry(entry);
+		}
+
+		entry = previous;
+	}
+}
+
+
+
+static
+char *duplicate_string(const char *string) {
+	return (string == NULL) ? NULL : strdup(string);
+}
+
+
+
+void store_cache_entry(const char *key, int32_t fd, char *temp_path, off_t size,
+					   const char *content_type, const char *etag) {
+
+	cache_entry_t *existing = find_cache_entry(key);
+
+	if(existing != NULL && !existing->validating) {
+		remove_cache_entry(existing);
+	}
+	else if(existing != NULL) {
+		discard_cache_file(fd, temp_path);
+		return;
+	}
+
+	make_room(size);
+
+	cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+
+	if(entry == NULL || stored_size + size > worker_budget || entries_count >= MAX_CACHE_ENTRIES) {
+		free(entry);
+		discard_cache_file(fd, temp_path);
+		return;
+	}
+
+	entry->key = strdup(key);
+	entry->content_type = duplicate_string(content_type);
+	entry->etag = duplicate_string(etag);
+	entry->file_name = make_file_name(entry_prefix);
+
+	/* Body becomes visible under its final name only once it is complete
+	 */
+	if(entry->key == NULL || (content_type != NULL && entry->content_type == NULL) ||
+	   (etag != NULL && entry->etag == NULL) || entry->file_name == NULL ||
+	   rename(temp_path, entry->file_name) < 0) {
+
+		free(entry->key);
+		free(entry->content_type);
+		free(entry->etag);
+		free(entry->file_name);
+		free(entry);
+		discard_cache_file(fd, temp_path);
+		return;
+	}
+
+	free(temp_path);
+
+	entry->fd = fd;
+	entry->size = size;
+	entry->validated_at = current_time();
+
+	uint32_t bucket = hash_key(key);
+	entry->bucket_next = buckets[bucket];
+	buckets[bucket] = entry;
+	push_lru(entry);
+
+	stored_size += size;
+	entries_count++;
+}
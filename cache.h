@@ -0,0 +1,141 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+
+
+/* Default size budget of the cache (shared by all the workers)
+ * and time for which an entry is served without asking the
+ * corelated server
+ */
+#define DEFAULT_CACHE_SIZE 		 (256 << 20)
+#define DEFAULT_CACHE_TTL 			 60
+
+
+
+typedef struct cache_entry_t cache_entry_t;
+
+
+
+/* Resource fetched from corelated server and stored in the cache
+ * directory. The entry keeps its file open, so that serving it does
+ * not touch the file system and evicted files stay readable for
+ * responses still being sent
+ */
+struct cache_entry_t {
+	char *key;
+	int32_t fd;
+	off_t size;
+
+	char *content_type;
+
+	/* ETag sent by the corelated server, NULL if there was none
+	 */
+	char *etag;
+
+	/* Time the entry was stored or last validated
+	 */
+	time_t validated_at;
+
+	/* Conditional request validating the stale entry is in flight,
+	 * the entry is not evicted meanwhile
+	 */
+	bool validating;
+
+	char *file_name;
+
+	cache_entry_t *bucket_next;
+	cache_entry_t *lru_prev;
+	cache_entry_t *lru_next;
+};
+
+
+
+/* Parses comma separated list of cache options (as passed to the -d server
+ * option). Recognised options:
+ * dir=<path>       directory the cached resources are stored in (required)
+ * size=<bytes>     size budget of the whole cache
+ * ttl=<seconds>    time for which an entry is served without validation
+ * Returns 0 on success and -1 on unknown option or invalid value.
+ */
+int32_t parse_cache_options(char *);
+
+
+
+/* Checks whether the cache has been configured
+ */
+bool is_cache_enabled(void);
+
+
+
+/* Prepares cache of the calling worker (passed index and number of workers):
+ * its own subdirectory of the cache directory with its share of the size
+ * budget. Files left by previous instance are removed as the index is
+ * kept in memory only. Returns 0 on success and -1 on failure.
+ */
+int32_t init_cache(int32_t, int32_t);
+
+
+
+/* Returns entry stored under passed key and marks it as recently used,
+ * NULL if there is none
+ */
+cache_entry_t *find_cache_entry(const char *);
+
+
+
+/* Checks whether the entry may still be served without validation
+ */
+bool is_cache_entry_fresh(cache_entry_t *);
+
+
+
+/* Marks the entry as validated by the corelated server now
+ */
+void refresh_cache_entry(cache_entry_t *);
+
+
+
+/* Removes the entry from the index and the cache directory
+ */
+void remove_cache_entry(cache_entry_t *);
+
+
+
+/* Checks whether a body of passed size may be stored in the cache
+ */
+bool is_cacheable_size(off_t);
+
+
+
+/* Creates temporary file the body is written into while it is being fetched.
+ * Stores its path (to be freed by the caller) under passed pointer. Returns
+ * the descriptor or -1 on failure.
+ */
+int32_t open_cache_file(char **);
+
+
+
+/* Atomically renames complete temporary file and stores it under passed key
+ * with given size, content type and ETag (both can be NULL), evicting least
+ * recently used entries to stay within the size budget. An entry already
+ * stored under the key is replaced. The descriptor and path are owned by
+ * the function.
+ */
+void store_cache_entry(const char *, int32_t, char *, off_t, const char *, const char *);
+
+
+
+/* Closes and removes temporary file of a fetch which has not completed
+ */
+void discard_cache_file(int32_t, char *);
+
+
+
+#endif /* CACHE_H */
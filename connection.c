@@ -0,0 +1,948 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include "connection.h"
+#include "ioprotocol.h"
+#include "buffer_pool.h"
+#include "proxy.h"
+#include "tls.h"
+#include "probes.h"
+#include "upload.h"
+#include "limiter.h"
+#include "http2.h"
+#include "stats.h"
+
+
+
+/* Table of connections indexed by socket descriptor, grown on demand
+ */
+static connection_t **connection_table = NULL;
+static size_t connection_table_size = 0;
+
+
+
+/* Maximum number of bytes passed to a single sendfile() call
+ */
+#define SENDFILE_CHUNK 			 (1 << 20)
+
+
+
+/* Copied bodies at least this many copy buffers long are sent from
+ * a file mapping, shorter ones through a pooled buffer where the cost
+ * of setting up and tearing down the mapping would dominate
+ */
+#define MAPPED_BODY_BUFFERS 		 4
+
+
+
+static bool copy_path_forced = false;
+
+
+
+static off_t send_quantum = DEFAULT_SEND_QUANTUM;
+
+
+
+/* Queue of connections which have used up their quantum
+ */
+static connection_t *yielded_head = NULL;
+static connection_t *yielded_tail = NULL;
+static int32_t yielded_count = 0;
+
+
+
+void force_copy_path(void) {
+	copy_path_forced = true;
+}
+
+
+
+static
+int32_t register_connection(connection_t *conn) {
+	if((size_t) conn->fd >= connection_table_size) {
+		size_t new_size = (connection_table_size == 0) ? 1024 : connection_table_size;
+
+		while(new_size <= (size_t) conn->fd) {
+			new_size *= 2;
+		}
+
+		connection_t **new_table = realloc(connection_table, new_size * sizeof(connection_t *));
+		if(new_table == NULL) {
+			return -1;
+		}
+
+		memset(new_table + connection_table_size, 0, (new_size - connection_table_size) * sizeof(connection_t *));
+
+		connection_table = new_table;
+		connection_table_size = new_size;
+	}
+
+	connection_table[conn->fd] = conn;
+	return 0;
+}
+
+
+
+connection_t *new_connection(int32_t client_socket, const char *catalogue_path) {
+	connection_t *conn = malloc(sizeof(connection_t));
+
+	if(conn == NULL) {
+		return NULL;
+	}
+
+	memset(conn, 0, sizeof(connection_t));
+
+	conn->fd = client_socket;
+	conn->state = CONNECTION_READING;
+	conn->body_fd = -1;
+	conn->request_data = new_request_data(catalogue_path);
+	conn->input = malloc(INPUT_BUFFER_SIZE);
+	conn->output = malloc(OUTPUT_BUFFER_SIZE);
+
+	if(conn->request_data == NULL || conn->input == NULL || conn->output == NULL ||
+	   register_connection(conn) < 0) {
+
+		if(conn->request_data != NULL) {
+			delete_request_data(conn->request_data);
+		}
+
+		free(conn->input);
+		free(conn->output);
+		free(conn);
+		return NULL;
+	}
+
+	STATS_ADD(connections_accepted, 1);
+	STATS_ADD(connections_active, 1);
+
+	return conn;
+}
+
+
+
+int32_t set_send_quantum(long long quantum) {
+	if(quantum < 0) {
+		return -1;
+	}
+
+	send_quantum = quantum;
+	return 0;
+}
+
+
+
+static
+uint64_t current_nanoseconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+
+void start_send_quantum(connection_t *conn) {
+	conn->quantum_left = send_quantum;
+	conn->quantum_start = 0;
+}
+
+
+
+/* Every body byte sent is charged, which is where they are counted.
+ * Turn starts being timed with its first send.
+ */
+void charge_quantum(connection_t *conn, size_t sent) {
+	STATS_ADD(bytes_sent, sent);
+
+	if(send_quantum == 0) {
+		return;
+	}
+
+	if(conn->quantum_start == 0) {
+		conn->quantum_start = current_nanoseconds();
+	}
+
+	conn->quantum_left -= sent;
+}
+
+
+
+bool is_quantum_used_up(connection_t *conn) {
+	if(send_quantum == 0 || conn->quantum_start == 0) {
+		return false;
+	}
+
+	return (conn->quantum_left <= 0 || current_nanoseconds() - conn->quantum_start > SEND_QUANTUM_TIME_NS);
+}
+
+
+
+/* Limits size of a single send to what is left of the quantum
+ */
+static
+size_t limit_to_quantum(connection_t *conn, size_t size) {
+	if(send_quantum == 0 || conn->quantum_left <= 0 || (off_t) size <= conn->quantum_left) {
+		return size;
+	}
+
+	return conn->quantum_left;
+}
+
+
+
+void yield_connection(connection_t *conn) {
+	if(conn->yielded) {
+		return;
+	}
+
+	conn->yielded = true;
+	conn->yielded_next = NULL;
+	conn->yielded_prev = yielded_tail;
+
+	if(yielded_tail == NULL) {
+		yielded_head = conn;
+	}
+	else {
+		yielded_tail->yielded_next = conn;
+	}
+
+	yielded_tail = conn;
+	yielded_count++;
+}
+
+
+
+static
+void take_yielded(connection_t *conn) {
+	if(conn->yielded_prev == NULL) {
+		yielded_head = conn->yielded_next;
+	}
+	else {
+		conn->yielded_prev->yielded_next = conn->yielded_next;
+	}
+
+	if(conn->yielded_next == NULL) {
+		yielded_tail = conn->yielded_prev;
+	}
+	else {
+		conn->yielded_next->yielded_prev = conn->yielded_prev;
+	}
+
+	conn->yielded = false;
+	conn->yielded_prev = NULL;
+	conn->yielded_next = NULL;
+	yielded_count--;
+}
+
+
+
+int32_t count_yielded_connections(void) {
+	return yielded_count;
+}
+
+
+
+connection_t *take_yielded_connection(void) {
+	connection_t *conn = yielded_head;
+
+	if(conn != NULL) {
+		take_yielded(conn);
+	}
+
+	return conn;
+}
+
+
+
+/* Closes body file and releases resources used for sending it
+ */
+static
+void release_body(connection_t *conn) {
+	if(conn->proxy_waiter != NULL) {
+		detach_proxy_waiter(conn);
+	}
+	
+	if(conn->body_fd >= 0) {
+		close(conn->body_fd);
+		conn->body_fd = -1;
+	}
+
+	if(conn->body_buffer != NULL) {
+		release_copy_buffer(conn->body_buffer);
+		conn->body_buffer = NULL;
+	}
+
+	if(conn->body_map != NULL) {
+		munmap(conn->body_map, conn->body_map_length);
+		conn->body_map = NULL;
+	}
+}
+
+
+
+void delete_connection(connection_t *conn) {
+	USDT_PROBE1(close, conn->fd);
+	STATS_SUB(connections_active, 1);
+
+	connection_table[conn->fd] = NULL;
+
+	if(conn->yielded) {
+		take_yielded(conn);
+	}
+
+	abandon_request(conn->admitted_at);
+
+	release_body(conn);
+
+	if(conn->upload != NULL) {
+		delete_upload(conn->upload);
+	}
+
+	if(conn->http2 != NULL) {
+		delete_http2_session(conn->http2);
+	}
+
+	if(conn->tls != NULL) {
+		delete_tls_session(conn->tls);
+	}
+
+	if(close(conn->fd) == -1) {
+		perror("close");
+	}
+
+	delete_request_data(conn->request_data);
+	free(conn->input);
+	free(conn->output);
+	free(conn);
+}
+
+
+
+connection_t *get_connection(int32_t client_socket) {
+	if(client_socket < 0 || (size_t) client_socket >= connection_table_size) {
+		return NULL;
+	}
+
+	return connection_table[client_socket];
+}
+
+
+
+ssize_t queue_output(int32_t client_socket, const void *data, size_t length) {
+	connection_t *conn = get_connection(client_socket);
+
+	if(conn == NULL || conn->output_length + length > OUTPUT_BUFFER_SIZE) {
+		return -1;
+	}
+
+	memcpy(conn->output + conn->output_length, data, length);
+	conn->output_length += length;
+
+	return length;
+}
+
+
+
+ssize_t queue_output_vector(int32_t client_socket, const struct iovec *parts, int32_t parts_count) {
+	connection_t *conn = get_connection(client_socket);
+	size_t length = 0;
+
+	for(int32_t i = 0; i < parts_count; ++i) {
+		length += parts[i].iov_len;
+	}
+
+	if(conn == NULL || conn->output_length + length > OUTPUT_BUFFER_SIZE) {
+		return -1;
+	}
+
+	for(int32_t i = 0; i < parts_count; ++i) {
+		memcpy(conn->output + conn->output_length, parts[i].iov_base, parts[i].iov_len);
+		conn->output_length += parts[i].iov_len;
+	}
+
+	return length;
+}
+
+
+
+/* Chooses between the two copy path variants for the body starting at
+ * current offset. Only bodies of files which are never truncated in place
+ * are mapped, reading a page past the end of truncated file would raise
+ * SIGBUS, while pread() reports it like sendfile() does
+ */
+static
+void choose_copy_mode(connection_t *conn) {
+	off_t body_end = conn->body_offset + conn->body_remaining;
+	off_t map_start = conn->body_offset & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+
+	if(conn->body_immutable && conn->body_remaining >= (off_t) (MAPPED_BODY_BUFFERS * get_copy_buffer_size())) {
+		void *map = mmap(NULL, body_end - map_start, PROT_READ, MAP_SHARED, conn->body_fd, map_start);
+
+		if(map != MAP_FAILED) {
+			madvise(map, body_end - map_start, MADV_SEQUENTIAL);
+
+			conn->body_map = map;
+			conn->body_map_start = map_start;
+			conn->body_map_length = body_end - map_start;
+			conn->body_mode = BODY_MAPPED;
+			return;
+		}
+	}
+
+	conn->body_mode = BODY_COPY;
+}
+
+
+
+static
+void start_file_body(connection_t *conn, int32_t body_fd, off_t offset, off_t length, bool immutable) {
+	conn->body_fd = body_fd;
+	conn->body_immutable = immutable;
+	conn->body_start = offset;
+	conn->body_offset = offset;
+	conn->body_remaining = length;
+	conn->body_buffered = 0;
+	conn->body_buffer_sent = 0;
+	conn->body_mode = BODY_SENDFILE;
+
+	/* Without kernel TLS the body has to be encrypted in user space
+	 */
+	if(copy_path_forced || (conn->tls != NULL && !tls_kernel_send(conn->tls))) {
+		choose_copy_mode(conn);
+	}
+}
+
+
+
+void set_response_body(int32_t client_socket, int32_t body_fd, off_t length) {
+	start_file_body(get_connection(client_socket), body_fd, 0, length, false);
+}
+
+
+
+void set_response_body_at(int32_t client_socket, int32_t body_fd, off_t offset, off_t length) {
+	start_file_body(get_connection(client_socket), body_fd, offset, length, true);
+}
+
+
+
+void set_piped_response_body(int32_t client_socket, int32_t pipe_fd, off_t length) {
+	connection_t *conn = get_connection(client_socket);
+	
+	conn->body_fd = pipe_fd;
+	conn->body_immutable = false;
+	conn->body_start = 0;
+	conn->body_offset = 0;
+	conn->body_remaining = length;
+	conn->body_buffered = 0;
+	conn->body_buffer_sent = 0;
+	conn->body_mode = BODY_PIPE;
+}
+
+
+
+bool has_complete_request(connection_t *conn) {
+	/* Terminating CRLF pair may have been split between reads, step back
+	 * over the bytes which could be its beginning
+	 */
+	size_t i = (conn->input_scanned > 3) ? conn->input_scanned - 3 : 0;
+
+	for(; i + 3 < conn->input_length; ++i) {
+		if(conn->input[i] == '\r' && conn->input[i + 1] == '\n' &&
+		   conn->input[i + 2] == '\r' && conn->input[i + 3] == '\n') {
+
+			return true;
+		}
+	}
+
+	conn->input_scanned = conn->input_length;
+	return false;
+}
+
+
+
+/* Socket input and output, going through the TLS session
+ * for TLS connections
+ */
+static
+ssize_t receive_bytes(connection_t *conn, void *buffer, size_t length) {
+	if(conn->tls != NULL) {
+		return tls_read(conn->tls, buffer, length);
+	}
+
+	return read(conn->fd, buffer, length);
+}
+
+
+
+static
+ssize_t send_bytes(connection_t *conn, const void *buffer, size_t length) {
+	if(conn->tls != NULL) {
+		return tls_write(conn->tls, buffer, length);
+	}
+
+	return write(conn->fd, buffer, length);
+}
+
+
+
+bool has_pending_input(connection_t *conn) {
+	return (conn->tls != NULL && conn->input_length < INPUT_BUFFER_SIZE && tls_has_pending(conn->tls));
+}
+
+
+
+ssize_t fill_input(connection_t *conn) {
+	if(conn->input_length == INPUT_BUFFER_SIZE) {
+		return -2;
+	}
+
+	ssize_t read_bytes = receive_bytes(conn, conn->input + conn->input_length,
+									   INPUT_BUFFER_SIZE - conn->input_length);
+
+	if(read_bytes < 0) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -2 : -1;
+	}
+
+	conn->input_length += read_bytes;
+	return read_bytes;
+}
+
+
+
+void consume_input(connection_t *conn, size_t length) {
+	memmove(conn->input, conn->input + length, conn->input_length - length);
+
+	conn->input_length -= length;
+	conn->input_scanned = 0;
+}
+
+
+
+static
+int32_t write_to_file(int32_t fd, const char *buffer, size_t length, off_t *offset) {
+	while(length > 0) {
+		ssize_t written = pwrite(fd, buffer, length, *offset);
+
+		if(written < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if(written <= 0) {
+			return -1;
+		}
+
+		buffer += written;
+		length -= written;
+		*offset += written;
+	}
+
+	return 0;
+}
+
+
+
+ssize_t receive_into_file(connection_t *conn, int32_t fd, off_t *offset, size_t length, const int32_t *pipe_fds) {
+	/* Body bytes received together with the request head
+	 */
+	if(conn->input_length > 0) {
+		size_t chunk = (length < conn->input_length) ? length : conn->input_length;
+
+		if(write_to_file(fd, conn->input, chunk, offset) < 0) {
+			return -1;
+		}
+
+		consume_input(conn, chunk);
+		return chunk;
+	}
+
+	/* Decrypted records can not be spliced, the (empty) input
+	 * buffer is used for copying them
+	 */
+	if(conn->tls != NULL) {
+		size_t chunk = (length < INPUT_BUFFER_SIZE) ? length : INPUT_BUFFER_SIZE;
+		ssize_t read_bytes = tls_read(conn->tls, conn->input, chunk);
+
+		if(read_bytes < 0) {
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -2 : -1;
+		}
+
+		if(read_bytes > 0 && write_to_file(fd, conn->input, read_bytes, offset) < 0) {
+			return -1;
+		}
+
+		return read_bytes;
+	}
+
+	ssize_t moved = splice(conn->fd, NULL, pipe_fds[1], NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+	if(moved < 0) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -2 : -1;
+	}
+
+	/* The pipe is drained completely, so that it is empty
+	 * for the next call
+	 */
+	for(ssize_t left = moved; left > 0;) {
+		ssize_t written = splice(pipe_fds[0], NULL, fd, offset, left, SPLICE_F_MOVE);
+
+		if(written < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if(written <= 0) {
+			return -1;
+		}
+
+		left -= written;
+	}
+
+	return moved;
+}
+
+
+
+static
+int32_t send_body_sendfile(connection_t *conn) {
+	while(conn->body_remaining > 0) {
+		if(is_quantum_used_up(conn)) {
+			return 3;
+		}
+
+		size_t chunk = (conn->body_remaining > SENDFILE_CHUNK) ? SENDFILE_CHUNK : (size_t) conn->body_remaining;
+		chunk = limit_to_quantum(conn, chunk);
+
+		prefetch_response_body(conn);
+
+		ssize_t sent;
+
+		if(conn->tls != NULL) {
+			sent = tls_sendfile(conn->tls, conn->body_fd, conn->body_offset, chunk);
+
+			if(sent > 0) {
+				conn->body_offset += sent;
+			}
+		}
+		else {
+			sent = sendfile(conn->fd, conn->body_fd, &conn->body_offset, chunk);
+		}
+
+		if(sent < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			if(errno == EINTR) {
+				continue;
+			}
+
+			/* File system which does not support sendfile(), continue
+			 * with the copy path from current offset
+			 */
+			if(errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+				choose_copy_mode(conn);
+				return 2;
+			}
+
+			return -1;
+		}
+
+		/* File has been truncated while being sent - the promised
+		 * Content-Length can not be fulfilled anymore
+		 */
+		if(sent == 0) {
+			return -1;
+		}
+
+		conn->body_remaining -= sent;
+		charge_quantum(conn, sent);
+	}
+
+	return 1;
+}
+
+
+
+static
+int32_t send_body_copy(connection_t *conn) {
+	if(conn->body_buffer == NULL) {
+		conn->body_buffer = take_copy_buffer();
+
+		if(conn->body_buffer == NULL) {
+			return -1;
+		}
+	}
+
+	size_t buffer_size = get_copy_buffer_size();
+
+	while(conn->body_remaining > 0 || conn->body_buffer_sent < conn->body_buffered) {
+		if(is_quantum_used_up(conn)) {
+			return 3;
+		}
+
+		if(conn->body_buffer_sent == conn->body_buffered) {
+			size_t wanted = (conn->body_remaining > (off_t) buffer_size) ? buffer_size : (size_t) conn->body_remaining;
+
+			prefetch_response_body(conn);
+
+			ssize_t read_bytes = pread(conn->body_fd, conn->body_buffer, wanted, conn->body_offset);
+
+			if(read_bytes < 0 && errno == EINTR) {
+				continue;
+			}
+
+			/* Read error or file truncated while being sent
+			 */
+			if(read_bytes <= 0) {
+				return -1;
+			}
+
+			conn->body_offset += read_bytes;
+			conn->body_remaining -= read_bytes;
+			conn->body_buffered = read_bytes;
+			conn->body_buffer_sent = 0;
+		}
+
+		ssize_t written = send_bytes(conn, conn->body_buffer + conn->body_buffer_sent,
+								limit_to_quantum(conn, conn->body_buffered - conn->body_buffer_sent));
+
+		if(written < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			if(errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		conn->body_buffer_sent += written;
+		charge_quantum(conn, written);
+	}
+
+	return 1;
+}
+
+
+
+static
+int32_t send_body_mapped(connection_t *conn) {
+	size_t chunk_limit = get_copy_buffer_size();
+
+	while(conn->body_remaining > 0) {
+		if(is_quantum_used_up(conn)) {
+			return 3;
+		}
+
+		size_t chunk = (conn->body_remaining > (off_t) chunk_limit) ? chunk_limit : (size_t) conn->body_remaining;
+		chunk = limit_to_quantum(conn, chunk);
+
+		prefetch_response_body(conn);
+
+		ssize_t written = send_bytes(conn, conn->body_map + (conn->body_offset - conn->body_map_start), chunk);
+
+		if(written < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			if(errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		conn->body_offset += written;
+		conn->body_remaining -= written;
+		charge_quantum(conn, written);
+	}
+
+	return 1;
+}
+
+
+
+static
+bool is_pipe_empty(int32_t pipe_fd) {
+	int32_t queued = 0;
+	
+	return (ioctl(pipe_fd, FIONREAD, &queued) == 0 && queued == 0);
+}
+
+
+
+/* Streams the body from the pipe filled by the proxy, spliced straight into
+ * the socket for plaintext connections and read into pooled buffer for TLS ones
+ */
+static
+int32_t send_body_pipe(connection_t *conn) {
+	while(conn->body_remaining > 0 || conn->body_buffer_sent < conn->body_buffered) {
+		if(is_quantum_used_up(conn)) {
+			return 3;
+		}
+		
+		ssize_t moved;
+		
+		if(conn->tls == NULL) {
+			size_t chunk = (conn->body_remaining > SENDFILE_CHUNK) ? SENDFILE_CHUNK : (size_t) conn->body_remaining;
+			chunk = limit_to_quantum(conn, chunk);
+			
+			moved = splice(conn->body_fd, NULL, conn->fd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		}
+		else if(conn->body_buffer_sent == conn->body_buffered) {
+			if(conn->body_buffer == NULL) {
+				conn->body_buffer = take_copy_buffer();
+				
+				if(conn->body_buffer == NULL) {
+					return -1;
+				}
+			}
+			
+			size_t buffer_size = get_copy_buffer_size();
+			size_t wanted = (conn->body_remaining > (off_t) buffer_size) ? buffer_size : (size_t) conn->body_remaining;
+			
+			moved = read(conn->body_fd, conn->body_buffer, wanted);
+			
+			if(moved > 0) {
+				conn->body_buffered = moved;
+				conn->body_buffer_sent = 0;
+			}
+		}
+		else {
+			ssize_t written = send_bytes(conn, conn->body_buffer + conn->body_buffer_sent,
+									limit_to_quantum(conn, conn->body_buffered - conn->body_buffer_sent));
+			
+			if(written < 0) {
+				if(errno == EAGAIN || errno == EWOULDBLOCK) {
+					return 0;
+				}
+				if(errno == EINTR) {
+					continue;
+				}
+				
+				return -1;
+			}
+			
+			conn->body_buffer_sent += written;
+			charge_quantum(conn, written);
+			continue;
+		}
+		
+		if(moved < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return is_pipe_empty(conn->body_fd) ? -2 : 0;
+			}
+			if(errno == EINTR) {
+				continue;
+			}
+			
+			return -1;
+		}
+		
+		/* Write end closed before the whole body has been passed - the
+		 * corelated server failed in the middle of the transfer
+		 */
+		if(moved == 0) {
+			return -1;
+		}
+		
+		conn->body_remaining -= moved;
+		
+		/* Read into the buffer is charged once it is written
+		 */
+		if(conn->tls == NULL) {
+			charge_quantum(conn, moved);
+		}
+		
+		proxy_body_drained(conn);
+	}
+	
+	return 1;
+}
+
+
+
+int32_t flush_output(connection_t *conn) {
+	while(conn->output_sent < conn->output_length) {
+		ssize_t written = send_bytes(conn, conn->output + conn->output_sent,
+								conn->output_length - conn->output_sent);
+
+		if(written < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			if(errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		STATS_ADD(bytes_sent, written);
+		conn->output_sent += written;
+	}
+
+	TIMING_PHASE(&conn->timing, PHASE_HEADER_SEND);
+
+	/* Service time of the request ends with its response head
+	 */
+	if(conn->admitted_at != 0) {
+		finish_request(conn->admitted_at);
+		conn->admitted_at = 0;
+	}
+
+	if(conn->body_fd >= 0) {
+		int32_t body_status = 2;
+
+		/* Value 2 means that the transfer switched to another mode
+		 * and has to be continued with it, 3 that the quantum has
+		 * been used up
+		 */
+		while(body_status == 2) {
+			if(conn->body_mode == BODY_SENDFILE) {
+				body_status = send_body_sendfile(conn);
+			}
+			else if(conn->body_mode == BODY_MAPPED) {
+				body_status = send_body_mapped(conn);
+			}
+			else if(conn->body_mode == BODY_PIPE) {
+				body_status = send_body_pipe(conn);
+			}
+			else {
+				body_status = send_body_copy(conn);
+			}
+		}
+
+		if(body_status == 3) {
+			return 2;
+		}
+
+		if(body_status <= 0) {
+			return body_status;
+		}
+	}
+
+	if(conn->body_fd >= 0 && conn->body_mode != BODY_PIPE) {
+		USDT_PROBE2(file_done, conn->fd, conn->body_offset - conn->body_start);
+	}
+
+	/* Whole response has been sent, prepare the connection
+	 * for the next one
+	 */
+	release_body(conn);
+
+	conn->output_length = 0;
+	conn->output_sent = 0;
+
+	return 1;
+}
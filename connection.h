@@ -0,0 +1,350 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "request_data.h"
+#include "timing.h"
+
+
+
+/* Size of per-connection input buffer, which has to hold the whole
+ * request head (request line and headers) before it is parsed
+ */
+#define INPUT_BUFFER_SIZE 		 16384
+
+
+
+/* Size of per-connection buffer for response status line and headers
+ */
+#define OUTPUT_BUFFER_SIZE 		 16384
+
+
+
+/* Default number of body bytes a connection may send in one turn before
+ * yielding to other connections, and time it may spend sending in one turn
+ */
+#define DEFAULT_SEND_QUANTUM 		 (512 << 10)
+#define SEND_QUANTUM_TIME_NS 		 2000000
+
+
+
+/* States of client connection in the event loop
+ */
+#define CONNECTION_READING 		 	0 	/* waiting for complete request head */
+#define CONNECTION_WAITING_FILE 	1 	/* blocking file operations offloaded */
+#define CONNECTION_SENDING 		 	2 	/* response is being written */
+#define CONNECTION_HANDSHAKE 		3 	/* TLS handshake in progress */
+#define CONNECTION_PROXYING 		4 	/* waiting for corelated server response head */
+#define CONNECTION_RECEIVING 		5 	/* request body is being stored */
+#define CONNECTION_HTTP2 			6 	/* HTTP/2 session multiplexes the streams */
+
+
+
+/* Ways of transferring response body
+ */
+#define BODY_SENDFILE 				0 	/* zero-copy sendfile() */
+#define BODY_COPY 					1 	/* pread() into pooled buffer and write() */
+#define BODY_MAPPED 				2 	/* write() straight from file mapping */
+#define BODY_PIPE 					3 	/* splice() from pipe filled by the proxy */
+
+
+
+typedef struct connection_t connection_t;
+
+
+
+struct connection_t {
+	int32_t fd;
+	int32_t state;
+
+	/* Events the event loop currently waits for on the socket
+	 */
+	uint32_t events;
+
+	/* Client has shut down its side of the connection
+	 */
+	bool peer_closed;
+
+	/* TLS session for connections accepted on TLS listeners,
+	 * NULL for plaintext ones
+	 */
+	void *tls;
+
+	/* Request data object reused by all requests on the connection
+	 */
+	request_data_t *request_data;
+
+	/* Site (vhost_t) whose catalogue prefixes the path in request data
+	 */
+	void *vhost;
+
+	/* Key of the client address for rate limiting (0 if not limited)
+	 */
+	uint64_t client_key;
+
+	/* Time the request was admitted by the concurrency limiter,
+	 * 0 once its response head has been sent
+	 */
+	uint64_t admitted_at;
+
+	/* Connection was accepted while the worker was at its concurrency
+	 * limit, its first request is answered with 503
+	 */
+	bool shed;
+
+	/* Client requested closing the connection (Connection: close)
+	 */
+	bool close_request;
+
+	/* Received bytes which have not been parsed yet
+	 */
+	char *input;
+	size_t input_length;
+
+	/* Number of input bytes already checked for the end of request head
+	 */
+	size_t input_scanned;
+
+	/* Queued status line and headers (or whole short response)
+	 */
+	char *output;
+	size_t output_length;
+	size_t output_sent;
+
+	/* Response body sent from a file (or read end of the pipe in BODY_PIPE
+	 * mode) starting at body_start, body_fd is -1 when there is none
+	 */
+	int32_t body_fd;
+	off_t body_start;
+	off_t body_offset;
+	off_t body_remaining;
+
+	/* Body file is never truncated in place (it is an archive, replaced
+	 * by rename), so it can be sent from its mapping
+	 */
+	bool body_immutable;
+
+	/* Offset up to which the body has been read ahead
+	 */
+	off_t body_prefetched;
+
+	/* Way the body is transferred, one of BODY_SENDFILE, BODY_COPY,
+	 * BODY_MAPPED and BODY_PIPE
+	 */
+	int32_t body_mode;
+
+	/* Copy path - pooled buffer holding body_buffered bytes read from the
+	 * file, body_buffer_sent of which have already been written
+	 */
+	char *body_buffer;
+	size_t body_buffered;
+	size_t body_buffer_sent;
+
+	/* Mapped path - part of the file from body_map_start (start of the body
+	 * rounded down to a page) to the end of the body mapped into memory
+	 */
+	char *body_map;
+	off_t body_map_start;
+	size_t body_map_length;
+
+	/* Proxy state of the connection while it waits for the corelated
+	 * server or receives the body from it, NULL otherwise
+	 */
+	void *proxy_waiter;
+
+	/* Upload the request body is being received into, NULL if
+	 * there is none
+	 */
+	void *upload;
+
+	/* HTTP/2 session of connection in CONNECTION_HTTP2 state,
+	 * NULL for HTTP/1.1 ones
+	 */
+	void *http2;
+
+	/* Body bytes the connection may still send in the current turn and
+	 * time the turn started
+	 */
+	off_t quantum_left;
+	uint64_t quantum_start;
+
+	/* Connection has used up its quantum and waits in the queue of yielded
+	 * connections, which are resumed in the order they yielded
+	 */
+	bool yielded;
+	connection_t *yielded_prev;
+	connection_t *yielded_next;
+
+#ifdef WITH_TIMING
+	/* Phase timestamps of the request being processed
+	 */
+	request_timing_t timing;
+#endif
+};
+
+
+
+/* Creates connection object for accepted client socket and registers it in
+ * connection table so that it can be found by descriptor. Returns NULL on
+ * memory error.
+ */
+connection_t *new_connection(int32_t, const char *);
+
+
+
+/* Unregisters and deallocates the connection, closes its socket and
+ * body file (if any)
+ */
+void delete_connection(connection_t *);
+
+
+
+/* Returns connection registered for passed socket descriptor or NULL
+ */
+connection_t *get_connection(int32_t);
+
+
+
+/* Appends data to the output of the connection registered for passed socket.
+ * Returns number of queued bytes, or -1 if there is no such connection or the
+ * output buffer is too small (same contract as write() for the callers).
+ */
+ssize_t queue_output(int32_t, const void *, size_t);
+
+
+
+/* Appends passed parts to the output of the connection registered for passed
+ * socket, either all of them or none. Same return values as queue_output().
+ */
+ssize_t queue_output_vector(int32_t, const struct iovec *, int32_t);
+
+
+
+/* Sets file that is sent as the response body after queued output
+ */
+void set_response_body(int32_t, int32_t, off_t);
+
+
+
+/* Sets part of file of passed offset and length (a file packed in an
+ * archive, which is never truncated in place) as the response body
+ */
+void set_response_body_at(int32_t, int32_t, off_t, off_t);
+
+
+
+/* Sets read end of a pipe the body of passed length is streamed through
+ * as the response body after queued output
+ */
+void set_piped_response_body(int32_t, int32_t, off_t);
+
+
+
+/* Sets number of body bytes a connection may send in one turn, 0 lets
+ * every connection send until its socket would block. Returns -1 for
+ * negative quantum.
+ */
+int32_t set_send_quantum(long long);
+
+
+
+/* Starts new turn of the connection with full quantum
+ */
+void start_send_quantum(connection_t *);
+
+
+
+/* Charges passed number of sent body bytes to the quantum of the connection
+ */
+void charge_quantum(connection_t *, size_t);
+
+
+
+/* Checks whether the connection has used up its quantum, either by
+ * sending enough bytes or by spending too long sending
+ */
+bool is_quantum_used_up(connection_t *);
+
+
+
+/* Appends connection which has used up its quantum to the queue of
+ * yielded connections
+ */
+void yield_connection(connection_t *);
+
+
+
+/* Returns number of connections in the queue of yielded connections
+ */
+int32_t count_yielded_connections(void);
+
+
+
+/* Removes and returns the connection which yielded first, NULL if
+ * there is none
+ */
+connection_t *take_yielded_connection(void);
+
+
+
+/* Makes bodies of all subsequent responses go through the copy path (pooled
+ * buffer or file mapping) instead of sendfile()
+ */
+void force_copy_path(void);
+
+
+
+/* Checks whether input of the connection contains a complete request head,
+ * scanning only the bytes received since the previous call
+ */
+bool has_complete_request(connection_t *);
+
+
+
+/* Reads available bytes from the socket into connection input. Returns number
+ * of read bytes, 0 on orderly shutdown of the peer, -1 on error and -2 when
+ * the read would block or the input buffer is full.
+ */
+ssize_t fill_input(connection_t *);
+
+
+
+/* Removes passed number of bytes from the beginning of connection input
+ */
+void consume_input(connection_t *, size_t);
+
+
+
+/* Moves up to passed number of request body bytes, from connection input first
+ * and then from the socket, into the file at passed offset (advanced by the
+ * number of moved bytes). Plaintext connections splice the bytes through passed
+ * pipe, which is left empty. Returns number of moved bytes, 0 on orderly shutdown
+ * of the peer, -1 on error and -2 when the read would block.
+ */
+ssize_t receive_into_file(connection_t *, int32_t, off_t *, size_t, const int32_t *);
+
+
+
+/* Checks whether TLS layer of the connection holds received bytes
+ * which have not been moved to connection input yet
+ */
+bool has_pending_input(connection_t *);
+
+
+
+/* Writes as much of queued output and response body as the socket accepts
+ * and the quantum of the connection allows. Returns 1 when the whole response
+ * has been sent, 0 when the socket would block, 2 when the quantum has been
+ * used up (the connection should yield), -2 when the body pipe is empty (the
+ * proxy wakes the connection up once it refills it) and -1 on error.
+ */
+int32_t flush_output(connection_t *);
+
+
+
+#endif /* CONNECTION_H */
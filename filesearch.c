@@ -10,139 +10,403 @@
 
 static const char *http_header = "http://";
 
-int32_t set_address(char **buffer, const char *path, size_t path_length, FILE *fp) {
-	int32_t error_status = 0;
-	
-	char *b = NULL;
-	size_t n;
-	
-	size_t resource_lo = 0;
-	size_t resource_hi = 0;
-	size_t server_lo = 0;
-	size_t server_hi = 0;
-	size_t port_lo = 0;
-	size_t port_hi = 0;
-	
-	bool port = false;
-	bool serv_address = false;
-	
-	bool first_tab = false;
-	bool second_tab = false;
-	
-	/* Move file pointer to the beginning of the file */
-	rewind(fp);
 
-	errno = 0;
-	while(getline(&b, &n, fp) != -1) {
-		port = false;
-		serv_address = false;
-		first_tab = false;
-		second_tab = false;
-		
-		for(size_t i = 0; i < strlen(b); ++i) {
-			if(b[i] == '\n') {
-				continue;
-			}
-			
-			if(b[i] != ' ' && b[i] != HORIZONTAL_TAB) {
-				if(second_tab) {
-					if(!port) {
-						port_lo = i;
-					}
-					
-					port_hi = i;
-					port = true;
-				}
-				else if(first_tab) {
-					if(!serv_address) {
-						server_lo = i;
-					}
-					
-					server_hi = i;
-					serv_address = true;
-				}
-				else {
-					resource_hi = i;
-				}
-			}
-			else {
-				if(serv_address) {
-					second_tab = true;
-				}
-				else {
-					first_tab = true;
+
+/* Address of the corelated server ("http://<server>:<port>") the
+ * resources matched by a rule have been moved to
+ */
+struct redirect_rule {
+	char *address;
+	size_t address_length;
+};
+
+
+
+/* Node of compressed radix trie of rule paths. Label is the part of the
+ * path on the edge from the parent, children are sorted by first byte of
+ * their labels. exact_rule matches the path ending at the node, prefix_rule
+ * every path starting with it.
+ */
+struct trie_node {
+	char *label;
+	size_t label_length;
+
+	struct redirect_rule *exact_rule;
+	struct redirect_rule *prefix_rule;
+
+	struct trie_node **children;
+	size_t children_count;
+};
+
+
+
+struct redirect_index_t {
+	struct trie_node root;
+	size_t rules_count;
+};
+
+
+
+/* Binary search for the child whose label starts with passed byte, returns
+ * its position or the position it should be inserted at
+ */
+static
+size_t find_child_position(const struct trie_node *node, unsigned char c, bool *found) {
+	size_t low = 0;
+	size_t high = node->children_count;
+
+	while(low < high) {
+		size_t middle = (low + high) / 2;
+		unsigned char first = node->children[middle]->label[0];
+
+		if(first == c) {
+			*found = true;
+			return middle;
+		}
+
+		if(first < c) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+
+	*found = false;
+	return low;
+}
+
+
+
+static
+struct trie_node *new_trie_node(const char *label, size_t label_length) {
+	struct trie_node *node = calloc(1, sizeof(struct trie_node));
+
+	if(node == NULL) {
+		return NULL;
+	}
+
+	node->label = malloc(label_length);
+
+	if(node->label == NULL) {
+		free(node);
+		return NULL;
+	}
+
+	memcpy(node->label, label, label_length);
+	node->label_length = label_length;
+
+	return node;
+}
+
+
+
+static
+int32_t insert_child(struct trie_node *node, size_t position, struct trie_node *child) {
+	struct trie_node **children = realloc(node->children, (node->children_count + 1) * sizeof(struct trie_node *));
+
+	if(children == NULL) {
+		return -1;
+	}
+
+	memmove(children + position + 1, children + position, (node->children_count - position) * sizeof(struct trie_node *));
+	children[position] = child;
+
+	node->children = children;
+	node->children_count++;
+
+	return 0;
+}
+
+
+
+/* Finds (creating and splitting nodes as necessary) the node ending
+ * passed path, returns NULL on memory error
+ */
+static
+struct trie_node *insert_path(struct trie_node *node, const char *path, size_t length) {
+	size_t position = 0;
+
+	while(position < length) {
+		bool found;
+		size_t child_position = find_child_position(node, path[position], &found);
+
+		if(!found) {
+			struct trie_node *leaf = new_trie_node(path + position, length - position);
+
+			if(leaf == NULL || insert_child(node, child_position, leaf) < 0) {
+				if(leaf != NULL) {
+					free(leaf->label);
+					free(leaf);
 				}
+
+				return NULL;
 			}
+
+			return leaf;
 		}
-		
-		size_t address_size = 30 + resource_hi + server_hi + port_hi - resource_lo - server_lo - port_lo;
-		
-		
-		bool ok_path = (path_length == resource_hi + 1);
-		
-		for(size_t i = 0; i <= resource_hi && ok_path; ++i) {
-			if(b[i] != path[i]) {
-				ok_path = false;
-			}
+
+		struct trie_node *child = node->children[child_position];
+		size_t common = 0;
+
+		while(common < child->label_length && position + common < length &&
+			  child->label[common] == path[position + common]) {
+
+			common++;
 		}
-		
-		if(ok_path) {	
-			*buffer = malloc(address_size * sizeof(char));
-			
-			char *array = *buffer;
-			
-			if(*buffer == NULL) {
-				error_status = 1;
-				break;
-			}
-			
-			memset(array, 0, address_size);
-			
-			size_t pos = 0;
-			
-			for(size_t i = 0; i < strlen(http_header); ++i) {
-				array[i] = http_header[i];
-				pos++;
-			}
-			
-			size_t save_pos = pos;
-			
-			for(size_t i = pos; i <= pos + server_hi - server_lo; ++i) {
-				array[i] = (b + server_lo)[i - pos];
-				save_pos++;
-			}
-			
-			pos = save_pos;
-			
-			array[pos] = ':';
-			pos++;
-			
-			save_pos = pos;
-			
-			for(size_t i = pos; i <= pos + port_hi - port_lo; ++i) {
-				array[i] = (b + port_lo)[i - pos];
-				save_pos++;
+
+		/* Path diverges from the label (or ends) within it, the edge
+		 * is split by a node ending the common part
+		 */
+		if(common < child->label_length) {
+			struct trie_node *middle = new_trie_node(child->label, common);
+
+			if(middle == NULL) {
+				return NULL;
 			}
-			
-			pos = save_pos;
 
-			for(size_t i = pos; i < pos + resource_hi - resource_lo + 1; ++i) {
-				array[i] = (b + resource_lo)[i - pos];
+			middle->children = malloc(sizeof(struct trie_node *));
+
+			if(middle->children == NULL) {
+				free(middle->label);
+				free(middle);
+				return NULL;
 			}
-			
-			break;
-		}	
+
+			child->label_length -= common;
+			memmove(child->label, child->label + common, child->label_length);
+
+			middle->children[0] = child;
+			middle->children_count = 1;
+			node->children[child_position] = middle;
+
+			child = middle;
+		}
+
+		node = child;
+		position += common;
 	}
-	
+
+	return node;
+}
+
+
+
+static
+void delete_trie_node(struct trie_node *node) {
+	for(size_t i = 0; i < node->children_count; ++i) {
+		delete_trie_node(node->children[i]);
+		free(node->children[i]);
+	}
+
+	if(node->exact_rule != NULL) {
+		free(node->exact_rule->address);
+		free(node->exact_rule);
+	}
+
+	if(node->prefix_rule != NULL) {
+		free(node->prefix_rule->address);
+		free(node->prefix_rule);
+	}
+
+	free(node->children);
+	free(node->label);
+}
+
+
+
+/* Splits line of corelated servers file into resource path, server
+ * and port fields, returns false if it has fewer of them
+ */
+static
+bool split_rule_line(char *line, char **fields) {
+	char *save_pointer;
+	const char separators[] = { ' ', HORIZONTAL_TAB, '\r', '\n', '\0' };
+
+	for(int32_t i = 0; i < 3; ++i) {
+		fields[i] = strtok_r((i == 0) ? line : NULL, separators, &save_pointer);
+
+		if(fields[i] == NULL) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+
+static
+int32_t add_rule(redirect_index_t *index, char **fields) {
+	const char *path = fields[0];
+	size_t path_length = strlen(path);
+	bool prefix = (path[path_length - 1] == '*');
+
+	if(prefix) {
+		path_length--;
+	}
+
+	struct trie_node *node = insert_path(&index->root, path, path_length);
+
+	if(node == NULL) {
+		return -1;
+	}
+
+	/* First rule for the path takes precedence
+	 */
+	struct redirect_rule **slot = prefix ? &node->prefix_rule : &node->exact_rule;
+
+	if(*slot != NULL) {
+		return 0;
+	}
+
+	struct redirect_rule *rule = malloc(sizeof(struct redirect_rule));
+
+	if(rule == NULL) {
+		return -1;
+	}
+
+	size_t address_size = strlen(http_header) + strlen(fields[1]) + strlen(fields[2]) + 2;
+	rule->address = malloc(address_size);
+
+	if(rule->address == NULL) {
+		free(rule);
+		return -1;
+	}
+
+	rule->address_length = snprintf(rule->address, address_size, "%s%s:%s", http_header, fields[1], fields[2]);
+
+	*slot = rule;
+	index->rules_count++;
+
+	return 0;
+}
+
+
+
+redirect_index_t *load_redirect_index(const char *file_path) {
+	FILE *fp = fopen(file_path, "r");
+
+	if(fp == NULL) {
+		return NULL;
+	}
+
+	redirect_index_t *index = calloc(1, sizeof(redirect_index_t));
+
+	if(index == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+
+	char *b = NULL;
+	size_t n;
+	int32_t error_status = 0;
+
+	errno = 0;
+	while(error_status == 0 && getline(&b, &n, fp) != -1) {
+		char *fields[3];
+
+		if(split_rule_line(b, fields)) {
+			error_status = add_rule(index, fields);
+		}
+	}
+
+	if(errno == ENOMEM || ferror(fp)) {
+		error_status = -1;
+	}
+
 	free(b);
+	fclose(fp);
+
+	if(error_status < 0) {
+		delete_redirect_index(index);
+		return NULL;
+	}
+
+	return index;
+}
+
+
+
+void delete_redirect_index(redirect_index_t *index) {
+	delete_trie_node(&index->root);
+	free(index);
+}
+
+
+
+/* Walks the trie along the path, remembering the longest prefix rule
+ * on the way, the exact rule for the whole path takes precedence
+ */
+static
+const struct redirect_rule *find_rule(const redirect_index_t *index, const char *path, size_t path_length) {
+	const struct trie_node *node = &index->root;
+	const struct redirect_rule *longest_prefix = NULL;
+	size_t position = 0;
+
+	while(true) {
+		if(node->prefix_rule != NULL) {
+			longest_prefix = node->prefix_rule;
+		}
+
+		if(position == path_length) {
+			return (node->exact_rule != NULL) ? node->exact_rule : longest_prefix;
+		}
+
+		bool found;
+		size_t child_position = find_child_position(node, path[position], &found);
+
+		if(!found) {
+			return longest_prefix;
+		}
 
-	/* Memory error with either getline or malloc, return -1
-	 * so as to send generic server error message to the client
-	 * in client request handling function
+		const struct trie_node *child = node->children[child_position];
+
+		if(path_length - position < child->label_length ||
+		   memcmp(child->label, path + position, child->label_length) != 0) {
+
+			return longest_prefix;
+		}
+
+		position += child->label_length;
+		node = child;
+	}
+}
+
+
+
+bool has_redirect(const redirect_index_t *index, const char *path, size_t path_length) {
+	return (find_rule(index, path, path_length) != NULL);
+}
+
+
+
+int32_t set_address(char **buffer, const char *path, size_t path_length, const redirect_index_t *index) {
+	const struct redirect_rule *rule = find_rule(index, path, path_length);
+
+	*buffer = NULL;
+
+	if(rule == NULL) {
+		return 0;
+	}
+
+	/* Room for the address, the path, double CRLF appended
+	 * by the caller and the terminating NUL
 	 */
-	if(errno == ENOMEM || error_status) {
+	size_t address_size = rule->address_length + path_length + 5;
+
+	*buffer = malloc(address_size * sizeof(char));
+
+	/* Memory error, return -1 so as to send generic server error
+	 * message to the client in client request handling function
+	 */
+	if(*buffer == NULL) {
 		return -1;
 	}
-	
+
+	memcpy(*buffer, rule->address, rule->address_length);
+	memcpy(*buffer + rule->address_length, path, path_length);
+	(*buffer)[rule->address_length + path_length] = '\0';
+
 	return 0;
 }
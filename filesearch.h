@@ -3,10 +3,43 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 
 
-int32_t set_address(char **, const char *, size_t, FILE *);
+/* Rules of corelated servers file compiled into a radix trie. Every line
+ * of the file consists of resource path, server and port. Path ending with
+ * '*' is a prefix rule matching every path starting with what precedes the
+ * '*' (e.g. /assets/ followed by '*' matches everything in /assets directory).
+ * Exact rule takes precedence over prefix ones, of which the longest matches.
+ */
+typedef struct redirect_index_t redirect_index_t;
+
+
+
+/* Compiles rules of corelated servers file of passed path, returns
+ * NULL if it can not be read or on memory error
+ */
+redirect_index_t *load_redirect_index(const char *);
+
+
+
+void delete_redirect_index(redirect_index_t *);
+
+
+
+/* Checks whether any rule matches passed path of passed length
+ */
+bool has_redirect(const redirect_index_t *, const char *, size_t);
+
+
+
+/* Stores address the resource of passed path (of passed length) has been
+ * moved to under passed pointer (the caller frees it), NULL if no rule
+ * matches. Returns -1 on memory error and 0 otherwise.
+ */
+int32_t set_address(char **, const char *, size_t, const redirect_index_t *);
 
 
 #endif /* FILESEARCH_H */
@@ -0,0 +1,577 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hpack.h"
+
+
+
+#define STATIC_TABLE_SIZE 			 61
+
+
+
+/* Integers larger than this are treated as compression error
+ */
+#define MAX_INTEGER 				 (1u << 28)
+
+
+
+/* Overhead of every entry of the dynamic table counted into its size
+ */
+#define ENTRY_OVERHEAD 				 32
+
+
+
+struct hpack_entry {
+	size_t name_length;
+	size_t value_length;
+
+	/* Name followed by value
+	 */
+	char strings[];
+};
+
+
+
+struct static_field {
+	const char *name;
+	const char *value;
+};
+
+
+
+static const struct static_field static_table[STATIC_TABLE_SIZE] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+
+
+/* Huffman code of every octet (RFC 7541 Appendix B), right-aligned,
+ * and its length in bits. End of string symbol is never decoded.
+ */
+static const uint32_t huffman_codes[256] = {
+	0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5, 0x0fffffe6, 0x0fffffe7,
+	0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9, 0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec,
+	0x0fffffed, 0x0fffffee, 0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+	0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9, 0x0ffffffa, 0x0ffffffb,
+	0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa, 0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa,
+	0x000003fa, 0x000003fb, 0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+	0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b, 0x0000001c, 0x0000001d,
+	0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb, 0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc,
+	0x00001ffa, 0x00000021, 0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+	0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068, 0x00000069, 0x0000006a,
+	0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e, 0x0000006f, 0x00000070, 0x00000071, 0x00000072,
+	0x000000fc, 0x00000073, 0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+	0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005, 0x00000025, 0x00000026,
+	0x00000027, 0x00000006, 0x00000074, 0x00000075, 0x00000028, 0x00000029, 0x0000002a, 0x00000007,
+	0x0000002b, 0x00000076, 0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+	0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd, 0x00001ffd, 0x0ffffffc,
+	0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8, 0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9,
+	0x003fffd6, 0x007fffda, 0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+	0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1, 0x007fffe2, 0x007fffe3,
+	0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5, 0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef,
+	0x003fffda, 0x001fffdd, 0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+	0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf, 0x007fffeb, 0x007fffec,
+	0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2, 0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef,
+	0x000fffea, 0x003fffe2, 0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+	0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2, 0x003fffe8, 0x01ffffec,
+	0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde, 0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed,
+	0x0007fff2, 0x001fffe3, 0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+	0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3, 0x07ffffe4, 0x07ffffe5,
+	0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6, 0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3,
+	0x003fffea, 0x003fffeb, 0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+	0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8, 0x07ffffe9, 0x07ffffea,
+	0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed, 0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee,
+};
+
+static const uint8_t huffman_lengths[256] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+
+
+/* Binary tree of the Huffman code built on first use. Children of internal
+ * nodes are indexes of other nodes (> 0, the root is node 0), leaves are
+ * stored as -(symbol + 1), 0 denotes missing child.
+ */
+static int16_t huffman_tree[256][2];
+static bool huffman_tree_ready = false;
+
+
+
+static
+void build_huffman_tree(void) {
+	int16_t nodes_count = 1;
+
+	for(int32_t symbol = 0; symbol < 256; ++symbol) {
+		int16_t node = 0;
+
+		for(int32_t bit = huffman_lengths[symbol] - 1; bit > 0; --bit) {
+			int32_t branch = (huffman_codes[symbol] >> bit) & 1;
+
+			if(huffman_tree[node][branch] == 0) {
+				huffman_tree[node][branch] = nodes_count++;
+			}
+
+			node = huffman_tree[node][branch];
+		}
+
+		huffman_tree[node][huffman_codes[symbol] & 1] = -(symbol + 1);
+	}
+
+	huffman_tree_ready = true;
+}
+
+
+
+/* Decodes Huffman coded string into passed buffer of passed size, returns
+ * length of the decoded string or -1 if it is invalid or too long
+ */
+static
+ssize_t decode_huffman(const uint8_t *input, size_t length, char *output, size_t output_size) {
+	if(!huffman_tree_ready) {
+		build_huffman_tree();
+	}
+
+	size_t output_length = 0;
+	int16_t node = 0;
+
+	/* Bits since the last decoded symbol and whether all of them are ones,
+	 * the string may only end with a prefix of end of string symbol
+	 */
+	int32_t pending_bits = 0;
+	bool pending_ones = true;
+
+	for(size_t i = 0; i < length; ++i) {
+		for(int32_t bit = 7; bit >= 0; --bit) {
+			int32_t branch = (input[i] >> bit) & 1;
+			int16_t child = huffman_tree[node][branch];
+
+			if(child == 0) {
+				return -1;
+			}
+
+			if(child < 0) {
+				if(output_length == output_size) {
+					return -1;
+				}
+
+				output[output_length++] = (char) (-child - 1);
+				node = 0;
+				pending_bits = 0;
+				pending_ones = true;
+				continue;
+			}
+
+			node = child;
+			pending_bits++;
+			pending_ones = pending_ones && branch;
+		}
+	}
+
+	if(pending_bits > 7 || !pending_ones) {
+		return -1;
+	}
+
+	return output_length;
+}
+
+
+
+/* Decodes integer with passed prefix length, advancing passed position.
+ * Returns -1 if it is truncated or too large.
+ */
+static
+int64_t decode_integer(const uint8_t **position, const uint8_t *end, int32_t prefix_bits) {
+	if(*position == end) {
+		return -1;
+	}
+
+	uint32_t prefix_mask = (1u << prefix_bits) - 1;
+	uint32_t value = **position & prefix_mask;
+	(*position)++;
+
+	if(value < prefix_mask) {
+		return value;
+	}
+
+	for(int32_t shift = 0; *position < end; shift += 7) {
+		/* Continuation bytes past 32 bits of value (possibly all of them
+		 * zero, which never grow it) make the integer a compression error
+		 */
+		if(shift > 28) {
+			return -1;
+		}
+
+		uint8_t byte = **position;
+		(*position)++;
+
+		uint64_t increment = (uint64_t) (byte & 0x7f) << shift;
+
+		if(increment > MAX_INTEGER - value) {
+			return -1;
+		}
+
+		value += increment;
+
+		if(!(byte & 0x80)) {
+			return value;
+		}
+	}
+
+	return -1;
+}
+
+
+
+/* Decodes string literal into passed buffer, returns its length
+ * or -1 if it is truncated, invalid or too long
+ */
+static
+ssize_t decode_string(const uint8_t **position, const uint8_t *end, char *output) {
+	if(*position == end) {
+		return -1;
+	}
+
+	bool huffman = (**position & 0x80);
+	int64_t length = decode_integer(position, end, 7);
+
+	if(length < 0 || length > end - *position) {
+		return -1;
+	}
+
+	const uint8_t *input = *position;
+	*position += length;
+
+	if(huffman) {
+		return decode_huffman(input, length, output, HPACK_MAX_STRING);
+	}
+
+	if(length > HPACK_MAX_STRING) {
+		return -1;
+	}
+
+	memcpy(output, input, length);
+	return length;
+}
+
+
+
+void init_hpack_decoder(hpack_decoder_t *decoder) {
+	decoder->head = 0;
+	decoder->count = 0;
+	decoder->size = 0;
+	decoder->max_size = HPACK_TABLE_SIZE;
+}
+
+
+
+void clear_hpack_decoder(hpack_decoder_t *decoder) {
+	for(size_t i = 0; i < decoder->count; ++i) {
+		free(decoder->entries[(decoder->head + i) % HPACK_MAX_ENTRIES]);
+	}
+
+	decoder->count = 0;
+	decoder->size = 0;
+}
+
+
+
+static
+void evict_entries(hpack_decoder_t *decoder, size_t max_size) {
+	while(decoder->size > max_size) {
+		struct hpack_entry *oldest = decoder->entries[(decoder->head + decoder->count - 1) % HPACK_MAX_ENTRIES];
+
+		decoder->size -= oldest->name_length + oldest->value_length + ENTRY_OVERHEAD;
+		decoder->count--;
+		free(oldest);
+	}
+}
+
+
+
+static
+int32_t add_entry(hpack_decoder_t *decoder, const char *name, size_t name_length,
+				  const char *value, size_t value_length) {
+
+	size_t entry_size = name_length + value_length + ENTRY_OVERHEAD;
+
+	/* Entry larger than the table empties it and is not added
+	 */
+	if(entry_size > decoder->max_size) {
+		evict_entries(decoder, 0);
+		return 0;
+	}
+
+	evict_entries(decoder, decoder->max_size - entry_size);
+
+	struct hpack_entry *entry = malloc(sizeof(struct hpack_entry) + name_length + value_length);
+
+	if(entry == NULL) {
+		return -1;
+	}
+
+	entry->name_length = name_length;
+	entry->value_length = value_length;
+	memcpy(entry->strings, name, name_length);
+	memcpy(entry->strings + name_length, value, value_length);
+
+	decoder->head = (decoder->head + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+	decoder->entries[decoder->head] = entry;
+	decoder->count++;
+	decoder->size += entry_size;
+
+	return 0;
+}
+
+
+
+/* Looks up field of passed index in the static and dynamic tables, returns
+ * false if there is no such field
+ */
+static
+bool find_field(hpack_decoder_t *decoder, int64_t index, const char **name, size_t *name_length,
+				const char **value, size_t *value_length) {
+
+	if(index <= 0) {
+		return false;
+	}
+
+	if(index <= STATIC_TABLE_SIZE) {
+		*name = static_table[index - 1].name;
+		*name_length = strlen(*name);
+		*value = static_table[index - 1].value;
+		*value_length = strlen(*value);
+		return true;
+	}
+
+	if((size_t) (index - STATIC_TABLE_SIZE) > decoder->count) {
+		return false;
+	}
+
+	const struct hpack_entry *entry = decoder->entries[(decoder->head + index - STATIC_TABLE_SIZE - 1) % HPACK_MAX_ENTRIES];
+
+	*name = entry->strings;
+	*name_length = entry->name_length;
+	*value = entry->strings + entry->name_length;
+	*value_length = entry->value_length;
+
+	return true;
+}
+
+
+
+int32_t decode_header_block(hpack_decoder_t *decoder, const uint8_t *block, size_t length,
+							hpack_field_callback_t callback, void *context) {
+
+	const uint8_t *position = block;
+	const uint8_t *end = block + length;
+	bool field_decoded = false;
+
+	while(position < end) {
+		uint8_t first = *position;
+		const char *name;
+		const char *value;
+		size_t name_length;
+		size_t value_length;
+
+		/* Dynamic table size update, only allowed at the beginning
+		 * of the block
+		 */
+		if((first & 0xe0) == 0x20) {
+			int64_t max_size = decode_integer(&position, end, 5);
+
+			if(field_decoded || max_size < 0 || max_size > HPACK_TABLE_SIZE) {
+				return -1;
+			}
+
+			decoder->max_size = max_size;
+			evict_entries(decoder, max_size);
+			continue;
+		}
+
+		if(first & 0x80) {
+			/* Indexed field
+			 */
+			int64_t index = decode_integer(&position, end, 7);
+
+			if(!find_field(decoder, index, &name, &name_length, &value, &value_length)) {
+				return -1;
+			}
+		}
+		else {
+			/* Literal field with incremental indexing (6 bit prefix of name index)
+			 * or without indexing / never indexed (4 bit prefix)
+			 */
+			bool indexing = (first & 0x40);
+			int64_t index = decode_integer(&position, end, indexing ? 6 : 4);
+
+			if(index < 0) {
+				return -1;
+			}
+
+			if(index == 0) {
+				ssize_t decoded_length = decode_string(&position, end, decoder->name);
+
+				if(decoded_length < 0) {
+					return -1;
+				}
+
+				name = decoder->name;
+				name_length = decoded_length;
+			}
+			else {
+				const char *unused_value;
+				size_t unused_length;
+
+				if(!find_field(decoder, index, &name, &name_length, &unused_value, &unused_length)) {
+					return -1;
+				}
+
+				/* Name of dynamic table entry may be evicted by adding
+				 * the field, it is copied first
+				 */
+				memcpy(decoder->name, name, name_length);
+				name = decoder->name;
+			}
+
+			ssize_t decoded_length = decode_string(&position, end, decoder->value);
+
+			if(decoded_length < 0) {
+				return -1;
+			}
+
+			value = decoder->value;
+			value_length = decoded_length;
+
+			if(indexing && add_entry(decoder, name, name_length, value, value_length) < 0) {
+				return -1;
+			}
+		}
+
+		field_decoded = true;
+
+		int32_t callback_status = callback(context, name, name_length, value, value_length);
+
+		if(callback_status != 0) {
+			return callback_status;
+		}
+	}
+
+	return 0;
+}
+
+
+
+static
+size_t encode_integer(uint8_t *output, uint32_t value, int32_t prefix_bits, uint8_t flags) {
+	uint32_t prefix_mask = (1u << prefix_bits) - 1;
+
+	if(value < prefix_mask) {
+		output[0] = flags | value;
+		return 1;
+	}
+
+	output[0] = flags | prefix_mask;
+	value -= prefix_mask;
+
+	size_t length = 1;
+
+	while(value >= 0x80) {
+		output[length++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+
+	output[length++] = value;
+	return length;
+}
+
+
+
+size_t encode_indexed_field(uint8_t *output, uint32_t index) {
+	return encode_integer(output, index, 7, 0x80);
+}
+
+
+
+size_t encode_literal_field(uint8_t *output, uint32_t name_index, const char *value, size_t length) {
+	size_t position = encode_integer(output, name_index, 4, 0x00);
+
+	position += encode_integer(output + position, length, 7, 0x00);
+	memcpy(output + position, value, length);
+
+	return position + length;
+}
@@ -0,0 +1,111 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+
+/* Size of the dynamic table of the decoder (the default of HTTP/2, which
+ * is what the server advertises) and maximum number of its entries
+ */
+#define HPACK_TABLE_SIZE 			 4096
+#define HPACK_MAX_ENTRIES 			 (HPACK_TABLE_SIZE / 32)
+
+
+
+/* Maximum length of a decoded header name or value, longer
+ * ones are treated as compression error
+ */
+#define HPACK_MAX_STRING 			 16384
+
+
+
+/* Indexes of the static table used when encoding responses
+ */
+#define HPACK_STATUS 				 8
+#define HPACK_CONTENT_LENGTH 		 28
+#define HPACK_CONTENT_TYPE 			 31
+#define HPACK_DATE 					 33
+#define HPACK_LOCATION 				 46
+#define HPACK_RETRY_AFTER 			 53
+#define HPACK_SERVER 				 54
+
+
+
+/* Header block decoder of HTTP/2 connection (RFC 7541), the dynamic table
+ * persists across header blocks of the connection
+ */
+typedef struct hpack_decoder_t hpack_decoder_t;
+
+
+
+struct hpack_entry;
+
+
+
+struct hpack_decoder_t {
+	/* Ring of entries of the dynamic table, the newest at head
+	 */
+	struct hpack_entry *entries[HPACK_MAX_ENTRIES];
+	size_t head;
+	size_t count;
+
+	size_t size;
+	size_t max_size;
+
+	/* Decoded strings of the field being decoded
+	 */
+	char name[HPACK_MAX_STRING];
+	char value[HPACK_MAX_STRING];
+};
+
+
+
+/* Called for every decoded header field with passed context, name and value
+ * (valid during the call only). Non-zero return value stops the decoding.
+ */
+typedef int32_t (*hpack_field_callback_t)(void *, const char *, size_t, const char *, size_t);
+
+
+
+/* Initialises decoder with empty dynamic table
+ */
+void init_hpack_decoder(hpack_decoder_t *);
+
+
+
+/* Frees entries of the dynamic table of the decoder
+ */
+void clear_hpack_decoder(hpack_decoder_t *);
+
+
+
+/* Decodes header block of passed length, calling passed callback with passed
+ * context for every field. Returns 0 on success, -1 on compression error (the
+ * connection has to be closed) and the value returned by the callback if it
+ * stopped the decoding.
+ */
+int32_t decode_header_block(hpack_decoder_t *, const uint8_t *, size_t, hpack_field_callback_t, void *);
+
+
+
+/* Encodes field of passed index of the static table, returns number
+ * of bytes written
+ */
+size_t encode_indexed_field(uint8_t *, uint32_t);
+
+
+
+/* Encodes field with name of passed index of the static table and passed
+ * value of passed length as a literal without indexing (and without
+ * Huffman coding), returns number of bytes written
+ */
+size_t encode_literal_field(uint8_t *, uint32_t, const char *, size_t);
+
+
+
+#endif /* HPACK_H */
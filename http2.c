@@ -0,0 +1,1821 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include "http2.h"
+#include "hpack.h"
+#include "ioprotocol.h"
+#include "offload_pool.h"
+#include "path_filter.h"
+#include "vhost.h"
+#include "warmup.h"
+#include "ratelimit.h"
+#include "limiter.h"
+#include "stats.h"
+#include "probes.h"
+
+
+
+/* Connection preface sent by the client, its first part is the request
+ * line and empty line which make it look like a complete request head
+ */
+#define PREFACE 					 "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LENGTH 				 24
+#define PREFACE_HEAD_LENGTH 		 18
+
+
+
+#define FRAME_HEADER_LENGTH 		 9
+
+
+
+/* Largest frame the server accepts (the protocol default, which is not
+ * changed) and sends
+ */
+#define MAX_FRAME_SIZE 				 16384
+
+
+
+/* Maximum number of streams of a connection open at once, advertised
+ * to the client in SETTINGS_MAX_CONCURRENT_STREAMS
+ */
+#define MAX_STREAMS 				 32
+
+
+
+/* Input holds a partial frame and a whole one
+ */
+#define INPUT_SIZE 					 (2 * (MAX_FRAME_SIZE + FRAME_HEADER_LENGTH))
+
+
+
+/* Frames are not handled while this much output is queued, so that
+ * a client which does not read can not make the output grow
+ */
+#define OUTPUT_HIGH_WATER 			 (64 << 10)
+
+
+
+/* Longest header block (HEADERS and CONTINUATION frames) accepted
+ */
+#define HEADER_BLOCK_LIMIT 			 (64 << 10)
+
+
+
+/* Received DATA bytes are given back to the connection window once
+ * this many have accumulated
+ */
+#define WINDOW_UPDATE_THRESHOLD 	 16384
+
+
+
+#define DEFAULT_WINDOW 				 65535
+#define MAX_WINDOW 					 0x7fffffffll
+
+
+
+/* Frame types
+ */
+#define FRAME_DATA 					 0x0
+#define FRAME_HEADERS 				 0x1
+#define FRAME_PRIORITY 				 0x2
+#define FRAME_RST_STREAM 			 0x3
+#define FRAME_SETTINGS 				 0x4
+#define FRAME_PUSH_PROMISE 			 0x5
+#define FRAME_PING 					 0x6
+#define FRAME_GOAWAY 				 0x7
+#define FRAME_WINDOW_UPDATE 		 0x8
+#define FRAME_CONTINUATION 			 0x9
+
+
+
+/* Frame flags
+ */
+#define FLAG_END_STREAM 			 0x1
+#define FLAG_ACK 					 0x1
+#define FLAG_END_HEADERS 			 0x4
+#define FLAG_PADDED 				 0x8
+#define FLAG_PRIORITY 				 0x20
+
+
+
+/* Settings
+ */
+#define SETTINGS_ENABLE_PUSH 				 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 	 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 		 0x4
+#define SETTINGS_MAX_FRAME_SIZE 			 0x5
+
+
+
+/* Error codes
+ */
+#define PROTOCOL_ERROR 				 0x1
+#define FLOW_CONTROL_ERROR 			 0x3
+#define FRAME_SIZE_ERROR 			 0x6
+#define REFUSED_STREAM 				 0x7
+#define COMPRESSION_ERROR 			 0x9
+#define ENHANCE_YOUR_CALM 			 0xb
+
+
+
+#define SERVER_NAME 				 "SIK_server"
+#define CONTENT_TYPE 				 "application/octet-stream"
+
+
+
+/* Response of a stream, its file is resolved by the offload pool and then
+ * sent in DATA frames interleaved with those of the other streams
+ */
+struct http2_stream {
+	uint32_t id;
+
+	request_data_t *request_data;
+	vhost_t *vhost;
+	bool head;
+
+	/* Time the request was admitted by the concurrency limiter,
+	 * 0 once its response head has been queued
+	 */
+	uint64_t admitted_at;
+
+	/* File is being resolved by the offload pool
+	 */
+	bool job_pending;
+
+	/* Client has reset the stream, it is released once the
+	 * offload pool or the frame being sent is done with it
+	 */
+	bool reset;
+
+	/* Body bytes not yet assigned to DATA frames, the body
+	 * started at body_start within the file
+	 */
+	int32_t body_fd;
+	off_t body_start;
+	off_t body_offset;
+	off_t body_remaining;
+
+	/* Flow control window of the client for the stream
+	 */
+	int64_t window;
+};
+
+
+
+/* Pseudo-headers and headers of a request collected
+ * while its header block is decoded
+ */
+struct request_fields {
+	int32_t method;
+	bool method_seen;
+	bool scheme_seen;
+	bool regular_seen;
+	bool malformed;
+
+	/* Target with room for the space ending it
+	 */
+	char path[MAX_TARGET_LENGTH + 1];
+	size_t path_length;
+	bool path_seen;
+
+	char authority[256];
+	size_t authority_length;
+	bool authority_seen;
+};
+
+
+
+typedef struct http2_session_t http2_session_t;
+
+
+
+struct http2_session_t {
+	/* NULL once the connection has been deleted, the session waits
+	 * for the jobs of its streams then
+	 */
+	connection_t *conn;
+	int32_t pending_jobs;
+
+	hpack_decoder_t decoder;
+
+	uint8_t input[INPUT_SIZE];
+	size_t input_length;
+	bool preface_received;
+	bool settings_received;
+
+	/* Queued frames, output_sent of which have been written
+	 */
+	uint8_t *output;
+	size_t output_length;
+	size_t output_sent;
+	size_t output_size;
+
+	/* DATA frame whose header ends the output at payload_at is being sent,
+	 * payload_left bytes of its payload still have to be written from
+	 * the file of sending stream before the rest of the output
+	 */
+	struct http2_stream *sending;
+	size_t payload_at;
+	size_t payload_left;
+
+	struct http2_stream *streams[MAX_STREAMS];
+	int32_t streams_count;
+	int32_t next_stream;
+	uint32_t last_stream_id;
+
+	/* Flow control windows of the client for the connection
+	 * and for new streams
+	 */
+	int64_t window;
+	int64_t initial_window;
+
+	/* Received DATA bytes not given back to the connection window yet
+	 */
+	uint32_t received_unacknowledged;
+
+	/* Header block being received in CONTINUATION frames
+	 * of continuation_stream (0 if none)
+	 */
+	uint8_t *header_block;
+	size_t header_block_length;
+	uint32_t continuation_stream;
+
+	/* Stream of the last header block and whether it opens
+	 * new stream
+	 */
+	uint32_t block_stream;
+	bool block_opens_stream;
+
+	struct request_fields fields;
+
+	/* GOAWAY has been queued after connection error, the connection is
+	 * closed once it has been sent. Client sent GOAWAY, the connection is
+	 * closed once its streams have been answered.
+	 */
+	bool closing;
+	bool peer_goaway;
+};
+
+
+
+/* Offloaded resolution of the file requested on a stream
+ */
+struct stream_job {
+	file_job_t file_job;
+	http2_session_t *session;
+	struct http2_stream *stream;
+};
+
+
+
+static const char switching_protocols_message[] =
+	"HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+
+
+static void (*wake_connection)(connection_t *) = NULL;
+
+
+
+void init_http2(void (*wake)(connection_t *)) {
+	wake_connection = wake;
+}
+
+
+
+static
+uint32_t read_uint32(const uint8_t *bytes) {
+	return ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | bytes[3];
+}
+
+
+
+static
+void write_uint32(uint8_t *bytes, uint32_t value) {
+	bytes[0] = value >> 24;
+	bytes[1] = value >> 16;
+	bytes[2] = value >> 8;
+	bytes[3] = value;
+}
+
+
+
+/* Makes room for passed number of bytes at the end of the output,
+ * returns NULL on memory error
+ */
+static
+uint8_t *reserve_output(http2_session_t *session, size_t length) {
+	if(session->output_length + length > session->output_size) {
+		size_t size = (session->output_size == 0) ? 4096 : session->output_size;
+
+		while(size < session->output_length + length) {
+			size *= 2;
+		}
+
+		uint8_t *output = realloc(session->output, size);
+
+		if(output == NULL) {
+			return NULL;
+		}
+
+		session->output = output;
+		session->output_size = size;
+	}
+
+	return session->output + session->output_length;
+}
+
+
+
+/* Queues header of frame with payload of passed length, returns pointer
+ * to the payload to be filled in or NULL on memory error
+ */
+static
+uint8_t *queue_frame(http2_session_t *session, uint8_t type, uint8_t flags, uint32_t stream_id, size_t length) {
+	uint8_t *frame = reserve_output(session, FRAME_HEADER_LENGTH + length);
+
+	if(frame == NULL) {
+		return NULL;
+	}
+
+	frame[0] = length >> 16;
+	frame[1] = length >> 8;
+	frame[2] = length;
+	frame[3] = type;
+	frame[4] = flags;
+	write_uint32(frame + 5, stream_id);
+
+	session->output_length += FRAME_HEADER_LENGTH + length;
+
+	return frame + FRAME_HEADER_LENGTH;
+}
+
+
+
+static
+int32_t queue_settings(http2_session_t *session) {
+	uint8_t *payload = queue_frame(session, FRAME_SETTINGS, 0, 0, 6);
+
+	if(payload == NULL) {
+		return -1;
+	}
+
+	payload[0] = 0;
+	payload[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+	write_uint32(payload + 2, MAX_STREAMS);
+
+	return 0;
+}
+
+
+
+static
+int32_t queue_window_update(http2_session_t *session, uint32_t stream_id, uint32_t increment) {
+	uint8_t *payload = queue_frame(session, FRAME_WINDOW_UPDATE, 0, stream_id, 4);
+
+	if(payload == NULL) {
+		return -1;
+	}
+
+	write_uint32(payload, increment);
+	return 0;
+}
+
+
+
+static
+int32_t queue_reset_stream(http2_session_t *session, uint32_t stream_id, uint32_t error_code) {
+	uint8_t *payload = queue_frame(session, FRAME_RST_STREAM, 0, stream_id, 4);
+
+	if(payload == NULL) {
+		return -1;
+	}
+
+	write_uint32(payload, error_code);
+	return 0;
+}
+
+
+
+static
+int32_t queue_goaway(http2_session_t *session, uint32_t error_code) {
+	uint8_t *payload = queue_frame(session, FRAME_GOAWAY, 0, 0, 8);
+
+	if(payload == NULL) {
+		return -1;
+	}
+
+	write_uint32(payload, session->last_stream_id);
+	write_uint32(payload + 4, error_code);
+
+	return 0;
+}
+
+
+
+/* Queues HEADERS frame of response with passed status (three digits) and
+ * content length, with Location header unless passed one is NULL. Service
+ * time of the request ends with it. Returns 0 on success and -1 on memory
+ * error.
+ */
+static
+int32_t queue_response_headers(http2_session_t *session, uint32_t stream_id, const char *status,
+							   off_t content_length, const char *location, bool end_stream,
+							   uint64_t *admitted_at) {
+
+	size_t location_length = (location == NULL) ? 0 : strlen(location);
+
+	/* Location longer than a frame can carry
+	 */
+	if(location_length > MAX_FRAME_SIZE / 2) {
+		location = NULL;
+		location_length = 0;
+		status = "500";
+		content_length = 0;
+		end_stream = true;
+	}
+
+	uint8_t block[MAX_FRAME_SIZE];
+	size_t length = 0;
+
+	if(strcmp(status, "200") == 0) {
+		length += encode_indexed_field(block, HPACK_STATUS);
+	}
+	else {
+		length += encode_literal_field(block, HPACK_STATUS, status, 3);
+	}
+
+	size_t date_length = 0;
+	const char *date = get_date_header(&date_length);
+
+	/* Date header line without name and CRLF
+	 */
+	length += encode_literal_field(block + length, HPACK_DATE, date + 6, date_length - 8);
+	length += encode_literal_field(block + length, HPACK_SERVER, SERVER_NAME, sizeof(SERVER_NAME) - 1);
+
+	if(strcmp(status, "200") == 0) {
+		length += encode_literal_field(block + length, HPACK_CONTENT_TYPE, CONTENT_TYPE, sizeof(CONTENT_TYPE) - 1);
+	}
+
+	char number[24];
+	int32_t number_length = snprintf(number, sizeof(number), "%lld", (long long) content_length);
+	length += encode_literal_field(block + length, HPACK_CONTENT_LENGTH, number, number_length);
+
+	if(location != NULL) {
+		length += encode_literal_field(block + length, HPACK_LOCATION, location, location_length);
+	}
+
+	if(strcmp(status, "429") == 0 || strcmp(status, "503") == 0) {
+		length += encode_literal_field(block + length, HPACK_RETRY_AFTER, "1", 1);
+	}
+
+	uint8_t flags = FLAG_END_HEADERS | (end_stream ? FLAG_END_STREAM : 0);
+	uint8_t *payload = queue_frame(session, FRAME_HEADERS, flags, stream_id, length);
+
+	if(payload == NULL) {
+		return -1;
+	}
+
+	memcpy(payload, block, length);
+	STATS_RESPONSE(status[0]);
+
+	if(*admitted_at != 0) {
+		finish_request(*admitted_at);
+		*admitted_at = 0;
+	}
+
+	return 0;
+}
+
+
+
+/* Queues response without body
+ */
+static
+int32_t answer_stream(http2_session_t *session, uint32_t stream_id, const char *status, uint64_t admitted_at) {
+	return queue_response_headers(session, stream_id, status, 0, NULL, true, &admitted_at);
+}
+
+
+
+static
+struct http2_stream *find_stream(http2_session_t *session, uint32_t stream_id) {
+	for(int32_t i = 0; i < MAX_STREAMS; ++i) {
+		if(session->streams[i] != NULL && session->streams[i]->id == stream_id) {
+			return session->streams[i];
+		}
+	}
+
+	return NULL;
+}
+
+
+
+static
+void release_stream(http2_session_t *session, struct http2_stream *stream) {
+	for(int32_t i = 0; i < MAX_STREAMS; ++i) {
+		if(session->streams[i] == stream) {
+			session->streams[i] = NULL;
+			session->streams_count--;
+			break;
+		}
+	}
+
+	if(stream->body_fd >= 0) {
+		close(stream->body_fd);
+	}
+
+	abandon_request(stream->admitted_at);
+	delete_request_data(stream->request_data);
+	free(stream);
+}
+
+
+
+static
+void free_session(http2_session_t *session) {
+	clear_hpack_decoder(&session->decoder);
+	free(session->output);
+	free(session->header_block);
+	free(session);
+}
+
+
+
+/* Queues response of a stream to the status of its file: 0 with the descriptor
+ * (owned by the function) whose body of passed offset and size is sent, -3 if
+ * the catalogue does not contain the file, -2 for 404 and -1 for 500. Releases
+ * the stream unless it has body to send. Returns 0 on success and -1 on memory
+ * error.
+ */
+static
+int32_t respond_to_stream(http2_session_t *session, struct http2_stream *stream, int32_t status,
+						  int32_t fd, off_t offset, off_t size) {
+
+	request_data_t *req_data = stream->request_data;
+	int32_t queue_status = 0;
+
+	if(status == 0) {
+		bool end_stream = (stream->head || size == 0);
+		queue_status = queue_response_headers(session, stream->id, "200", size, NULL, end_stream, &stream->admitted_at);
+		USDT_PROBE2(file_start, session->conn->fd, size);
+
+		if(!end_stream && queue_status == 0) {
+			stream->body_fd = fd;
+			stream->body_start = offset;
+			stream->body_offset = offset;
+			stream->body_remaining = size;
+		}
+		else {
+			USDT_PROBE2(file_done, session->conn->fd, 0);
+			close(fd);
+		}
+	}
+	else if(status == -3) {
+		/* Resource moved to corelated server, clients are always redirected
+		 * to it (reverse-proxy mode serves HTTP/1.1 connections only)
+		 */
+		char *address = NULL;
+		STATS_ADD(corelated_lookups, 1);
+
+		if(set_address(&address, get_original_path_string_pointer(req_data), get_path_length(req_data),
+					   get_redirect_index(stream->vhost)) < 0) {
+
+			queue_status = answer_stream(session, stream->id, "500", stream->admitted_at);
+		}
+		else if(address == NULL) {
+			queue_status = answer_stream(session, stream->id, "404", stream->admitted_at);
+		}
+		else {
+			queue_status = queue_response_headers(session, stream->id, "302", 0, address, true, &stream->admitted_at);
+			free(address);
+		}
+
+		stream->admitted_at = 0;
+	}
+	else {
+		queue_status = answer_stream(session, stream->id, (status == -2) ? "404" : "500", stream->admitted_at);
+		stream->admitted_at = 0;
+	}
+
+	if(stream->body_fd < 0) {
+		release_stream(session, stream);
+	}
+
+	return queue_status;
+}
+
+
+
+/* Completes resolution of the file requested on a stream
+ * (offload_job_t complete callback)
+ */
+static
+void finish_stream_file(offload_job_t *job) {
+	struct stream_job *stream_job = (struct stream_job *) job;
+	http2_session_t *session = stream_job->session;
+	struct http2_stream *stream = stream_job->stream;
+
+	int32_t status = stream_job->file_job.status;
+	int32_t fd = stream_job->file_job.fd;
+	off_t size = stream_job->file_job.size;
+
+	free(stream_job);
+
+	session->pending_jobs--;
+	stream->job_pending = false;
+
+	if(session->conn == NULL || stream->reset) {
+		if(fd >= 0) {
+			close(fd);
+		}
+
+		release_stream(session, stream);
+
+		if(session->conn == NULL && session->pending_jobs == 0) {
+			free_session(session);
+		}
+
+		return;
+	}
+
+	/* Hit snapshot and warm-up cover the default catalogue only
+	 */
+	if(status == 0 && stream->vhost == get_default_vhost()) {
+		record_file_hit(get_original_path_string_pointer(stream->request_data), get_path_length(stream->request_data));
+	}
+
+	if(respond_to_stream(session, stream, status, fd, 0, size) < 0) {
+		session->closing = true;
+	}
+
+	wake_connection(session->conn);
+}
+
+
+
+/* Answers request of passed request data (owned by the function) on stream
+ * of passed id, either right away or once its file has been resolved by the
+ * offload pool. Returns 0 on success and -1 on memory error.
+ */
+static
+int32_t answer_request(http2_session_t *session, uint32_t stream_id, request_data_t *req_data, vhost_t *vhost) {
+	connection_t *conn = session->conn;
+	int32_t method = get_method_type(req_data);
+	uint64_t admitted_at = 0;
+	const char *status = NULL;
+
+	STATS_ADD(requests, 1);
+	USDT_PROBE3(request_parsed, conn->fd, method, get_path_length(req_data));
+
+	if(!take_client_token(conn->client_key)) {
+		status = "429";
+	}
+	else if(conn->shed || !admit_request(&admitted_at)) {
+		/* Later streams of a session accepted while overloaded are
+		 * admitted as usual
+		 */
+		conn->shed = false;
+		status = "503";
+	}
+	else if(method != GET_METHOD && method != HEAD_METHOD) {
+		status = "501";
+	}
+	else if(!check_request_path_characters(req_data) || (vhost == get_default_vhost() &&
+			is_path_absent(get_original_path_string_pointer(req_data), get_path_length(req_data)))) {
+		status = "404";
+	}
+
+	struct http2_stream *stream = NULL;
+	struct stream_job *stream_job = NULL;
+	archive_t *archive = get_archive(vhost);
+
+	if(status == NULL) {
+		stream = malloc(sizeof(struct http2_stream));
+		stream_job = (archive == NULL) ? malloc(sizeof(struct stream_job)) : NULL;
+
+		if(stream == NULL || (archive == NULL && stream_job == NULL)) {
+			free(stream);
+			free(stream_job);
+			status = "500";
+		}
+	}
+
+	if(status != NULL) {
+		delete_request_data(req_data);
+		return answer_stream(session, stream_id, status, admitted_at);
+	}
+
+	memset(stream, 0, sizeof(struct http2_stream));
+	stream->id = stream_id;
+	stream->request_data = req_data;
+	stream->vhost = vhost;
+	stream->head = (method == HEAD_METHOD);
+	stream->admitted_at = admitted_at;
+	stream->job_pending = (archive == NULL);
+	stream->body_fd = -1;
+	stream->window = session->initial_window;
+
+	for(int32_t i = 0; i < MAX_STREAMS; ++i) {
+		if(session->streams[i] == NULL) {
+			session->streams[i] = stream;
+			session->streams_count++;
+			break;
+		}
+	}
+
+	/* Index of packed catalogue is in memory, the stream is answered right
+	 * away with its body sent from a duplicate of the archive descriptor
+	 */
+	if(archive != NULL) {
+		archived_file_t file;
+
+		if(!find_archived_file(archive, get_original_path_string_pointer(req_data), get_path_length(req_data), &file)) {
+			return respond_to_stream(session, stream, -3, -1, 0, 0);
+		}
+
+		int32_t fd = fcntl(file.fd, F_DUPFD_CLOEXEC, 0);
+
+		return respond_to_stream(session, stream, (fd < 0) ? -1 : 0, fd, file.offset, file.length);
+	}
+
+	/* Path resolution, stat() and open() may block on slow file systems,
+	 * they are performed on the offload pool like for HTTP/1.1 requests
+	 */
+	stream_job->file_job.job.run = resolve_requested_file;
+	stream_job->file_job.job.complete = finish_stream_file;
+	stream_job->file_job.client_socket = conn->fd;
+	stream_job->file_job.head = stream->head;
+	stream_job->file_job.path = get_path_string_pointer(req_data);
+	stream_job->file_job.catalogue_path = vhost->catalogue_path;
+	stream_job->session = session;
+	stream_job->stream = stream;
+
+	session->pending_jobs++;
+	submit_offload_job(&stream_job->file_job.job);
+
+	return 0;
+}
+
+
+
+static
+bool is_name(const char *name, size_t length, const char *expected) {
+	return (length == strlen(expected) && memcmp(name, expected, length) == 0);
+}
+
+
+
+/* Collects fields of request header block (hpack_field_callback_t),
+ * the whole block is always decoded to keep the decoder state in sync
+ */
+static
+int32_t collect_field(void *context, const char *name, size_t name_length, const char *value, size_t value_length) {
+	struct request_fields *fields = context;
+
+	if(name_length > 0 && name[0] == ':') {
+		if(fields->regular_seen) {
+			fields->malformed = true;
+		}
+		else if(is_name(name, name_length, ":method") && !fields->method_seen) {
+			fields->method_seen = true;
+
+			if(is_name(value, value_length, "GET")) {
+				fields->method = GET_METHOD;
+			}
+			else if(is_name(value, value_length, "HEAD")) {
+				fields->method = HEAD_METHOD;
+			}
+			else if(is_name(value, value_length, "PUT")) {
+				fields->method = PUT_METHOD;
+			}
+			else {
+				fields->method = UNKNOWN_METHOD_TYPE;
+			}
+		}
+		else if(is_name(name, name_length, ":path") && !fields->path_seen) {
+			fields->path_seen = true;
+
+			/* Only origin-form targets are served, anything not starting
+			 * with '/' could escape the catalogue once joined with its path
+			 */
+			if(value_length == 0 || value_length > MAX_TARGET_LENGTH || value[0] != '/') {
+				fields->malformed = true;
+			}
+			else {
+				memcpy(fields->path, value, value_length);
+				fields->path_length = value_length;
+			}
+		}
+		else if(is_name(name, name_length, ":authority") && !fields->authority_seen) {
+			fields->authority_seen = (value_length <= sizeof(fields->authority));
+			memcpy(fields->authority, value, fields->authority_seen ? value_length : 0);
+			fields->authority_length = fields->authority_seen ? value_length : 0;
+		}
+		else if(is_name(name, name_length, ":scheme") && !fields->scheme_seen) {
+			fields->scheme_seen = true;
+		}
+		else {
+			fields->malformed = true;
+		}
+
+		return 0;
+	}
+
+	fields->regular_seen = true;
+
+	/* Header names are lowercase, connection-specific
+	 * headers are not allowed
+	 */
+	for(size_t i = 0; i < name_length; ++i) {
+		if(name[i] >= 'A' && name[i] <= 'Z') {
+			fields->malformed = true;
+		}
+	}
+
+	if(is_name(name, name_length, "connection") || is_name(name, name_length, "upgrade") ||
+	   is_name(name, name_length, "keep-alive") || is_name(name, name_length, "proxy-connection") ||
+	   is_name(name, name_length, "transfer-encoding") ||
+	   (is_name(name, name_length, "te") && !is_name(value, value_length, "trailers"))) {
+
+		fields->malformed = true;
+	}
+
+	/* Host stands for missing :authority
+	 */
+	if(is_name(name, name_length, "host") && !fields->authority_seen && value_length <= sizeof(fields->authority)) {
+		memcpy(fields->authority, value, value_length);
+		fields->authority_length = value_length;
+	}
+
+	return 0;
+}
+
+
+
+/* Decodes complete header block of the last HEADERS frame and answers
+ * the request if it opens new stream. Returns 0 on success, error code
+ * of connection error or -1 on memory error.
+ */
+static
+int32_t finish_header_block(http2_session_t *session, const uint8_t *block, size_t length) {
+	struct request_fields *fields = &session->fields;
+
+	fields->method_seen = false;
+	fields->scheme_seen = false;
+	fields->regular_seen = false;
+	fields->malformed = false;
+	fields->path_seen = false;
+	fields->path_length = 0;
+	fields->authority_seen = false;
+	fields->authority_length = 0;
+
+	int32_t status = decode_header_block(&session->decoder, block, length, collect_field, fields);
+
+	if(status != 0) {
+		return COMPRESSION_ERROR;
+	}
+
+	/* Trailers of a request are ignored
+	 */
+	if(!session->block_opens_stream) {
+		return 0;
+	}
+
+	uint32_t stream_id = session->block_stream;
+
+	if(fields->malformed || !fields->method_seen || !fields->path_seen || !fields->scheme_seen) {
+		return queue_reset_stream(session, stream_id, PROTOCOL_ERROR);
+	}
+
+	if(session->streams_count == MAX_STREAMS) {
+		return queue_reset_stream(session, stream_id, REFUSED_STREAM);
+	}
+
+	vhost_t *vhost = (fields->authority_length == 0) ? get_default_vhost() :
+					 find_vhost(fields->authority, fields->authority_length);
+
+	request_data_t *req_data = new_request_data(vhost->catalogue_path);
+
+	if(req_data == NULL) {
+		return answer_stream(session, stream_id, "500", 0);
+	}
+
+	set_method_type(req_data, fields->method);
+
+	/* Target is decoded the way request line's one is, ended with a space
+	 */
+	fields->path[fields->path_length] = ' ';
+
+	if(decode_request_target(req_data, fields->path, fields->path_length + 1) < 0) {
+		delete_request_data(req_data);
+		return answer_stream(session, stream_id, "400", 0);
+	}
+
+	return answer_request(session, stream_id, req_data, vhost);
+}
+
+
+
+static
+int32_t handle_headers(http2_session_t *session, uint8_t flags, uint32_t stream_id,
+					   const uint8_t *payload, size_t length) {
+
+	if(stream_id == 0 || (stream_id & 1) == 0) {
+		return PROTOCOL_ERROR;
+	}
+
+	size_t padding = 0;
+
+	if(flags & FLAG_PADDED) {
+		if(length < 1) {
+			return FRAME_SIZE_ERROR;
+		}
+
+		padding = payload[0];
+		payload++;
+		length--;
+	}
+
+	/* Priorities are not supported, the stream dependency is skipped
+	 */
+	if(flags & FLAG_PRIORITY) {
+		if(length < 5) {
+			return FRAME_SIZE_ERROR;
+		}
+
+		payload += 5;
+		length -= 5;
+	}
+
+	if(padding > length) {
+		return PROTOCOL_ERROR;
+	}
+
+	length -= padding;
+
+	session->block_stream = stream_id;
+	session->block_opens_stream = (stream_id > session->last_stream_id);
+
+	if(stream_id > session->last_stream_id) {
+		session->last_stream_id = stream_id;
+	}
+
+	if(flags & FLAG_END_HEADERS) {
+		return finish_header_block(session, payload, length);
+	}
+
+	if(length > HEADER_BLOCK_LIMIT) {
+		return ENHANCE_YOUR_CALM;
+	}
+
+	if(session->header_block == NULL) {
+		session->header_block = malloc(HEADER_BLOCK_LIMIT);
+
+		if(session->header_block == NULL) {
+			return -1;
+		}
+	}
+
+	memcpy(session->header_block, payload, length);
+	session->header_block_length = length;
+	session->continuation_stream = stream_id;
+
+	return 0;
+}
+
+
+
+static
+int32_t handle_continuation(http2_session_t *session, uint8_t flags, const uint8_t *payload, size_t length) {
+	if(session->header_block_length + length > HEADER_BLOCK_LIMIT) {
+		return ENHANCE_YOUR_CALM;
+	}
+
+	memcpy(session->header_block + session->header_block_length, payload, length);
+	session->header_block_length += length;
+
+	if(!(flags & FLAG_END_HEADERS)) {
+		return 0;
+	}
+
+	session->continuation_stream = 0;
+
+	return finish_header_block(session, session->header_block, session->header_block_length);
+}
+
+
+
+/* Applies client settings, either of SETTINGS frame or of HTTP2-Settings
+ * header. Returns 0 on success or error code of connection error.
+ */
+static
+int32_t apply_settings(http2_session_t *session, const uint8_t *payload, size_t length) {
+	if(length % 6 != 0) {
+		return FRAME_SIZE_ERROR;
+	}
+
+	for(size_t i = 0; i < length; i += 6) {
+		uint16_t identifier = (payload[i] << 8) | payload[i + 1];
+		uint32_t value = read_uint32(payload + i + 2);
+
+		if(identifier == SETTINGS_ENABLE_PUSH && value > 1) {
+			return PROTOCOL_ERROR;
+		}
+
+		/* Frames sent never exceed the default maximum size,
+		 * which the client can not decrease
+		 */
+		if(identifier == SETTINGS_MAX_FRAME_SIZE && (value < MAX_FRAME_SIZE || value > 0xffffff)) {
+			return PROTOCOL_ERROR;
+		}
+
+		/* Change of initial window applies to the windows
+		 * of all open streams
+		 */
+		if(identifier == SETTINGS_INITIAL_WINDOW_SIZE) {
+			if(value > MAX_WINDOW) {
+				return FLOW_CONTROL_ERROR;
+			}
+
+			int64_t delta = (int64_t) value - session->initial_window;
+
+			for(int32_t j = 0; j < MAX_STREAMS; ++j) {
+				if(session->streams[j] != NULL) {
+					session->streams[j]->window += delta;
+
+					if(session->streams[j]->window > MAX_WINDOW) {
+						return FLOW_CONTROL_ERROR;
+					}
+				}
+			}
+
+			session->initial_window = value;
+		}
+	}
+
+	return 0;
+}
+
+
+
+static
+int32_t handle_settings(http2_session_t *session, uint8_t flags, uint32_t stream_id,
+						const uint8_t *payload, size_t length) {
+
+	if(stream_id != 0) {
+		return PROTOCOL_ERROR;
+	}
+
+	if(flags & FLAG_ACK) {
+		return (length == 0) ? 0 : FRAME_SIZE_ERROR;
+	}
+
+	int32_t status = apply_settings(session, payload, length);
+
+	if(status != 0) {
+		return status;
+	}
+
+	session->settings_received = true;
+
+	return (queue_frame(session, FRAME_SETTINGS, FLAG_ACK, 0, 0) == NULL) ? -1 : 0;
+}
+
+
+
+static
+int32_t handle_window_update(http2_session_t *session, uint32_t stream_id, const uint8_t *payload, size_t length) {
+	if(length != 4) {
+		return FRAME_SIZE_ERROR;
+	}
+
+	uint32_t increment = read_uint32(payload) & 0x7fffffff;
+
+	if(increment == 0) {
+		return PROTOCOL_ERROR;
+	}
+
+	if(stream_id == 0) {
+		session->window += increment;
+		return (session->window > MAX_WINDOW) ? FLOW_CONTROL_ERROR : 0;
+	}
+
+	/* Window of stream answered already
+	 */
+	struct http2_stream *stream = find_stream(session, stream_id);
+
+	if(stream == NULL) {
+		return 0;
+	}
+
+	stream->window += increment;
+	return (stream->window > MAX_WINDOW) ? FLOW_CONTROL_ERROR : 0;
+}
+
+
+
+static
+int32_t handle_reset_stream(http2_session_t *session, uint32_t stream_id, size_t length) {
+	if(length != 4) {
+		return FRAME_SIZE_ERROR;
+	}
+
+	if(stream_id == 0 || stream_id > session->last_stream_id) {
+		return PROTOCOL_ERROR;
+	}
+
+	struct http2_stream *stream = find_stream(session, stream_id);
+
+	if(stream == NULL) {
+		return 0;
+	}
+
+	/* Frame already started has to be finished, no more are sent
+	 */
+	if(stream->job_pending || stream == session->sending) {
+		stream->reset = true;
+		stream->body_remaining = 0;
+		return 0;
+	}
+
+	release_stream(session, stream);
+	return 0;
+}
+
+
+
+static
+int32_t handle_data(http2_session_t *session, uint8_t flags, uint32_t stream_id, size_t length) {
+	if(stream_id == 0 || stream_id > session->last_stream_id) {
+		return PROTOCOL_ERROR;
+	}
+
+	/* Request bodies are not used, received bytes are given back to the
+	 * connection window and, unless the body has ended, to the window of
+	 * the stream (which may already be answered), so that a client still
+	 * sending the body is never left blocked
+	 */
+	if(length > 0 && !(flags & FLAG_END_STREAM)) {
+		if(queue_window_update(session, stream_id, length) < 0) {
+			return -1;
+		}
+	}
+
+	session->received_unacknowledged += length;
+
+	if(session->received_unacknowledged >= WINDOW_UPDATE_THRESHOLD) {
+		if(queue_window_update(session, 0, session->received_unacknowledged) < 0) {
+			return -1;
+		}
+
+		session->received_unacknowledged = 0;
+	}
+
+	return 0;
+}
+
+
+
+/* Handles single frame. Returns 0 on success, error code of connection
+ * error or -1 on memory error.
+ */
+static
+int32_t handle_frame(http2_session_t *session, uint8_t type, uint8_t flags, uint32_t stream_id,
+					 const uint8_t *payload, size_t length) {
+
+	/* Header block has to be continued by the very next frame
+	 */
+	if(session->continuation_stream != 0) {
+		if(type != FRAME_CONTINUATION || stream_id != session->continuation_stream) {
+			return PROTOCOL_ERROR;
+		}
+
+		return handle_continuation(session, flags, payload, length);
+	}
+
+	if(!session->settings_received && type != FRAME_SETTINGS) {
+		return PROTOCOL_ERROR;
+	}
+
+	switch(type) {
+		case FRAME_DATA:
+			return handle_data(session, flags, stream_id, length);
+		case FRAME_HEADERS:
+			return handle_headers(session, flags, stream_id, payload, length);
+		case FRAME_PRIORITY:
+			return (length == 5) ? 0 : FRAME_SIZE_ERROR;
+		case FRAME_RST_STREAM:
+			return handle_reset_stream(session, stream_id, length);
+		case FRAME_SETTINGS:
+			return handle_settings(session, flags, stream_id, payload, length);
+		case FRAME_PUSH_PROMISE:
+			return PROTOCOL_ERROR;
+		case FRAME_PING:
+			if(stream_id != 0) {
+				return PROTOCOL_ERROR;
+			}
+
+			if(length != 8) {
+				return FRAME_SIZE_ERROR;
+			}
+
+			if(!(flags & FLAG_ACK)) {
+				uint8_t *reply = queue_frame(session, FRAME_PING, FLAG_ACK, 0, 8);
+
+				if(reply == NULL) {
+					return -1;
+				}
+
+				memcpy(reply, payload, 8);
+			}
+
+			return 0;
+		case FRAME_GOAWAY:
+			if(stream_id != 0) {
+				return PROTOCOL_ERROR;
+			}
+
+			session->peer_goaway = true;
+			return 0;
+		case FRAME_WINDOW_UPDATE:
+			return handle_window_update(session, stream_id, payload, length);
+		case FRAME_CONTINUATION:
+			return PROTOCOL_ERROR;
+		default:
+			/* Frames of unknown types are ignored
+			 */
+			return 0;
+	}
+}
+
+
+
+/* Handles complete frames of the input for as long as the output stays
+ * below the high water mark. Returns -1 if the connection has to be closed
+ * right away (invalid preface or memory error), 0 otherwise.
+ */
+static
+int32_t handle_input(http2_session_t *session) {
+	size_t position = 0;
+
+	while(!session->closing && session->output_length - session->output_sent < OUTPUT_HIGH_WATER) {
+		size_t available = session->input_length - position;
+
+		if(!session->preface_received) {
+			if(available < PREFACE_LENGTH) {
+				break;
+			}
+
+			if(memcmp(session->input + position, PREFACE, PREFACE_LENGTH) != 0) {
+				return -1;
+			}
+
+			position += PREFACE_LENGTH;
+			session->preface_received = true;
+			continue;
+		}
+
+		if(available < FRAME_HEADER_LENGTH) {
+			break;
+		}
+
+		const uint8_t *header = session->input + position;
+		size_t length = ((size_t) header[0] << 16) | (header[1] << 8) | header[2];
+		int32_t status;
+
+		if(length > MAX_FRAME_SIZE) {
+			status = FRAME_SIZE_ERROR;
+		}
+		else if(available < FRAME_HEADER_LENGTH + length) {
+			break;
+		}
+		else {
+			status = handle_frame(session, header[3], header[4], read_uint32(header + 5) & 0x7fffffff,
+								  header + FRAME_HEADER_LENGTH, length);
+			position += FRAME_HEADER_LENGTH + length;
+		}
+
+		if(status < 0) {
+			return -1;
+		}
+
+		/* Connection error, the client learns the last stream
+		 * processed and the connection is closed
+		 */
+		if(status > 0) {
+			if(queue_goaway(session, status) < 0) {
+				return -1;
+			}
+
+			session->closing = true;
+		}
+	}
+
+	memmove(session->input, session->input + position, session->input_length - position);
+	session->input_length -= position;
+
+	return 0;
+}
+
+
+
+/* Checks whether the input holds a frame which can be handled
+ */
+static
+bool has_complete_frame(http2_session_t *session) {
+	if(!session->preface_received) {
+		return (session->input_length >= PREFACE_LENGTH);
+	}
+
+	if(session->input_length < FRAME_HEADER_LENGTH) {
+		return false;
+	}
+
+	size_t length = ((size_t) session->input[0] << 16) | (session->input[1] << 8) | session->input[2];
+
+	return (length > MAX_FRAME_SIZE || session->input_length >= FRAME_HEADER_LENGTH + length);
+}
+
+
+
+/* Reads from the socket and handles received frames until the read would
+ * block or the output reaches the high water mark. Returns -1 if the
+ * connection has to be closed, 0 otherwise.
+ */
+static
+int32_t receive_frames(http2_session_t *session) {
+	int32_t fd = session->conn->fd;
+
+	while(true) {
+		if(handle_input(session) < 0) {
+			return -1;
+		}
+
+		if(session->closing || session->output_length - session->output_sent >= OUTPUT_HIGH_WATER) {
+			return 0;
+		}
+
+		ssize_t read_bytes = read(fd, session->input + session->input_length, INPUT_SIZE - session->input_length);
+
+		if(read_bytes < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+
+		if(read_bytes == 0) {
+			return -1;
+		}
+
+		session->input_length += read_bytes;
+	}
+}
+
+
+
+/* Queues header of the next DATA frame, taking streams with sendable body
+ * in turns. Returns false if no stream can send (or flow control windows
+ * do not let it).
+ */
+static
+bool schedule_data_frame(http2_session_t *session) {
+	if(session->closing || session->window <= 0) {
+		return false;
+	}
+
+	for(int32_t i = 0; i < MAX_STREAMS; ++i) {
+		int32_t index = (session->next_stream + i) % MAX_STREAMS;
+		struct http2_stream *stream = session->streams[index];
+
+		if(stream == NULL || stream->body_remaining == 0 || stream->window <= 0) {
+			continue;
+		}
+
+		off_t length = stream->body_remaining;
+
+		if(length > stream->window) {
+			length = stream->window;
+		}
+
+		if(length > session->window) {
+			length = session->window;
+		}
+
+		if(length > MAX_FRAME_SIZE) {
+			length = MAX_FRAME_SIZE;
+		}
+
+		bool end_stream = (length == stream->body_remaining);
+
+		if(queue_frame(session, FRAME_DATA, end_stream ? FLAG_END_STREAM : 0, stream->id, 0) == NULL) {
+			return false;
+		}
+
+		/* Payload length is filled in here, queue_frame() reserves none
+		 */
+		uint8_t *header = session->output + session->output_length - FRAME_HEADER_LENGTH;
+		header[0] = length >> 16;
+		header[1] = length >> 8;
+		header[2] = length;
+
+		stream->body_remaining -= length;
+		stream->window -= length;
+		session->window -= length;
+
+		session->sending = stream;
+		session->payload_at = session->output_length;
+		session->payload_left = length;
+		session->next_stream = (index + 1) % MAX_STREAMS;
+
+		return true;
+	}
+
+	return false;
+}
+
+
+
+/* Writes queued output and DATA payloads. Returns 1 when everything that can be
+ * sent has been, 0 when the socket would block, 2 when the quantum has been
+ * used up and -1 on error.
+ */
+static
+int32_t flush_frames(http2_session_t *session) {
+	connection_t *conn = session->conn;
+
+	/* Response switching protocols precedes the frames
+	 */
+	while(conn->output_sent < conn->output_length) {
+		ssize_t written = write(conn->fd, conn->output + conn->output_sent, conn->output_length - conn->output_sent);
+
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+
+		conn->output_sent += written;
+	}
+
+	conn->output_length = 0;
+	conn->output_sent = 0;
+
+	while(true) {
+		size_t output_end = (session->payload_left > 0) ? session->payload_at : session->output_length;
+
+		while(session->output_sent < output_end) {
+			/* Header of DATA frame is held until its payload follows
+			 */
+			ssize_t written = send(conn->fd, session->output + session->output_sent, output_end - session->output_sent,
+								   (session->payload_left > 0) ? MSG_MORE : 0);
+
+			if(written < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+
+				return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+			}
+
+			STATS_ADD(bytes_sent, written);
+			session->output_sent += written;
+		}
+
+		if(session->payload_left > 0) {
+			if(is_quantum_used_up(conn)) {
+				return 2;
+			}
+
+			struct http2_stream *stream = session->sending;
+			ssize_t sent = sendfile(conn->fd, stream->body_fd, &stream->body_offset, session->payload_left);
+
+			if(sent < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+
+				return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+			}
+
+			/* File has been truncated while being sent - the frame
+			 * can not be completed anymore
+			 */
+			if(sent == 0) {
+				return -1;
+			}
+
+			session->payload_left -= sent;
+			charge_quantum(conn, sent);
+
+			if(session->payload_left > 0) {
+				continue;
+			}
+
+			session->sending = NULL;
+
+			if(stream->body_remaining == 0) {
+				if(!stream->reset) {
+					USDT_PROBE2(file_done, conn->fd, stream->body_offset - stream->body_start);
+				}
+
+				release_stream(session, stream);
+			}
+
+			continue;
+		}
+
+		session->output_length = 0;
+		session->output_sent = 0;
+
+		if(!schedule_data_frame(session)) {
+			return 1;
+		}
+	}
+}
+
+
+
+static
+http2_session_t *new_session(connection_t *conn) {
+	http2_session_t *session = malloc(sizeof(http2_session_t));
+
+	if(session == NULL) {
+		return NULL;
+	}
+
+	memset(session, 0, sizeof(http2_session_t));
+
+	session->conn = conn;
+	session->window = DEFAULT_WINDOW;
+	session->initial_window = DEFAULT_WINDOW;
+
+	init_hpack_decoder(&session->decoder);
+
+	/* Server's connection preface
+	 */
+	if(queue_settings(session) < 0) {
+		free_session(session);
+		return NULL;
+	}
+
+	return session;
+}
+
+
+
+/* Moves unparsed connection input into the session
+ */
+static
+void take_connection_input(http2_session_t *session, connection_t *conn) {
+	memcpy(session->input, conn->input, conn->input_length);
+	session->input_length = conn->input_length;
+
+	conn->input_length = 0;
+	conn->input_scanned = 0;
+}
+
+
+
+bool is_http2_preface(connection_t *conn) {
+	return (conn->tls == NULL && conn->input_length >= PREFACE_HEAD_LENGTH &&
+			memcmp(conn->input, PREFACE, PREFACE_HEAD_LENGTH) == 0);
+}
+
+
+
+int32_t start_http2(connection_t *conn) {
+	http2_session_t *session = new_session(conn);
+
+	if(session == NULL) {
+		return -1;
+	}
+
+	take_connection_input(session, conn);
+
+	conn->http2 = session;
+	conn->state = CONNECTION_HTTP2;
+
+	return 0;
+}
+
+
+
+static
+int32_t base64_value(char c) {
+	if(c >= 'A' && c <= 'Z') {
+		return c - 'A';
+	}
+
+	if(c >= 'a' && c <= 'z') {
+		return c - 'a' + 26;
+	}
+
+	if(c >= '0' && c <= '9') {
+		return c - '0' + 52;
+	}
+
+	if(c == '-' || c == '+') {
+		return 62;
+	}
+
+	if(c == '_' || c == '/') {
+		return 63;
+	}
+
+	return -1;
+}
+
+
+
+/* Checks whether comma separated list of tokens contains passed one
+ */
+static
+bool has_list_token(const char *value, size_t length, const char *token) {
+	size_t token_length = strlen(token);
+	size_t position = 0;
+
+	while(position < length) {
+		while(position < length && (value[position] == ' ' || value[position] == '\t' || value[position] == ',')) {
+			position++;
+		}
+
+		size_t start = position;
+
+		while(position < length && value[position] != ',' && value[position] != ' ' && value[position] != '\t') {
+			position++;
+		}
+
+		if(position - start == token_length && strncasecmp(value + start, token, token_length) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+
+bool parse_http2_upgrade(request_data_t *req_data, http2_upgrade_t *upgrade) {
+	const header_span_t *upgrade_header = find_request_header(req_data, UPGRADE_HEADER);
+	const header_span_t *settings_header = find_request_header(req_data, HTTP2_SETTINGS_HEADER);
+	int32_t method = get_method_type(req_data);
+
+	if(upgrade_header == NULL || settings_header == NULL || (method != GET_METHOD && method != HEAD_METHOD) ||
+	   !has_list_token(upgrade_header->value, upgrade_header->value_length, "h2c")) {
+
+		return false;
+	}
+
+	/* Settings are base64url encoded, without padding
+	 */
+	uint32_t bits = 0;
+	int32_t bits_count = 0;
+
+	upgrade->settings_length = 0;
+
+	for(size_t i = 0; i < settings_header->value_length && settings_header->value[i] != '='; ++i) {
+		int32_t value = base64_value(settings_header->value[i]);
+
+		if(value < 0) {
+			return false;
+		}
+
+		bits = (bits << 6) | value;
+		bits_count += 6;
+
+		if(bits_count >= 8) {
+			if(upgrade->settings_length == HTTP2_UPGRADE_SETTINGS_SIZE) {
+				return false;
+			}
+
+			bits_count -= 8;
+			upgrade->settings[upgrade->settings_length++] = bits >> bits_count;
+		}
+	}
+
+	return (upgrade->settings_length % 6 == 0);
+}
+
+
+
+bool upgrade_to_http2(connection_t *conn, const http2_upgrade_t *upgrade) {
+	vhost_t *default_vhost = get_default_vhost();
+	request_data_t *replacement = new_request_data(default_vhost->catalogue_path);
+
+	if(replacement == NULL) {
+		return false;
+	}
+
+	http2_session_t *session = new_session(conn);
+
+	if(session == NULL || apply_settings(session, upgrade->settings, upgrade->settings_length) != 0 ||
+	   queue_output(conn->fd, switching_protocols_message, sizeof(switching_protocols_message) - 1) < 0) {
+
+		if(session != NULL) {
+			free_session(session);
+		}
+
+		delete_request_data(replacement);
+		return false;
+	}
+
+	take_connection_input(session, conn);
+
+	conn->http2 = session;
+	conn->state = CONNECTION_HTTP2;
+
+	/* Request continues as stream 1, half-closed by the client,
+	 * the connection keeps request data for the default site
+	 */
+	request_data_t *req_data = conn->request_data;
+	vhost_t *vhost = conn->vhost;
+
+	conn->request_data = replacement;
+	conn->vhost = default_vhost;
+
+	session->last_stream_id = 1;
+
+	if(answer_request(session, 1, req_data, vhost) < 0) {
+		session->closing = true;
+	}
+
+	return true;
+}
+
+
+
+int32_t advance_http2(connection_t *conn, uint32_t *events) {
+	http2_session_t *session = conn->http2;
+
+	while(true) {
+		if(!session->closing && receive_frames(session) < 0) {
+			return -1;
+		}
+
+		int32_t flush_status = flush_frames(session);
+
+		if(flush_status < 0) {
+			return -1;
+		}
+
+		if(flush_status == 2) {
+			return 2;
+		}
+
+		bool below_high_water = (session->output_length - session->output_sent < OUTPUT_HIGH_WATER);
+
+		if(flush_status == 0) {
+			*events = EPOLLOUT | ((below_high_water && !session->closing) ? EPOLLIN : 0);
+			return 0;
+		}
+
+		/* Everything queued has been sent
+		 */
+		if(session->closing || (session->peer_goaway && session->streams_count == 0)) {
+			return -1;
+		}
+
+		/* Frames left unhandled while the output was full
+		 */
+		if(has_complete_frame(session)) {
+			continue;
+		}
+
+		*events = EPOLLIN;
+		return 0;
+	}
+}
+
+
+
+void delete_http2_session(void *http2) {
+	http2_session_t *session = http2;
+
+	session->conn = NULL;
+
+	/* Streams waiting for the offload pool are released
+	 * once their jobs complete
+	 */
+	for(int32_t i = 0; i < MAX_STREAMS; ++i) {
+		if(session->streams[i] != NULL && !session->streams[i]->job_pending) {
+			release_stream(session, session->streams[i]);
+		}
+	}
+
+	if(session->pending_jobs == 0) {
+		free_session(session);
+	}
+}
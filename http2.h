@@ -0,0 +1,93 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "connection.h"
+#include "request_data.h"
+
+
+
+/* Maximum size of client settings carried by the HTTP2-Settings header
+ * of a request upgrading the connection (at most 16 settings)
+ */
+#define HTTP2_UPGRADE_SETTINGS_SIZE 	 96
+
+
+
+/* Client settings of a request upgrading the connection to HTTP/2
+ * (payload of SETTINGS frame decoded from the HTTP2-Settings header)
+ */
+typedef struct http2_upgrade_t http2_upgrade_t;
+
+
+
+struct http2_upgrade_t {
+	uint8_t settings[HTTP2_UPGRADE_SETTINGS_SIZE];
+	size_t settings_length;
+};
+
+
+
+/* Initialises HTTP/2 state of the calling worker. Passed function is called
+ * whenever a stream of HTTP/2 connection has been answered by the offload
+ * pool - it must only register interest in the socket becoming writable,
+ * not advance the connection itself.
+ */
+void init_http2(void (*)(connection_t *));
+
+
+
+/* Checks whether input of plaintext connection starts with the HTTP/2
+ * connection preface (client with prior knowledge of HTTP/2 support)
+ */
+bool is_http2_preface(connection_t *);
+
+
+
+/* Switches connection whose input starts with the connection preface to
+ * HTTP/2, puts it into CONNECTION_HTTP2 state. Returns 0 on success and
+ * -1 on memory error.
+ */
+int32_t start_http2(connection_t *);
+
+
+
+/* Checks whether parsed request (GET or HEAD without body) asks for upgrade
+ * to HTTP/2 over plaintext connection (Upgrade: h2c) and decodes its settings.
+ * Has to be called before the request head is consumed from connection input.
+ */
+bool parse_http2_upgrade(request_data_t *, http2_upgrade_t *);
+
+
+
+/* Answers request of the connection with 101 Switching Protocols and switches
+ * the connection to HTTP/2 with passed client settings, the request continues
+ * as stream 1 and is answered over HTTP/2. Returns false (the request is to be
+ * answered over HTTP/1.1) on memory error or invalid settings.
+ */
+bool upgrade_to_http2(connection_t *, const http2_upgrade_t *);
+
+
+
+/* Reads and handles frames received on HTTP/2 connection and writes as much
+ * of queued frames and response bodies as the socket accepts and the quantum
+ * of the connection allows. Returns 0 and stores events the connection waits
+ * for under passed pointer, 2 when the quantum has been used up (the connection
+ * should yield) and -1 when the connection has to be closed.
+ */
+int32_t advance_http2(connection_t *, uint32_t *);
+
+
+
+/* Detaches HTTP/2 session from deleted connection and frees it once the
+ * files of its streams have been resolved by the offload pool
+ */
+void delete_http2_session(void *);
+
+
+
+#endif /* HTTP2_H */
@@ -1,24 +1,26 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
 #include <errno.h>
+#include <time.h>
 #include "request_data.h"
 #include "ioprotocol.h"
 #include "filesearch.h"
-
-
-
-/* Constant representing the size of server buffer
- */
-#define BUFFER_SIZE 		 4096
+#include "connection.h"
+#include "proxy.h"
+#include "probes.h"
+#include "stats.h"
 
 
 
@@ -36,25 +38,41 @@ static const ssize_t HTTP_VERSION_LENGTH = 8;
 
 
 
-/* Array storing the string representations of all request headers that are relevant to
- * the server
+/* Names (in lowercase) of all request headers that are relevant to the server,
+ * indexed by the *_HEADER constants
  */
-static const char *headers[] = { "Connection", "Content-Length" };
+static const char *headers[HEADERS_COUNT] = { "connection", "content-length", "transfer-encoding", "expect", "host",
+                                              "upgrade", "http2-settings" };
 
 
 
-/* Array storing informations about whether header with corresponding index in headers array
- * has been provided in HTTP request message, filled with (false) values before parsing each
- * request
+/* Open addressing table of known headers keyed by hash of the lowercased
+ * name, slots store index of the header (-1 for empty ones). Filled once,
+ * before the first request is parsed.
  */
-static bool header_usage[2] = { false };
+#define HEADER_SLOTS 				 32
+
+_Static_assert(HEADERS_COUNT <= MAX_KNOWN_HEADERS && HEADERS_COUNT < HEADER_SLOTS, "too many known headers");
+
+static int8_t header_slots[HEADER_SLOTS];
+static uint32_t header_hashes[HEADERS_COUNT];
+static bool header_slots_ready = false;
+
+
+
+/* FNV-1a hash of header name, bit 0x20 is set in every byte so that
+ * the hash does not depend on the case of letters
+ */
+#define HEADER_HASH_BASIS 			 2166136261u
+#define HEADER_HASH_PRIME 			 16777619u
+#define HEADER_HASH_STEP(hash, c) 	 (((hash) ^ ((unsigned char) (c) | 0x20)) * HEADER_HASH_PRIME)
 
 
 
 /* Array storing the string representations of methods implemented by the server
  * (known methods)
  */
-static const char *methods[] = { "GET", "HEAD" };
+static const char *methods[] = { "GET", "HEAD", "PUT" };
 
 
 
@@ -65,68 +83,144 @@ static const char *CRLF = "\r\n";
 
 
 
+/* Response template - status line together with Server header, which is followed
+ * by the shared Date header and the remaining headers of the response. Lengths of
+ * both parts are known at compile time
+ */
+typedef struct response_template_t {
+	const char *status;
+	size_t status_length;
+	const char *headers;
+	size_t headers_length;
+} response_template_t;
+
+
+
+#define RESPONSE_TEMPLATE(status, headers) 	 { status, sizeof(status) - 1, headers, sizeof(headers) - 1 }
+#define SERVER_HEADER 						 "Server: SIK_server\r\n"
+
+
+
 /* Error message sent to client on server error
  */
-static const char *generic_error_message = "HTTP/1.1 500 InternalServerError\r\nConnection: close\r\nServer: SIK_server\r\n\r\n";
+static const response_template_t generic_error_message = RESPONSE_TEMPLATE(
+	"HTTP/1.1 500 InternalServerError\r\n" SERVER_HEADER, "Connection: close\r\nContent-Length: 0\r\n\r\n");
 
 
 
 /* Error message sent to client on incorrect request
  */
-static const char *bad_request_message = "HTTP/1.1 400 BadRequest\r\nConnection: close\r\nServer: SIK_server\r\n\r\n";
+static const response_template_t bad_request_message = RESPONSE_TEMPLATE(
+	"HTTP/1.1 400 BadRequest\r\n" SERVER_HEADER, "Connection: close\r\nContent-Length: 0\r\n\r\n");
 
 
 
 /* Message sent to client on encountering an unknown
  * method name (provided that the rest of http request is correct)
  */
-static const char *unknown_method_message = "HTTP/1.1 501 UnknownMethod\r\nServer: SIK_server\r\n\r\n";
+static const response_template_t unknown_method_message = RESPONSE_TEMPLATE(
+	"HTTP/1.1 501 UnknownMethod\r\n" SERVER_HEADER, "Content-Length: 0\r\n\r\n");
 
 
 
 /* Message sent to client on request for a file that can not be found
  * both in server files directory and as a file located on corelated server
  */
-static const char *resource_not_found_message = "HTTP/1.1 404 TargetNotFound\r\nServer: SIK_server\r\n\r\n";
-static const char *resource_not_found_close_message = "HTTP/1.1 404 TargetNotFound\r\nServer: SIK_server\r\nConnection: close\r\n\r\n";
+static const response_template_t resource_not_found_message = RESPONSE_TEMPLATE(
+	"HTTP/1.1 404 TargetNotFound\r\n" SERVER_HEADER, "Content-Length: 0\r\n\r\n");
+static const response_template_t resource_not_found_close_message = RESPONSE_TEMPLATE(
+	"HTTP/1.1 404 TargetNotFound\r\n" SERVER_HEADER, "Connection: close\r\nContent-Length: 0\r\n\r\n");
+
+
+
+/* Error message sent to client which has exceeded its request rate
+ */
+static const response_template_t too_many_requests_message = RESPONSE_TEMPLATE(
+	"HTTP/1.1 429 TooManyRequests\r\n" SERVER_HEADER, "Connection: close\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n");
+
+
+
+/* Error message sent to client whose request has been shed by overloaded server
+ */
+static const response_template_t service_unavailable_message = RESPONSE_TEMPLATE(
+	"HTTP/1.1 503 ServiceUnavailable\r\n" SERVER_HEADER, "Connection: close\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n");
 
 
 
 /* Part of message which is sent to client when requested file has not been found in server directory
- * but was found on one of corelated servers
+ * but was found on one of corelated servers, followed by the address and double CRLF
  */
-static const char *temp_moved_message_part = "HTTP/1.1 302 TemporarilyMoved\r\nServer: SIK_server\r\nLocation: ";
+static const response_template_t temp_moved_message_part = RESPONSE_TEMPLATE(
+	"HTTP/1.1 302 TemporarilyMoved\r\n" SERVER_HEADER, "Content-Length: 0\r\nLocation: ");
+
+
+
+/* Error message sent to client when the resource could not be fetched
+ * from corelated server in reverse-proxy mode
+ */
+static const response_template_t bad_gateway_message = RESPONSE_TEMPLATE(
+	"HTTP/1.1 502 BadGateway\r\n" SERVER_HEADER, "Connection: close\r\nContent-Length: 0\r\n\r\n");
+
+
+
+/* Messages sent to client once the body of PUT request has been stored either as
+ * a new file or over an existing one
+ */
+static const response_template_t created_message = RESPONSE_TEMPLATE(
+	"HTTP/1.1 201 Created\r\n" SERVER_HEADER, "Content-Length: 0\r\n\r\n");
+static const response_template_t created_close_message = RESPONSE_TEMPLATE(
+	"HTTP/1.1 201 Created\r\n" SERVER_HEADER, "Connection: close\r\nContent-Length: 0\r\n\r\n");
+static const response_template_t replaced_message = RESPONSE_TEMPLATE(
+	"HTTP/1.1 204 NoContent\r\n" SERVER_HEADER, "\r\n");
+static const response_template_t replaced_close_message = RESPONSE_TEMPLATE(
+	"HTTP/1.1 204 NoContent\r\n" SERVER_HEADER, "Connection: close\r\n\r\n");
+
+
+
+/* Interim response sent to client waiting for permission to send the body,
+ * interim responses carry no Date header
+ */
+static const char continue_message[] = "HTTP/1.1 100 Continue\r\n\r\n";
 
 
 
 /* Part of message which is sent to client when requested file has been found and its content (whole
- * or part of it) is expected to be passed in message body (GET method from client)
+ * or part of it) is expected to be passed in message body (GET method from client), followed by
+ * the file size and double CRLF
  */
-static const char *file_response_part = "HTTP/1.1 200 OK\r\nServer: SIK_server\r\nContent-Type: application/octet-stream\r\nContent-Length: ";
-static const char *file_response_part_close = "HTTP/1.1 200 OK\r\nServer: SIK_server\r\nConnection: close\r\nContent-Type: application/octet-stream\r\nContent-Length: ";
+static const response_template_t file_response_part = RESPONSE_TEMPLATE(
+	"HTTP/1.1 200 OK\r\n" SERVER_HEADER, "Content-Type: application/octet-stream\r\nContent-Length: ");
+static const response_template_t file_response_part_close = RESPONSE_TEMPLATE(
+	"HTTP/1.1 200 OK\r\n" SERVER_HEADER, "Connection: close\r\nContent-Type: application/octet-stream\r\nContent-Length: ");
 
 
 
-/* Buffer for reading input data from client socket
+/* Status line of file packed in an archive, which is followed by the
+ * Date header, Connection header (if any) and headers stored in the archive
  */
-static char server_buffer[BUFFER_SIZE];
+static const response_template_t archived_file_part = RESPONSE_TEMPLATE(
+	"HTTP/1.1 200 OK\r\n" SERVER_HEADER, "");
+static const response_template_t archived_file_part_close = RESPONSE_TEMPLATE(
+	"HTTP/1.1 200 OK\r\n" SERVER_HEADER, "Connection: close\r\n");
 
 
 
-/* Buffer for writing file content to client socket
+/* Date header of responses, refreshed by refresh_date_header() once
+ * per second (IMF-fixdate is always 29 characters long)
  */
-static char file_content_buffer[BUFFER_SIZE];
+static char date_header[sizeof("Date: \r\n") + 29] = "Date: Thu, 01 Jan 1970 00:00:00 GMT\r\n";
+static size_t date_header_length = sizeof(date_header) - 1;
 
 
 
-/* Maximum number of bytes that target resource path
- * or header value can contain
+/* Number of bytes of response body read ahead by a single
+ * offloaded job
  */
-static const size_t bytes_length_limit = 1 << 13;
+#define PREFETCH_WINDOW 		 (2 << 20)
 
 
 
-void parse_request_line(int32_t client_socket, 
+void parse_request_line(char *server_buffer, 
                         ssize_t *bytes_in_buffer,
                         request_data_t *request_data) {
 
@@ -157,21 +251,19 @@ void parse_request_line(int32_t client_socket,
 	memset(method_name_buffer, 0, 10);
 	
 	while(!finish_request_line) {
+		/* Whole request head is in the buffer before parsing begins, running
+		 * out of bytes means that it is malformed
+		 */
 		if(remaining == 0) {
-			remaining = read(client_socket, server_buffer, sizeof(server_buffer));
-			
-			if(remaining == 0) {
-				mark_connection_closed(request_data);
-				return;
-			}
-
-			buffer_iter = 0;
+			set_error_status(request_data, ERROR_BAD_REQUEST);
+			return;
 		}
 		
 		if(!check_method) {
 			if(server_buffer[buffer_iter] == ' ') {
 				if(!method_detected) {
 					set_error_status(request_data, ERROR_BAD_REQUEST);
+					return;
 				}
 				else {
 					check_method = true;
@@ -202,6 +294,9 @@ void parse_request_line(int32_t client_socket,
 			else if(strcmp(method_name_buffer, methods[HEAD_METHOD]) == 0) {
 				set_method_type(request_data, HEAD_METHOD);
 			}
+			else if(strcmp(method_name_buffer, methods[PUT_METHOD]) == 0) {
+				set_method_type(request_data, PUT_METHOD);
+			}
 			else {
 				set_method_type(request_data, UNKNOWN_METHOD_TYPE);
 			}
@@ -218,35 +313,29 @@ void parse_request_line(int32_t client_socket,
 			check_first_space = true;
 		}
 		else if(!check_request_target) {
-
-			if(server_buffer[buffer_iter] != ' ') {
-				append_char(request_data, server_buffer[buffer_iter]);
-				
-				/* Too long resource path (answer to one of questions to the task
-				 * proposes sensible limit to be 2^13 bytes), request can be rejected
-				 * as bad
-				 */
-				if(get_path_length(request_data) > bytes_length_limit) {
-
-					set_error_status(request_data, ERROR_BAD_REQUEST);
-					return;
-				}
-				
-				buffer_iter++;
-				remaining--;
+			ssize_t target_length = decode_request_target(request_data, server_buffer + buffer_iter, remaining);
+			
+			/* Illegal bytes, invalid percent-encoding or too long resource path (answer
+			 * to one of questions to the task proposes sensible limit to be 2^13 bytes),
+			 * request can be rejected as bad
+			 */
+			if(target_length < 0) {
+				set_error_status(request_data, ERROR_BAD_REQUEST);
+				return;
 			}
-			else {
-				/* Empty path of requested target or path does not begin with slash, 
-				 * server can repsond with error code 400 (ERROR_BAD_REQUEST)
-				 */
-				if(!get_path_length(request_data) || get_path_char_at(request_data, 0) != '/') {
-
-					set_error_status(request_data, ERROR_BAD_REQUEST);
-					return;
-				}
-
-				check_request_target = true;
+			
+			/* Empty path of requested target or path does not begin with slash, 
+			 * server can repsond with error code 400 (ERROR_BAD_REQUEST)
+			 */
+			if(!get_path_length(request_data) || get_path_char_at(request_data, 0) != '/') {
+				set_error_status(request_data, ERROR_BAD_REQUEST);
+				return;
 			}
+			
+			buffer_iter += target_length;
+			remaining -= target_length;
+			
+			check_request_target = true;
 		}
 		else if(!check_second_space) {
 			if(server_buffer[buffer_iter] != ' ') {
@@ -302,288 +391,292 @@ void parse_request_line(int32_t client_socket,
 		}
 	}
 
-	rearrange_buffer(buffer_iter, remaining);
+	rearrange_buffer(server_buffer, buffer_iter, remaining);
 	*bytes_in_buffer = remaining;
 }
 
 
 
-/* Compares two strings stores in str_1 and str_2 ignoring whether compared
- * letters are either lowercase or uppercase
- */
 static
-int32_t cmp_insensitive(const char *str_1,
-					    const char *str_2) {
-
-	if(strlen(str_1) != strlen(str_2)) {
-		return -1;
-	}
-	else {
-		for(size_t i = 0; i < strlen(str_1); ++i) {
-			if(tolower(str_1[i]) != tolower(str_2[i])) {
-				return -1;
-			}
+void fill_header_slots(void) {
+	memset(header_slots, -1, sizeof(header_slots));
+	
+	for(int32_t i = 0; i < HEADERS_COUNT; ++i) {
+		uint32_t hash = HEADER_HASH_BASIS;
+		
+		for(const char *c = headers[i]; *c != '\0'; ++c) {
+			hash = HEADER_HASH_STEP(hash, *c);
 		}
 		
-		return 0;
+		uint32_t slot = hash & (HEADER_SLOTS - 1);
+		
+		while(header_slots[slot] >= 0) {
+			slot = (slot + 1) & (HEADER_SLOTS - 1);
+		}
+		
+		header_slots[slot] = i;
+		header_hashes[i] = hash;
 	}
+	
+	header_slots_ready = true;
 }
 
 
 
-/* Updates the array which stores usage of headers in client request
+/* Compares bytes of passed length with lowercase string eight bytes at a time,
+ * ignoring case of the letters. Setting bit 0x20 lowercases letters and keeps
+ * digits and '-', and it can not turn any other character allowed in header
+ * names and values (no control characters other than tab) into one of those.
  */
 static
-int32_t update_header_status(const char *header_string, 
-							 ssize_t *header_index) {
-							 
-	for(ssize_t i = 0; i < 2; ++i) {
-		if(cmp_insensitive(header_string, headers[i]) == 0) {
-			if(header_usage[i]) {
-				return -1;
-			}
-			
-			*header_index = i;
-			header_usage[i] = true;
+bool equals_lowercase(const char *bytes, size_t length, const char *lowercase) {
+	const uint64_t case_bits = 0x2020202020202020ull;
+	uint64_t word, expected;
+	size_t i = 0;
+	
+	for(; i + 8 <= length; i += 8) {
+		memcpy(&word, bytes + i, 8);
+		memcpy(&expected, lowercase + i, 8);
+		
+		if((word | case_bits) != expected) {
+			return false;
 		}
 	}
 	
-	return 0;
+	if(i == length) {
+		return true;
+	}
+	
+	word = 0;
+	expected = 0;
+	memcpy(&word, bytes + i, length - i);
+	memcpy(&expected, lowercase + i, length - i);
+	
+	/* Padding bytes get the bit as well
+	 */
+	return ((word | case_bits) == (expected | case_bits));
 }
 
 
 
+/* Checks whether header value of passed length is equal to the lowercase
+ * token, ignoring case of the letters
+ */
 static
-bool correct_header_name_char(char c) {
-	return (isalpha(c) || c == '-' || c == '_');
+bool is_value_token(const char *value, size_t length, const char *token) {
+	return (length == strlen(token) && equals_lowercase(value, length, token));
 }
 
 
 
-/* Parses headers and corresponding values from client request
+/* Returns index of known header with passed name (and its hash),
+ * -1 if the header is not relevant to the server
  */
-void parse_headers(int32_t client_socket, 
-                   ssize_t *bytes_in_buffer,
-                   bool *close_connection,
-                   request_data_t *request_data) {
+static
+int32_t find_known_header(const char *name, size_t length, uint32_t hash) {
+	uint32_t slot = hash & (HEADER_SLOTS - 1);
+	
+	while(header_slots[slot] >= 0) {
+		int32_t index = header_slots[slot];
+		
+		if(header_hashes[index] == hash && is_value_token(name, length, headers[index])) {
+			return index;
+		}
+		
+		slot = (slot + 1) & (HEADER_SLOTS - 1);
+	}
+	
+	return -1;
+}
 
-	if(is_connection_closed(request_data)) {
-		return;
+
+
+/* Characters allowed in header names (tchar of RFC 9110)
+ */
+static
+bool is_token_char(unsigned char c) {
+	return (isalnum(c) || (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL));
+}
+
+
+
+/* Characters allowed in header values - visible ones, spaces,
+ * tabs and bytes of obsolete text (>= 0x80)
+ */
+static
+bool is_value_char(unsigned char c) {
+	return (c == '\t' || (c >= ' ' && c != 0x7f));
+}
+
+
+
+/* Parses value of Content-Length header (of passed length) into request data.
+ * Values of more than 18 digits are rejected, so that the length always fits
+ * in off_t.
+ * Returns 0 on success and -1 on invalid value
+ */
+static
+int32_t parse_content_length(const char *value, ssize_t value_length, request_data_t *request_data) {
+	if(value_length == 0 || value_length > 18) {
+		return -1;
 	}
 	
-	for(size_t i = 0; i < 2; ++i) {
-		header_usage[i] = false;
+	off_t length = 0;
+	
+	for(ssize_t i = 0; i < value_length; ++i) {
+		if(!isdigit(value[i])) {
+			return -1;
+		}
+		
+		length = length * 10 + (value[i] - '0');
 	}
 	
-	bool finish_headers = false;
+	set_body_length(request_data, length);
+	return 0;
+}
+
+
+
+/* Acts on the known headers of the request. Returns -1 if their values
+ * (or combination) make the request bad
+ */
+static
+int32_t apply_known_headers(bool *close_connection, request_data_t *request_data) {
+	const header_span_t *connection = find_request_header(request_data, CONNECTION_HEADER);
+	const header_span_t *content_length = find_request_header(request_data, CONTENT_LENGTH_HEADER);
+	const header_span_t *transfer_encoding = find_request_header(request_data, TRANSFER_ENCODING_HEADER);
+	const header_span_t *expect = find_request_header(request_data, EXPECT_HEADER);
 	
-	char header_buffer[24];
-	char value_buffer[24];
+	/* Client specified body (content-length or transfer-encoding header) for method
+	 * other than PUT or both of them, which allows us to reject his request
+	 * with http error code 400
+	 */
+	if((content_length != NULL || transfer_encoding != NULL) && get_method_type(request_data) != PUT_METHOD) {
+		return -1;
+	}
 	
-	memset(header_buffer, 0, sizeof(header_buffer));
-	memset(value_buffer, 0, sizeof(value_buffer));
+	if(content_length != NULL && transfer_encoding != NULL) {
+		return -1;
+	}
 	
-	ssize_t buffer_iter = 0;
-	ssize_t header_field_iter = 0;
-	ssize_t header_value_iter = 0;
+	if(connection != NULL && is_value_token(connection->value, connection->value_length, "close")) {
+		*close_connection = true;
+	}
 	
-	ssize_t remaining = *bytes_in_buffer;
+	if(content_length != NULL &&
+	   parse_content_length(content_length->value, content_length->value_length, request_data) < 0) {
+		return -1;
+	}
 	
-	ssize_t crlf_off = 0;
-	ssize_t current_header_index = -1;
-
-	bool parsed_header = false; /* Flag indicating whether header (name and value) has been parsed */
-	bool parsed_name = false; /* Flag indicating whether header name has been parsed */
-	bool parsed_first_ows = false; /* Flag indicating whether first OWS has been parsed */
-	bool parsed_value = false; /* Flag indicating whether header value has been parsed */
-	bool parsed_second_ows = false; /* Flag indicating whether second OWS has been parsed */
-	bool colon = false; /* Flag indicating whether colon occured in header */
+	if(transfer_encoding != NULL) {
+		/* Chunked is the only transfer coding supported
+		 */
+		if(!is_value_token(transfer_encoding->value, transfer_encoding->value_length, "chunked")) {
+			return -1;
+		}
+		
+		set_chunked_body(request_data);
+	}
 	
-	while(!finish_headers) {
-		if(remaining == 0) {
-			remaining = read(client_socket, server_buffer, sizeof(server_buffer));
-			
-			if(remaining == 0) {
-				mark_connection_closed(request_data);
-				return;
-			}
+	if(expect != NULL && is_value_token(expect->value, expect->value_length, "100-continue")) {
+		set_expect_continue(request_data);
+	}
+	
+	return 0;
+}
+
 
-			buffer_iter = 0;
+
+/* Parses headers and corresponding values from client request into the header
+ * index of request data, whose spans point into the buffer
+ */
+ssize_t parse_headers(char *server_buffer,
+                      ssize_t bytes_in_buffer,
+                      bool *close_connection,
+                      request_data_t *request_data) {
+
+	if(is_connection_closed(request_data)) {
+		return 0;
+	}
+	
+	if(!header_slots_ready) {
+		fill_header_slots();
+	}
+	
+	ssize_t position = 0;
+	
+	/* Whole request head is in the buffer before parsing begins, running
+	 * out of bytes means that it is malformed. Empty line ending the headers
+	 * is left for parse_further().
+	 */
+	while(position < bytes_in_buffer && server_buffer[position] != '\r' && server_buffer[position] != '\n') {
+		header_span_t header;
+		uint32_t hash = HEADER_HASH_BASIS;
+		
+		header.name = server_buffer + position;
+		
+		while(position < bytes_in_buffer && is_token_char(server_buffer[position])) {
+			hash = HEADER_HASH_STEP(hash, server_buffer[position]);
+			position++;
 		}
 		
-		if(parsed_header) {
-			/* Restore the parsing flags to their default values
-			 */
-			parsed_header = false;
-			parsed_name = false;
-			parsed_first_ows = false;
-			parsed_value = false;
-			parsed_second_ows = false;
-			
-			colon = false;
-			
-			crlf_off = 0;
-			
-			header_field_iter = 0;
-			header_value_iter = 0;
-			/* Fill the appropriate buffer with NUL characters
-			 */
-			memset(header_buffer, 0, sizeof(header_buffer));
-			memset(value_buffer, 0, sizeof(value_buffer));
+		header.name_length = server_buffer + position - header.name;
+		
+		if(header.name_length == 0 || position == bytes_in_buffer || server_buffer[position] != ':') {
+			set_error_status(request_data, ERROR_BAD_REQUEST);
+			return position;
 		}
 		
-		if(!parsed_name) {
+		position++;
 		
-			if(server_buffer[buffer_iter] == '\r' || server_buffer[buffer_iter] == '\n') { 
-				if(header_field_iter > 0 && !colon) {
-					set_error_status(request_data, ERROR_BAD_REQUEST);
-					return;
-				}
-				else {
-					finish_headers = true;
-					continue;
-				}
-			}
-			else if(!correct_header_name_char(server_buffer[buffer_iter]) && 
-					server_buffer[buffer_iter] != ':') {
-				/* Name parsing has not been finished and non-letter character (different from colon)
-				 * has been detected -> request is bad
-				 */
-				set_error_status(request_data, ERROR_BAD_REQUEST);
-				return;
-			}
-			else if(server_buffer[buffer_iter] == ':') {
-				if(header_field_iter == 0) {
-					set_error_status(request_data, ERROR_BAD_REQUEST);
-					return;
-				}
-				
-				colon = true;
-				remaining--;
-				buffer_iter++;
-			
-				if(header_field_iter < 20) {
-
-					int32_t error_check = update_header_status(header_buffer, &current_header_index);
-					
-					memset(header_buffer, 0, sizeof(header_buffer));
-					header_field_iter = 0;
-					
-					if(error_check < 0 || header_usage[1]) {
-						/* Either error occured (double use of some non-ignored header) or
-						 * client specified content-length header which allows us to reject
-						 * his request with http error code 400
-						 */
-						set_error_status(request_data, ERROR_BAD_REQUEST);
-						return;
-					}
-				}
-
-				parsed_name = true;
-			}
-			else {
-				/* Store up to 20 characters (the only important for us header names length is at most 14):
-				 * Content-Length
-				 */
-				if(header_field_iter < 20) {
-					header_buffer[header_field_iter] = server_buffer[buffer_iter];
-					header_field_iter++;
-				}
-				
-				remaining--;
-				buffer_iter++;
-			}					
+		while(position < bytes_in_buffer && (server_buffer[position] == ' ' || server_buffer[position] == '\t')) {
+			position++;
 		}
 		
-		else if(!parsed_first_ows) {
-			if(server_buffer[buffer_iter] == ' ') {
-				remaining--;
-				buffer_iter++;
-			}
-			else {
-				parsed_first_ows = true;
-			}		
+		header.value = server_buffer + position;
+		
+		while(position < bytes_in_buffer && is_value_char(server_buffer[position])) {
+			position++;
 		}
 		
-		else if(!parsed_value) {
-
-		   	/* End of string corresponding to value of header, mark parsed_value flag as true
-		   	 * and proceed with possible second optional whitespace section parsing
-		   	 */
-			if(server_buffer[buffer_iter] == ' ' || server_buffer[buffer_iter] == '\r') {
-				/* Check if current header-line corresponds 'Connection' header and provided
-				 * header value is equal to 'close'. If so, mark close_connection flag as true
-				 * denoting that the client requested to end the connection with the server
-				 */
-				if(!strcmp(value_buffer, "close") && !current_header_index) {
-					*close_connection = true;
-				}
-				
-				current_header_index = -1;
-				parsed_value = true;
-				continue;
-			}
-			
-			/* If the header value is short enough, append current character to header_value
-			 */
-			if(header_value_iter < 20) {
-				value_buffer[header_value_iter] = server_buffer[buffer_iter];
-				header_value_iter++;
-			}
-			
-			remaining--;
-			buffer_iter++;
+		header.value_length = server_buffer + position - header.value;
+		
+		/* Trailing whitespace is not a part of the value
+		 */
+		while(header.value_length > 0 &&
+			  (header.value[header.value_length - 1] == ' ' || header.value[header.value_length - 1] == '\t')) {
+			header.value_length--;
 		}
 		
-		else if(!parsed_second_ows) {
-
-			if(server_buffer[buffer_iter] == ' ') {
-				remaining--;
-				buffer_iter++;
-			}
-			/* We are parsing the second optional whitespace section. The only
-			 * character different from whitespace that we should expect here is
-			 * carriage return, if it is not, the request is bad
+		if(bytes_in_buffer - position < 2 || server_buffer[position] != '\r' || server_buffer[position + 1] != '\n') {
+			/* Bad CRLF on end of header line (or character not allowed in the value)
 			 */
-			else if(server_buffer[buffer_iter] != '\r') {
-				/* As the only character which we should expect after
-				 * the second optional whitespaces is carriage return
-				 * character
-				 */
-				set_error_status(request_data, ERROR_BAD_REQUEST);
-				return;
-			}
-			else {
-				parsed_second_ows = true;
-			}
+			set_error_status(request_data, ERROR_BAD_REQUEST);
+			return position;
 		}
 		
-		else {
-			if(server_buffer[buffer_iter] != CRLF[crlf_off]) {
-				/* Bad CRLF on end of header line
-				 */
-				set_error_status(request_data, ERROR_BAD_REQUEST);
-				return;
-			}
-			
-			if(crlf_off == 1) {
-				parsed_header = true;
-			}
-			
-			crlf_off++;
-			
-			remaining--;
-			buffer_iter++;
+		position += 2;
+		header.known = find_known_header(header.name, header.name_length, hash);
+		
+		/* Either too many header lines or double use of some
+		 * non-ignored header
+		 */
+		if(add_request_header(request_data, &header) < 0) {
+			set_error_status(request_data, ERROR_BAD_REQUEST);
+			return position;
 		}
 	}
-
-	rearrange_buffer(buffer_iter, remaining);
-	*bytes_in_buffer = remaining;
+	
+	if(position == bytes_in_buffer || apply_known_headers(close_connection, request_data) < 0) {
+		set_error_status(request_data, ERROR_BAD_REQUEST);
+	}
+	
+	return position;
 }
 
 
 
-void parse_further(int32_t client_socket, 
+void parse_further(char *server_buffer, 
 				   ssize_t *bytes_in_buffer, 
 				   request_data_t *request_data) {
 
@@ -601,15 +694,12 @@ void parse_further(int32_t client_socket,
 	
 	while(!finish_further_parsing) {
 
+		/* Whole request head is in the buffer before parsing begins, running
+		 * out of bytes means that it is malformed
+		 */
 		if(remaining == 0) {
-			remaining = read(client_socket, server_buffer, sizeof(server_buffer));
-			
-			if(remaining == 0) {
-				mark_connection_closed(request_data);
-				return;
-			}
-			
-			buffer_iter = 0;
+			set_error_status(request_data, ERROR_BAD_REQUEST);
+			return;
 		}
 		
 		if(server_buffer[buffer_iter] != CRLF[crlf_off]) {
@@ -638,94 +728,153 @@ void parse_further(int32_t client_socket,
 		}
 	}
 	
-	rearrange_buffer(buffer_iter, remaining);
+	rearrange_buffer(server_buffer, buffer_iter, remaining);
 	*bytes_in_buffer = remaining;
 }
 
 
 
+void refresh_date_header(void) {
+	/* time() reads coarse clock, which may still be in the previous
+	 * second when the timer expires
+	 */
+	struct timespec now;
+	struct tm now_tm;
+	
+	clock_gettime(CLOCK_REALTIME, &now);
+	gmtime_r(&now.tv_sec, &now_tm);
+	date_header_length = strftime(date_header, sizeof(date_header), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &now_tm);
+}
+
+
+
+const char *get_date_header(size_t *length) {
+	*length = date_header_length;
+	return date_header;
+}
+
+
+
+/* Queues response made of the template, Date header and passed trailing part
+ * (NULL if there is none) with a single copy into connection output
+ */
+static
+ssize_t queue_response(int32_t client_socket, const response_template_t *template,
+					   const char *trailer, size_t trailer_length) {
+	
+	struct iovec parts[] = {
+		{ (void *) template->status, template->status_length },
+		{ date_header, date_header_length },
+		{ (void *) template->headers, template->headers_length },
+		{ (void *) trailer, trailer_length }
+	};
+	
+	ssize_t queued = queue_output_vector(client_socket, parts, (trailer == NULL) ? 3 : 4);
+	
+	/* Status class is the first digit of the code following "HTTP/1.1 "
+	 */
+	if(queued >= 0) {
+		STATS_RESPONSE(template->status[9]);
+	}
+	
+	return queued;
+}
+
+
+
 ssize_t send_generic_error_message(int32_t client_socket) {
-	return write(client_socket, generic_error_message, strlen(generic_error_message));
+	return queue_response(client_socket, &generic_error_message, NULL, 0);
 }
 
 
 
 ssize_t send_bad_request_message(int32_t client_socket) {
-	return write(client_socket, bad_request_message, strlen(bad_request_message));
+	return queue_response(client_socket, &bad_request_message, NULL, 0);
 }
 
 
 
 ssize_t send_unknown_method_message(int32_t client_socket) {
-	return write(client_socket, unknown_method_message, strlen(unknown_method_message));
+	return queue_response(client_socket, &unknown_method_message, NULL, 0);
+}
+
+
+
+ssize_t send_bad_gateway_message(int32_t client_socket) {
+	return queue_response(client_socket, &bad_gateway_message, NULL, 0);
+}
+
+
+
+ssize_t send_too_many_requests_message(int32_t client_socket) {
+	return queue_response(client_socket, &too_many_requests_message, NULL, 0);
+}
+
+
+
+ssize_t send_service_unavailable_message(int32_t client_socket) {
+	return queue_response(client_socket, &service_unavailable_message, NULL, 0);
 }
 
 
 
 ssize_t send_not_found_message(int32_t client_socket, bool include_close) {
 	if(include_close) {
-		return write(client_socket, resource_not_found_close_message, strlen(resource_not_found_close_message));
+		return queue_response(client_socket, &resource_not_found_close_message, NULL, 0);
 	}
 	else { 
-		return write(client_socket, resource_not_found_message, strlen(resource_not_found_message));
+		return queue_response(client_socket, &resource_not_found_message, NULL, 0);
 	}
 }
 
 
 
-ssize_t send_get_message_part(int32_t client_socket, bool include_close) {
-	if(include_close) {
-		return write(client_socket, file_response_part_close, strlen(file_response_part_close));
+ssize_t send_upload_message(int32_t client_socket, bool replaced, bool include_close) {
+	const response_template_t *message;
+	
+	if(replaced) {
+		message = include_close ? &replaced_close_message : &replaced_message;
 	}
 	else {
-		return write(client_socket, file_response_part, strlen(file_response_part));
+		message = include_close ? &created_close_message : &created_message;
 	}
+	
+	return queue_response(client_socket, message, NULL, 0);
 }
 
 
 
-ssize_t send_content_length(int32_t client_socket, const char *content_length_buffer) {
-	return write(client_socket, content_length_buffer, strlen(content_length_buffer));
-}
-
-
-
-ssize_t send_obtained_file_content(int32_t client_socket, size_t bytes) {
-	return write(client_socket, file_content_buffer, bytes);
+ssize_t send_continue_message(int32_t client_socket) {
+	return queue_output(client_socket, continue_message, sizeof(continue_message) - 1);
 }
 
 
 
-void rearrange_buffer(ssize_t buffer_pos, ssize_t remaining_bytes) {
-	for(ssize_t i = 0; i < remaining_bytes; ++i) {
-		server_buffer[i] = server_buffer[i + buffer_pos];
+ssize_t send_file_response_head(int32_t client_socket, bool include_close, off_t file_size) {
+	/* Size is followed by the end of the last header and the empty line
+	 */
+	char size_buffer[32];
+	int32_t size_length = snprintf(size_buffer, sizeof(size_buffer), "%lld\r\n\r\n", (long long) file_size);
+	
+	if(include_close) {
+		return queue_response(client_socket, &file_response_part_close, size_buffer, size_length);
+	}
+	else {
+		return queue_response(client_socket, &file_response_part, size_buffer, size_length);
 	}
 }
 
 
 
-/* Utility function for returning the number of digits in decimal
- * representation of passed integer
- */
-static
-size_t digits(size_t val) {
-	if(val == 0) {
-		return 1;
-	}
-	
-	size_t ret = 0;
-	while(val) {
-		val /= 10;
-		ret++;
-	}
-	
-	return ret;
+void rearrange_buffer(char *server_buffer, ssize_t buffer_pos, ssize_t remaining_bytes) {
+	memmove(server_buffer, server_buffer + buffer_pos, remaining_bytes);
 }
 
 
 
 /* Utility function for appending double CRLF to the passed string
- * at specified offset (position from the beginning of the string)
+ * at specified offset (position from the beginning of the string),
+ * the string stays terminated (room for 5 more bytes is required)
  */
 static
 void append_double_crlf(char *target_string, size_t offset) {
@@ -733,100 +882,234 @@ void append_double_crlf(char *target_string, size_t offset) {
 	target_string[offset + 1] = '\n';
 	target_string[offset + 2] = '\r';
 	target_string[offset + 3] = '\n';
+	target_string[offset + 4] = '\0';
 }
 
 
 
-int32_t handle_file(int32_t client_socket, bool close_conn, const char *path, bool head) {
+/* Checks whether string passed as str_1 argument is a prefix of string
+ * passed as str_2 argument ending at a path component boundary, so that
+ * "/srv/www" is not taken for a prefix of "/srv/www-private/file"
+ */
+static
+bool is_prefix_of(const char *str_1, const char *str_2) {
+	size_t length_1 = strlen(str_1);
+	
+	if(length_1 > strlen(str_2) || strncmp(str_1, str_2, length_1) != 0) {
+		return false;
+	}
+	
+	return (str_2[length_1] == '/' || str_2[length_1] == '\0' ||
+			(length_1 > 0 && str_1[length_1 - 1] == '/'));
+}
+
+
+
+void resolve_requested_file(offload_job_t *job) {
+	file_job_t *file_job = (file_job_t *) job;
+	
+	file_job->fd = -1;
+	file_job->size = 0;
+	
+	/* Clear errno before executing library realpath() function so as to
+	 * grab data about possible ENOMEM
+	 */
+	errno = 0;
+	char *req_resource_realpath = realpath(file_job->path, NULL);
+	
+	/* Memory error occured while resolving full path of the resource requested
+	 * by server client
+	 */
+	if(req_resource_realpath == NULL && errno == ENOMEM) {
+		file_job->status = -1;
+		return;
+	}
+	else if(req_resource_realpath == NULL) {
+		file_job->status = -3;
+		return;
+	}
+	
+	/* Path has been successfully resolved, the only thing that we have to check now is
+	 * whether its string representation is a prefix of the server resources directory path
+	 */
+	if(!is_prefix_of(file_job->catalogue_path, req_resource_realpath)) {
+		free(req_resource_realpath);
+		file_job->status = -2;
+		return;
+	}
+	
+	/* Non-blocking open so that a FIFO placed in the catalogue can not hang
+	 * the thread, it is rejected below as not being a regular file
+	 */
+	int32_t fd = open(req_resource_realpath, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	free(req_resource_realpath);
+	
+	if(fd < 0) {
+		file_job->status = -1;
+		return;
+	}
+	
 	/* For determining the useful data about file (or directory) to which
 	 * the passed path points
 	 */
 	struct stat statbuf;
-	int32_t ret_val = stat(path, &statbuf);
 	
 	/* Error in stat - treating it as internal server error
 	 */
-	if(ret_val < 0) {
-		return -1;
+	if(fstat(fd, &statbuf) < 0) {
+		close(fd);
+		file_job->status = -1;
+		return;
 	}
-	/* Correct path, but pointing to directory... do not open it (fopen would not return NULL ...) and
-	 * forfeit sending by returning -2 value which will indicate to the server that it has to send
-	 * 404 not found message to the cilent
+	
+	/* Correct path, but pointing to directory (or other non-regular file) - forfeit
+	 * sending, the server has to send 404 not found message to the client
 	 */
-	if(S_ISDIR(statbuf.st_mode)) {
-		return -2;
+	if(!S_ISREG(statbuf.st_mode)) {
+		close(fd);
+		file_job->status = -2;
+		return;
 	}
 	
-	size_t file_size = statbuf.st_size;
-	
-	FILE *fp = fopen(path, "r");
-	if(fp == NULL) {
-		return -1;
+	/* Warm the page cache for the beginning of the body here, so that the
+	 * event loop does not wait for the disk in sendfile()
+	 */
+	if(!file_job->head) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		readahead(fd, 0, PREFETCH_WINDOW);
 	}
+	
+	file_job->fd = fd;
+	file_job->size = statbuf.st_size;
+	file_job->status = 0;
+}
+
+
+
+/* Offloaded read-ahead of a window of response body, performed on
+ * a duplicate of body descriptor which belongs to the job
+ */
+struct prefetch_job {
+	offload_job_t job;
+	int32_t fd;
+	off_t offset;
+};
+
 
-	char bytes_number_buf[digits(file_size) + 10];
-	memset(bytes_number_buf, 0, sizeof(bytes_number_buf));
+
+static
+void run_prefetch(offload_job_t *job) {
+	struct prefetch_job *prefetch = (struct prefetch_job *) job;
+	readahead(prefetch->fd, prefetch->offset, PREFETCH_WINDOW);
+}
+
+
+
+static
+void complete_prefetch(offload_job_t *job) {
+	struct prefetch_job *prefetch = (struct prefetch_job *) job;
+	close(prefetch->fd);
+	free(prefetch);
+}
+
+
+
+void prefetch_response_body(connection_t *conn) {
+	off_t body_end = conn->body_offset + conn->body_remaining;
 	
-	bool continue_sending = true;
+	/* Whole body has already been prefetched or the prefetched part
+	 * still reaches far enough
+	 */
+	if(conn->body_prefetched >= body_end ||
+	   conn->body_prefetched - conn->body_offset > PREFETCH_WINDOW / 2) {
+		return;
+	}
 	
-	size_t read_bytes = 0;
-
-	ssize_t write_val;
+	struct prefetch_job *prefetch = malloc(sizeof(struct prefetch_job));
+	if(prefetch == NULL) {
+		return;
+	}
 	
-	sprintf(bytes_number_buf, "%lu", file_size);
-	append_double_crlf(bytes_number_buf, strlen(bytes_number_buf));
+	prefetch->fd = dup(conn->body_fd);
+	if(prefetch->fd < 0) {
+		free(prefetch);
+		return;
+	}
 	
-	write_val = send_get_message_part(client_socket, close_conn);
-	/* Check write() return value */
-	if(write_val < 0) {
-		fclose(fp);
+	prefetch->offset = conn->body_prefetched;
+	prefetch->job.run = run_prefetch;
+	prefetch->job.complete = complete_prefetch;
+	
+	conn->body_prefetched += PREFETCH_WINDOW;
+	
+	submit_offload_job(&prefetch->job);
+}
+
+
+
+int32_t handle_file(int32_t client_socket, bool close_conn, int32_t fd, off_t file_size, bool head) {
+	USDT_PROBE2(file_start, client_socket, file_size);
+	
+	/* Check queue_output_vector() return value */
+	if(send_file_response_head(client_socket, close_conn, file_size) < 0) {
+		close(fd);
 		return -1;
 	}
 	
-	write_val = send_content_length(client_socket, bytes_number_buf);
-	/* Check write() return value */
-	if(write_val < 0) {
-		fclose(fp);
+	if(head) {
+		close(fd);
+		USDT_PROBE2(file_done, client_socket, 0);
+		return 0;
+	}
+	
+	/* Body is sent from the file with sendfile() by the event loop once
+	 * the headers have been written
+	 */
+	set_response_body(client_socket, fd, file_size);
+	get_connection(client_socket)->body_prefetched = PREFETCH_WINDOW;
+	
+	return 0;
+}
+
+
+
+int32_t handle_archived_file(int32_t client_socket, bool close_conn, const archived_file_t *file, bool head) {
+	USDT_PROBE2(file_start, client_socket, file->length);
+	
+	const response_template_t *template = close_conn ? &archived_file_part_close : &archived_file_part;
+	
+	if(queue_response(client_socket, template, file->head, file->head_length) < 0) {
 		return -1;
 	}
 	
 	if(head) {
-		fclose(fp);
+		USDT_PROBE2(file_done, client_socket, 0);
 		return 0;
 	}
 	
-
-	while(continue_sending) {
-		errno = 0;
-		read_bytes = fread(file_content_buffer, 1, sizeof(file_content_buffer) - 1, fp);
-		
-		if(ferror(fp)) {
-			fclose(fp);
-			return -1;
-		}
-		/* Do we need to continue sending? */
-		continue_sending = (feof(fp) ? false : true);
-		
-		write_val = send_obtained_file_content(client_socket, read_bytes);
-		
-		/* Negative return value from write indicates that client has closed
-		 * the socket, return with -1 value indicating error of function execution
-		 */
-		if(write_val < 0) {
-			fclose(fp);
-			return -1;
-		}
+	/* Response owns a duplicate of the descriptor, so that the archive
+	 * can be replaced while the body is being sent
+	 */
+	int32_t fd = fcntl(file->fd, F_DUPFD_CLOEXEC, 0);
+	
+	if(fd < 0) {
+		return -1;
 	}
 	
-	/* Close the file pointer after processing its content
+	set_response_body_at(client_socket, fd, file->offset, file->length);
+	
+	/* Small bodies share pages with their neighbours in the archive and are
+	 * likely to be cached, larger ones are read ahead by the offload pool
 	 */
-	fclose(fp);
+	get_connection(client_socket)->body_prefetched = file->offset +
+		((file->length > PREFETCH_WINDOW / 2) ? 0 : PREFETCH_WINDOW);
+	
 	return 0;
 }
 
 
 
-int32_t check_corelated(int32_t client_socket, request_data_t *req_data, FILE *file_corelated) {
+int32_t check_corelated(int32_t client_socket, request_data_t *req_data, const redirect_index_t *redirects) {
 	printf("Checking corelated servers file...\n");
 	
 	/* Buffer for string moved resource address (if it exists in corelated servers file)
@@ -838,10 +1121,11 @@ int32_t check_corelated(int32_t client_socket, request_data_t *req_data, FILE *f
 	char *path_pointer = get_original_path_string_pointer(req_data);
 	size_t path_length = get_path_length(req_data);
 	
-	int32_t ret_val = set_address(&address_buffer, path_pointer, path_length, file_corelated);
+	STATS_ADD(corelated_lookups, 1);
+	int32_t ret_val = set_address(&address_buffer, path_pointer, path_length, redirects);
 	
 
-	/* Negative return value (-1) indicates error (malloc / getline)
+	/* Negative return value (-1) indicates memory error
 	 */
 	if(ret_val < 0) {
 		return ret_val;
@@ -854,20 +1138,21 @@ int32_t check_corelated(int32_t client_socket, request_data_t *req_data, FILE *f
 		return -2;
 	}
 	
-	append_double_crlf(address_buffer, strlen(address_buffer));
-	
-	/* Write first part of message 
-	 	*/
-	ret_val = write(client_socket, temp_moved_message_part, strlen(temp_moved_message_part));
-	if(ret_val < 0) {
+	/* In reverse-proxy mode the resource is fetched from the corelated server
+	 * and the response is queued once the upstream answers
+	 */
+	if(is_proxy_enabled()) {
+		ret_val = proxy_request(client_socket, address_buffer, (get_method_type(req_data) == HEAD_METHOD));
 		free(address_buffer);
-		return -1;
-	}
 		
+		return (ret_val < 0) ? -1 : 1;
+	}
+	
+	append_double_crlf(address_buffer, strlen(address_buffer));
 	
-	/* Write moved resource address to the client socket 
+	/* Write the message together with moved resource address to the client socket
 	 */
-	ret_val = write(client_socket, address_buffer, strlen(address_buffer));
+	ret_val = queue_response(client_socket, &temp_moved_message_part, address_buffer, strlen(address_buffer));
 	if(ret_val < 0) {
 		free(address_buffer);
 		return -1;
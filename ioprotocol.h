@@ -6,6 +6,10 @@
 #include <stdbool.h>
 #include <sys/types.h>
 #include "request_data.h"
+#include "connection.h"
+#include "offload_pool.h"
+#include "filesearch.h"
+#include "archive.h"
 
 
 
@@ -22,25 +26,76 @@
 
 #define GET_METHOD 				  0
 #define HEAD_METHOD 			  1
-#define UNKNOWN_METHOD_TYPE 	  2
+#define PUT_METHOD 				  2
+#define UNKNOWN_METHOD_TYPE 	  3
+
+
+
+/* Request headers relevant to the server, indexes in the header
+ * index of request data (at most MAX_KNOWN_HEADERS)
+ */
+#define CONNECTION_HEADER 			0
+#define CONTENT_LENGTH_HEADER 		1
+#define TRANSFER_ENCODING_HEADER 	2
+#define EXPECT_HEADER 				3
+#define HOST_HEADER 				4
+#define UPGRADE_HEADER 				5
+#define HTTP2_SETTINGS_HEADER 		6
+#define HEADERS_COUNT 				7
+
+
+/* Blocking part of handling a request for a file, executed on the offload
+ * pool: resolves the path, checks that it lies within the catalogue, opens
+ * the file and obtains its size
+ */
+typedef struct file_job_t file_job_t;
+
+
+
+struct file_job_t {
+	offload_job_t job;
+	
+	int32_t client_socket;
+	bool head;
+	
+	/* Catalogue path concatenated with requested path, and the catalogue
+	 * path itself (both have to stay valid until the job completes)
+	 */
+	const char *path;
+	const char *catalogue_path;
+	
+	/* Result of the job, status is one of:
+	 *  0 <---> fd and size describe opened regular file
+	 * -1 <---> memory / open / stat error (http 500)
+	 * -2 <---> path points outside the catalogue or not to a regular file (http 404)
+	 * -3 <---> path could not be resolved, corelated servers should be checked
+	 */
+	int32_t status;
+	int32_t fd;
+	off_t size;
+};
+
 
 
 /* Parses request line from client HTTP message 
  */
-void parse_request_line(int32_t, ssize_t *, request_data_t *);
+void parse_request_line(char *, ssize_t *, request_data_t *);
 
 
 
-/* Parses lines corresponding to headers from client HTTP message 
+/* Parses lines corresponding to headers from client HTTP message of passed
+ * length into the header index of request data, without moving them, so that
+ * the spans stay valid until the request head is consumed from the buffer.
+ * Returns length of the header lines (the empty line ending them excluded).
  */
-void parse_headers(int32_t, ssize_t *, bool *, request_data_t *);
+ssize_t parse_headers(char *, ssize_t, bool *, request_data_t *);
 
 
 
 /* Parses further data from client HTTP message; includes parsing the 'null line'
  * consisting of the CRLF - carriage-return and line-feed concatenation and message body
  */
-void parse_further(int32_t, ssize_t *, request_data_t *);
+void parse_further(char *, ssize_t *, request_data_t *);
 
 
 
@@ -65,6 +120,27 @@ ssize_t send_unknown_method_message(int32_t);
 
 
 
+/* Sends to client socket message indicating that the resource
+ * could not be fetched from corelated server
+ */
+ssize_t send_bad_gateway_message(int32_t);
+
+
+
+/* Sends to client socket message indicating that the client has
+ * exceeded its request rate, the connection is closed afterwards
+ */
+ssize_t send_too_many_requests_message(int32_t);
+
+
+
+/* Sends to client socket message indicating that the request has been
+ * shed by overloaded server, the connection is closed afterwards
+ */
+ssize_t send_service_unavailable_message(int32_t);
+
+
+
 /* Sends to client socket message indicating that the requested
  * file has not been found in server resources
  */
@@ -72,62 +148,94 @@ ssize_t send_not_found_message(int32_t, bool);
 
 
 
-/* Sends to client socket part of message which is response
- * to the GET method requested by client (if required resource
- * was found in server resources directory)
+/* Sends to client socket message indicating that the body of PUT request
+ * has been stored, either replacing existing file (204) or as a new one (201)
+ */
+ssize_t send_upload_message(int32_t, bool, bool);
+
+
+
+/* Sends to client socket interim response allowing it to send
+ * request body (Expect: 100-continue)
+ */
+ssize_t send_continue_message(int32_t);
+
+
+
+/* Sends to client socket status line and headers of response to the GET
+ * (or HEAD) method with passed size of the requested file, which has been
+ * found in server resources directory
  */
-ssize_t send_get_message_part(int32_t, bool);
+ssize_t send_file_response_head(int32_t, bool, off_t);
 
 
 
-/* Sends to client string representation of number of bytes that were read
- * from requested file. String passed to the function shall be ended with double
- * CRLF as its interpreted as header "Content-Length" value ended with CRLF
- * and (as in HTTP message format) second CRLF indicating empty line which
- * precedes message body
+/* Formats Date header of subsequent responses for the current time,
+ * called once per second
  */
-ssize_t send_content_length(int32_t, const char *);
+void refresh_date_header(void);
 
 
 
-/* Sends to client bytes stored in static buffer that were obtained
- * from the file requested by client.
+/* Returns Date header line (ending with CRLF) of responses
+ * and stores its length under passed pointer
  */
-ssize_t send_obtained_file_content(int32_t, size_t);
+const char *get_date_header(size_t *);
 
 
 
 /* Rearranges the buffer content so that the first available
  * byte is at the position 0
  */
-void rearrange_buffer(ssize_t, ssize_t);
+void rearrange_buffer(char *, ssize_t, ssize_t);
+
+
+
+/* Runs file_job_t on the offload pool (offload_job_t run callback)
+ */
+void resolve_requested_file(offload_job_t *);
+
+
+
+/* Handles request for file opened by resolve_requested_file(). Queues content-type
+ * and requested file size, and if client requested GET method, also sets the file
+ * as response body which is sent by the event loop. The descriptor is owned by the
+ * function (closed on error and for HEAD method).
+ * Function returns 0 on success and -1 if the output could not be queued (http 500
+ * generic server error message should be issued to the client)
+ */
+int32_t handle_file(int32_t, bool, int32_t, off_t, bool);
+
+
+
+/* Handles request for file found in an archive. Queues the headers stored in the
+ * archive, and for GET method also sets the body as response body, sent from
+ * a duplicate of the archive descriptor. Returns 0 on success and -1 if the
+ * response could not be queued (http 500 should be issued to the client).
+ */
+int32_t handle_archived_file(int32_t, bool, const archived_file_t *, bool);
 
 
 
-/* Handles request for file after verification path. If head method was specified,
- * sends (provided that everything goes good) content-type and requested file size.
- * If client requested GET method, file content is also sent.
- * Function return 0 on success and appropriate negative value if it fails. Possible
- * cases of failing are: ( return value <---> case)
- * -2 <---> although the path is correct, it points to a directory (in such case http
- * 404 target not found message is sent to the client)
- * -1 <---> file stream error / memory error / file stat error occurred (in these cases
- * http 500 generic server error message is issued to the client)
+/* Submits read-ahead of the next window of response body to the offload pool
+ * when the part already read ahead is running out
  */
-int32_t handle_file(int32_t, bool, const char *, bool);
+void prefetch_response_body(connection_t *);
 
 
 
-/* Checks in corelated servers file for the resource the path of which is 
- * stored in request_data_t object. Returns:
+/* Checks in compiled rules of corelated servers file for the resource the
+ * path of which is stored in request_data_t object. Returns:
  * 0 on success (and nothing more has to be done as in such case the function
  * sends http response to the client socket)
- * -1 on error (malloc / getline in nested function) -> issue HTTP 500 generic
+ * -1 on error (malloc in nested function) -> issue HTTP 500 generic
  * server error message from calling function
  * -2 when requested file has not been found and no errors occured -> issue
  * HTTP 404 not found message from calling function
+ * 1 when reverse-proxy mode is enabled and the resource is being fetched from
+ * the corelated server (the connection waits in CONNECTION_PROXYING state)
  */
-int32_t check_corelated(int32_t, request_data_t *, FILE *);
+int32_t check_corelated(int32_t, request_data_t *, const redirect_index_t *);
 
 
 
@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "limiter.h"
+
+
+
+/* Service time without load is the minimum over a window of this length
+ * (nanoseconds), the previous window's minimum is kept as well so that
+ * the estimate follows changes of the workload
+ */
+#define BASELINE_WINDOW 			 10000000000ull
+
+
+
+/* Service time within this much (nanoseconds) of the baseline never
+ * decreases the limit, requests served in microseconds would otherwise
+ * decrease it on every scheduling hiccup
+ */
+#define LATENCY_SLACK 				 1000000ull
+
+
+
+/* Factor the limit is multiplied by on decrease
+ */
+#define DECREASE_FACTOR 			 0.9
+
+
+
+static bool limiter_enabled = false;
+
+static long long limit_initial = DEFAULT_LIMIT_INITIAL;
+static long long limit_min = DEFAULT_LIMIT_MIN;
+static long long limit_max = DEFAULT_LIMIT_MAX;
+static long long tolerance = DEFAULT_LIMIT_TOLERANCE;
+
+
+
+/* State of the calling worker
+ */
+static double limit = 0;
+static int32_t in_flight = 0;
+
+static uint64_t baseline = UINT64_MAX;
+static uint64_t window_minimum = UINT64_MAX;
+static uint64_t window_start = 0;
+static uint64_t last_decrease = 0;
+
+
+
+enum {
+	OPTION_INITIAL = 0,
+	OPTION_MIN,
+	OPTION_MAX,
+	OPTION_TOLERANCE
+};
+
+
+
+static char *const option_names[] = {
+	[OPTION_INITIAL] = "initial",
+	[OPTION_MIN] = "min",
+	[OPTION_MAX] = "max",
+	[OPTION_TOLERANCE] = "tolerance",
+	NULL
+};
+
+
+
+static
+int32_t parse_option_number(const char *value, long long *target) {
+	if(value == NULL || *value == '\0') {
+		return -1;
+	}
+
+	char *end = NULL;
+	errno = 0;
+	long long parsed = strtoll(value, &end, 10);
+
+	if(errno != 0 || *end != '\0' || parsed <= 0 || parsed > INT32_MAX) {
+		return -1;
+	}
+
+	*target = parsed;
+	return 0;
+}
+
+
+
+int32_t parse_limiter_options(char *options) {
+	char *value = NULL;
+
+	while(*options != '\0') {
+		int32_t status = -1;
+
+		switch(getsubopt(&options, option_names, &value)) {
+			case OPTION_INITIAL:
+				status = parse_option_number(value, &limit_initial);
+				break;
+			case OPTION_MIN:
+				status = parse_option_number(value, &limit_min);
+				break;
+			case OPTION_MAX:
+				status = parse_option_number(value, &limit_max);
+				break;
+			case OPTION_TOLERANCE:
+				status = parse_option_number(value, &tolerance);
+				break;
+			default:
+				fprintf(stderr, "Unknown limiter option: %s\n", value);
+				return -1;
+		}
+
+		if(status < 0) {
+			fprintf(stderr, "Invalid limiter option value: %s\n", value == NULL ? "(none)" : value);
+			return -1;
+		}
+	}
+
+	if(limit_min > limit_max || limit_initial < limit_min || limit_initial > limit_max || tolerance < 100) {
+		fprintf(stderr, "Limiter requires min <= initial <= max and tolerance >= 100\n");
+		return -1;
+	}
+
+	limiter_enabled = true;
+	limit = limit_initial;
+
+	return 0;
+}
+
+
+
+bool is_limiter_enabled(void) {
+	return limiter_enabled;
+}
+
+
+
+static
+uint64_t current_nanoseconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+
+bool is_overloaded(void) {
+	return (limiter_enabled && in_flight >= (int32_t) limit);
+}
+
+
+
+bool admit_request(uint64_t *admitted_at) {
+	*admitted_at = 0;
+
+	if(!limiter_enabled) {
+		return true;
+	}
+
+	if(in_flight >= (int32_t) limit) {
+		return false;
+	}
+
+	in_flight++;
+	*admitted_at = current_nanoseconds();
+
+	return true;
+}
+
+
+
+void finish_request(uint64_t admitted_at) {
+	if(admitted_at == 0) {
+		return;
+	}
+
+	uint64_t now = current_nanoseconds();
+	uint64_t service_time = now - admitted_at;
+
+	in_flight--;
+
+	if(service_time < window_minimum) {
+		window_minimum = service_time;
+	}
+
+	if(now - window_start > BASELINE_WINDOW) {
+		baseline = window_minimum;
+		window_minimum = UINT64_MAX;
+		window_start = now;
+	}
+
+	uint64_t no_load_time = (baseline < window_minimum) ? baseline : window_minimum;
+
+	/* Requests queue up, decrease at most once per service time so that
+	 * a single episode of queueing does not collapse the limit
+	 */
+	if(service_time > no_load_time * tolerance / 100 + LATENCY_SLACK) {
+		if(now - last_decrease > service_time) {
+			limit *= DECREASE_FACTOR;
+			last_decrease = now;
+
+			if(limit < limit_min) {
+				limit = limit_min;
+			}
+		}
+	}
+	/* Limit grows by about one per limit's worth of requests, only while
+	 * it is actually being reached
+	 */
+	else if(2 * (in_flight + 1) >= limit) {
+		limit += 1.0 / limit;
+
+		if(limit > limit_max) {
+			limit = limit_max;
+		}
+	}
+}
+
+
+
+void abandon_request(uint64_t admitted_at) {
+	if(admitted_at != 0) {
+		in_flight--;
+	}
+}
@@ -0,0 +1,73 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+
+/* Default initial, minimum and maximum number of requests a worker serves
+ * at once, and default latency (percentage of latency without load) above
+ * which the limit is decreased
+ */
+#define DEFAULT_LIMIT_INITIAL 		 64
+#define DEFAULT_LIMIT_MIN 			 8
+#define DEFAULT_LIMIT_MAX 			 4096
+#define DEFAULT_LIMIT_TOLERANCE 	 200
+
+
+
+/* Parses comma separated list of concurrency limiter options (as passed to
+ * the -L server option), which also enables the limiter. Recognised options:
+ * initial=<n>      limit of requests served at once by a worker on start
+ * min=<n>          limit is never decreased below it
+ * max=<n>          limit is never increased above it
+ * tolerance=<%>    service time (percentage of the one without load) above
+ *                  which the limit is decreased
+ * Returns 0 on success and -1 on unknown option or invalid value.
+ */
+int32_t parse_limiter_options(char *);
+
+
+
+/* Checks whether the limiter has been configured
+ */
+bool is_limiter_enabled(void);
+
+
+
+/* Checks whether the calling worker serves as many requests as its limit
+ * allows (always false if the limiter is disabled)
+ */
+bool is_overloaded(void);
+
+
+
+/* Admits request to the calling worker unless it is overloaded, storing the
+ * time of admission under passed pointer. Returns false if the request has
+ * to be shed, true otherwise (and if the limiter is disabled, in which case
+ * the stored time is 0).
+ */
+bool admit_request(uint64_t *);
+
+
+
+/* Finishes request admitted at passed time once the response head has been
+ * sent, its service time adjusts the limit: increased additively while
+ * the service time stays within tolerance, decreased multiplicatively
+ * once it grows (queueing)
+ */
+void finish_request(uint64_t);
+
+
+
+/* Finishes request admitted at passed time which has been abandoned
+ * (connection closed) before its response head has been sent
+ */
+void abandon_request(uint64_t);
+
+
+
+#endif /* LIMITER_H */
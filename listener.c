@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "listener.h"
+
+
+
+/* Prefix of listen address specification denoting
+ * a Unix domain socket
+ */
+static const char *unix_prefix = "unix:";
+
+
+
+/* Prefix of listen address specification denoting
+ * a listener accepting TLS connections
+ */
+static const char *tls_prefix = "tls:";
+
+
+
+/* Maximum length of host part of listen address
+ * specification (enough for textual IPv6 address
+ * with scope identifier)
+ */
+#define HOST_LENGTH_LIMIT 		  64
+
+
+
+/* Maximum length of interface name (IFNAMSIZ)
+ */
+#define INTERFACE_LENGTH_LIMIT 	  16
+
+
+
+/* Parses port number, rejecting anything which is not
+ * a decimal number in range [1, 65535]. Returns -1 on
+ * failure
+ */
+static
+int32_t parse_port(const char *port_string) {
+	if(*port_string == '\0') {
+		return -1;
+	}
+
+	char *end = NULL;
+	errno = 0;
+	long port = strtol(port_string, &end, 10);
+
+	if(errno != 0 || *end != '\0' || port < 1 || port > 65535) {
+		return -1;
+	}
+
+	return (int32_t) port;
+}
+
+
+
+static
+int32_t set_nonblocking(int32_t socket_desc) {
+	int32_t flags = fcntl(socket_desc, F_GETFL, 0);
+
+	if(flags < 0) {
+		return -1;
+	}
+
+	return fcntl(socket_desc, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+
+static
+int32_t finish_listener(int32_t socket_desc, const char *spec, int32_t queue_length) {
+	if(listen(socket_desc, queue_length) < 0) {
+		fprintf(stderr, "listen (%s): %s\n", spec, strerror(errno));
+		close(socket_desc);
+		return -1;
+	}
+
+	if(set_nonblocking(socket_desc) < 0) {
+		fprintf(stderr, "fcntl (%s): %s\n", spec, strerror(errno));
+		close(socket_desc);
+		return -1;
+	}
+
+	return socket_desc;
+}
+
+
+
+static
+int32_t open_unix_listener(const char *spec, int32_t queue_length) {
+	const char *path = spec + strlen(unix_prefix);
+	struct sockaddr_un address;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if(*path == '\0' || strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Invalid Unix socket path: %s\n", spec);
+		return -1;
+	}
+
+	strcpy(address.sun_path, path);
+
+	int32_t socket_desc = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(socket_desc < 0) {
+		fprintf(stderr, "socket (%s): %s\n", spec, strerror(errno));
+		return -1;
+	}
+
+	/* Remove socket file left by previous server instance, binding
+	 * would fail with EADDRINUSE otherwise
+	 */
+	if(unlink(path) < 0 && errno != ENOENT) {
+		fprintf(stderr, "unlink (%s): %s\n", spec, strerror(errno));
+		close(socket_desc);
+		return -1;
+	}
+
+	if(bind(socket_desc, (struct sockaddr *) &address, sizeof(address)) < 0) {
+		fprintf(stderr, "bind (%s): %s\n", spec, strerror(errno));
+		close(socket_desc);
+		return -1;
+	}
+
+	return finish_listener(socket_desc, spec, queue_length);
+}
+
+
+
+static
+int32_t open_tcp_socket(const char *spec, int32_t family, struct sockaddr *address,
+						socklen_t address_length, const char *interface, bool reuse_port) {
+
+	int32_t socket_desc = socket(family, SOCK_STREAM, 0);
+	if(socket_desc < 0) {
+		/* Missing IPv6 support is reported by the caller which
+		 * may still fall back to IPv4
+		 */
+		if(errno != EAFNOSUPPORT) {
+			fprintf(stderr, "socket (%s): %s\n", spec, strerror(errno));
+		}
+
+		return -1;
+	}
+
+	int32_t on = 1;
+	if(setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+		fprintf(stderr, "setsockopt SO_REUSEADDR (%s): %s\n", spec, strerror(errno));
+		close(socket_desc);
+		return -1;
+	}
+
+	if(reuse_port && setsockopt(socket_desc, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		fprintf(stderr, "setsockopt SO_REUSEPORT (%s): %s\n", spec, strerror(errno));
+		close(socket_desc);
+		return -1;
+	}
+
+	/* Explicitly bound IPv6 addresses are IPv6 only so that they can share the port
+	 * with IPv4 listeners, the wildcard one is made dual-stack
+	 */
+	if(family == AF_INET6) {
+		struct sockaddr_in6 *address_6 = (struct sockaddr_in6 *) address;
+		int32_t v6_only = !IN6_IS_ADDR_UNSPECIFIED(&address_6->sin6_addr);
+
+		if(setsockopt(socket_desc, IPPROTO_IPV6, IPV6_V6ONLY, &v6_only, sizeof(v6_only)) < 0) {
+			fprintf(stderr, "setsockopt IPV6_V6ONLY (%s): %s\n", spec, strerror(errno));
+			close(socket_desc);
+			return -1;
+		}
+	}
+
+	if(interface != NULL &&
+	   setsockopt(socket_desc, SOL_SOCKET, SO_BINDTODEVICE, interface, strlen(interface) + 1) < 0) {
+
+		fprintf(stderr, "setsockopt SO_BINDTODEVICE (%s): %s\n", spec, strerror(errno));
+		close(socket_desc);
+		return -1;
+	}
+
+	if(bind(socket_desc, address, address_length) < 0) {
+		fprintf(stderr, "bind (%s): %s\n", spec, strerror(errno));
+		close(socket_desc);
+		return -1;
+	}
+
+	return socket_desc;
+}
+
+
+
+static
+int32_t open_wildcard_listener(const char *spec, int32_t port, const char *interface,
+							   int32_t queue_length, bool reuse_port) {
+
+	struct sockaddr_in6 address_6;
+	memset(&address_6, 0, sizeof(address_6));
+	address_6.sin6_family = AF_INET6;
+	address_6.sin6_addr = in6addr_any;
+	address_6.sin6_port = htons(port);
+
+	int32_t socket_desc = open_tcp_socket(spec, AF_INET6, (struct sockaddr *) &address_6,
+										  sizeof(address_6), interface, reuse_port);
+
+	if(socket_desc >= 0) {
+		return finish_listener(socket_desc, spec, queue_length);
+	}
+
+	/* Kernel without IPv6 support, fall back to IPv4 wildcard address
+	 */
+	if(errno != EAFNOSUPPORT) {
+		return -1;
+	}
+
+	struct sockaddr_in address_4;
+	memset(&address_4, 0, sizeof(address_4));
+	address_4.sin_family = AF_INET;
+	address_4.sin_addr.s_addr = htonl(INADDR_ANY);
+	address_4.sin_port = htons(port);
+
+	socket_desc = open_tcp_socket(spec, AF_INET, (struct sockaddr *) &address_4,
+								  sizeof(address_4), interface, reuse_port);
+
+	if(socket_desc < 0) {
+		return -1;
+	}
+
+	return finish_listener(socket_desc, spec, queue_length);
+}
+
+
+
+const char *strip_tls_prefix(const char *spec, bool *tls) {
+	*tls = (strncmp(spec, tls_prefix, strlen(tls_prefix)) == 0);
+
+	return *tls ? spec + strlen(tls_prefix) : spec;
+}
+
+
+
+bool is_unix_listen_spec(const char *spec) {
+	return (strncmp(spec, unix_prefix, strlen(unix_prefix)) == 0);
+}
+
+
+
+int32_t open_listener(const char *spec, int32_t queue_length, bool reuse_port) {
+	if(is_unix_listen_spec(spec)) {
+		return open_unix_listener(spec, queue_length);
+	}
+
+	char host[HOST_LENGTH_LIMIT];
+	char interface[INTERFACE_LENGTH_LIMIT];
+	const char *port_string;
+	const char *interface_string = strchr(spec, '@');
+
+	size_t spec_length = (interface_string == NULL) ? strlen(spec) : (size_t) (interface_string - spec);
+
+	memset(host, 0, sizeof(host));
+	memset(interface, 0, sizeof(interface));
+
+	if(interface_string != NULL) {
+		interface_string++;
+
+		if(*interface_string == '\0' || strlen(interface_string) >= sizeof(interface)) {
+			fprintf(stderr, "Invalid interface name: %s\n", spec);
+			return -1;
+		}
+
+		strcpy(interface, interface_string);
+	}
+
+	char port_buffer[8];
+	memset(port_buffer, 0, sizeof(port_buffer));
+
+	/* Split the specification into host and port parts, the brackets
+	 * around IPv6 address are stripped
+	 */
+	const char *separator = NULL;
+	const char *host_begin = spec;
+	size_t host_length = 0;
+
+	if(spec[0] == '[') {
+		const char *closing = memchr(spec, ']', spec_length);
+
+		if(closing == NULL || closing + 1 >= spec + spec_length || closing[1] != ':') {
+			fprintf(stderr, "Invalid listen address: %s\n", spec);
+			return -1;
+		}
+
+		host_begin = spec + 1;
+		host_length = closing - host_begin;
+		separator = closing + 1;
+	}
+	else {
+		for(size_t i = 0; i < spec_length; ++i) {
+			if(spec[i] == ':') {
+				separator = spec + i;
+			}
+		}
+
+		if(separator != NULL) {
+			host_length = separator - spec;
+		}
+	}
+
+	port_string = (separator == NULL) ? spec : separator + 1;
+	size_t port_length = spec_length - (port_string - spec);
+
+	if(host_length >= sizeof(host) || port_length >= sizeof(port_buffer)) {
+		fprintf(stderr, "Invalid listen address: %s\n", spec);
+		return -1;
+	}
+
+	memcpy(host, host_begin, host_length);
+	memcpy(port_buffer, port_string, port_length);
+
+	int32_t port = parse_port(port_buffer);
+	if(port < 0) {
+		fprintf(stderr, "Invalid port number: %s\n", spec);
+		return -1;
+	}
+
+	const char *interface_ptr = (interface_string == NULL) ? NULL : interface;
+
+	if(host_length == 0) {
+		return open_wildcard_listener(spec, port, interface_ptr, queue_length, reuse_port);
+	}
+
+	struct addrinfo hints;
+	struct addrinfo *result = NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE;
+
+	int32_t gai_status = getaddrinfo(host, port_buffer, &hints, &result);
+	if(gai_status != 0) {
+		fprintf(stderr, "Invalid listen address %s: %s\n", spec, gai_strerror(gai_status));
+		return -1;
+	}
+
+	int32_t socket_desc = open_tcp_socket(spec, result->ai_family, result->ai_addr,
+										  result->ai_addrlen, interface_ptr, reuse_port);
+
+	if(socket_desc < 0 && errno == EAFNOSUPPORT) {
+		fprintf(stderr, "socket (%s): %s\n", spec, strerror(errno));
+	}
+
+	freeaddrinfo(result);
+
+	if(socket_desc < 0) {
+		return -1;
+	}
+
+	return finish_listener(socket_desc, spec, queue_length);
+}
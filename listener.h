@@ -0,0 +1,61 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+
+/* Maximum number of listen addresses the server can be
+ * started with
+ */
+#define MAX_LISTENERS 			 16
+
+
+
+/* Default server port, used when no listen address
+ * has been provided on the command line
+ */
+#define DEFAULT_SERVER_PORT 	"8080"
+
+
+
+/* Creates, binds and starts listening on a socket described by the passed
+ * listen address specification. Accepted formats are:
+ * <port>                    - dual-stack wildcard address (IPv6 socket accepting
+ *                             IPv4-mapped connections, falls back to IPv4 only
+ *                             when IPv6 is not available)
+ * <ipv4-address>:<port>     - single IPv4 address
+ * [<ipv6-address>]:<port>   - single IPv6 address (IPv6 only, except for [::]
+ *                             which is dual-stack)
+ * unix:<path>               - Unix domain stream socket (stale socket file is removed)
+ * Any TCP specification may be suffixed with @<interface> so that the socket is bound
+ * to the given network interface. Specification may be prefixed with tls: (see
+ * strip_tls_prefix()), the prefix has to be removed before calling this function.
+ * When the last argument is true, TCP sockets are created with SO_REUSEPORT so
+ * that several workers can each own a socket bound to the same address.
+ * Returned descriptor is non-blocking. Returns -1 on failure (with message printed
+ * to stderr).
+ */
+int32_t open_listener(const char *, int32_t, bool);
+
+
+
+/* Strips "tls:" prefix from listen address specification. Returns pointer
+ * to the rest of specification and sets the flag telling whether connections
+ * accepted on the listener are TLS ones
+ */
+const char *strip_tls_prefix(const char *, bool *);
+
+
+
+/* Checks whether passed listen address specification denotes a Unix
+ * domain socket (which can not be opened once per worker)
+ */
+bool is_unix_listen_spec(const char *);
+
+
+
+#endif /* LISTENER_H */
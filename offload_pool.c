@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "offload_pool.h"
+
+
+
+/* Double-ended queue of jobs owned by a single pool thread. The owner
+ * takes jobs from the head, other threads steal from the tail
+ */
+struct job_queue {
+	pthread_mutex_t lock;
+	offload_job_t *head;
+	offload_job_t *tail;
+};
+
+
+
+static struct job_queue queues[MAX_OFFLOAD_THREADS];
+static pthread_t threads[MAX_OFFLOAD_THREADS];
+static int32_t threads_count = 0;
+
+
+
+/* Round-robin counter used for choosing queue of submitted job,
+ * only touched by the submitting thread
+ */
+static int32_t next_queue = 0;
+
+
+
+/* Number of queued jobs, pool threads sleep on pending_cond
+ * while it is zero
+ */
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+static int32_t pending_jobs = 0;
+
+
+
+/* Finished jobs waiting to be completed on the submitting thread
+ */
+static pthread_mutex_t completed_lock = PTHREAD_MUTEX_INITIALIZER;
+static offload_job_t *completed_head = NULL;
+static offload_job_t *completed_tail = NULL;
+
+static int32_t completion_fd = -1;
+
+
+
+static
+void push_tail(struct job_queue *queue, offload_job_t *job) {
+	job->next = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if(queue->tail == NULL) {
+		queue->head = job;
+	}
+	else {
+		queue->tail->next = job;
+	}
+
+	queue->tail = job;
+
+	pthread_mutex_unlock(&queue->lock);
+}
+
+
+
+static
+offload_job_t *pop_head(struct job_queue *queue) {
+	pthread_mutex_lock(&queue->lock);
+
+	offload_job_t *job = queue->head;
+
+	if(job != NULL) {
+		queue->head = job->next;
+
+		if(queue->head == NULL) {
+			queue->tail = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+
+	return job;
+}
+
+
+
+static
+offload_job_t *steal_tail(struct job_queue *queue) {
+	pthread_mutex_lock(&queue->lock);
+
+	offload_job_t *job = queue->tail;
+
+	if(job != NULL) {
+		if(queue->head == job) {
+			queue->head = NULL;
+			queue->tail = NULL;
+		}
+		else {
+			/* Singly linked queue - find the predecessor of the tail. Queues
+			 * are short, the submitting thread spreads jobs evenly
+			 */
+			offload_job_t *previous = queue->head;
+
+			while(previous->next != job) {
+				previous = previous->next;
+			}
+
+			previous->next = NULL;
+			queue->tail = previous;
+		}
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+
+	return job;
+}
+
+
+
+static
+offload_job_t *take_job(int32_t own_index) {
+	offload_job_t *job = pop_head(&queues[own_index]);
+
+	for(int32_t i = 1; i < threads_count && job == NULL; ++i) {
+		job = steal_tail(&queues[(own_index + i) % threads_count]);
+	}
+
+	return job;
+}
+
+
+
+static
+void signal_completion(offload_job_t *job) {
+	job->next = NULL;
+
+	pthread_mutex_lock(&completed_lock);
+
+	if(completed_tail == NULL) {
+		completed_head = job;
+	}
+	else {
+		completed_tail->next = job;
+	}
+
+	completed_tail = job;
+
+	pthread_mutex_unlock(&completed_lock);
+
+	uint64_t one = 1;
+	while(write(completion_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+
+
+static
+void *pool_thread(void *arg) {
+	int32_t own_index = (int32_t) (intptr_t) arg;
+
+	while(true) {
+		pthread_mutex_lock(&pending_lock);
+
+		while(pending_jobs == 0) {
+			pthread_cond_wait(&pending_cond, &pending_lock);
+		}
+
+		pending_jobs--;
+
+		pthread_mutex_unlock(&pending_lock);
+
+		/* A job is guaranteed to be queued somewhere as pending_jobs has
+		 * been decremented by this thread only
+		 */
+		offload_job_t *job = NULL;
+
+		while(job == NULL) {
+			job = take_job(own_index);
+		}
+
+		job->run(job);
+		signal_completion(job);
+	}
+
+	return NULL;
+}
+
+
+
+int32_t start_offload_pool(int32_t count) {
+	if(count < 1 || count > MAX_OFFLOAD_THREADS) {
+		return -1;
+	}
+
+	completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(completion_fd < 0) {
+		return -1;
+	}
+
+	for(int32_t i = 0; i < count; ++i) {
+		pthread_mutex_init(&queues[i].lock, NULL);
+		queues[i].head = NULL;
+		queues[i].tail = NULL;
+	}
+
+	threads_count = count;
+
+	for(int32_t i = 0; i < count; ++i) {
+		int32_t error = pthread_create(&threads[i], NULL, pool_thread, (void *) (intptr_t) i);
+
+		if(error != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(error));
+			return -1;
+		}
+
+		pthread_detach(threads[i]);
+	}
+
+	return completion_fd;
+}
+
+
+
+void submit_offload_job(offload_job_t *job) {
+	push_tail(&queues[next_queue], job);
+	next_queue = (next_queue + 1) % threads_count;
+
+	pthread_mutex_lock(&pending_lock);
+	pending_jobs++;
+	pthread_cond_signal(&pending_cond);
+	pthread_mutex_unlock(&pending_lock);
+}
+
+
+
+void complete_offload_jobs(void) {
+	uint64_t counter;
+	while(read(completion_fd, &counter, sizeof(counter)) < 0 && errno == EINTR);
+
+	pthread_mutex_lock(&completed_lock);
+
+	offload_job_t *job = completed_head;
+	completed_head = NULL;
+	completed_tail = NULL;
+
+	pthread_mutex_unlock(&completed_lock);
+
+	while(job != NULL) {
+		offload_job_t *next = job->next;
+		job->complete(job);
+		job = next;
+	}
+}
@@ -0,0 +1,55 @@
+#ifndef OFFLOAD_POOL_H
+#define OFFLOAD_POOL_H
+
+
+
+#include <stdint.h>
+
+
+
+/* Maximum number of offload threads per worker
+ */
+#define MAX_OFFLOAD_THREADS 	 64
+
+
+
+typedef struct offload_job_t offload_job_t;
+
+
+
+/* Job executed by the offload pool. It is meant to be embedded as the
+ * first member of a structure carrying job-specific data. run() is called
+ * on one of the pool threads and may block, complete() is called afterwards
+ * on the thread that drains completions (the event loop).
+ */
+struct offload_job_t {
+	void (*run)(offload_job_t *);
+	void (*complete)(offload_job_t *);
+	offload_job_t *next;
+};
+
+
+
+/* Starts the offload pool with given number of threads. Returns eventfd
+ * descriptor which becomes readable whenever completed jobs are waiting
+ * to be drained with complete_offload_jobs(), or -1 on failure.
+ */
+int32_t start_offload_pool(int32_t);
+
+
+
+/* Queues job for execution on the pool. Jobs are spread round-robin
+ * over per-thread queues, idle threads steal from the other queues.
+ */
+void submit_offload_job(offload_job_t *);
+
+
+
+/* Calls complete() for every job that has finished since the previous
+ * call. Has to be called from the thread which submits the jobs.
+ */
+void complete_offload_jobs(void);
+
+
+
+#endif /* OFFLOAD_POOL_H */
@@ -0,0 +1,526 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "archive.h"
+
+
+
+/* Average number of paths per bucket of the perfect hash and number of slots
+ * per 4 paths, displacement search gives up after MAX_DISPLACEMENT tries and
+ * the table is built again with another seed
+ */
+#define PATHS_PER_BUCKET 			 4
+#define SLOTS_PER_4_PATHS 			 5
+#define MAX_DISPLACEMENT 			 (1 << 20)
+#define MAX_SEEDS 					 64
+
+
+
+/* Size of the buffer bodies are copied through
+ */
+#define COPY_BUFFER_SIZE 			 (1 << 20)
+
+
+
+/* Regular file of the catalogue packed into the archive
+ */
+struct packed_file {
+	char *path;
+	size_t path_length;
+	off_t size;
+	uint64_t hash;
+
+	char head[96];
+	uint32_t head_length;
+
+	uint64_t body_offset;
+};
+
+
+
+static struct packed_file *files = NULL;
+static size_t files_count = 0;
+static size_t files_capacity = 0;
+
+
+
+/* Resolved catalogue, files outside of which are not packed
+ */
+static char *catalogue = NULL;
+static size_t catalogue_length = 0;
+
+
+
+/* Archive being written, removed if packing fails
+ */
+static char temporary_path[PATH_MAX];
+static bool temporary_created = false;
+
+
+
+static
+void remove_temporary(void) {
+	if(temporary_created) {
+		unlink(temporary_path);
+	}
+}
+
+
+
+static
+void print_usage(const char *program_name) {
+	fprintf(stderr, "Usage: %s <catalogue> <archive>\n", program_name);
+	fprintf(stderr, "Packs regular files of the catalogue into the archive, which replaces the old one atomically\n");
+}
+
+
+
+static
+bool is_inside_catalogue(const char *path) {
+	return (strncmp(path, catalogue, catalogue_length) == 0 &&
+			(path[catalogue_length] == '/' || path[catalogue_length] == '\0'));
+}
+
+
+
+/* Adds file found by nftw(). Symbolic links are packed as the files they point
+ * to as long as those are inside the catalogue, like the server resolves them.
+ */
+static
+int add_file(const char *path, const struct stat *statbuf, int type, struct FTW *ftw) {
+	(void) ftw;
+
+	struct stat target;
+
+	if(type == FTW_SL) {
+		char *resolved = realpath(path, NULL);
+
+		if(resolved == NULL || !is_inside_catalogue(resolved) || stat(resolved, &target) < 0) {
+			free(resolved);
+			return 0;
+		}
+
+		free(resolved);
+		statbuf = &target;
+	}
+	else if(type != FTW_F) {
+		return 0;
+	}
+
+	if(!S_ISREG(statbuf->st_mode)) {
+		return 0;
+	}
+
+	if(files_count == files_capacity) {
+		size_t capacity = (files_capacity == 0) ? 1024 : 2 * files_capacity;
+		struct packed_file *resized = realloc(files, capacity * sizeof(struct packed_file));
+
+		if(resized == NULL) {
+			perror("realloc");
+			return -1;
+		}
+
+		files = resized;
+		files_capacity = capacity;
+	}
+
+	/* Requested path is the one relative to the catalogue
+	 */
+	struct packed_file *file = &files[files_count];
+
+	file->path = strdup(path + catalogue_length);
+
+	if(file->path == NULL) {
+		perror("strdup");
+		return -1;
+	}
+
+	file->path_length = strlen(file->path);
+	file->size = statbuf->st_size;
+	file->head_length = snprintf(file->head, sizeof(file->head),
+								 "Content-Type: application/octet-stream\r\nContent-Length: %lld\r\n\r\n",
+								 (long long) file->size);
+
+	files_count++;
+	return 0;
+}
+
+
+
+/* Finds displacement of every bucket such that the paths of all buckets hash
+ * to distinct slots, the largest buckets are placed first. Returns false if
+ * some bucket can not be placed with the seed.
+ */
+static
+bool build_perfect_hash(uint64_t seed, uint32_t *displacements, uint32_t buckets_count,
+						uint32_t *slots, uint32_t slots_count) {
+
+	for(size_t i = 0; i < files_count; ++i) {
+		files[i].hash = hash_archived_path(files[i].path, files[i].path_length, seed);
+	}
+
+	/* Paths sorted by bucket with counting sort
+	 */
+	uint32_t *bucket_start = calloc(buckets_count + 1, sizeof(uint32_t));
+	uint32_t *bucket_paths = malloc(files_count * sizeof(uint32_t));
+	uint32_t *order = malloc(buckets_count * sizeof(uint32_t));
+	uint32_t *candidate = malloc((files_count + 1) * sizeof(uint32_t));
+
+	if(bucket_start == NULL || bucket_paths == NULL || order == NULL || candidate == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for(size_t i = 0; i < files_count; ++i) {
+		bucket_start[(files[i].hash >> 32) % buckets_count + 1]++;
+	}
+
+	uint32_t max_bucket_size = 0;
+
+	for(uint32_t i = 0; i < buckets_count; ++i) {
+		if(bucket_start[i + 1] > max_bucket_size) {
+			max_bucket_size = bucket_start[i + 1];
+		}
+
+		bucket_start[i + 1] += bucket_start[i];
+	}
+
+	uint32_t *fill = calloc(buckets_count, sizeof(uint32_t));
+
+	if(fill == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for(size_t i = 0; i < files_count; ++i) {
+		uint32_t bucket = (files[i].hash >> 32) % buckets_count;
+		bucket_paths[bucket_start[bucket] + fill[bucket]++] = i;
+	}
+
+	free(fill);
+
+	/* Buckets ordered by decreasing size with counting sort as well
+	 */
+	size_t ordered = 0;
+
+	for(uint32_t size = max_bucket_size; size > 0; --size) {
+		for(uint32_t i = 0; i < buckets_count; ++i) {
+			if(bucket_start[i + 1] - bucket_start[i] == size) {
+				order[ordered++] = i;
+			}
+		}
+	}
+
+	for(uint32_t i = 0; i < slots_count; ++i) {
+		slots[i] = ARCHIVE_EMPTY_SLOT;
+	}
+
+	memset(displacements, 0, buckets_count * sizeof(uint32_t));
+
+	bool placed = true;
+
+	for(size_t i = 0; i < ordered && placed; ++i) {
+		uint32_t bucket = order[i];
+		uint32_t count = bucket_start[bucket + 1] - bucket_start[bucket];
+		const uint32_t *paths = bucket_paths + bucket_start[bucket];
+
+		placed = false;
+
+		for(uint32_t displacement = 0; displacement < MAX_DISPLACEMENT && !placed; ++displacement) {
+			placed = true;
+
+			for(uint32_t j = 0; j < count && placed; ++j) {
+				candidate[j] = get_archive_slot(files[paths[j]].hash, displacement, slots_count);
+
+				if(slots[candidate[j]] != ARCHIVE_EMPTY_SLOT) {
+					placed = false;
+				}
+
+				for(uint32_t k = 0; k < j && placed; ++k) {
+					placed = (candidate[k] != candidate[j]);
+				}
+			}
+
+			if(placed) {
+				for(uint32_t j = 0; j < count; ++j) {
+					slots[candidate[j]] = paths[j];
+				}
+
+				displacements[bucket] = displacement;
+			}
+		}
+	}
+
+	free(candidate);
+	free(order);
+	free(bucket_paths);
+	free(bucket_start);
+
+	return placed;
+}
+
+
+
+static
+uint64_t align(uint64_t offset, uint64_t alignment) {
+	return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+
+
+/* Places bodies after the index, bodies of at least a page are page aligned,
+ * smaller ones share pages but never cross their boundary. Returns size
+ * of the archive.
+ */
+static
+uint64_t place_bodies(uint64_t index_size) {
+	uint64_t offset = align(index_size, ARCHIVE_PAGE);
+
+	for(size_t i = 0; i < files_count; ++i) {
+		uint64_t size = files[i].size;
+
+		if(size >= ARCHIVE_PAGE) {
+			offset = align(offset, ARCHIVE_PAGE);
+		}
+		else {
+			offset = align(offset, ARCHIVE_LINE);
+
+			if(size > 0 && offset / ARCHIVE_PAGE != (offset + size - 1) / ARCHIVE_PAGE) {
+				offset = align(offset, ARCHIVE_PAGE);
+			}
+		}
+
+		files[i].body_offset = offset;
+		offset += size;
+	}
+
+	return offset;
+}
+
+
+
+static
+void write_fully(int32_t fd, const void *bytes, size_t length, uint64_t offset, const char *path) {
+	while(length > 0) {
+		ssize_t written = pwrite(fd, bytes, length, offset);
+
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+
+		bytes = (const char *) bytes + written;
+		length -= written;
+		offset += written;
+	}
+}
+
+
+
+/* Copies body of the file into the archive, the file must not change
+ * while being packed
+ */
+static
+void copy_body(int32_t archive_fd, const struct packed_file *file, char *buffer, const char *archive_path) {
+	char path[PATH_MAX];
+
+	if(snprintf(path, sizeof(path), "%s%s", catalogue, file->path) >= (int) sizeof(path)) {
+		fprintf(stderr, "%s%s: path too long\n", catalogue, file->path);
+		exit(EXIT_FAILURE);
+	}
+
+	int32_t fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+	if(fd < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t copied = 0;
+
+	while(copied < (uint64_t) file->size) {
+		size_t wanted = COPY_BUFFER_SIZE;
+
+		if(wanted > file->size - copied) {
+			wanted = file->size - copied;
+		}
+
+		ssize_t read_bytes = pread(fd, buffer, wanted, copied);
+
+		if(read_bytes < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if(read_bytes <= 0) {
+			fprintf(stderr, "%s: %s\n", path, (read_bytes < 0) ? strerror(errno) : "file shrunk while being packed");
+			exit(EXIT_FAILURE);
+		}
+
+		write_fully(archive_fd, buffer, read_bytes, file->body_offset + copied, archive_path);
+		copied += read_bytes;
+	}
+
+	close(fd);
+}
+
+
+
+int main(int argc, char *argv[]) {
+	if(argc != 3) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	catalogue = realpath(argv[1], NULL);
+
+	if(catalogue == NULL) {
+		perror(argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Paths of files in the root directory keep their leading slash
+	 */
+	catalogue_length = (strcmp(catalogue, "/") == 0) ? 0 : strlen(catalogue);
+
+	/* Symbolic links are not followed into directories, so that
+	 * the walk can not loop
+	 */
+	if(nftw(catalogue, add_file, 64, FTW_PHYS) != 0) {
+		fprintf(stderr, "Could not walk catalogue %s\n", catalogue);
+		exit(EXIT_FAILURE);
+	}
+
+	if(files_count >= ARCHIVE_EMPTY_SLOT / SLOTS_PER_4_PATHS) {
+		fprintf(stderr, "Too many files in catalogue %s\n", catalogue);
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t buckets_count = files_count / PATHS_PER_BUCKET + 1;
+	uint32_t slots_count = files_count * SLOTS_PER_4_PATHS / 4 + 1;
+
+	uint32_t *displacements = malloc(buckets_count * sizeof(uint32_t));
+	uint32_t *slots = malloc(slots_count * sizeof(uint32_t));
+
+	if(displacements == NULL || slots == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t seed = 0;
+
+	while(!build_perfect_hash(seed, displacements, buckets_count, slots, slots_count)) {
+		if(++seed == MAX_SEEDS) {
+			fprintf(stderr, "Could not build perfect hash of %zu paths\n", files_count);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Index: header, displacements, slots, entries, then paths
+	 * and heads of the files
+	 */
+	struct archive_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+
+	header.entries_count = files_count;
+	header.buckets_count = buckets_count;
+	header.slots_count = slots_count;
+	header.seed = seed;
+	header.displacements_offset = sizeof(header);
+	header.slots_offset = header.displacements_offset + (uint64_t) buckets_count * sizeof(uint32_t);
+	header.entries_offset = align(header.slots_offset + (uint64_t) slots_count * sizeof(uint32_t), sizeof(uint64_t));
+
+	uint64_t strings_offset = header.entries_offset + (uint64_t) files_count * sizeof(struct archive_entry);
+	uint64_t strings_length = 0;
+
+	for(size_t i = 0; i < files_count; ++i) {
+		strings_length += files[i].path_length + files[i].head_length;
+	}
+
+	header.index_size = strings_offset + strings_length;
+
+	uint64_t archive_size = place_bodies(header.index_size);
+
+	/* New archive is written next to the old one and renamed over it,
+	 * servers pick it up once their next check sees another file
+	 */
+	if(snprintf(temporary_path, sizeof(temporary_path), "%s.%d.tmp", argv[2], (int) getpid()) >= (int) sizeof(temporary_path)) {
+		fprintf(stderr, "%s: path too long\n", argv[2]);
+		exit(EXIT_FAILURE);
+	}
+
+	int32_t archive_fd = open(temporary_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+	if(archive_fd < 0) {
+		perror(temporary_path);
+		exit(EXIT_FAILURE);
+	}
+
+	temporary_created = true;
+	atexit(remove_temporary);
+
+	if(ftruncate(archive_fd, archive_size) < 0) {
+		perror(temporary_path);
+		exit(EXIT_FAILURE);
+	}
+
+	struct archive_entry *entries = calloc(files_count + 1, sizeof(struct archive_entry));
+	char *strings = malloc(strings_length + 1);
+	char *buffer = malloc(COPY_BUFFER_SIZE);
+
+	if(entries == NULL || strings == NULL || buffer == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t string_offset = 0;
+
+	for(size_t i = 0; i < files_count; ++i) {
+		entries[i].path_offset = strings_offset + string_offset;
+		entries[i].path_length = files[i].path_length;
+		memcpy(strings + string_offset, files[i].path, files[i].path_length);
+		string_offset += files[i].path_length;
+
+		entries[i].head_offset = strings_offset + string_offset;
+		entries[i].head_length = files[i].head_length;
+		memcpy(strings + string_offset, files[i].head, files[i].head_length);
+		string_offset += files[i].head_length;
+
+		entries[i].body_offset = files[i].body_offset;
+		entries[i].body_length = files[i].size;
+	}
+
+	write_fully(archive_fd, &header, sizeof(header), 0, temporary_path);
+	write_fully(archive_fd, displacements, buckets_count * sizeof(uint32_t), header.displacements_offset, temporary_path);
+	write_fully(archive_fd, slots, slots_count * sizeof(uint32_t), header.slots_offset, temporary_path);
+	write_fully(archive_fd, entries, files_count * sizeof(struct archive_entry), header.entries_offset, temporary_path);
+	write_fully(archive_fd, strings, strings_length, strings_offset, temporary_path);
+
+	for(size_t i = 0; i < files_count; ++i) {
+		copy_body(archive_fd, &files[i], buffer, temporary_path);
+	}
+
+	if(fsync(archive_fd) < 0 || close(archive_fd) < 0 || rename(temporary_path, argv[2]) < 0) {
+		perror(argv[2]);
+		exit(EXIT_FAILURE);
+	}
+
+	temporary_created = false;
+
+	printf("Packed %zu files into %s (%llu bytes)\n", files_count, argv[2], (unsigned long long) archive_size);
+
+	return 0;
+}
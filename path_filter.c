@@ -0,0 +1,847 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "path_filter.h"
+#include "filesearch.h"
+#include "offload_pool.h"
+
+
+
+/* Bits of the filter per path and number of bits set for every path,
+ * giving false positive rate of about 0.1%
+ */
+#define BITS_PER_PATH 			 16
+#define HASHES_COUNT 				7
+
+
+
+/* Size of the filter built for a catalogue of unknown size
+ */
+#define MIN_FILTER_BITS 		 (1 << 20)
+
+
+
+/* Directories nested deeper than this make the filter give up
+ */
+#define MAX_WALK_DEPTH 			 32
+
+
+
+#define WATCH_MASK 				 (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR)
+
+
+
+/* Inotify events read while the filter is being rebuilt are kept for
+ * the new filter up to this many bytes, more make it rebuild again
+ */
+#define MAX_REPLAY_BYTES 		 (1 << 20)
+
+
+
+/* Paths (relative to the catalogue) of a watched directory, a directory
+ * reachable through symbolic links has more of them
+ */
+struct watch_path {
+	char *path;
+	struct watch_path *next;
+};
+
+
+
+/* Directory on the path from the catalogue to the directory being walked
+ */
+struct walk_ancestor {
+	dev_t device;
+	ino_t inode;
+	const struct walk_ancestor *parent;
+};
+
+
+
+/* Filter with the watches and rules it answers with. A new one is built on
+ * the offload pool while the event loop keeps answering with (and keeping
+ * up to date) the previous one
+ */
+struct path_filter {
+	/* Filter can only answer for paths while all the watches are in place,
+	 * any failure makes every path possibly present
+	 */
+	bool valid;
+	bool overfilled;
+
+	uint64_t *bits;
+	size_t bits_count;
+	size_t inserted_count;
+
+	/* Paths of watched directories indexed by watch descriptor
+	 */
+	struct watch_path **watch_table;
+	size_t watch_table_size;
+
+	/* Paths of links to directories on the path walked to them, names below
+	 * them are endless (realpath() resolves every one of them) and are left
+	 * to the file system
+	 */
+	char **looped_paths;
+	size_t looped_count;
+	size_t looped_capacity;
+
+	/* Rules of the corelated servers file, prefix rules can not be
+	 * represented by the filter
+	 */
+	redirect_index_t *redirects;
+	int32_t corelated_wd;
+};
+
+
+
+typedef struct {
+	offload_job_t job;
+	size_t bits_count;
+	struct path_filter *result;
+} rebuild_job_t;
+
+
+
+static const char *catalogue = NULL;
+static const char *corelated_file = NULL;
+
+static char corelated_directory[PATH_MAX];
+static const char *corelated_name = NULL;
+
+static int32_t inotify_fd = -1;
+
+/* Filter answering the requests, NULL until the first one is built
+ */
+static struct path_filter *filter = NULL;
+
+static bool rebuild_running = false;
+static bool rebuild_pending = false;
+
+/* Events read during the rebuild, applied to the new filter once it
+ * replaces the previous one
+ */
+static char *replay_events = NULL;
+static size_t replay_length = 0;
+static bool replay_incomplete = false;
+
+
+
+static
+void walk_directory(struct path_filter *, const char *, int32_t, const struct walk_ancestor *);
+
+
+
+/* FNV-1a, the two halves of the result drive double hashing
+ */
+static
+uint64_t hash_path(const char *path, size_t length) {
+	uint64_t hash = 14695981039346656037ull;
+
+	for(size_t i = 0; i < length; ++i) {
+		hash ^= (unsigned char) path[i];
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+
+
+static
+void add_path(struct path_filter *state, const char *path, size_t length) {
+	uint64_t hash = hash_path(path, length);
+	uint32_t step = (uint32_t) (hash >> 32) | 1;
+	uint32_t position = (uint32_t) hash;
+
+	for(int32_t i = 0; i < HASHES_COUNT; ++i) {
+		size_t bit = position & (state->bits_count - 1);
+		state->bits[bit / 64] |= (1ull << (bit % 64));
+		position += step;
+	}
+
+	/* Filter overfilled by files created since it was built
+	 */
+	if(++state->inserted_count * BITS_PER_PATH > state->bits_count) {
+		state->overfilled = true;
+	}
+}
+
+
+
+static
+bool contains_path(const struct path_filter *state, const char *path, size_t length) {
+	uint64_t hash = hash_path(path, length);
+	uint32_t step = (uint32_t) (hash >> 32) | 1;
+	uint32_t position = (uint32_t) hash;
+
+	for(int32_t i = 0; i < HASHES_COUNT; ++i) {
+		size_t bit = position & (state->bits_count - 1);
+
+		if(!(state->bits[bit / 64] & (1ull << (bit % 64)))) {
+			return false;
+		}
+
+		position += step;
+	}
+
+	return true;
+}
+
+
+
+static
+void invalidate_filter(struct path_filter *state, const char *reason, const char *path) {
+	if(state->valid) {
+		fprintf(stderr, "Path filter disabled (%s %s): %s\n", reason, path, strerror(errno));
+	}
+
+	state->valid = false;
+}
+
+
+
+static
+void add_looped_path(struct path_filter *state, const char *path) {
+	if(state->looped_count == state->looped_capacity) {
+		size_t new_capacity = (state->looped_capacity == 0) ? 8 : state->looped_capacity * 2;
+		char **new_paths = realloc(state->looped_paths, new_capacity * sizeof(char *));
+
+		if(new_paths == NULL) {
+			invalidate_filter(state, "allocating", path);
+			return;
+		}
+
+		state->looped_paths = new_paths;
+		state->looped_capacity = new_capacity;
+	}
+
+	if((state->looped_paths[state->looped_count] = strdup(path)) == NULL) {
+		invalidate_filter(state, "allocating", path);
+		return;
+	}
+
+	state->looped_count++;
+}
+
+
+
+static
+bool is_below_looped_path(const struct path_filter *state, const char *path, size_t length) {
+	for(size_t i = 0; i < state->looped_count; ++i) {
+		size_t looped_length = strlen(state->looped_paths[i]);
+
+		if(looped_length < length && path[looped_length] == '/' &&
+		   strncmp(state->looped_paths[i], path, looped_length) == 0) {
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+
+static
+bool is_watched(const struct path_filter *state, int32_t wd) {
+	return ((size_t) wd < state->watch_table_size && state->watch_table[wd] != NULL) || wd == state->corelated_wd;
+}
+
+
+
+/* Frees the filter, its watches are left in place as the filter replacing
+ * it shares the ones of directories watched by both
+ */
+static
+void delete_filter(struct path_filter *state) {
+	for(size_t wd = 0; wd < state->watch_table_size; ++wd) {
+		while(state->watch_table[wd] != NULL) {
+			struct watch_path *watch = state->watch_table[wd];
+			state->watch_table[wd] = watch->next;
+
+			free(watch->path);
+			free(watch);
+		}
+	}
+
+	for(size_t i = 0; i < state->looped_count; ++i) {
+		free(state->looped_paths[i]);
+	}
+
+	if(state->redirects != NULL) {
+		delete_redirect_index(state->redirects);
+	}
+
+	free(state->watch_table);
+	free(state->looped_paths);
+	free(state->bits);
+	free(state);
+}
+
+
+
+/* Removes watches of directories the previous filter watched and the
+ * new one does not (removed or no longer reachable ones)
+ */
+static
+void remove_stale_watches(const struct path_filter *previous, const struct path_filter *current) {
+	for(size_t wd = 0; wd < previous->watch_table_size; ++wd) {
+		if(previous->watch_table[wd] != NULL && !is_watched(current, wd)) {
+			inotify_rm_watch(inotify_fd, wd);
+		}
+	}
+
+	if(previous->corelated_wd >= 0 && !is_watched(current, previous->corelated_wd)) {
+		inotify_rm_watch(inotify_fd, previous->corelated_wd);
+	}
+}
+
+
+
+static
+int32_t add_watch(struct path_filter *state, const char *absolute_path, const char *path) {
+	int32_t wd = inotify_add_watch(inotify_fd, absolute_path, WATCH_MASK);
+
+	if(wd < 0) {
+		invalidate_filter(state, "watching", absolute_path);
+		return -1;
+	}
+
+	if((size_t) wd >= state->watch_table_size) {
+		size_t new_size = (state->watch_table_size == 0) ? 256 : state->watch_table_size;
+
+		while(new_size <= (size_t) wd) {
+			new_size *= 2;
+		}
+
+		struct watch_path **new_table = realloc(state->watch_table, new_size * sizeof(struct watch_path *));
+		if(new_table == NULL) {
+			invalidate_filter(state, "watching", absolute_path);
+			return -1;
+		}
+
+		memset(new_table + state->watch_table_size, 0, (new_size - state->watch_table_size) * sizeof(struct watch_path *));
+
+		state->watch_table = new_table;
+		state->watch_table_size = new_size;
+	}
+
+	/* Directory created while its parent was listed is reported both by
+	 * the listing and by an event
+	 */
+	for(struct watch_path *iter = state->watch_table[wd]; iter != NULL; iter = iter->next) {
+		if(strcmp(iter->path, path) == 0) {
+			return wd;
+		}
+	}
+
+	struct watch_path *watch = malloc(sizeof(struct watch_path));
+
+	if(watch == NULL || (watch->path = strdup(path)) == NULL) {
+		free(watch);
+		invalidate_filter(state, "watching", absolute_path);
+		return -1;
+	}
+
+	watch->next = state->watch_table[wd];
+	state->watch_table[wd] = watch;
+
+	return wd;
+}
+
+
+
+/* Adds the entry named name of the directory with passed catalogue relative
+ * path, walking it if it is a directory (symbolic links are followed as
+ * realpath() does when serving the request)
+ */
+static
+void add_entry(struct path_filter *state, int32_t dir_fd, const char *directory, const char *name, int32_t depth,
+			   const struct walk_ancestor *ancestor) {
+
+	char path[PATH_MAX];
+	int32_t length = snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+	if(length < 0 || (size_t) length >= sizeof(path)) {
+		invalidate_filter(state, "path too long", directory);
+		return;
+	}
+
+	struct stat statbuf;
+
+	if(fstatat(dir_fd, name, &statbuf, 0) < 0) {
+		/* Dangling link or entry removed in the meantime, the path
+		 * is added anyway as false positives are harmless
+		 */
+		add_path(state, path, length);
+		return;
+	}
+
+	if(!S_ISDIR(statbuf.st_mode)) {
+		add_path(state, path, length);
+		return;
+	}
+
+	/* Link to a directory which is being walked already, paths below
+	 * it are not added but can not be reported as absent either
+	 */
+	for(const struct walk_ancestor *iter = ancestor; iter != NULL; iter = iter->parent) {
+		if(iter->device == statbuf.st_dev && iter->inode == statbuf.st_ino) {
+			add_looped_path(state, path);
+			return;
+		}
+	}
+
+	struct walk_ancestor current = { statbuf.st_dev, statbuf.st_ino, ancestor };
+	walk_directory(state, path, depth + 1, &current);
+}
+
+
+
+/* Watches directory with passed catalogue relative path ("" for the catalogue
+ * itself) and adds all the files below it. Directory is watched before it is
+ * listed so that no file created meanwhile is missed
+ */
+static
+void walk_directory(struct path_filter *state, const char *path, int32_t depth, const struct walk_ancestor *ancestor) {
+	char absolute_path[PATH_MAX];
+
+	if(depth > MAX_WALK_DEPTH) {
+		invalidate_filter(state, "directories nested too deep", path);
+		return;
+	}
+
+	if(snprintf(absolute_path, sizeof(absolute_path), "%s%s", catalogue, path) >= (int32_t) sizeof(absolute_path)) {
+		invalidate_filter(state, "path too long", path);
+		return;
+	}
+
+	if(add_watch(state, absolute_path, path) < 0) {
+		return;
+	}
+
+	DIR *directory = opendir(absolute_path);
+
+	if(directory == NULL) {
+		invalidate_filter(state, "listing", absolute_path);
+		return;
+	}
+
+	struct dirent *dir_entry;
+
+	while(state->valid && (dir_entry = readdir(directory)) != NULL) {
+		if(strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0) {
+			continue;
+		}
+
+		add_entry(state, dirfd(directory), path, dir_entry->d_name, depth, ancestor);
+	}
+
+	closedir(directory);
+}
+
+
+
+/* Compiles rules of corelated servers file, paths matched by any of
+ * them are never reported as absent
+ */
+static
+void read_corelated_file(struct path_filter *state) {
+	redirect_index_t *new_redirects = load_redirect_index(corelated_file);
+
+	if(new_redirects == NULL) {
+		invalidate_filter(state, "reading", corelated_file);
+		return;
+	}
+
+	if(state->redirects != NULL) {
+		delete_redirect_index(state->redirects);
+	}
+
+	state->redirects = new_redirects;
+}
+
+
+
+/* Walks the catalogue into a new filter, called on the offload pool
+ */
+static
+struct path_filter *build_filter(size_t bits_count) {
+	struct path_filter *state = calloc(1, sizeof(struct path_filter));
+
+	if(state == NULL) {
+		return NULL;
+	}
+
+	state->corelated_wd = -1;
+	state->bits_count = bits_count;
+	state->valid = true;
+
+	if((state->bits = calloc(bits_count / 64, sizeof(uint64_t))) == NULL) {
+		invalidate_filter(state, "allocating", "filter");
+		return state;
+	}
+
+	/* Corelated servers file may be replaced by renaming another file over it,
+	 * its directory is watched for the name
+	 */
+	state->corelated_wd = inotify_add_watch(inotify_fd, corelated_directory, WATCH_MASK | IN_MASK_ADD);
+
+	if(state->corelated_wd < 0) {
+		invalidate_filter(state, "watching", corelated_directory);
+		return state;
+	}
+
+	read_corelated_file(state);
+
+	struct stat statbuf;
+
+	if(stat(catalogue, &statbuf) < 0) {
+		invalidate_filter(state, "reading", catalogue);
+		return state;
+	}
+
+	struct walk_ancestor root = { statbuf.st_dev, statbuf.st_ino, NULL };
+	walk_directory(state, "", 0, &root);
+
+	return state;
+}
+
+
+
+static
+void run_rebuild(offload_job_t *job) {
+	rebuild_job_t *rebuild = (rebuild_job_t *) job;
+	size_t bits_count = rebuild->bits_count;
+
+	rebuild->result = build_filter(bits_count);
+
+	/* Catalogue has grown past the estimate, size the filter for
+	 * the number of paths found
+	 */
+	if(rebuild->result != NULL && rebuild->result->valid && rebuild->result->overfilled) {
+		while(bits_count < rebuild->result->inserted_count * BITS_PER_PATH * 2) {
+			bits_count *= 2;
+		}
+
+		delete_filter(rebuild->result);
+		rebuild->result = build_filter(bits_count);
+	}
+}
+
+
+
+static
+void read_events(void);
+
+
+
+static
+void apply_events(const char *, size_t);
+
+
+
+static
+void complete_rebuild(offload_job_t *job) {
+	rebuild_job_t *rebuild = (rebuild_job_t *) job;
+
+	/* Events queued meanwhile are read for the replay too
+	 */
+	read_events();
+	rebuild_running = false;
+
+	if(rebuild->result != NULL) {
+		struct path_filter *previous = filter;
+		filter = rebuild->result;
+
+		apply_events(replay_events, replay_length);
+
+		if(replay_incomplete) {
+			filter->valid = false;
+			rebuild_pending = true;
+		}
+
+		if(previous != NULL) {
+			remove_stale_watches(previous, filter);
+			delete_filter(previous);
+		}
+	}
+
+	free(replay_events);
+	replay_events = NULL;
+	replay_length = 0;
+	replay_incomplete = false;
+
+	free(rebuild);
+
+	if(rebuild_pending) {
+		rebuild_path_filter();
+	}
+}
+
+
+
+void rebuild_path_filter(void) {
+	if(inotify_fd < 0) {
+		return;
+	}
+
+	if(rebuild_running) {
+		rebuild_pending = true;
+		return;
+	}
+
+	rebuild_job_t *rebuild = calloc(1, sizeof(rebuild_job_t));
+
+	if(rebuild == NULL) {
+		if(filter != NULL) {
+			invalidate_filter(filter, "allocating", "rebuild");
+		}
+
+		return;
+	}
+
+	size_t bits_count = MIN_FILTER_BITS;
+
+	while(filter != NULL && bits_count < filter->inserted_count * BITS_PER_PATH * 2) {
+		bits_count *= 2;
+	}
+
+	rebuild->job.run = run_rebuild;
+	rebuild->job.complete = complete_rebuild;
+	rebuild->bits_count = bits_count;
+
+	rebuild_running = true;
+	rebuild_pending = false;
+
+	submit_offload_job(&rebuild->job);
+}
+
+
+
+int32_t init_path_filter(const char *catalogue_path, const char *corelated_servers_file) {
+	catalogue = catalogue_path;
+	corelated_file = corelated_servers_file;
+
+	const char *separator = strrchr(corelated_file, '/');
+
+	if(separator == NULL) {
+		strcpy(corelated_directory, ".");
+		corelated_name = corelated_file;
+	}
+	else if((size_t) (separator - corelated_file) < sizeof(corelated_directory)) {
+		memcpy(corelated_directory, corelated_file, separator - corelated_file);
+		corelated_directory[separator - corelated_file] = '\0';
+
+		if(separator == corelated_file) {
+			strcpy(corelated_directory, "/");
+		}
+
+		corelated_name = separator + 1;
+	}
+	else {
+		return -1;
+	}
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if(inotify_fd < 0) {
+		perror("inotify_init1");
+		return -1;
+	}
+
+	rebuild_path_filter();
+
+	return inotify_fd;
+}
+
+
+
+/* Applies events to the filter answering the requests
+ */
+static
+void apply_events(const char *buffer, size_t length) {
+	bool corelated_changed = false;
+	const struct inotify_event *event;
+
+	for(const char *iter = buffer; iter < buffer + length; iter += sizeof(struct inotify_event) + event->len) {
+		event = (const struct inotify_event *) iter;
+
+		if(event->mask & IN_Q_OVERFLOW) {
+			/* Files created meanwhile may be missing until it is rebuilt
+			 */
+			if(filter != NULL) {
+				filter->valid = false;
+			}
+
+			rebuild_pending = true;
+			continue;
+		}
+
+		if(filter == NULL || event->len == 0 || event->wd < 0) {
+			continue;
+		}
+
+		if(event->wd == filter->corelated_wd && strcmp(event->name, corelated_name) == 0) {
+			corelated_changed = true;
+		}
+
+		if(!(event->mask & (IN_CREATE | IN_MOVED_TO)) || (size_t) event->wd >= filter->watch_table_size) {
+			continue;
+		}
+
+		for(struct watch_path *watch = filter->watch_table[event->wd]; watch != NULL && filter->valid; watch = watch->next) {
+			char absolute_path[PATH_MAX];
+			snprintf(absolute_path, sizeof(absolute_path), "%s%s", catalogue, watch->path);
+
+			int32_t dir_fd = open(absolute_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+			if(dir_fd < 0) {
+				continue;
+			}
+
+			int32_t depth = 0;
+
+			for(const char *c = watch->path; *c != '\0'; ++c) {
+				depth += (*c == '/');
+			}
+
+			add_entry(filter, dir_fd, watch->path, event->name, depth, NULL);
+			close(dir_fd);
+		}
+	}
+
+	if(corelated_changed && filter->valid) {
+		read_corelated_file(filter);
+	}
+}
+
+
+
+/* Keeps events read during the rebuild for the new filter
+ */
+static
+void keep_events(const char *buffer, size_t length) {
+	if(replay_incomplete) {
+		return;
+	}
+
+	char *new_events = NULL;
+
+	if(replay_length + length <= MAX_REPLAY_BYTES) {
+		new_events = realloc(replay_events, replay_length + length);
+	}
+
+	if(new_events == NULL) {
+		replay_incomplete = true;
+		return;
+	}
+
+	memcpy(new_events + replay_length, buffer, length);
+	replay_events = new_events;
+	replay_length += length;
+}
+
+
+
+static
+void read_events(void) {
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while(true) {
+		ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+
+		if(length <= 0) {
+			break;
+		}
+
+		if(rebuild_running) {
+			keep_events(buffer, length);
+		}
+
+		apply_events(buffer, length);
+	}
+}
+
+
+
+void handle_path_filter_events(void) {
+	read_events();
+
+	/* Overfilled filter keeps answering until the larger one replaces it
+	 */
+	if(rebuild_pending || (filter != NULL && filter->overfilled && !rebuild_running)) {
+		rebuild_path_filter();
+	}
+}
+
+
+
+/* Checks that the path starts with a slash and has no empty (except for the
+ * last one), . or .. segments, which realpath() would resolve
+ */
+static
+bool is_canonical_path(const char *path, size_t length) {
+	if(length == 0 || path[0] != '/') {
+		return false;
+	}
+
+	size_t segment_start = 1;
+
+	for(size_t i = 1; i <= length; ++i) {
+		if(i < length && path[i] != '/') {
+			continue;
+		}
+
+		size_t segment_length = i - segment_start;
+		const char *segment = path + segment_start;
+
+		if((segment_length == 0 && i < length) ||
+		   (segment_length == 1 && segment[0] == '.') ||
+		   (segment_length == 2 && segment[0] == '.' && segment[1] == '.')) {
+
+			return false;
+		}
+
+		segment_start = i + 1;
+	}
+
+	return true;
+}
+
+
+
+static
+bool is_known_path(const char *path, size_t length) {
+	return (contains_path(filter, path, length) || has_redirect(filter->redirects, path, length) ||
+			is_below_looped_path(filter, path, length));
+}
+
+
+
+bool is_path_absent(const char *path, size_t length) {
+	if(filter == NULL || !filter->valid || !is_canonical_path(path, length)) {
+		return false;
+	}
+
+	if(is_known_path(path, length)) {
+		return false;
+	}
+
+	/* File created just before the request may have its event still queued,
+	 * the definite answer is only given once the queue is empty
+	 */
+	handle_path_filter_events();
+
+	return (filter != NULL && filter->valid && !is_known_path(path, length));
+}
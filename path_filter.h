@@ -0,0 +1,47 @@
+#ifndef PATH_FILTER_H
+#define PATH_FILTER_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+
+/* Starts building Bloom filter of paths of all files in passed catalogue on
+ * the offload pool, compiles rules of passed corelated servers file and
+ * watches both with inotify so that files created later are added and
+ * changed rules compiled again. No path is reported as absent until the
+ * build completes. Returns the inotify descriptor which has to be polled
+ * for readability, or -1 if the filter could not be set up (it then never
+ * reports a path as absent).
+ */
+int32_t init_path_filter(const char *, const char *);
+
+
+
+/* Processes pending inotify events, called when the descriptor
+ * returned by init_path_filter() becomes readable
+ */
+void handle_path_filter_events(void);
+
+
+
+/* Rebuilds the filter from scratch on the offload pool, dropping paths of
+ * removed files. The current filter answers until the new one replaces it
+ */
+void rebuild_path_filter(void);
+
+
+
+/* Checks whether request path of passed length is definitely neither a file
+ * in the catalogue nor matched by a rule of corelated servers file. Paths
+ * which are not in canonical form (. and .. segments, repeated slashes) are
+ * never reported as absent.
+ */
+bool is_path_absent(const char *, size_t);
+
+
+
+#endif /* PATH_FILTER_H */
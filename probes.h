@@ -0,0 +1,38 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+
+
+/* USDT (SystemTap compatible) static tracepoints of provider "serwer",
+ * which bpftrace, perf and SystemTap can attach to at run time. A probe
+ * nobody is attached to is a single nop instruction, with its arguments
+ * only described in an ELF note. Compiled in with WITH_USDT (requires
+ * sys/sdt.h), otherwise the probes disappear. Probes:
+ *
+ * accept(fd, tls)                      connection accepted
+ * request_parsed(fd, method, path_len) request head parsed (method as in
+ *                                      ioprotocol.h)
+ * file_start(fd, size)                 response for a file is being queued
+ * file_done(fd, bytes)                 body of the file has been sent (0 bytes
+ *                                      for HEAD requests)
+ * corelated(fd, result)                corelated servers file lookup finished
+ *                                      with check_corelated() result
+ * close(fd)                            connection closed
+ *
+ * Requests on HTTP/2 streams report the descriptor of their connection,
+ * probes of streams multiplexed over one connection interleave.
+ */
+#ifdef WITH_USDT
+#include <sys/sdt.h>
+#define USDT_PROBE1(name, a) 			DTRACE_PROBE1(serwer, name, a)
+#define USDT_PROBE2(name, a, b) 		DTRACE_PROBE2(serwer, name, a, b)
+#define USDT_PROBE3(name, a, b, c) 		DTRACE_PROBE3(serwer, name, a, b, c)
+#else
+#define USDT_PROBE1(name, a) 			((void) 0)
+#define USDT_PROBE2(name, a, b) 		((void) 0)
+#define USDT_PROBE3(name, a, b, c) 		((void) 0)
+#endif /* WITH_USDT */
+
+
+
+#endif /* PROBES_H */
@@ -0,0 +1,1754 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include "proxy.h"
+#include "ioprotocol.h"
+#include "offload_pool.h"
+#include "buffer_pool.h"
+#include "cache.h"
+#include "stats.h"
+
+
+
+/* Maximum number of idle keep-alive connections kept open
+ * to a single corelated server
+ */
+#define MAX_IDLE_UPSTREAM 		 16
+
+
+
+/* Seconds the corelated server is given to accept the connection (and take
+ * the request), to send the complete response head and to send more of the
+ * body, fetches past their deadline are failed by a sweep once a second
+ */
+#define CONNECT_TIMEOUT 			5
+#define HEAD_TIMEOUT 			   30
+#define BODY_IDLE_TIMEOUT 		   30
+
+
+
+/* Maximum size of response head accepted from corelated server
+ */
+#define RESPONSE_HEAD_LIMIT 	 8192
+
+
+
+/* Capacity requested for pipes carrying the body to the clients
+ */
+#define PROXY_PIPE_SIZE 		 (256 << 10)
+
+
+
+/* Number of buckets of the table of in-flight fetches
+ */
+#define FETCH_BUCKETS 			 256
+
+
+
+#define HOST_LENGTH_LIMIT 		 256
+#define PORT_LENGTH_LIMIT 		   8
+
+
+
+/* Longest reason phrase and content type passed on to the client
+ */
+#define REASON_LENGTH_LIMIT 	 64
+#define CONTENT_TYPE_LIMIT 		 256
+
+
+
+/* Address resolution states of a corelated server
+ */
+#define UPSTREAM_UNRESOLVED 		0
+#define UPSTREAM_RESOLVING 			1
+#define UPSTREAM_RESOLVED 			2
+
+
+
+/* States of a fetch from corelated server
+ */
+#define FETCH_RESOLVING 			0 	/* waiting for server address */
+#define FETCH_CONNECTING 			1 	/* non-blocking connect() in progress */
+#define FETCH_REQUEST 				2 	/* request is being written */
+#define FETCH_HEAD 					3 	/* waiting for complete response head */
+#define FETCH_BODY 					4 	/* body is being streamed to the clients */
+
+
+
+static const char *http_prefix = "http://";
+
+
+
+typedef struct upstream_t upstream_t;
+typedef struct fetch_t fetch_t;
+typedef struct waiter_t waiter_t;
+
+
+
+/* Corelated server together with its resolved address and
+ * idle keep-alive connections
+ */
+struct upstream_t {
+	char host[HOST_LENGTH_LIMIT];
+	char port[PORT_LENGTH_LIMIT];
+
+	int32_t state;
+	struct sockaddr_storage address;
+	socklen_t address_length;
+
+	int32_t idle[MAX_IDLE_UPSTREAM];
+	int32_t idle_count;
+
+	/* Fetches waiting for the address to be resolved
+	 */
+	fetch_t *resolving;
+
+	upstream_t *next;
+};
+
+
+
+/* Client connection served by a fetch. Body bytes are written into
+ * the pipe the connection splices into its socket
+ */
+struct waiter_t {
+	connection_t *conn;
+	fetch_t *fetch;
+	int32_t pipe_write;
+
+	/* Bytes of fetch buffer already written into the pipe
+	 */
+	size_t buffer_sent;
+
+	waiter_t *next;
+};
+
+
+
+/* Single request sent to corelated server, shared by all the clients
+ * which requested the same resource while it was in flight
+ */
+struct fetch_t {
+	upstream_t *upstream;
+
+	/* Method and address of the resource, identifying coalesced requests
+	 */
+	char *key;
+	bool head;
+	bool joinable;
+
+	char *request;
+	size_t request_length;
+	size_t request_sent;
+
+	int32_t fd;
+	int32_t state;
+	uint32_t events;
+
+	/* Time (in seconds of the monotonic clock) by which the upstream
+	 * has to make progress in the current state
+	 */
+	time_t deadline;
+
+	/* Connection has been taken from the idle ones, a request failing on
+	 * it before any response is retried once on a fresh connection
+	 */
+	bool reused;
+	bool keep_alive;
+
+	char *response_head;
+	size_t response_head_length;
+
+	/* Body bytes which have not been read from the upstream yet
+	 */
+	off_t remaining;
+
+	waiter_t *waiters;
+
+	/* With several waiters the body is read into pooled buffer and written
+	 * into each of their pipes, a single waiter gets it spliced directly
+	 */
+	char *buffer;
+	size_t buffered;
+
+	/* Stale cache entry the request asks the upstream to validate
+	 */
+	cache_entry_t *validated_entry;
+
+	/* Temporary cache file the body is written into (-1 when the response
+	 * is not cached) together with the fields stored with the entry
+	 */
+	int32_t cache_fd;
+	char *cache_path;
+	off_t cache_size;
+	char *content_type;
+	char *etag;
+
+	fetch_t *bucket_next;
+	fetch_t *resolving_next;
+};
+
+
+
+/* Upstream response head fields the proxy cares about
+ */
+struct response_head {
+	int32_t status;
+	const char *reason;
+	size_t reason_length;
+	const char *content_type;
+	size_t content_type_length;
+	off_t content_length;
+	const char *etag;
+	size_t etag_length;
+	bool chunked;
+	bool keep_alive;
+};
+
+
+
+/* Offloaded resolution of corelated server address
+ */
+struct resolve_job {
+	offload_job_t job;
+	upstream_t *upstream;
+	int32_t status;
+	struct sockaddr_storage address;
+	socklen_t address_length;
+};
+
+
+
+static bool proxy_enabled = false;
+
+static int32_t proxy_epoll_fd = -1;
+static void (*wake_connection)(connection_t *) = NULL;
+
+/* Timer driving the sweep over deadlines of the fetches
+ */
+static int32_t sweep_timer_fd = -1;
+
+static upstream_t *upstreams = NULL;
+
+static fetch_t *fetch_buckets[FETCH_BUCKETS];
+
+
+
+/* Fetches indexed by descriptor of their upstream socket
+ */
+static fetch_t **fetch_table = NULL;
+static size_t fetch_table_size = 0;
+
+
+
+static
+void pump_body(fetch_t *);
+
+
+
+void enable_proxy(void) {
+	proxy_enabled = true;
+}
+
+
+
+bool is_proxy_enabled(void) {
+	return proxy_enabled;
+}
+
+
+
+int32_t init_proxy(int32_t epoll_fd, void (*wake)(connection_t *)) {
+	proxy_epoll_fd = epoll_fd;
+	wake_connection = wake;
+
+	memset(fetch_buckets, 0, sizeof(fetch_buckets));
+
+	fetch_table_size = 1024;
+	fetch_table = calloc(fetch_table_size, sizeof(fetch_t *));
+
+	if(fetch_table == NULL) {
+		return -1;
+	}
+
+	sweep_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if(sweep_timer_fd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+
+	struct itimerspec sweep_timer = { { 1, 0 }, { 1, 0 } };
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = sweep_timer_fd;
+
+	if(timerfd_settime(sweep_timer_fd, 0, &sweep_timer, NULL) < 0 ||
+	   epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sweep_timer_fd, &event) < 0) {
+
+		perror("Proxy sweep timer");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+static
+time_t current_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+	return now.tv_sec;
+}
+
+
+
+static
+uint32_t hash_key(const char *key) {
+	uint32_t hash = 2166136261u;
+
+	for(; *key != '\0'; ++key) {
+		hash ^= (unsigned char) *key;
+		hash *= 16777619u;
+	}
+
+	return hash % FETCH_BUCKETS;
+}
+
+
+
+static
+fetch_t *find_joinable(const char *key) {
+	for(fetch_t *fetch = fetch_buckets[hash_key(key)]; fetch != NULL; fetch = fetch->bucket_next) {
+		if(strcmp(fetch->key, key) == 0) {
+			return fetch;
+		}
+	}
+
+	return NULL;
+}
+
+
+
+static
+void add_joinable(fetch_t *fetch) {
+	uint32_t bucket = hash_key(fetch->key);
+
+	fetch->bucket_next = fetch_buckets[bucket];
+	fetch_buckets[bucket] = fetch;
+	fetch->joinable = true;
+}
+
+
+
+static
+void remove_joinable(fetch_t *fetch) {
+	if(!fetch->joinable) {
+		return;
+	}
+
+	fetch_t **link = &fetch_buckets[hash_key(fetch->key)];
+
+	while(*link != fetch) {
+		link = &(*link)->bucket_next;
+	}
+
+	*link = fetch->bucket_next;
+	fetch->joinable = false;
+}
+
+
+
+static
+int32_t register_fetch_socket(fetch_t *fetch) {
+	if((size_t) fetch->fd >= fetch_table_size) {
+		size_t new_size = fetch_table_size;
+
+		while(new_size <= (size_t) fetch->fd) {
+			new_size *= 2;
+		}
+
+		fetch_t **new_table = realloc(fetch_table, new_size * sizeof(fetch_t *));
+		if(new_table == NULL) {
+			return -1;
+		}
+
+		memset(new_table + fetch_table_size, 0, (new_size - fetch_table_size) * sizeof(fetch_t *));
+
+		fetch_table = new_table;
+		fetch_table_size = new_size;
+	}
+
+	fetch_table[fetch->fd] = fetch;
+	return 0;
+}
+
+
+
+/* Changes the set of events the event loop waits for on the upstream socket,
+ * the socket is removed from epoll instance when there are none so that
+ * a hang up of paused upstream does not keep waking the loop
+ */
+static
+int32_t set_fetch_interest(fetch_t *fetch, uint32_t events) {
+	if(fetch->events == events) {
+		return 0;
+	}
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.fd = fetch->fd;
+
+	int32_t operation = (fetch->events == 0) ? EPOLL_CTL_ADD : ((events == 0) ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+
+	if(epoll_ctl(proxy_epoll_fd, operation, fetch->fd, &event) < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	fetch->events = events;
+	return 0;
+}
+
+
+
+static
+void close_fetch_socket(fetch_t *fetch) {
+	if(fetch->fd < 0) {
+		return;
+	}
+
+	fetch_table[fetch->fd] = NULL;
+	close(fetch->fd);
+
+	fetch->fd = -1;
+	fetch->events = 0;
+}
+
+
+
+/* Returns upstream socket of completed fetch to the idle ones, or closes
+ * it if the server does not keep the connection alive
+ */
+static
+void release_fetch_socket(fetch_t *fetch) {
+	upstream_t *upstream = fetch->upstream;
+
+	if(!fetch->keep_alive || upstream->idle_count == MAX_IDLE_UPSTREAM ||
+	   set_fetch_interest(fetch, 0) < 0) {
+
+		close_fetch_socket(fetch);
+		return;
+	}
+
+	fetch_table[fetch->fd] = NULL;
+	upstream->idle[upstream->idle_count++] = fetch->fd;
+	fetch->fd = -1;
+}
+
+
+
+/* Takes idle connection to the upstream which has not been closed by the
+ * server in the meantime. Returns -1 if there is none
+ */
+static
+int32_t take_idle_socket(upstream_t *upstream) {
+	while(upstream->idle_count > 0) {
+		int32_t fd = upstream->idle[--upstream->idle_count];
+		char byte;
+
+		/* Idle connection is expected to have nothing to read, end of
+		 * stream or stray data mean it can not be reused
+		 */
+		if(recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return fd;
+		}
+
+		close(fd);
+	}
+
+	return -1;
+}
+
+
+
+static
+void free_fetch(fetch_t *fetch) {
+	remove_joinable(fetch);
+	close_fetch_socket(fetch);
+
+	if(fetch->validated_entry != NULL) {
+		fetch->validated_entry->validating = false;
+	}
+
+	if(fetch->cache_fd >= 0) {
+		discard_cache_file(fetch->cache_fd, fetch->cache_path);
+	}
+
+	if(fetch->buffer != NULL) {
+		release_copy_buffer(fetch->buffer);
+	}
+
+	free(fetch->key);
+	free(fetch->request);
+	free(fetch->response_head);
+	free(fetch->content_type);
+	free(fetch->etag);
+	free(fetch);
+}
+
+
+
+/* Queues response head made of status part (status line and Server header)
+ * and body part (headers describing the body and the empty line), adding
+ * Date header and Connection header if the client asked for closing the
+ * connection.
+ * Returns -1 if the output buffer is too small
+ */
+static
+int32_t queue_response_head(connection_t *conn, const char *status_part, const char *body_part) {
+	static const char close_header[] = "Connection: close\r\n";
+	size_t date_length;
+	const char *date_header = get_date_header(&date_length);
+
+	struct iovec parts[] = {
+		{ (void *) status_part, strlen(status_part) },
+		{ (void *) date_header, date_length },
+		{ (void *) close_header, conn->close_request ? sizeof(close_header) - 1 : 0 },
+		{ (void *) body_part, strlen(body_part) }
+	};
+
+	if(queue_output_vector(conn->fd, parts, sizeof(parts) / sizeof(parts[0])) < 0) {
+		return -1;
+	}
+
+	STATS_RESPONSE(status_part[9]);
+	return 0;
+}
+
+
+
+/* Queues response served from the cache, the body is sent from the entry
+ * file like any other file. Returns -1 on failure
+ */
+static
+int32_t serve_cached_entry(connection_t *conn, cache_entry_t *entry, bool head) {
+	char body_part[96 + CONTENT_TYPE_LIMIT];
+	int32_t body_fd = -1;
+
+	if(!head) {
+		body_fd = dup(entry->fd);
+
+		if(body_fd < 0) {
+			return -1;
+		}
+	}
+
+	snprintf(body_part, sizeof(body_part), "%s%.*s%sContent-Length: %lld\r\n\r\n",
+			 (entry->content_type != NULL) ? "Content-Type: " : "",
+			 CONTENT_TYPE_LIMIT, (entry->content_type != NULL) ? entry->content_type : "",
+			 (entry->content_type != NULL) ? "\r\n" : "", (long long) entry->size);
+
+	if(queue_response_head(conn, "HTTP/1.1 200 OK\r\nServer: SIK_server\r\n", body_part) < 0) {
+		if(body_fd >= 0) {
+			close(body_fd);
+		}
+
+		return -1;
+	}
+
+	if(body_fd >= 0) {
+		set_response_body(conn->fd, body_fd, entry->size);
+	}
+
+	conn->state = CONNECTION_SENDING;
+	return 0;
+}
+
+
+
+/* Answers the waiter with http 502 and closes its connection afterwards
+ */
+static
+void respond_bad_gateway(waiter_t *waiter) {
+	connection_t *conn = waiter->conn;
+
+	conn->output_length = 0;
+	conn->output_sent = 0;
+	conn->proxy_waiter = NULL;
+	conn->state = CONNECTION_SENDING;
+
+	send_bad_gateway_message(conn->fd);
+	mark_connection_closed(conn->request_data);
+
+	wake_connection(conn);
+}
+
+
+
+/* Ends the fetch on upstream failure. Clients which have not received the
+ * response head yet are answered with http 502, the ones receiving the body
+ * see their pipe closed and drop the connection once it runs dry
+ */
+static
+void fail_fetch(fetch_t *fetch) {
+	while(fetch->waiters != NULL) {
+		waiter_t *waiter = fetch->waiters;
+		fetch->waiters = waiter->next;
+
+		/* Stale entry is still better than an error when the corelated
+		 * server can not be reached to validate it
+		 */
+		if(fetch->state != FETCH_BODY && fetch->validated_entry != NULL &&
+		   serve_cached_entry(waiter->conn, fetch->validated_entry, fetch->head) == 0) {
+
+			waiter->conn->proxy_waiter = NULL;
+			wake_connection(waiter->conn);
+		}
+		else if(fetch->state == FETCH_BODY) {
+			if(waiter->pipe_write >= 0) {
+				close(waiter->pipe_write);
+			}
+
+			waiter->conn->proxy_waiter = NULL;
+			wake_connection(waiter->conn);
+		}
+		else {
+			respond_bad_gateway(waiter);
+		}
+
+		free(waiter);
+	}
+
+	free_fetch(fetch);
+}
+
+
+
+/* Opens connection to the upstream, reusing an idle one if possible
+ */
+static
+void connect_fetch(fetch_t *fetch) {
+	upstream_t *upstream = fetch->upstream;
+
+	fetch->request_sent = 0;
+	fetch->response_head_length = 0;
+
+	fetch->fd = take_idle_socket(upstream);
+	fetch->reused = (fetch->fd >= 0);
+	fetch->state = fetch->reused ? FETCH_REQUEST : FETCH_CONNECTING;
+	fetch->deadline = current_time() + CONNECT_TIMEOUT;
+
+	if(!fetch->reused) {
+		fetch->fd = socket(upstream->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+		if(fetch->fd < 0) {
+			fail_fetch(fetch);
+			return;
+		}
+
+		if(connect(fetch->fd, (struct sockaddr *) &upstream->address, upstream->address_length) < 0 &&
+		   errno != EINPROGRESS) {
+
+			/* Address may be stale, resolve it again for the next request
+			 */
+			upstream->state = UPSTREAM_UNRESOLVED;
+
+			close(fetch->fd);
+			fetch->fd = -1;
+			fail_fetch(fetch);
+			return;
+		}
+	}
+
+	/* Both completion of connect() and the possibility of writing the request
+	 * into reused connection are signalled by the socket becoming writable
+	 */
+	if(register_fetch_socket(fetch) < 0 || set_fetch_interest(fetch, EPOLLOUT) < 0) {
+		fail_fetch(fetch);
+	}
+}
+
+
+
+static
+void run_resolve(offload_job_t *job) {
+	struct resolve_job *resolve = (struct resolve_job *) job;
+	struct addrinfo hints;
+	struct addrinfo *result = NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+
+	resolve->status = -1;
+
+	if(getaddrinfo(resolve->upstream->host, resolve->upstream->port, &hints, &result) != 0) {
+		return;
+	}
+
+	memcpy(&resolve->address, result->ai_addr, result->ai_addrlen);
+	resolve->address_length = result->ai_addrlen;
+	resolve->status = 0;
+
+	freeaddrinfo(result);
+}
+
+
+
+static
+void complete_resolve(offload_job_t *job) {
+	struct resolve_job *resolve = (struct resolve_job *) job;
+	upstream_t *upstream = resolve->upstream;
+
+	if(resolve->status == 0) {
+		upstream->address = resolve->address;
+		upstream->address_length = resolve->address_length;
+		upstream->state = UPSTREAM_RESOLVED;
+	}
+	else {
+		fprintf(stderr, "Resolving corelated server %s failed\n", upstream->host);
+		upstream->state = UPSTREAM_UNRESOLVED;
+	}
+
+	free(resolve);
+
+	fetch_t *fetch = upstream->resolving;
+	upstream->resolving = NULL;
+
+	while(fetch != NULL) {
+		fetch_t *next = fetch->resolving_next;
+
+		if(fetch->waiters == NULL) {
+			free_fetch(fetch);
+		}
+		else if(upstream->state == UPSTREAM_RESOLVED) {
+			connect_fetch(fetch);
+		}
+		else {
+			fail_fetch(fetch);
+		}
+
+		fetch = next;
+	}
+}
+
+
+
+/* Connects the fetch to the upstream once its address is known, the name
+ * is resolved on the offload pool as getaddrinfo() may block
+ */
+static
+void start_fetch(fetch_t *fetch) {
+	upstream_t *upstream = fetch->upstream;
+
+	if(upstream->state == UPSTREAM_RESOLVED) {
+		connect_fetch(fetch);
+		return;
+	}
+
+	if(upstream->state == UPSTREAM_UNRESOLVED) {
+		struct resolve_job *resolve = malloc(sizeof(struct resolve_job));
+
+		if(resolve == NULL) {
+			fail_fetch(fetch);
+			return;
+		}
+
+		resolve->job.run = run_resolve;
+		resolve->job.complete = complete_resolve;
+		resolve->upstream = upstream;
+
+		upstream->state = UPSTREAM_RESOLVING;
+		submit_offload_job(&resolve->job);
+	}
+
+	fetch->state = FETCH_RESOLVING;
+	fetch->resolving_next = upstream->resolving;
+	upstream->resolving = fetch;
+}
+
+
+
+/* Retries request which failed on reused connection (the server may have
+ * closed it just before the request arrived), fails the fetch otherwise
+ */
+static
+void retry_or_fail(fetch_t *fetch) {
+	if(fetch->reused && fetch->response_head_length == 0) {
+		close_fetch_socket(fetch);
+		connect_fetch(fetch);
+		return;
+	}
+
+	fail_fetch(fetch);
+}
+
+
+
+static
+void send_fetch_request(fetch_t *fetch) {
+	while(fetch->request_sent < fetch->request_length) {
+		ssize_t written = send(fetch->fd, fetch->request + fetch->request_sent,
+							   fetch->request_length - fetch->request_sent, MSG_NOSIGNAL);
+
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				set_fetch_interest(fetch, EPOLLOUT);
+				return;
+			}
+
+			retry_or_fail(fetch);
+			return;
+		}
+
+		fetch->request_sent += written;
+	}
+
+	fetch->state = FETCH_HEAD;
+	fetch->deadline = current_time() + HEAD_TIMEOUT;
+
+	if(set_fetch_interest(fetch, EPOLLIN) < 0) {
+		fail_fetch(fetch);
+	}
+}
+
+
+
+/* Returns length of the head terminated with empty line, scanning from the
+ * end of the part checked before, or 0 if it is not complete yet
+ */
+static
+size_t find_head_end(const char *head, size_t checked, size_t length) {
+	size_t i = (checked > 3) ? checked - 3 : 0;
+
+	for(; i + 3 < length; ++i) {
+		if(head[i] == '\r' && head[i + 1] == '\n' && head[i + 2] == '\r' && head[i + 3] == '\n') {
+			return i + 4;
+		}
+	}
+
+	return 0;
+}
+
+
+
+static
+bool is_header(const char *line, size_t line_length, const char *name, const char **value, size_t *value_length) {
+	size_t name_length = strlen(name);
+
+	if(line_length <= name_length || line[name_length] != ':' || strncasecmp(line, name, name_length) != 0) {
+		return false;
+	}
+
+	const char *begin = line + name_length + 1;
+	const char *end = line + line_length;
+
+	while(begin < end && (*begin == ' ' || *begin == '\t')) {
+		begin++;
+	}
+
+	while(end > begin && (end[-1] == ' ' || end[-1] == '\t')) {
+		end--;
+	}
+
+	*value = begin;
+	*value_length = end - begin;
+	return true;
+}
+
+
+
+/* Parses status line and the headers describing the body. Returns -1 if
+ * the head is malformed
+ */
+static
+int32_t parse_response_head(const char *head, size_t length, struct response_head *parsed) {
+	memset(parsed, 0, sizeof(struct response_head));
+	parsed->content_length = -1;
+
+	const char *line_end = memmem(head, length, "\r\n", 2);
+	size_t line_length = line_end - head;
+
+	if(line_length < 12 || strncmp(head, "HTTP/1.", 7) != 0 || head[8] != ' ') {
+		return -1;
+	}
+
+	for(int32_t i = 9; i < 12; ++i) {
+		if(head[i] < '0' || head[i] > '9') {
+			return -1;
+		}
+
+		parsed->status = parsed->status * 10 + (head[i] - '0');
+	}
+
+	parsed->keep_alive = (head[7] == '1');
+	parsed->reason = head + 12;
+	parsed->reason_length = line_length - 12;
+
+	while(parsed->reason_length > 0 && *parsed->reason == ' ') {
+		parsed->reason++;
+		parsed->reason_length--;
+	}
+
+	const char *line = line_end + 2;
+
+	while(true) {
+		line_end = memmem(line, length - (line - head), "\r\n", 2);
+		line_length = line_end - line;
+
+		if(line_length == 0) {
+			break;
+		}
+
+		const char *value;
+		size_t value_length;
+
+		if(is_header(line, line_length, "Content-Length", &value, &value_length)) {
+			off_t content_length = 0;
+
+			if(value_length == 0 || value_length > 18) {
+				return -1;
+			}
+
+			for(size_t i = 0; i < value_length; ++i) {
+				if(value[i] < '0' || value[i] > '9') {
+					return -1;
+				}
+
+				content_length = content_length * 10 + (value[i] - '0');
+			}
+
+			parsed->content_length = content_length;
+		}
+		else if(is_header(line, line_length, "ETag", &value, &value_length)) {
+			parsed->etag = value;
+			parsed->etag_length = value_length;
+		}
+		else if(is_header(line, line_length, "Content-Type", &value, &value_length)) {
+			parsed->content_type = value;
+			parsed->content_type_length = value_length;
+		}
+		else if(is_header(line, line_length, "Transfer-Encoding", &value, &value_length)) {
+			parsed->chunked = (value_length != 8 || strncasecmp(value, "identity", 8) != 0);
+		}
+		else if(is_header(line, line_length, "Connection", &value, &value_length)) {
+			if(value_length == 5 && strncasecmp(value, "close", 5) == 0) {
+				parsed->keep_alive = false;
+			}
+		}
+
+		line = line_end + 2;
+	}
+
+	return 0;
+}
+
+
+
+/* Queues response head for the waiter and sets up the pipe its body is
+ * streamed through. Returns -1 on failure
+ */
+static
+int32_t start_waiter_response(fetch_t *fetch, waiter_t *waiter, const char *status_part, const char *body_part) {
+	connection_t *conn = waiter->conn;
+	int32_t pipe_fds[2] = { -1, -1 };
+
+	if(fetch->remaining > 0) {
+		if(pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+			return -1;
+		}
+
+		/* Larger pipe lets the upstream run ahead of the client, failure
+		 * (limit on pipe sizes) only costs more wake ups
+		 */
+		fcntl(pipe_fds[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+	}
+
+	if(queue_response_head(conn, status_part, body_part) < 0) {
+		if(pipe_fds[0] >= 0) {
+			close(pipe_fds[0]);
+			close(pipe_fds[1]);
+		}
+
+		return -1;
+	}
+
+	if(fetch->remaining > 0) {
+		set_piped_response_body(conn->fd, pipe_fds[0], fetch->remaining);
+		waiter->pipe_write = pipe_fds[1];
+	}
+
+	conn->state = CONNECTION_SENDING;
+	wake_connection(conn);
+
+	return 0;
+}
+
+
+
+/* Serves all the waiters from the cache entry the upstream has
+ * confirmed with 304 (which carries no body)
+ */
+static
+void serve_validated_entry(fetch_t *fetch) {
+	cache_entry_t *entry = fetch->validated_entry;
+
+	refresh_cache_entry(entry);
+
+	while(fetch->waiters != NULL) {
+		waiter_t *waiter = fetch->waiters;
+		fetch->waiters = waiter->next;
+
+		if(serve_cached_entry(waiter->conn, entry, fetch->head) < 0) {
+			respond_bad_gateway(waiter);
+		}
+		else {
+			waiter->conn->proxy_waiter = NULL;
+			wake_connection(waiter->conn);
+		}
+
+		free(waiter);
+	}
+
+	release_fetch_socket(fetch);
+	free_fetch(fetch);
+}
+
+
+
+/* Starts writing the body into temporary cache file, the response is
+ * simply not cached if any step fails
+ */
+static
+void start_cache_file(fetch_t *fetch, struct response_head *parsed) {
+	fetch->cache_fd = open_cache_file(&fetch->cache_path);
+
+	if(fetch->cache_fd < 0) {
+		return;
+	}
+
+	fetch->cache_size = fetch->remaining;
+
+	if(parsed->content_type != NULL && parsed->content_type_length <= CONTENT_TYPE_LIMIT) {
+		fetch->content_type = strndup(parsed->content_type, parsed->content_type_length);
+	}
+
+	if(parsed->etag != NULL) {
+		fetch->etag = strndup(parsed->etag, parsed->etag_length);
+	}
+
+	if((parsed->content_type != NULL && parsed->content_type_length <= CONTENT_TYPE_LIMIT && fetch->content_type == NULL) ||
+	   (parsed->etag != NULL && fetch->etag == NULL)) {
+
+		discard_cache_file(fetch->cache_fd, fetch->cache_path);
+		fetch->cache_fd = -1;
+		fetch->cache_path = NULL;
+	}
+}
+
+
+
+/* Appends part of the body read into fetch buffer to the cache file. The file
+ * is written from the event loop as it only fills the page cache
+ */
+static
+void write_cache_file(fetch_t *fetch, size_t length) {
+	size_t written = 0;
+
+	while(written < length) {
+		ssize_t result = write(fetch->cache_fd, fetch->buffer + written, length - written);
+
+		if(result < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if(result <= 0) {
+			discard_cache_file(fetch->cache_fd, fetch->cache_path);
+			fetch->cache_fd = -1;
+			fetch->cache_path = NULL;
+			return;
+		}
+
+		written += result;
+	}
+}
+
+
+
+/* Passes complete response head to all the waiters and starts streaming
+ * the body, the fetch can not be joined anymore
+ */
+static
+void deliver_response_head(fetch_t *fetch) {
+	remove_joinable(fetch);
+
+	if(fetch->waiters == NULL) {
+		free_fetch(fetch);
+		return;
+	}
+
+	struct response_head parsed;
+
+	if(parse_response_head(fetch->response_head, fetch->response_head_length, &parsed) < 0) {
+		fail_fetch(fetch);
+		return;
+	}
+
+	if(fetch->validated_entry != NULL && parsed.status == 304) {
+		fetch->keep_alive = parsed.keep_alive;
+		serve_validated_entry(fetch);
+		return;
+	}
+
+	/* Resource has changed or is gone on the corelated server
+	 */
+	if(fetch->validated_entry != NULL) {
+		fetch->validated_entry->validating = false;
+		remove_cache_entry(fetch->validated_entry);
+		fetch->validated_entry = NULL;
+	}
+
+	bool has_body = !(parsed.status < 200 || parsed.status == 204 || parsed.status == 304);
+
+	/* Only bodies delimited by Content-Length are streamed, the length has
+	 * to be known up front to answer the coalesced clients
+	 */
+	if(parsed.status < 200 || parsed.chunked || (has_body && !fetch->head && parsed.content_length < 0)) {
+		fail_fetch(fetch);
+		return;
+	}
+
+	fetch->keep_alive = parsed.keep_alive;
+	fetch->remaining = (fetch->head || !has_body) ? 0 : parsed.content_length;
+
+	if(is_cache_enabled() && parsed.status == 200 && !fetch->head && is_cacheable_size(fetch->remaining)) {
+		start_cache_file(fetch, &parsed);
+	}
+
+	char status_part[64 + REASON_LENGTH_LIMIT];
+	char body_part[64 + CONTENT_TYPE_LIMIT];
+	size_t body_part_length = 0;
+
+	snprintf(status_part, sizeof(status_part), "HTTP/1.1 %d %.*s\r\nServer: SIK_server\r\n", (int) parsed.status,
+			 (int) ((parsed.reason_length > REASON_LENGTH_LIMIT) ? REASON_LENGTH_LIMIT : parsed.reason_length), parsed.reason);
+
+	if(parsed.content_type != NULL && parsed.content_type_length <= CONTENT_TYPE_LIMIT) {
+		body_part_length += snprintf(body_part, sizeof(body_part), "Content-Type: %.*s\r\n",
+									 (int) parsed.content_type_length, parsed.content_type);
+	}
+
+	if(has_body && parsed.content_length >= 0) {
+		body_part_length += snprintf(body_part + body_part_length, sizeof(body_part) - body_part_length,
+									 "Content-Length: %lld\r\n", (long long) parsed.content_length);
+	}
+
+	snprintf(body_part + body_part_length, sizeof(body_part) - body_part_length, "\r\n");
+
+	free(fetch->response_head);
+	fetch->response_head = NULL;
+	fetch->state = FETCH_BODY;
+	fetch->deadline = current_time() + BODY_IDLE_TIMEOUT;
+
+	waiter_t **link = &fetch->waiters;
+
+	while(*link != NULL) {
+		waiter_t *waiter = *link;
+
+		if(start_waiter_response(fetch, waiter, status_part, body_part) < 0) {
+			*link = waiter->next;
+			respond_bad_gateway(waiter);
+			free(waiter);
+			continue;
+		}
+
+		link = &waiter->next;
+	}
+
+	pump_body(fetch);
+}
+
+
+
+/* Receives the response head. It is peeked first so that exactly the head
+ * is consumed and the body stays in the socket to be spliced
+ */
+static
+void receive_response_head(fetch_t *fetch) {
+	if(fetch->response_head == NULL) {
+		fetch->response_head = malloc(RESPONSE_HEAD_LIMIT);
+
+		if(fetch->response_head == NULL) {
+			fail_fetch(fetch);
+			return;
+		}
+	}
+
+	while(true) {
+		char *free_part = fetch->response_head + fetch->response_head_length;
+		size_t free_space = RESPONSE_HEAD_LIMIT - fetch->response_head_length;
+
+		if(free_space == 0) {
+			fail_fetch(fetch);
+			return;
+		}
+
+		ssize_t peeked = recv(fetch->fd, free_part, free_space, MSG_PEEK);
+
+		if(peeked < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return;
+			}
+
+			retry_or_fail(fetch);
+			return;
+		}
+
+		if(peeked == 0) {
+			retry_or_fail(fetch);
+			return;
+		}
+
+		size_t head_end = find_head_end(fetch->response_head, fetch->response_head_length,
+										fetch->response_head_length + peeked);
+
+		size_t wanted = (head_end == 0) ? (size_t) peeked : head_end - fetch->response_head_length;
+
+		if(recv(fetch->fd, free_part, wanted, 0) != (ssize_t) wanted) {
+			fail_fetch(fetch);
+			return;
+		}
+
+		fetch->response_head_length += wanted;
+
+		if(head_end != 0) {
+			deliver_response_head(fetch);
+			return;
+		}
+	}
+}
+
+
+
+/* Releases all the waiters once the whole body has been passed
+ * to their pipes and returns the upstream connection to idle ones
+ */
+static
+void finish_body(fetch_t *fetch) {
+	while(fetch->waiters != NULL) {
+		waiter_t *waiter = fetch->waiters;
+		fetch->waiters = waiter->next;
+
+		if(waiter->pipe_write >= 0) {
+			close(waiter->pipe_write);
+		}
+
+		waiter->conn->proxy_waiter = NULL;
+		free(waiter);
+	}
+
+	/* Key of the cache entry is the address, without the method
+	 */
+	if(fetch->cache_fd >= 0) {
+		store_cache_entry(strchr(fetch->key, ' ') + 1, fetch->cache_fd, fetch->cache_path,
+						  fetch->cache_size, fetch->content_type, fetch->etag);
+
+		fetch->cache_fd = -1;
+		fetch->cache_path = NULL;
+	}
+
+	release_fetch_socket(fetch);
+	free_fetch(fetch);
+}
+
+
+
+static
+void drop_waiter(waiter_t *waiter) {
+	if(waiter->pipe_write >= 0) {
+		close(waiter->pipe_write);
+	}
+
+	waiter->conn->proxy_waiter = NULL;
+	wake_connection(waiter->conn);
+	free(waiter);
+}
+
+
+
+/* Writes buffered part of the body into pipes of all the waiters. Returns
+ * true once every waiter has received the whole buffer
+ */
+static
+bool distribute_buffer(fetch_t *fetch) {
+	bool distributed = true;
+	waiter_t **link = &fetch->waiters;
+
+	while(*link != NULL) {
+		waiter_t *waiter = *link;
+		bool failed = false;
+
+		while(waiter->buffer_sent < fetch->buffered) {
+			ssize_t written = write(waiter->pipe_write, fetch->buffer + waiter->buffer_sent,
+									fetch->buffered - waiter->buffer_sent);
+
+			if(written < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				if(errno == EAGAIN || errno == EWOULDBLOCK) {
+					distributed = false;
+				}
+				else {
+					failed = true;
+				}
+
+				break;
+			}
+
+			waiter->buffer_sent += written;
+			wake_connection(waiter->conn);
+		}
+
+		if(failed) {
+			*link = waiter->next;
+			drop_waiter(waiter);
+			continue;
+		}
+
+		link = &waiter->next;
+	}
+
+	if(distributed) {
+		fetch->buffered = 0;
+	}
+
+	return distributed;
+}
+
+
+
+static
+bool has_unread_bytes(int32_t fd) {
+	int32_t unread = 0;
+
+	return (ioctl(fd, FIONREAD, &unread) == 0 && unread > 0);
+}
+
+
+
+/* Moves as much of the body from the upstream to the waiters as their pipes
+ * accept. The upstream is paused while a pipe is full and resumed by
+ * proxy_body_drained()
+ */
+static
+void pump_body(fetch_t *fetch) {
+	while(true) {
+		/* All the clients are gone, rest of the body is not read
+		 * and the connection can not be reused
+		 */
+		if(fetch->waiters == NULL) {
+			free_fetch(fetch);
+			return;
+		}
+
+		if(!distribute_buffer(fetch)) {
+			set_fetch_interest(fetch, 0);
+			return;
+		}
+
+		if(fetch->remaining == 0) {
+			finish_body(fetch);
+			return;
+		}
+
+		/* Body written into the cache goes through the buffer as well
+		 */
+		bool single = (fetch->waiters->next == NULL && fetch->cache_fd < 0);
+		ssize_t moved;
+
+		if(single) {
+			size_t wanted = (fetch->remaining > PROXY_PIPE_SIZE) ? PROXY_PIPE_SIZE : (size_t) fetch->remaining;
+
+			moved = splice(fetch->fd, NULL, fetch->waiters->pipe_write, NULL, wanted,
+						   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		}
+		else {
+			if(fetch->buffer == NULL) {
+				fetch->buffer = take_copy_buffer();
+
+				if(fetch->buffer == NULL) {
+					fail_fetch(fetch);
+					return;
+				}
+			}
+
+			size_t buffer_size = get_copy_buffer_size();
+			size_t wanted = (fetch->remaining > (off_t) buffer_size) ? buffer_size : (size_t) fetch->remaining;
+
+			moved = read(fetch->fd, fetch->buffer, wanted);
+		}
+
+		if(moved < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			/* Either the upstream has nothing to read yet or the pipe is full,
+			 * in which case the upstream is paused until the client drains it
+			 */
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				set_fetch_interest(fetch, has_unread_bytes(fetch->fd) ? 0 : EPOLLIN);
+				return;
+			}
+
+			fail_fetch(fetch);
+			return;
+		}
+
+		/* Upstream closed the connection before sending the whole body
+		 */
+		if(moved == 0) {
+			fail_fetch(fetch);
+			return;
+		}
+
+		fetch->remaining -= moved;
+		fetch->deadline = current_time() + BODY_IDLE_TIMEOUT;
+
+		if(single) {
+			wake_connection(fetch->waiters->conn);
+		}
+		else {
+			fetch->buffered = moved;
+
+			if(fetch->cache_fd >= 0) {
+				write_cache_file(fetch, moved);
+			}
+
+			for(waiter_t *waiter = fetch->waiters; waiter != NULL; waiter = waiter->next) {
+				waiter->buffer_sent = 0;
+			}
+		}
+	}
+}
+
+
+
+/* Fails fetches whose upstream has not made progress by the deadline. Body
+ * of a fetch paused by a full pipe is waited for by the clients, not by the
+ * upstream, its deadline starts over once the fetch resumes
+ */
+static
+void sweep_deadlines(void) {
+	uint64_t expirations;
+
+	if(read(sweep_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+		return;
+	}
+
+	time_t now = current_time();
+
+	for(size_t fd = 0; fd < fetch_table_size; ++fd) {
+		fetch_t *fetch = fetch_table[fd];
+
+		if(fetch == NULL || now < fetch->deadline) {
+			continue;
+		}
+
+		if(fetch->state == FETCH_BODY && fetch->events == 0) {
+			continue;
+		}
+
+		fprintf(stderr, "Corelated server %s timed out\n", fetch->upstream->host);
+		fail_fetch(fetch);
+	}
+}
+
+
+
+bool handle_upstream_event(int32_t fd) {
+	if(fd >= 0 && fd == sweep_timer_fd) {
+		sweep_deadlines();
+		return true;
+	}
+
+	if(fd < 0 || (size_t) fd >= fetch_table_size || fetch_table[fd] == NULL) {
+		return false;
+	}
+
+	fetch_t *fetch = fetch_table[fd];
+
+	if(fetch->state == FETCH_CONNECTING) {
+		int32_t error = 0;
+		socklen_t length = sizeof(error);
+
+		if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+			fprintf(stderr, "Connecting to corelated server %s failed: %s\n", fetch->upstream->host, strerror(error));
+
+			fetch->upstream->state = UPSTREAM_UNRESOLVED;
+			fail_fetch(fetch);
+			return true;
+		}
+
+		fetch->state = FETCH_REQUEST;
+	}
+
+	if(fetch->state == FETCH_REQUEST) {
+		send_fetch_request(fetch);
+	}
+	else if(fetch->state == FETCH_HEAD) {
+		receive_response_head(fetch);
+	}
+	else {
+		pump_body(fetch);
+	}
+
+	return true;
+}
+
+
+
+static
+upstream_t *get_upstream(const char *host, size_t host_length, const char *port, size_t port_length) {
+	for(upstream_t *upstream = upstreams; upstream != NULL; upstream = upstream->next) {
+		if(strlen(upstream->host) == host_length && strncmp(upstream->host, host, host_length) == 0 &&
+		   strlen(upstream->port) == port_length && strncmp(upstream->port, port, port_length) == 0) {
+
+			return upstream;
+		}
+	}
+
+	upstream_t *upstream = calloc(1, sizeof(upstream_t));
+
+	if(upstream == NULL) {
+		return NULL;
+	}
+
+	memcpy(upstream->host, host, host_length);
+	memcpy(upstream->port, port, port_length);
+	upstream->state = UPSTREAM_UNRESOLVED;
+
+	upstream->next = upstreams;
+	upstreams = upstream;
+
+	return upstream;
+}
+
+
+
+/* Creates fetch of resource with passed http://host:port/path address,
+ * conditional one if a stale cache entry is passed
+ */
+static
+fetch_t *new_fetch(char *key, const char *address, bool head, cache_entry_t *validated_entry) {
+	if(strncmp(address, http_prefix, strlen(http_prefix)) != 0) {
+		return NULL;
+	}
+
+	const char *host = address + strlen(http_prefix);
+	const char *path = strchr(host, '/');
+	const char *port = NULL;
+
+	if(path == NULL) {
+		return NULL;
+	}
+
+	/* Host may be an IPv6 address, the port follows the last colon
+	 */
+	for(const char *iter = host; iter < path; ++iter) {
+		if(*iter == ':') {
+			port = iter + 1;
+		}
+	}
+
+	if(port == NULL) {
+		return NULL;
+	}
+
+	size_t host_length = port - 1 - host;
+	size_t port_length = path - port;
+
+	if(host_length == 0 || host_length >= HOST_LENGTH_LIMIT || port_length == 0 || port_length >= PORT_LENGTH_LIMIT) {
+		return NULL;
+	}
+
+	fetch_t *fetch = calloc(1, sizeof(fetch_t));
+
+	if(fetch == NULL) {
+		return NULL;
+	}
+
+	fetch->upstream = get_upstream(host, host_length, port, port_length);
+
+	const char *etag = (validated_entry != NULL) ? validated_entry->etag : NULL;
+	size_t request_size = strlen(path) + host_length + port_length + ((etag != NULL) ? strlen(etag) : 0) + 96;
+	fetch->request = malloc(request_size);
+
+	if(fetch->upstream == NULL || fetch->request == NULL) {
+		free(fetch->request);
+		free(fetch);
+		return NULL;
+	}
+
+	bool bracketed = (memchr(host, ':', host_length) != NULL);
+
+	fetch->request_length = snprintf(fetch->request, request_size, "%s %s HTTP/1.1\r\nHost: %s%.*s%s:%.*s\r\n%s%s%s\r\n",
+									 head ? "HEAD" : "GET", path, bracketed ? "[" : "", (int) host_length, host,
+									 bracketed ? "]" : "", (int) port_length, port, (etag != NULL) ? "If-None-Match: " : "",
+									 (etag != NULL) ? etag : "", (etag != NULL) ? "\r\n" : "");
+
+	fetch->key = key;
+	fetch->head = head;
+	fetch->fd = -1;
+	fetch->cache_fd = -1;
+
+	if(etag != NULL) {
+		fetch->validated_entry = validated_entry;
+		validated_entry->validating = true;
+	}
+
+	return fetch;
+}
+
+
+
+int32_t proxy_request(int32_t client_socket, const char *address, bool head) {
+	connection_t *conn = get_connection(client_socket);
+
+	/* Fresh copy in the cache is served without asking the corelated server,
+	 * stale one is validated with its ETag by the upstream request or
+	 * dropped if it has none
+	 */
+	cache_entry_t *entry = is_cache_enabled() ? find_cache_entry(address) : NULL;
+
+	if(entry != NULL && is_cache_entry_fresh(entry)) {
+		STATS_ADD(cache_hits, 1);
+		return serve_cached_entry(conn, entry, head);
+	}
+
+	if(is_cache_enabled()) {
+		STATS_ADD(cache_misses, 1);
+	}
+
+	if(entry != NULL && entry->etag == NULL) {
+		remove_cache_entry(entry);
+		entry = NULL;
+	}
+	else if(entry != NULL && entry->validating) {
+		entry = NULL;
+	}
+
+	size_t key_size = strlen(address) + 6;
+	char *key = malloc(key_size);
+	waiter_t *waiter = malloc(sizeof(waiter_t));
+
+	if(key == NULL || waiter == NULL) {
+		free(key);
+		free(waiter);
+		return -1;
+	}
+
+	snprintf(key, key_size, "%s %s", head ? "HEAD" : "GET", address);
+
+	/* Same resource is already being fetched and its response has not
+	 * started yet, wait for it instead of sending another request
+	 */
+	fetch_t *fetch = find_joinable(key);
+	bool coalesced = (fetch != NULL);
+
+	if(coalesced) {
+		free(key);
+	}
+	else {
+		fetch = new_fetch(key, address, head, entry);
+
+		if(fetch == NULL) {
+			free(key);
+			free(waiter);
+			return -1;
+		}
+
+		add_joinable(fetch);
+	}
+
+	waiter->conn = conn;
+	waiter->fetch = fetch;
+	waiter->pipe_write = -1;
+	waiter->buffer_sent = 0;
+	waiter->next = fetch->waiters;
+	fetch->waiters = waiter;
+
+	conn->proxy_waiter = waiter;
+	conn->state = CONNECTION_PROXYING;
+
+	if(!coalesced) {
+		start_fetch(fetch);
+	}
+
+	return 0;
+}
+
+
+
+void detach_proxy_waiter(connection_t *conn) {
+	waiter_t *waiter = conn->proxy_waiter;
+	fetch_t *fetch = waiter->fetch;
+
+	waiter_t **link = &fetch->waiters;
+
+	while(*link != waiter) {
+		link = &(*link)->next;
+	}
+
+	*link = waiter->next;
+
+	if(waiter->pipe_write >= 0) {
+		close(waiter->pipe_write);
+	}
+
+	conn->proxy_waiter = NULL;
+	free(waiter);
+
+	/* Remaining waiters may have been held back by the detached one
+	 */
+	if(fetch->state == FETCH_BODY) {
+		pump_body(fetch);
+	}
+}
+
+
+
+void proxy_body_drained(connection_t *conn) {
+	waiter_t *waiter = conn->proxy_waiter;
+
+	if(waiter != NULL && waiter->fetch->state == FETCH_BODY && waiter->fetch->events == 0) {
+		waiter->fetch->deadline = current_time() + BODY_IDLE_TIMEOUT;
+		pump_body(waiter->fetch);
+	}
+}
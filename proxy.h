@@ -0,0 +1,71 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "connection.h"
+
+
+
+/* Enables reverse-proxy mode: resources found in corelated servers
+ * file are fetched from the corelated server and streamed back instead
+ * of redirecting the client with 302
+ */
+void enable_proxy(void);
+
+
+
+/* Checks whether reverse-proxy mode has been enabled
+ */
+bool is_proxy_enabled(void);
+
+
+
+/* Initialises proxy state of the calling worker. Passed function is called
+ * whenever a connection waiting for the upstream (in CONNECTION_PROXYING or
+ * CONNECTION_SENDING state) can make progress - it must only register interest
+ * in the socket becoming writable, not advance the connection itself.
+ * Returns 0 on success and -1 on failure.
+ */
+int32_t init_proxy(int32_t, void (*)(connection_t *));
+
+
+
+/* Starts fetching resource with passed absolute http:// address (with HEAD
+ * method if the last argument is true) for the client connection, which is put
+ * into CONNECTION_PROXYING state. Requests for the same resource which are in
+ * flight and have not received response head yet are coalesced into a single
+ * upstream request. With the cache enabled, fresh cached copy is served right
+ * away (the connection is put into CONNECTION_SENDING state) and stale one is
+ * validated by the upstream. Upstream failures are answered with http 502 by
+ * the proxy itself. Returns 0 on success and -1 on error (http 500 generic
+ * server error should be issued).
+ */
+int32_t proxy_request(int32_t, const char *, bool);
+
+
+
+/* Handles readiness of an upstream socket or of the timer failing fetches
+ * past their deadlines. Returns false if the descriptor belongs to neither.
+ */
+bool handle_upstream_event(int32_t);
+
+
+
+/* Detaches client connection from the fetch it waits for or receives the body
+ * from, called when its body transfer ends or the connection is deleted
+ */
+void detach_proxy_waiter(connection_t *);
+
+
+
+/* Notifies the fetch feeding connection's body pipe that there is
+ * room in the pipe again
+ */
+void proxy_body_drained(connection_t *);
+
+
+
+#endif /* PROXY_H */
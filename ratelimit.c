@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include "ratelimit.h"
+
+
+
+/* Number of consecutive slots a client may be stored in, the least
+ * recently seen client among them is evicted when all are taken
+ */
+#define PROBE_LENGTH 				 8
+
+
+
+/* State of a bucket packed into 64 bits, so that it is updated with a single
+ * compare-and-swap: time of the last refill (microseconds, wrapping), tokens
+ * in 1/256 units and CLOCK reference bit set on every use. State 0 denotes
+ * a bucket not used yet, which is full.
+ */
+#define TIME_BITS 					 40
+#define TIME_MASK 					 ((1ull << TIME_BITS) - 1)
+#define TOKENS_BITS 				 23
+#define TOKENS_MASK 				 ((1ull << TOKENS_BITS) - 1)
+#define REFERENCED 					 (1ull << 63)
+
+#define TOKEN_UNIT 					 256ull
+#define MAX_BURST 					 (TOKENS_MASK / TOKEN_UNIT)
+#define MAX_RATE 					 1000000ll
+
+
+
+/* Bucket idle for this long (microseconds) is full whatever
+ * its state, which keeps the refill computation from overflowing
+ */
+#define REFILL_LIMIT 				 (1ull << 32)
+
+
+
+/* Slot of the table shared by the workers (key 0 denotes free slot), slots
+ * are never freed, only taken over by other clients
+ */
+struct client_bucket {
+	_Atomic uint64_t key;
+	_Atomic uint64_t state;
+};
+
+
+
+static long long rate = 0;
+static long long burst = 0;
+static long long clients = DEFAULT_RATE_LIMIT_CLIENTS;
+
+static uint64_t burst_units = 0;
+
+static struct client_bucket *buckets = NULL;
+static uint64_t slots_mask = 0;
+
+
+
+enum {
+	OPTION_RATE = 0,
+	OPTION_BURST,
+	OPTION_CLIENTS
+};
+
+
+
+static char *const option_names[] = {
+	[OPTION_RATE] = "rate",
+	[OPTION_BURST] = "burst",
+	[OPTION_CLIENTS] = "clients",
+	NULL
+};
+
+
+
+static
+int32_t parse_option_number(const char *value, long long *target) {
+	if(value == NULL || *value == '\0') {
+		return -1;
+	}
+
+	char *end = NULL;
+	errno = 0;
+	long long parsed = strtoll(value, &end, 10);
+
+	if(errno != 0 || *end != '\0' || parsed <= 0) {
+		return -1;
+	}
+
+	*target = parsed;
+	return 0;
+}
+
+
+
+int32_t parse_rate_limit_options(char *options) {
+	char *value = NULL;
+
+	while(*options != '\0') {
+		int32_t status = -1;
+
+		switch(getsubopt(&options, option_names, &value)) {
+			case OPTION_RATE:
+				status = parse_option_number(value, &rate);
+				break;
+			case OPTION_BURST:
+				status = parse_option_number(value, &burst);
+				break;
+			case OPTION_CLIENTS:
+				status = parse_option_number(value, &clients);
+				break;
+			default:
+				fprintf(stderr, "Unknown rate limit option: %s\n", value);
+				return -1;
+		}
+
+		if(status < 0) {
+			fprintf(stderr, "Invalid rate limit option value: %s\n", value == NULL ? "(none)" : value);
+			return -1;
+		}
+	}
+
+	if(rate == 0 || rate > MAX_RATE) {
+		fprintf(stderr, "Rate (rate=<n>) has to be specified, at most %lld\n", MAX_RATE);
+		return -1;
+	}
+
+	if(burst == 0) {
+		burst = (rate < (long long) MAX_BURST) ? rate : (long long) MAX_BURST;
+	}
+
+	if(burst > (long long) MAX_BURST) {
+		fprintf(stderr, "Burst can not exceed %llu\n", MAX_BURST);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+bool is_rate_limit_enabled(void) {
+	return (rate > 0);
+}
+
+
+
+int32_t init_rate_limit(void) {
+	uint64_t slots_count = PROBE_LENGTH;
+
+	while(slots_count < (uint64_t) clients) {
+		slots_count *= 2;
+	}
+
+	/* Anonymous shared mapping is inherited by the workers, zeroed
+	 * slots are free
+	 */
+	void *table = mmap(NULL, slots_count * sizeof(struct client_bucket), PROT_READ | PROT_WRITE,
+					   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if(table == MAP_FAILED) {
+		return -1;
+	}
+
+	buckets = table;
+	slots_mask = slots_count - 1;
+	burst_units = burst * TOKEN_UNIT;
+
+	return 0;
+}
+
+
+
+uint64_t get_client_key(const struct sockaddr *address, socklen_t length) {
+	uint64_t key = 0;
+
+	if(address->sa_family == AF_INET && length >= sizeof(struct sockaddr_in)) {
+		const struct sockaddr_in *ipv4 = (const struct sockaddr_in *) address;
+		key = (1ull << 32) | ntohl(ipv4->sin_addr.s_addr);
+	}
+	else if(address->sa_family == AF_INET6 && length >= sizeof(struct sockaddr_in6)) {
+		const struct sockaddr_in6 *ipv6 = (const struct sockaddr_in6 *) address;
+		const uint8_t *bytes = ipv6->sin6_addr.s6_addr;
+
+		/* Clients of IPv4 listeners bound to IPv6 sockets are limited
+		 * by their IPv4 addresses, others by their /64 networks
+		 */
+		if(IN6_IS_ADDR_V4MAPPED(&ipv6->sin6_addr)) {
+			key = (1ull << 32) | ((uint32_t) bytes[12] << 24) | ((uint32_t) bytes[13] << 16) |
+				  ((uint32_t) bytes[14] << 8) | bytes[15];
+		}
+		else {
+			memcpy(&key, bytes, sizeof(key));
+			key |= (1ull << 63);
+		}
+	}
+
+	return key;
+}
+
+
+
+static
+uint64_t current_time_us(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+
+/* Finds the slot of the client of passed key, taking a free slot or evicting
+ * the least recently seen client among the probed slots (second chance
+ * given to those with the reference bit set) if the client has none. Slot
+ * taken over by another worker at the same time may make the first
+ * requests of both clients share the bucket.
+ */
+static
+struct client_bucket *find_bucket(uint64_t key) {
+	uint64_t start = (key * 0x9e3779b97f4a7c15ull) >> 32;
+
+	for(uint64_t i = 0; i < PROBE_LENGTH; ++i) {
+		struct client_bucket *bucket = &buckets[(start + i) & slots_mask];
+		uint64_t slot_key = atomic_load_explicit(&bucket->key, memory_order_relaxed);
+
+		if(slot_key == key) {
+			return bucket;
+		}
+
+		if(slot_key == 0) {
+			if(atomic_compare_exchange_strong(&bucket->key, &slot_key, key) || slot_key == key) {
+				return bucket;
+			}
+		}
+	}
+
+	for(uint64_t i = 0; i < 2 * PROBE_LENGTH; ++i) {
+		struct client_bucket *bucket = &buckets[(start + i % PROBE_LENGTH) & slots_mask];
+		uint64_t state = atomic_fetch_and_explicit(&bucket->state, ~REFERENCED, memory_order_relaxed);
+
+		if(state & REFERENCED) {
+			continue;
+		}
+
+		uint64_t slot_key = atomic_load_explicit(&bucket->key, memory_order_relaxed);
+
+		if(atomic_compare_exchange_strong(&bucket->key, &slot_key, key)) {
+			atomic_store_explicit(&bucket->state, 0, memory_order_relaxed);
+			return bucket;
+		}
+	}
+
+	/* Every probed client has been seen again meanwhile
+	 */
+	struct client_bucket *bucket = &buckets[start & slots_mask];
+	atomic_store_explicit(&bucket->key, key, memory_order_relaxed);
+	atomic_store_explicit(&bucket->state, 0, memory_order_relaxed);
+
+	return bucket;
+}
+
+
+
+bool take_client_token(uint64_t key) {
+	if(buckets == NULL || key == 0) {
+		return true;
+	}
+
+	struct client_bucket *bucket = find_bucket(key);
+	uint64_t now = current_time_us() & TIME_MASK;
+	uint64_t state = atomic_load_explicit(&bucket->state, memory_order_relaxed);
+
+	while(true) {
+		uint64_t tokens = burst_units;
+		uint64_t refill_time = now;
+
+		if(state != 0) {
+			uint64_t last_refill = state & TIME_MASK;
+			uint64_t elapsed = (now - last_refill) & TIME_MASK;
+
+			/* Another worker has refilled the bucket at a time later than the
+			 * one sampled here, the difference wraps around to a huge value
+			 */
+			if(elapsed > TIME_MASK / 2) {
+				elapsed = 0;
+			}
+
+			tokens = (state >> TIME_BITS) & TOKENS_MASK;
+
+			/* Refill time advances only by the time the added tokens account for,
+			 * so that frequent requests do not lose fractions of tokens
+			 */
+			uint64_t added = (elapsed >= REFILL_LIMIT) ? burst_units : elapsed * rate * TOKEN_UNIT / 1000000;
+
+			if(tokens + added >= burst_units) {
+				tokens = burst_units;
+			}
+			else {
+				tokens += added;
+				refill_time = (last_refill + added * 1000000 / (rate * TOKEN_UNIT)) & TIME_MASK;
+			}
+		}
+
+		bool allowed = (tokens >= TOKEN_UNIT);
+
+		if(allowed) {
+			tokens -= TOKEN_UNIT;
+		}
+
+		uint64_t new_state = REFERENCED | (tokens << TIME_BITS) | refill_time;
+
+		if(atomic_compare_exchange_weak_explicit(&bucket->state, &state, new_state,
+												 memory_order_relaxed, memory_order_relaxed)) {
+			return allowed;
+		}
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+
+
+/* Default number of client slots of the table of token buckets
+ */
+#define DEFAULT_RATE_LIMIT_CLIENTS 		 (1 << 16)
+
+
+
+/* Parses comma separated list of rate limiting options (as passed to the -r
+ * server option), which also enables the limiting. Recognised options:
+ * rate=<n>         requests (and new connections) per second allowed to
+ *                  a single client address (required)
+ * burst=<n>        number of requests a client may make at once after being
+ *                  idle, the rate by default
+ * clients=<n>      number of clients tracked at once, least recently seen
+ *                  ones are forgotten when the table is full
+ * Returns 0 on success and -1 on unknown option or invalid value.
+ */
+int32_t parse_rate_limit_options(char *);
+
+
+
+/* Checks whether the rate limiting has been configured
+ */
+bool is_rate_limit_enabled(void);
+
+
+
+/* Creates table of token buckets shared by all the workers, has to be
+ * called before they are started. Returns 0 on success and -1 on error.
+ */
+int32_t init_rate_limit(void);
+
+
+
+/* Returns key identifying client of passed address of passed length (IPv4
+ * address or /64 prefix of IPv6 one), 0 for clients which are not limited
+ * (e.g. connected through Unix domain sockets)
+ */
+uint64_t get_client_key(const struct sockaddr *, socklen_t);
+
+
+
+/* Takes a token from the bucket of client of passed key. Returns false if
+ * the client is over the limit, true otherwise (and if rate limiting is
+ * disabled). Lock-free, safe to be called by all the workers at once.
+ */
+bool take_client_token(uint64_t);
+
+
+
+#endif /* RATELIMIT_H */
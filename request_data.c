@@ -1,14 +1,58 @@
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include <limits.h>
 #include "request_data.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 
 
 #define ARRAY_SIZE 8220
 
 
 
+/* Classes of bytes of request target
+ */
+#define TARGET_ILLEGAL 				0 	/* not allowed in request target */
+#define TARGET_PATH 				1 	/* allowed in served paths */
+#define TARGET_OTHER 				2 	/* allowed in target, not in served paths */
+#define TARGET_PERCENT 				3
+#define TARGET_QUERY 				4
+#define TARGET_END 					5
+
+
+
+static const uint8_t target_classes[256] = {
+	['A' ... 'Z'] = TARGET_PATH,
+	['a' ... 'z'] = TARGET_PATH,
+	['0' ... '9'] = TARGET_PATH,
+	['-'] = TARGET_PATH,
+	['.'] = TARGET_PATH,
+	['/'] = TARGET_PATH,
+	['_'] = TARGET_OTHER,
+	['~'] = TARGET_OTHER,
+	['!'] = TARGET_OTHER,
+	['$'] = TARGET_OTHER,
+	['&'] = TARGET_OTHER,
+	['\''] = TARGET_OTHER,
+	['('] = TARGET_OTHER,
+	[')'] = TARGET_OTHER,
+	['*'] = TARGET_OTHER,
+	['+'] = TARGET_OTHER,
+	[','] = TARGET_OTHER,
+	[';'] = TARGET_OTHER,
+	['='] = TARGET_OTHER,
+	[':'] = TARGET_OTHER,
+	['@'] = TARGET_OTHER,
+	['%'] = TARGET_PERCENT,
+	['?'] = TARGET_QUERY,
+	[' '] = TARGET_END
+};
+
+
+
 struct request_data_t {
 	size_t work_dir_path_len;
 	size_t resource_path_array_size;
@@ -17,6 +61,26 @@ struct request_data_t {
 	int32_t connection_status;
 	int32_t error_status;
 	
+	off_t body_length;
+	bool chunked_body;
+	bool expect_continue;
+	
+	/* Decoded path consists of characters allowed in served paths only
+	 */
+	bool path_valid;
+	
+	/* Length of query string stored after the path (and its terminating
+	 * NUL), -1 if the target has none
+	 */
+	ssize_t query_length;
+	
+	/* Header index, known_headers stores index of each known
+	 * header in headers (-1 if it is absent)
+	 */
+	header_span_t headers[MAX_REQUEST_HEADERS];
+	int32_t headers_count;
+	int8_t known_headers[MAX_KNOWN_HEADERS];
+	
 	char *array_ptr;
 };
 
@@ -28,8 +92,11 @@ request_data_t *new_request_data(const char *work_path) {
 	if(req_data_ptr == NULL)
 		return NULL;
 	
+	/* Any catalogue (resolved path) can later replace the one
+	 * passed here as the prefix of the path
+	 */
 	size_t work_path_len = strlen(work_path);
-	size_t allocation_size = work_path_len + ARRAY_SIZE;
+	size_t allocation_size = ((work_path_len > PATH_MAX) ? work_path_len : PATH_MAX) + ARRAY_SIZE;
 	
 	char *array_alloc_ptr = malloc(allocation_size * sizeof(char));
 	
@@ -55,30 +122,212 @@ request_data_t *new_request_data(const char *work_path) {
 	req_data_ptr->method_type = -1;
 	req_data_ptr->connection_status = 1;
 	req_data_ptr->error_status = 0;
+	req_data_ptr->body_length = -1;
+	req_data_ptr->chunked_body = false;
+	req_data_ptr->expect_continue = false;
+	req_data_ptr->path_valid = false;
+	req_data_ptr->query_length = -1;
+	req_data_ptr->headers_count = 0;
+	memset(req_data_ptr->known_headers, -1, sizeof(req_data_ptr->known_headers));
 	
 	return req_data_ptr;
 }
 
 
+
+static
+int32_t hex_digit_value(char c) {
+	if(c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	
+	if(c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	
+	if(c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	
+	return -1;
+}
+
+
+
+#ifdef __SSE2__
+/* Returns number of leading bytes among the 16 at passed pointer which
+ * are allowed in served paths. Letters are matched after setting bit 0x20,
+ * '-', '.', '/' and digits form range 0x2d - 0x39. Bytes >= 0x80 are
+ * negative for the signed comparisons, so they never match.
+ */
+static
+size_t count_path_bytes(const char *bytes) {
+	__m128i chunk = _mm_loadu_si128((const __m128i *) bytes);
+	__m128i lowercase = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+	
+	__m128i letters = _mm_and_si128(_mm_cmpgt_epi8(lowercase, _mm_set1_epi8('a' - 1)),
+									_mm_cmplt_epi8(lowercase, _mm_set1_epi8('z' + 1)));
+	__m128i others = _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('-' - 1)),
+								   _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1)));
+	
+	uint32_t mask = _mm_movemask_epi8(_mm_or_si128(letters, others));
 	
-void append_char(request_data_t *req_data, char c) {
-	req_data->array_ptr[req_data->work_dir_path_len+req_data->resource_path_length] = c;
-	(req_data->resource_path_length)++;
+	return __builtin_ctz(~mask);
 }
+#endif
 
 
 
-void clear_request_data(request_data_t *req_data) {
-	size_t iteration_start = req_data->work_dir_path_len;
-	size_t iteration_end = req_data->resource_path_array_size;
+ssize_t decode_request_target(request_data_t *req_data, const char *target, size_t length) {
+	char *path = req_data->array_ptr + req_data->work_dir_path_len;
+	size_t path_length = 0;
+	size_t position = 0;
+	bool path_valid = true;
+	
+	/* Space ending the target is the only byte allowed past the limit
+	 */
+	if(length > MAX_TARGET_LENGTH + 1) {
+		length = MAX_TARGET_LENGTH + 1;
+	}
 	
-	for(size_t i = iteration_start; i < iteration_end; ++i) {
-		(req_data->array_ptr)[i] = '\0';
+	while(position < length) {
+#ifdef __SSE2__
+		/* Runs of plain path bytes are copied 16 at a time
+		 */
+		if(length - position >= 16) {
+			size_t count = count_path_bytes(target + position);
+			
+			memcpy(path + path_length, target + position, count);
+			path_length += count;
+			position += count;
+			
+			if(count == 16) {
+				continue;
+			}
+		}
+#endif
+		unsigned char c = target[position];
+		uint8_t target_class = target_classes[c];
+		
+		if(target_class == TARGET_END || target_class == TARGET_QUERY) {
+			break;
+		}
+		
+		if(target_class == TARGET_ILLEGAL) {
+			return -1;
+		}
+		
+		if(target_class == TARGET_PERCENT) {
+			if(length - position < 3) {
+				return -1;
+			}
+			
+			int32_t high = hex_digit_value(target[position + 1]);
+			int32_t low = hex_digit_value(target[position + 2]);
+			
+			if(high < 0 || low < 0) {
+				return -1;
+			}
+			
+			c = high * 16 + low;
+			position += 2;
+			
+			/* Encoded slash is not a segment separator, it can not
+			 * name a file in the catalogue
+			 */
+			if(target_classes[c] != TARGET_PATH || c == '/') {
+				path_valid = false;
+			}
+		}
+		else if(target_class == TARGET_OTHER) {
+			path_valid = false;
+		}
+		
+		path[path_length++] = c;
+		position++;
+	}
+	
+	path[path_length] = '\0';
+	req_data->resource_path_length = path_length;
+	req_data->path_valid = path_valid;
+	
+	if(position < length && target[position] == '?') {
+		char *query = path + path_length + 1;
+		size_t query_start = ++position;
+		
+		while(position < length && target_classes[(unsigned char) target[position]] != TARGET_END) {
+			if(target_classes[(unsigned char) target[position]] == TARGET_ILLEGAL) {
+				return -1;
+			}
+			
+			position++;
+		}
+		
+		memcpy(query, target + query_start, position - query_start);
+		query[position - query_start] = '\0';
+		req_data->query_length = position - query_start;
+	}
+	
+	/* Target not ended within the limit
+	 */
+	if(position == length) {
+		return -1;
+	}
+	
+	return position;
+}
+
+
+
+const char *get_query_string(request_data_t *req_data, size_t *length) {
+	if(req_data->query_length < 0) {
+		return NULL;
+	}
+	
+	*length = req_data->query_length;
+	return req_data->array_ptr + req_data->work_dir_path_len + req_data->resource_path_length + 1;
+}
+
+
+
+void set_path_prefix(request_data_t *req_data, const char *prefix, size_t length) {
+	size_t old_length = req_data->work_dir_path_len;
+	
+	if(length + ARRAY_SIZE > req_data->resource_path_array_size) {
+		return;
+	}
+	
+	/* Path and query string (both NUL-terminated) follow the prefix
+	 */
+	size_t moved_length = req_data->resource_path_length + 1;
+	
+	if(req_data->query_length >= 0) {
+		moved_length += req_data->query_length + 1;
 	}
 	
+	memmove(req_data->array_ptr + length, req_data->array_ptr + old_length, moved_length);
+	memcpy(req_data->array_ptr, prefix, length);
+	
+	req_data->work_dir_path_len = length;
+}
+
+
+
+void clear_request_data(request_data_t *req_data) {
+	/* Path is NUL-terminated once it has been decoded
+	 */
+	req_data->array_ptr[req_data->work_dir_path_len] = '\0';
+	
 	req_data->resource_path_length = 0;
+	req_data->path_valid = false;
+	req_data->query_length = -1;
 	req_data->error_status = 0;
 	req_data->method_type = -1;
+	req_data->body_length = -1;
+	req_data->chunked_body = false;
+	req_data->expect_continue = false;
+	req_data->headers_count = 0;
+	memset(req_data->known_headers, -1, sizeof(req_data->known_headers));
 }
 
 
@@ -126,42 +375,93 @@ int32_t get_method_type(request_data_t *req_data) {
 
 
 
-char get_path_char_at(request_data_t *req_data, size_t pos) {
-	if(pos >= req_data->resource_path_length) {
-		return 0;
-	}
-	
-	return req_data->array_ptr[req_data->work_dir_path_len + pos];
+void set_body_length(request_data_t *req_data, off_t length) {
+	req_data->body_length = length;
 }
 
 
 
-static
-bool check_path_character(char c) {
-	if(isalnum(c) 								||
-	   (c == DOT) 								||
-	   (c == SLASH) 							||
-	   (c == HYPHEN)) {
-	   
-		return true;
-	}
-	
-	return false;
+off_t get_body_length(request_data_t *req_data) {
+	return req_data->body_length;
 }
-	
 
 
-bool check_request_path_characters(request_data_t *req_data) {
-	size_t iteration_start = req_data->work_dir_path_len;
-	size_t iteration_limit = iteration_start + req_data->resource_path_length;
 
-	for(size_t i = iteration_start; i < iteration_limit; ++i) {
-		if(!check_path_character(req_data->array_ptr[i])) {
-			return false;
+void set_chunked_body(request_data_t *req_data) {
+	req_data->chunked_body = true;
+}
+
+
+
+bool is_chunked_body(request_data_t *req_data) {
+	return req_data->chunked_body;
+}
+
+
+
+void set_expect_continue(request_data_t *req_data) {
+	req_data->expect_continue = true;
+}
+
+
+
+bool is_continue_expected(request_data_t *req_data) {
+	return req_data->expect_continue;
+}
+
+
+
+int32_t add_request_header(request_data_t *req_data, const header_span_t *header) {
+	if(req_data->headers_count == MAX_REQUEST_HEADERS) {
+		return -1;
+	}
+
+	if(header->known >= 0) {
+		if(req_data->known_headers[header->known] >= 0) {
+			return -1;
 		}
+
+		req_data->known_headers[header->known] = req_data->headers_count;
+	}
+
+	req_data->headers[req_data->headers_count++] = *header;
+	return 0;
+}
+
+
+
+const header_span_t *find_request_header(request_data_t *req_data, int32_t known) {
+	int32_t index = req_data->known_headers[known];
+
+	return (index < 0) ? NULL : &req_data->headers[index];
+}
+
+
+
+int32_t get_request_headers_count(request_data_t *req_data) {
+	return req_data->headers_count;
+}
+
+
+
+const header_span_t *get_request_header(request_data_t *req_data, int32_t index) {
+	return &req_data->headers[index];
+}
+
+
+
+char get_path_char_at(request_data_t *req_data, size_t pos) {
+	if(pos >= req_data->resource_path_length) {
+		return 0;
 	}
 	
-	return true;	
+	return req_data->array_ptr[req_data->work_dir_path_len + pos];
+}
+
+
+
+bool check_request_path_characters(request_data_t *req_data) {
+	return req_data->path_valid;
 }
 
 
@@ -5,12 +5,22 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 
 
-#define 	HYPHEN 				45
-#define 	DOT 				46
-#define 	SLASH 				47
+/* Maximum length of request target (path and query string)
+ * as sent by the client
+ */
+#define MAX_TARGET_LENGTH 			 (1 << 13)
+
+
+
+/* Maximum number of header lines of a request and of headers
+ * recognised by the server (see ioprotocol.h)
+ */
+#define MAX_REQUEST_HEADERS 		 64
+#define MAX_KNOWN_HEADERS 			 16
 
 
 
@@ -18,6 +28,24 @@ typedef struct request_data_t request_data_t;
 
 
 
+/* Header line of the request head. Name and value are spans of connection
+ * input (value without surrounding whitespace), known is index of the header
+ * among the headers recognised by the server or -1 for other ones.
+ */
+typedef struct header_span_t header_span_t;
+
+
+
+struct header_span_t {
+	const char *name;
+	size_t name_length;
+	const char *value;
+	size_t value_length;
+	int32_t known;
+};
+
+
+
 /* Creates new request_data_t object; initializes
  * the char array within it with DEFAULT_SIZE
  * returns pointer to created structure on success
@@ -30,10 +58,28 @@ request_data_t *new_request_data();
 
 
 
-/* Appends character to the resource path
- * stored in request data.
+/* Validates request target (at the beginning of passed bytes of passed length,
+ * ended with a space) in a single pass, percent-decoding its path into request
+ * data and storing the query string (without '?') separately. Returns length of
+ * the target or -1 if it contains bytes not allowed in request target, invalid
+ * percent-encoding or is too long (http 400).
+ */
+ssize_t decode_request_target(request_data_t *, const char *, size_t);
+
+
+
+/* Returns query string of the request target (not decoded) and stores
+ * its length under passed pointer, NULL if the target has none
  */
-void append_char(request_data_t *, char);
+const char *get_query_string(request_data_t *, size_t *);
+
+
+
+/* Replaces the path prefix (the catalogue) preceding the decoded path
+ * with passed one of passed length, moving the path and query string.
+ * The prefix has to be shorter than PATH_MAX.
+ */
+void set_path_prefix(request_data_t *, const char *, size_t);
 
 
 
@@ -85,6 +131,52 @@ int32_t get_method_type(request_data_t *);
 
 
 
+/* Sets and gets length of request body announced with Content-Length
+ * header, -1 if there is none
+ */
+void set_body_length(request_data_t *, off_t);
+off_t get_body_length(request_data_t *);
+
+
+
+/* Marks request body as sent with chunked transfer coding and checks
+ * whether it is
+ */
+void set_chunked_body(request_data_t *);
+bool is_chunked_body(request_data_t *);
+
+
+
+/* Marks that the client waits for interim 100 Continue response before
+ * sending request body (Expect: 100-continue) and checks whether it does
+ */
+void set_expect_continue(request_data_t *);
+bool is_continue_expected(request_data_t *);
+
+
+
+/* Adds header line to the header index of the request. Returns -1 if the
+ * index is full or a known header is repeated.
+ */
+int32_t add_request_header(request_data_t *, const header_span_t *);
+
+
+
+/* Returns known header with passed index, NULL if the request
+ * does not have it
+ */
+const header_span_t *find_request_header(request_data_t *, int32_t);
+
+
+
+/* Returns number of header lines of the request and the header line
+ * with passed index (in the order they were received)
+ */
+int32_t get_request_headers_count(request_data_t *);
+const header_span_t *get_request_header(request_data_t *, int32_t);
+
+
+
 /* Returns the char that is stored at passed index
  * in request data's target resource path. If the index
  * is too big ( >= path length), function returns ASCII NUL.
@@ -95,10 +187,8 @@ char get_path_char_at(request_data_t *, size_t);
 
 
 
-/* Iterates through the path of request resource and
- * checks for each character if it is in set [A-Za-z0-9./].
- * Returns true if each character fulfills the condition
- * and false in other cases.
+/* Checks whether every character of the decoded path of request resource
+ * is in set [A-Za-z0-9./-] (determined while the target is decoded)
  */
 bool check_request_path_characters(request_data_t *);
 
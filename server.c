@@ -1,16 +1,45 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <stdint.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
 #include "request_data.h"
 #include "ioprotocol.h"
+#include "connection.h"
+#include "offload_pool.h"
+#include "buffer_pool.h"
+#include "tls.h"
+#include "listener.h"
+#include "tcp_tuning.h"
+#include "affinity.h"
+#include "proxy.h"
+#include "cache.h"
+#include "path_filter.h"
+#include "timing.h"
+#include "probes.h"
+#include "upload.h"
+#include "warmup.h"
+#include "archive.h"
+#include "vhost.h"
+#include "ratelimit.h"
+#include "limiter.h"
+#include "http2.h"
+#include "stats.h"
 
 
 
@@ -21,25 +50,56 @@
 
 
 
+/* Catalogue and corelated servers file passed as program arguments,
+ * used for requests of unknown hosts
+ */
 static char *catalogue_path;
 static char *corelated_servers_file;
 
-static FILE *servers_file_pointer;
+
+
+/* Maximum number of events handled in a single
+ * iteration of the event loop
+ */
+#define EVENTS_BATCH 			 64
 
 
 
-/* Default server port
+/* Maximum number of worker processes
  */
-static int32_t SERVER_PORT = 8080;
+#define MAX_WORKERS 			 64
 
 
 
-static
-void setup_server_address(struct sockaddr_in *server_addr) {
-	server_addr->sin_family = AF_INET;
-	server_addr->sin_addr.s_addr = htonl(INADDR_ANY);
-	server_addr->sin_port = htons(SERVER_PORT);
-}
+/* Worker terminating within this many seconds of its start is restarted
+ * after a delay doubling with every such termination in a row, after this
+ * many of them the server gives up
+ */
+#define MIN_WORKER_LIFETIME 	 10
+#define MAX_QUICK_RESTARTS 		 5
+
+
+
+/* Listening socket together with the index of the worker that
+ * owns it (-1 for sockets shared by all the workers) and whether
+ * connections accepted on it are TLS ones
+ */
+struct listener_entry {
+	int32_t fd;
+	int32_t owner;
+	bool tls;
+};
+
+
+
+static struct listener_entry listeners[MAX_LISTENERS * MAX_WORKERS];
+static int32_t listeners_count = 0;
+
+
+
+/* Number of worker processes serving the connections
+ */
+static int32_t workers_count = 1;
 
 
 
@@ -53,152 +113,184 @@ void check_socket_value(int32_t socket_desc) {
 
 
 
-/* Checks whether string passed as str_1 argument is a
- * prefix of string passed as str_2 argument
+/* Epoll instance of the worker's event loop
+ */
+static int32_t epoll_fd = -1;
+
+
+
+/* Eventfd signalled by the offload pool when jobs complete
+ */
+static int32_t completion_fd = -1;
+
+
+
+/* Number of offload pool threads started by every worker
+ */
+static int32_t offload_threads_count = 4;
+
+
+
+/* PUT requests store their bodies in the catalogue only when
+ * enabled with -u, otherwise they are answered with 501
+ */
+static bool uploads_enabled = false;
+
+
+
+/* Inotify descriptor of the path filter (-1 if it is disabled) and signalfd
+ * receiving SIGHUP, which makes the worker rebuild the filter, and SIGUSR1,
+ * which makes it print request phase latency histograms
+ */
+static int32_t path_filter_fd = -1;
+static int32_t signal_fd = -1;
+
+
+
+/* Timer expiring at the start of every second of wall clock time, when the
+ * Date header of responses gets refreshed
+ */
+static int32_t date_timer_fd = -1;
+
+
+
+/* Set by SIGHUP and SIGUSR1 in the supervising process, which passes
+ * them to the workers
  */
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t histograms_requested = 0;
+
+
+
 static
-bool is_prefix_of(const char *str_1, const char *str_2) {
-	if(strlen(str_1) > strlen(str_2)) {
-		return false;
+void advance_connection(connection_t *);
+
+
+
+/* Changes the set of events the event loop waits for on the connection
+ * socket. Connection waiting for the offload pool or the proxy (no events)
+ * is removed from the epoll instance, as EPOLLERR and EPOLLHUP of a client
+ * resetting meanwhile would be reported on every iteration otherwise, it is
+ * added back once woken up
+ */
+static
+void update_interest(connection_t *conn, uint32_t events) {
+	if(conn->events == events) {
+		return;
 	}
-	for(size_t i = 0; i < strlen(str_1); ++i) {
-		if(str_1[i] != str_2[i]) {
-			return false;
-		}
+	
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.fd = conn->fd;
+	
+	int32_t operation = (conn->events == 0) ? EPOLL_CTL_ADD : ((events == 0) ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+	
+	if(epoll_ctl(epoll_fd, operation, conn->fd, &event) < 0) {
+		perror("epoll_ctl");
 	}
 	
-	return true;
+	conn->events = events;
 }
 
 
 
+/* Lets connection waiting for the corelated server continue once the proxy
+ * has queued its response or refilled its body pipe, and HTTP/2 connection
+ * continue once the file of its stream has been resolved
+ */
 static
-void process_request(int32_t client_socket, 
-					 ssize_t *bytes_in_buffer,
-					 request_data_t *req_data) {
+void wake_connection(connection_t *conn) {
+	update_interest(conn, EPOLLOUT);
+}
 
-	ssize_t available_bytes = *bytes_in_buffer;
-	bool close_request = false;
 
 
-	parse_request_line(client_socket, &available_bytes, req_data);
-	parse_headers(client_socket, &available_bytes, &close_request, req_data);	
-	parse_further(client_socket, &available_bytes, req_data);
+/* Answers request for a file the catalogue does not contain, which may
+ * have been moved to one of corelated servers
+ */
+static
+void answer_missing_file(connection_t *conn, bool close_request) {
+	int32_t client_socket = conn->fd;
+	request_data_t *req_data = conn->request_data;
 	
+	int32_t ret_val = check_corelated(client_socket, req_data, get_redirect_index(conn->vhost));
+	TIMING_PHASE(&conn->timing, PHASE_CORELATED);
+	USDT_PROBE2(corelated, client_socket, ret_val);
 	
-	if(get_error_status(req_data) == ERROR_BAD_REQUEST) {
-		send_bad_request_message(client_socket);
-		return;
+	/* Available cases of ret_val:
+	 * ret_val ==  0 ----> message with address of moved resource has been sent to client
+	 * in check_corelated() function (we can neglect this case as we have nothing to do with it)
+	 * ret_val == -1 ----> memory error occured while searching the corelated servers file,
+	 * so generic server error message should be issued
+	 * ret_val == -2 ----> searching the corelated servers file was successful, but the
+	 * requested resource path has not been found, 404 not found message should be issued
+	 * ret_val ==  1 ----> resource is being fetched from the corelated server by the proxy,
+	 * which queues the response itself
+	 */
+	if(ret_val == -2) {
+		send_not_found_message(client_socket, close_request);
 	}
-	else if(get_error_status(req_data) == ERROR_INTERNAL) {
+	else if(ret_val == -1) {
+		set_error_status(req_data, ERROR_INTERNAL);
 		send_generic_error_message(client_socket);
-		return;
 	}
+}
+
+
+
+/* Completes request for a file once the blocking operations have been
+ * performed by the offload pool (offload_job_t complete callback)
+ */
+static
+void finish_file_request(offload_job_t *job) {
+	file_job_t *file_job = (file_job_t *) job;
+	connection_t *conn = get_connection(file_job->client_socket);
 	
+	int32_t client_socket = conn->fd;
+	request_data_t *req_data = conn->request_data;
+	vhost_t *vhost = conn->vhost;
+	bool close_request = conn->close_request;
 	
-	/* Either set to 0 by encountering an error (which was treated with appropriate
-	 * error message) or by detecting that the client disconnected from the socket
-	 */
-	if(is_connection_closed(req_data)) {
-		return;
-	}
+	int32_t status = file_job->status;
+	int32_t fd = file_job->fd;
+	off_t size = file_job->size;
 	
-	if(get_method_type(req_data) == UNKNOWN_METHOD_TYPE) {	
-		ssize_t write_val = send_unknown_method_message(client_socket);
-		if(write_val < 0) {
-			mark_connection_closed(req_data);
-			return;
-		}
+	free(file_job);
+	
+	TIMING_PHASE(&conn->timing, PHASE_RESOLVE);
+	
+	conn->state = CONNECTION_SENDING;
+	
+	if(status == -3) {
+		answer_missing_file(conn, close_request);
+	}
+	else if(status == -2) {
+		send_not_found_message(client_socket, close_request);
+	}
+	else if(status == -1) {
+		set_error_status(req_data, ERROR_INTERNAL);
+		send_generic_error_message(client_socket);
 	}
-	else if(check_request_path_characters(req_data)) {
-		/* Clear errno before executing library realpath() function so as to
-		 * grab data about possible ENOMEM
+	else {
+		int32_t ret_val = handle_file(client_socket, close_request, fd, size, (get_method_type(req_data) == HEAD_METHOD));
+		
+		/* Hit snapshot and warm-up cover the default catalogue only
 		 */
-		errno = 0;
-		char *req_resource_realpath = realpath(get_path_string_pointer(req_data), NULL);
+		if(ret_val == 0 && vhost == get_default_vhost()) {
+			record_file_hit(get_original_path_string_pointer(req_data), get_path_length(req_data));
+		}
 		
-		/* Memory error occured while resolving full path of the resource requested
-		 * by server client
+		/* Headers could not be queued, replace whatever part of them
+		 * has been queued with generic server error message
 		 */
-		if(req_resource_realpath == NULL && errno == ENOMEM) {
-			free(req_resource_realpath);
+		if(ret_val == -1) {
+			conn->output_length = 0;
 			set_error_status(req_data, ERROR_INTERNAL);
 			send_generic_error_message(client_socket);
-			return;
-		}
-		else if(req_resource_realpath == NULL) {
-
-			int32_t ret_val = check_corelated(client_socket, req_data, servers_file_pointer);
-			
-			/* Available cases of ret_val:
-			 * ret_val ==  0 ----> message with address of moved resource has been sent to client
-			 * in check_corelated() function (we can neglect this case as we have nothing to do with it)
-			 * ret_val == -1 ----> memory error occured while searching the corelated servers file,
-			 * so generic server error message should be issued
-			 * ret_val == -2 ----> searching the corelated servers file was successful, but the
-			 * requested resource path has not been found, 404 not found message should be issued
-			 */
-			if(ret_val == -2) {
-				ssize_t write_val = send_not_found_message(client_socket, close_request);
-				if(write_val < 0) {
-					mark_connection_closed(req_data);
-					return;
-				}
-			}
-			else if(ret_val == -1) {
-				free(req_resource_realpath);
-				set_error_status(req_data, ERROR_INTERNAL);
-				send_generic_error_message(client_socket);
-				return;
-			}
-		}
-		else {
-			/* Path has been successfully resolved, the only thing that we have to check now is
-			 * whether its string representation is a prefix of the server resources directory path\
-			 */
-			
-			bool path_prefix_check = is_prefix_of(catalogue_path, req_resource_realpath);
-			
-			if(!path_prefix_check) {
-				ssize_t write_val = send_not_found_message(client_socket, close_request);
-				if(write_val < 0) {
-					mark_connection_closed(req_data);
-					return;
-				}
-			}
-			else {
-
-				int32_t ret_val = handle_file(client_socket, close_request, req_resource_realpath, (get_method_type(req_data) == HEAD_METHOD));
-					
-				/* Negative ret_val (exactly: -1) indicates that a file stream error occured while
-				 * reading from requested file, issue a generic server error message on such event
-				 */
-				if(ret_val == -1) {
-					free(req_resource_realpath);
-					set_error_status(req_data, ERROR_INTERNAL);
-					send_generic_error_message(client_socket);
-					return;
-				}
-				else if(ret_val == -2) {
-					ssize_t write_val = send_not_found_message(client_socket, close_request);
-					if(write_val < 0) {
-						mark_connection_closed(req_data);
-						return;
-					}
-				}
-			}
 		}
-		
-		/* Deallocate the memory allocated by realpath() function
-		 */
-		free(req_resource_realpath);
-	}
-	else {
-		send_not_found_message(client_socket, close_request);
 	}
 	
-	
-	
 	/* Client requested to close the connection (no errors occured)
 	 */
 	if(close_request) {
@@ -206,179 +298,1373 @@ void process_request(int32_t client_socket,
 		mark_connection_closed(req_data);
 	}
 	
+	advance_connection(conn);
+}
+
+
+
+/* Completes opening of the file the body of PUT request is stored into
+ * (offload_job_t complete callback)
+ */
+static
+void finish_upload_open(offload_job_t *job) {
+	upload_t *upload = (upload_t *) job;
+	connection_t *conn = get_connection(upload->client_socket);
 	
+	int32_t client_socket = conn->fd;
+	request_data_t *req_data = conn->request_data;
 	
-	/* Update the number of bytes that are available in server buffer
+	/* Body which is not going to be read can not be told apart from the next
+	 * request, the connection is closed after the error response
 	 */
-	*bytes_in_buffer = available_bytes;
+	if(upload->status < 0) {
+		conn->upload = NULL;
+		
+		if(upload->status == -2) {
+			send_not_found_message(client_socket, true);
+			mark_connection_closed(req_data);
+		}
+		else {
+			set_error_status(req_data, ERROR_INTERNAL);
+			send_generic_error_message(client_socket);
+		}
+		
+		delete_upload(upload);
+		conn->state = CONNECTION_SENDING;
+		advance_connection(conn);
+		return;
+	}
+	
+	if(is_continue_expected(req_data)) {
+		send_continue_message(client_socket);
+	}
+	
+	conn->state = CONNECTION_RECEIVING;
+	advance_connection(conn);
 }
 
 
 
-/* Function for serving connection with client via TCP socket
+/* Completes storing the body of PUT request once the file has been
+ * renamed over the target (offload_job_t complete callback)
  */
 static
-void serve_client(int32_t client_socket) {	
-	/* Number of bytes that remaing to be parsed in server buffer
-	 */
-	ssize_t remaining_bytes = 0;
+void finish_upload_commit(offload_job_t *job) {
+	upload_t *upload = (upload_t *) job;
+	connection_t *conn = get_connection(upload->client_socket);
 	
-	/* Create request data object for client
-	 */
-	request_data_t *request_data = new_request_data(catalogue_path);
+	int32_t client_socket = conn->fd;
+	request_data_t *req_data = conn->request_data;
+	bool close_request = conn->close_request;
 	
-	if(request_data == NULL) {
-		send_generic_error_message(client_socket);
+	if(upload->status == 0) {
+		send_upload_message(client_socket, upload->replaced, close_request);
 	}
 	else {
-		while(!is_connection_closed(request_data)) {
-			
-			process_request(client_socket, &remaining_bytes, request_data);
-			clear_request_data(request_data);
-		}
+		set_error_status(req_data, ERROR_INTERNAL);
+		send_generic_error_message(client_socket);
 	}
 	
-	/* Deallocate the client request data buffer
-	 */
-	delete_request_data(request_data);
-	
+	conn->upload = NULL;
+	delete_upload(upload);
 	
-	/* Close the client socket
-	 */
-	if(close(client_socket) == -1) {
-		perror("close");
+	if(close_request) {
+		printf("Closing connection on request\n");
+		mark_connection_closed(req_data);
 	}
+	
+	conn->state = CONNECTION_SENDING;
+	advance_connection(conn);
 }
 
 
 
-
-/* Main function of the server, responsible for creating server socket and accepting messages
- * from clients that are connecting to the server
+/* Offloads creation of the file the body of PUT request is stored into,
+ * the body is received once it has been created
  */
-int main(int argc, char *argv[]) {
-	/* Check if either too few or too many arguments have been provided
-	 * to server exeuction command
-	 */
-	if(argc < 3 || argc > 4) {
-		fprintf(stderr, "Usage: %s <catalogue> <corelated-servers-file> <optional port>\n", argv[0]);
-		exit(EXIT_FAILURE);
-	}
+static
+void start_upload(connection_t *conn, bool close_request) {
+	int32_t client_socket = conn->fd;
+	request_data_t *req_data = conn->request_data;
 	
+	if(!check_request_path_characters(req_data)) {
+		send_not_found_message(client_socket, true);
+		mark_connection_closed(req_data);
+		return;
+	}
 	
-	/* Save character strings denoting respectively the catalogue path
-	 * and name of corelated servers file
-	 */
-	corelated_servers_file = argv[2];
+	vhost_t *vhost = conn->vhost;
 	
-	catalogue_path = realpath(argv[1], NULL);
+	upload_t *upload = new_upload(client_socket, get_path_string_pointer(req_data), vhost->catalogue_path,
+								  get_body_length(req_data), is_chunked_body(req_data));
 	
-	if(catalogue_path == NULL) {
-		perror("Error in resolving catalogue path");
-		exit(EXIT_FAILURE);
+	if(upload == NULL) {
+		set_error_status(req_data, ERROR_INTERNAL);
+		send_generic_error_message(client_socket);
+		return;
 	}
 	
+	upload->job.run = open_upload_file;
+	upload->job.complete = finish_upload_open;
 	
-	servers_file_pointer = fopen(corelated_servers_file, "r");
+	conn->upload = upload;
+	conn->close_request = close_request;
+	conn->state = CONNECTION_WAITING_FILE;
 	
+	submit_offload_job(&upload->job);
+}
+
+
+
+/* Moves the body of PUT request from the connection into the file and
+ * offloads committing the file once the whole body has been received.
+ * Returns false if the connection has been deleted
+ */
+static
+bool receive_request_body(connection_t *conn) {
+	upload_t *upload = conn->upload;
 	
-	if(servers_file_pointer == NULL) {
-		perror("Opening corelated servers file");
-		exit(EXIT_FAILURE);
+	/* Interim 100 Continue response has to reach the client before it sends
+	 * the body, it is not held back until the final response
+	 */
+	if(conn->output_length > 0) {
+		int32_t flush_status = flush_output(conn);
+		
+		if(flush_status < 0) {
+			delete_connection(conn);
+			return false;
+		}
+		
+		if(flush_status == 0) {
+			update_interest(conn, EPOLLOUT);
+			return true;
+		}
+		
+		uncork_response(conn->fd);
 	}
 	
-	struct sigaction act;
-	memset(&act, 0, sizeof(act));
-	act.sa_handler = SIG_IGN;
-	act.sa_flags = SA_RESTART;
+	int32_t receive_status = receive_upload_body(conn, upload);
 	
-	if(sigaction(SIGPIPE, &act, NULL) != 0) {
-		perror("sigaction");
-		exit(EXIT_FAILURE);
+	if(receive_status == 0) {
+		update_interest(conn, EPOLLIN);
+		return true;
+	}
+	
+	if(receive_status == -1) {
+		delete_connection(conn);
+		return false;
 	}
+	
+	if(receive_status == -2) {
+		conn->upload = NULL;
+		delete_upload(upload);
 		
-	/* Override default server port value with the one
-	 * provided as program argument
-	 */
-	if(argc == 4) {
-		SERVER_PORT = atoi(argv[3]);
+		set_error_status(conn->request_data, ERROR_BAD_REQUEST);
+		send_bad_request_message(conn->fd);
+		conn->state = CONNECTION_SENDING;
+		return true;
 	}
 	
+	upload->job.run = commit_upload_file;
+	upload->job.complete = finish_upload_commit;
 	
-	/* Address structures for server and client
-	 */
-	struct sockaddr_in server_address;
-	struct sockaddr_in client_address;
+	conn->state = CONNECTION_WAITING_FILE;
+	submit_offload_job(&upload->job);
 	
-	socklen_t client_addr_length;
+	return true;
+}
 
 
-	/* Initialise server address
-	 */
-	setup_server_address(&server_address);
+
+/* Parses complete request head stored in connection input and either queues
+ * the response or offloads opening of the requested file
+ */
+static
+void process_request(connection_t *conn) {
+	int32_t client_socket = conn->fd;
+	request_data_t *req_data = conn->request_data;
 	
+	ssize_t available_bytes = conn->input_length;
+	bool close_request = false;
+
+
+	TIMING_START(&conn->timing);
 	
-	int32_t server_socket;
-	int32_t message_socket;
+	parse_request_line(conn->input, &available_bytes, req_data);
+	TIMING_PHASE(&conn->timing, PHASE_REQUEST_LINE);
 	
+	ssize_t headers_length = parse_headers(conn->input, available_bytes, &close_request, req_data);
+	available_bytes -= headers_length;
 	
-	/* Initialise server socket
-	 */
-	server_socket = socket(PF_INET, SOCK_STREAM, 0);
-	check_socket_value(server_socket);
+	parse_further(conn->input + headers_length, &available_bytes, req_data);
+	TIMING_PHASE(&conn->timing, PHASE_HEADERS);
 	
-
-	/* Bind obtained socket descriptor to server address
-	 */
-	if(bind(server_socket, (struct sockaddr *) &server_address, sizeof(server_address)) < 0) {
-		perror("bind");
-		exit(EXIT_FAILURE);
-	}
-
-
-	/* Begin listening on the socket for incoming connections
-	 * of clients
-	 */
-	if(listen(server_socket, SERVER_QUEUE_LENGTH) < 0) {
-		perror("listen");
-		exit(EXIT_FAILURE);
-	}
-
-
-	while(1) {	
-		printf("Waiting for client...\n");
-		client_addr_length = sizeof(client_address);
-
-		/* Get the descriptor of socket used for communication with incoming client
-		 */
-		message_socket = accept(server_socket, (struct sockaddr *) &client_address, &client_addr_length);
-		
-		/* Check the value of socket for possible errors that may have occured
-		 */
-		check_socket_value(message_socket);
-		
-		/* Serve connection with accepted server client
-		 */
-		serve_client(message_socket);
-	}
+	USDT_PROBE3(request_parsed, client_socket, get_method_type(req_data), get_path_length(req_data));
+	STATS_ADD(requests, 1);
 	
 	
-	/* Deallocate the memory which was allocated by 
-	 * execution of realpath() function
+	/* Host selects the site, whose catalogue replaces the one the path
+	 * has been decoded under (that of the previous request)
 	 */
-	free(catalogue_path);
+	const header_span_t *host = find_request_header(req_data, HOST_HEADER);
+	vhost_t *vhost = (host == NULL) ? get_default_vhost() : find_vhost(host->value, host->value_length);
+	archive_t *archive;
+	
+	if(vhost != conn->vhost) {
+		set_path_prefix(req_data, vhost->catalogue_path, vhost->catalogue_length);
+		conn->vhost = vhost;
+	}
 	
+	/* Plaintext request asking to switch to HTTP/2, its settings are
+	 * decoded from the header before the head is consumed
+	 */
+	http2_upgrade_t upgrade;
+	bool upgrade_requested = (conn->tls == NULL && get_error_status(req_data) == 0 &&
+							  parse_http2_upgrade(req_data, &upgrade));
 	
-	/* Close the corelated servers file
+	/* Header lines stay at the beginning of connection input, followed by the
+	 * beginning of the next pipelined request. Spans of the header index point
+	 * into them, so they have to be used before the head is consumed here.
 	 */
-	fclose(servers_file_pointer);
+	conn->input_length = headers_length + available_bytes;
+	consume_input(conn, headers_length);
+	
 	
+	if(get_error_status(req_data) == ERROR_BAD_REQUEST) {
+		send_bad_request_message(client_socket);
+		return;
+	}
+	else if(get_error_status(req_data) == ERROR_INTERNAL) {
+		send_generic_error_message(client_socket);
+		return;
+	}
 	
-	/* Close the server socket
+	/* Request continues as the first stream of HTTP/2 session, which
+	 * answers it (limits are applied to it there)
 	 */
-	if(close(server_socket) == -1) {
-		perror("Closing server socket");
-		exit(EXIT_FAILURE);
+	if(upgrade_requested && upgrade_to_http2(conn, &upgrade)) {
+		uncork_response(client_socket);
+		return;
+	}
+	
+	if(!take_client_token(conn->client_key)) {
+		/* Body of the request (if any) is not read
+		 */
+		send_too_many_requests_message(client_socket);
+		close_request = true;
+	}
+	else if(conn->shed || !admit_request(&conn->admitted_at)) {
+		send_service_unavailable_message(client_socket);
+		close_request = true;
+	}
+	else if(get_method_type(req_data) == UNKNOWN_METHOD_TYPE) {	
+		send_unknown_method_message(client_socket);
+	}
+	else if(get_method_type(req_data) == PUT_METHOD && (!uploads_enabled || vhost->archive != NULL)) {
+		/* Body of the request is not read, packed catalogues
+		 * are read-only
+		 */
+		send_unknown_method_message(client_socket);
+		close_request = true;
+	}
+	else if(get_method_type(req_data) == PUT_METHOD) {
+		start_upload(conn, close_request);
+		return;
+	}
+	else if(check_request_path_characters(req_data) && (archive = get_archive(vhost)) != NULL) {
+		/* Index of packed catalogue is in memory, the request is answered
+		 * without the offload pool
+		 */
+		archived_file_t file;
+		bool found = find_archived_file(archive, get_original_path_string_pointer(req_data),
+										get_path_length(req_data), &file);
+		
+		TIMING_PHASE(&conn->timing, PHASE_RESOLVE);
+		
+		if(!found) {
+			answer_missing_file(conn, close_request);
+		}
+		else if(handle_archived_file(client_socket, close_request, &file, (get_method_type(req_data) == HEAD_METHOD)) < 0) {
+			/* Replace whatever part of the headers has been queued
+			 * with generic server error message
+			 */
+			conn->output_length = 0;
+			set_error_status(req_data, ERROR_INTERNAL);
+			send_generic_error_message(client_socket);
+		}
+	}
+	else if(check_request_path_characters(req_data) && (vhost != get_default_vhost() ||
+			!is_path_absent(get_original_path_string_pointer(req_data), get_path_length(req_data)))) {
+		file_job_t *file_job = malloc(sizeof(file_job_t));
+		
+		if(file_job == NULL) {
+			set_error_status(req_data, ERROR_INTERNAL);
+			send_generic_error_message(client_socket);
+			return;
+		}
+		
+		/* Path resolution, stat() and open() may block on slow file systems, they
+		 * are performed on the offload pool and the connection waits for completion
+		 */
+		file_job->job.run = resolve_requested_file;
+		file_job->job.complete = finish_file_request;
+		file_job->client_socket = client_socket;
+		file_job->head = (get_method_type(req_data) == HEAD_METHOD);
+		file_job->path = get_path_string_pointer(req_data);
+		file_job->catalogue_path = vhost->catalogue_path;
+		
+		conn->close_request = close_request;
+		conn->state = CONNECTION_WAITING_FILE;
+		
+		submit_offload_job(&file_job->job);
+		return;
+	}
+	else {
+		send_not_found_message(client_socket, close_request);
+	}
+	
+	
+	
+	/* Client requested to close the connection (no errors occured)
+	 */
+	if(close_request) {
+		printf("Closing connection on request\n");
+		mark_connection_closed(req_data);
+	}
+}
+
+
+
+/* Drives the connection through its states for as long as it can make
+ * progress without waiting, then registers interest in the event it waits for
+ */
+static
+void advance_connection(connection_t *conn) {
+	start_send_quantum(conn);
+	
+	while(true) {
+		if(conn->state == CONNECTION_HTTP2) {
+			uint32_t events = 0;
+			int32_t http2_status = advance_http2(conn, &events);
+			
+			if(http2_status < 0) {
+				delete_connection(conn);
+				return;
+			}
+			
+			if(http2_status == 2) {
+				yield_connection(conn);
+				return;
+			}
+			
+			update_interest(conn, events);
+			return;
+		}
+		
+		if(conn->state == CONNECTION_WAITING_FILE || conn->state == CONNECTION_PROXYING) {
+			update_interest(conn, 0);
+			return;
+		}
+		
+		if(conn->state == CONNECTION_RECEIVING) {
+			if(!receive_request_body(conn) || conn->state == CONNECTION_RECEIVING) {
+				return;
+			}
+			
+			continue;
+		}
+		
+		if(conn->state == CONNECTION_SENDING) {
+			int32_t flush_status = flush_output(conn);
+			
+			/* Body pipe has run dry, the proxy wakes the connection
+			 * up once it has been refilled
+			 */
+			if(flush_status == -2) {
+				update_interest(conn, 0);
+				return;
+			}
+			
+			if(flush_status < 0) {
+				delete_connection(conn);
+				return;
+			}
+			
+			/* Quantum has been used up, other connections get their turn
+			 * before this one continues
+			 */
+			if(flush_status == 2) {
+				yield_connection(conn);
+				return;
+			}
+			
+			if(flush_status == 0) {
+				update_interest(conn, EPOLLOUT);
+				return;
+			}
+			
+			uncork_response(conn->fd);
+			
+			TIMING_FINISH(&conn->timing, get_original_path_string_pointer(conn->request_data),
+						  get_path_length(conn->request_data));
+			
+			/* Either set by encountering an error (which was treated with appropriate
+			 * error message) or by client request to close the connection
+			 */
+			if(is_connection_closed(conn->request_data)) {
+				delete_connection(conn);
+				return;
+			}
+			
+			clear_request_data(conn->request_data);
+			conn->state = CONNECTION_READING;
+		}
+		
+		if(!has_complete_request(conn)) {
+			if(conn->peer_closed) {
+				delete_connection(conn);
+				return;
+			}
+			
+			/* Request head does not fit into the input buffer
+			 */
+			if(conn->input_length == INPUT_BUFFER_SIZE) {
+				cork_response(conn->fd);
+				set_error_status(conn->request_data, ERROR_BAD_REQUEST);
+				send_bad_request_message(conn->fd);
+				conn->state = CONNECTION_SENDING;
+				continue;
+			}
+			
+			/* Records decrypted by the TLS layer do not make the socket
+			 * readable again
+			 */
+			if(has_pending_input(conn)) {
+				fill_input(conn);
+				continue;
+			}
+			
+			update_interest(conn, EPOLLIN);
+			return;
+		}
+		
+		/* Client with prior knowledge of HTTP/2 support starts with the
+		 * connection preface, the session takes the connection over
+		 */
+		if(is_http2_preface(conn)) {
+			if(start_http2(conn) < 0) {
+				delete_connection(conn);
+				return;
+			}
+			
+			continue;
+		}
+		
+		/* Hold partial frames of the response in the kernel until
+		 * the whole response has been written
+		 */
+		cork_response(conn->fd);
+		
+		conn->state = CONNECTION_SENDING;
+		process_request(conn);
+	}
+}
+
+
+
+static
+void handle_readable(connection_t *conn) {
+	ssize_t read_bytes;
+	
+	while((read_bytes = fill_input(conn)) > 0);
+	
+	if(read_bytes == -1) {
+		delete_connection(conn);
+		return;
+	}
+	
+	/* Client shut down its side of the connection, requests which have
+	 * already been received are still answered
+	 */
+	if(read_bytes == 0) {
+		conn->peer_closed = true;
+	}
+	
+	advance_connection(conn);
+}
+
+
+
+static
+void continue_handshake(connection_t *conn) {
+	bool wants_write = false;
+	int32_t handshake_status = tls_handshake(conn->tls, &wants_write);
+	
+	if(handshake_status < 0) {
+		delete_connection(conn);
+		return;
+	}
+	
+	if(handshake_status == 0) {
+		update_interest(conn, wants_write ? EPOLLOUT : EPOLLIN);
+		return;
+	}
+	
+	conn->state = CONNECTION_READING;
+	handle_readable(conn);
+}
+
+
+
+/* Returns listener entry of the listening socket, NULL if the descriptor
+ * is not a listening socket
+ */
+static
+struct listener_entry *find_listener(int32_t server_socket) {
+	for(int32_t i = 0; i < listeners_count; ++i) {
+		if(listeners[i].fd == server_socket) {
+			return &listeners[i];
+		}
+	}
+	
+	return NULL;
+}
+
+
+
+static
+void accept_connections(int32_t server_socket, bool tls) {
+	/* Address structure for client (large enough for every
+	 * supported address family)
+	 */
+	struct sockaddr_storage client_address;
+	socklen_t client_addr_length;
+	
+	while(true) {
+		client_addr_length = sizeof(client_address);
+
+		/* Get the descriptor of socket used for communication with incoming client
+		 */
+		int32_t message_socket = accept4(server_socket, (struct sockaddr *) &client_address,
+										 &client_addr_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		
+		/* No more pending connections (or they have been taken by another worker sharing
+		 * the socket), or connection reset by the client before being accepted
+		 */
+		if(message_socket < 0 && 
+		   (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR)) {
+			return;
+		}
+		
+		/* Out of descriptors or memory, retry on the next readiness
+		 * notification instead of terminating the worker
+		 */
+		if(message_socket < 0 && 
+		   (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)) {
+			perror("accept");
+			return;
+		}
+		
+		/* Check the value of socket for possible errors that may have occured
+		 */
+		check_socket_value(message_socket);
+		
+		USDT_PROBE2(accept, message_socket, tls);
+		
+		/* Connections of clients over the rate limit are dropped
+		 * before any state is allocated for them
+		 */
+		uint64_t client_key = get_client_key((struct sockaddr *) &client_address, client_addr_length);
+		
+		if(!take_client_token(client_key)) {
+			close(message_socket);
+			continue;
+		}
+		
+		tune_connection(message_socket);
+		
+		/* Create connection object for client
+		 */
+		connection_t *conn = new_connection(message_socket, catalogue_path);
+		
+		if(conn == NULL) {
+			close(message_socket);
+			continue;
+		}
+		
+		conn->vhost = get_default_vhost();
+		conn->client_key = client_key;
+		
+		/* Worker at its concurrency limit fails new connections fast
+		 * instead of letting their requests queue up, the request is
+		 * read first so that the client gets the answer
+		 */
+		conn->shed = is_overloaded();
+		
+		if(tls) {
+			conn->tls = new_tls_session(message_socket);
+			
+			if(conn->tls == NULL) {
+				delete_connection(conn);
+				continue;
+			}
+			
+			conn->state = CONNECTION_HANDSHAKE;
+		}
+		
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.fd = message_socket;
+		
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, message_socket, &event) < 0) {
+			perror("epoll_ctl");
+			delete_connection(conn);
+			continue;
+		}
+		
+		conn->events = EPOLLIN;
+	}
+}
+
+
+
+/* Event loop of a single worker. Worker with non-negative index is pinned to
+ * its CPU before any of its memory is touched, and polls only the listening
+ * sockets it owns together with the shared ones
+ */
+static
+void run_worker(int32_t worker_index) {
+	int32_t cpu = -1;
+	
+	if(worker_index >= 0) {
+		cpu = get_worker_cpu(worker_index);
+		
+		if(cpu < 0 || pin_to_cpu(cpu) < 0) {
+			perror("Pinning worker");
+			cpu = -1;
+		}
+	}
+	
+	/* The only worker (index -1) counts into the first block
+	 */
+	select_worker_stats((worker_index >= 0) ? worker_index : 0);
+	
+	/* Signals are blocked before the offload threads are started so that they
+	 * are only ever received through the signalfd
+	 */
+	sigset_t worker_signals;
+	sigemptyset(&worker_signals);
+	sigaddset(&worker_signals, SIGHUP);
+	sigaddset(&worker_signals, SIGUSR1);
+	sigaddset(&worker_signals, SIGTERM);
+	sigaddset(&worker_signals, SIGINT);
+	
+	if(sigprocmask(SIG_BLOCK, &worker_signals, NULL) < 0) {
+		perror("sigprocmask");
+		exit(EXIT_FAILURE);
+	}
+	
+	signal_fd = signalfd(-1, &worker_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if(signal_fd < 0) {
+		perror("signalfd");
+		exit(EXIT_FAILURE);
+	}
+	
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd < 0) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+	
+	completion_fd = start_offload_pool(offload_threads_count);
+	if(completion_fd < 0) {
+		fprintf(stderr, "Starting offload pool failed\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = completion_fd;
+	
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, completion_fd, &event) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+	
+	if(is_proxy_enabled() && init_proxy(epoll_fd, wake_connection) < 0) {
+		fprintf(stderr, "Initialising proxy failed\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	init_http2(wake_connection);
+	
+	if(is_cache_enabled() && init_cache(worker_index, workers_count) < 0) {
+		exit(EXIT_FAILURE);
+	}
+	
+	event.events = EPOLLIN;
+	event.data.fd = signal_fd;
+	
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+	
+	/* Date header is formatted once per second instead of once per response
+	 */
+	refresh_date_header();
+	
+	date_timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(date_timer_fd < 0) {
+		perror("timerfd_create");
+		exit(EXIT_FAILURE);
+	}
+	
+	struct itimerspec date_timer = { { 1, 0 }, { time(NULL) + 1, 0 } };
+	
+	if(timerfd_settime(date_timer_fd, TFD_TIMER_ABSTIME, &date_timer, NULL) < 0) {
+		perror("timerfd_settime");
+		exit(EXIT_FAILURE);
+	}
+	
+	event.data.fd = date_timer_fd;
+	
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, date_timer_fd, &event) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+	
+	/* Without the filter every path is looked up in the catalogue, packed
+	 * catalogue is looked up in its in-memory index instead
+	 */
+	if(get_default_vhost()->archive == NULL) {
+		path_filter_fd = init_path_filter(catalogue_path, corelated_servers_file);
+	}
+	
+	if(path_filter_fd >= 0) {
+		event.data.fd = path_filter_fd;
+		
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, path_filter_fd, &event) < 0) {
+			perror("epoll_ctl");
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	for(int32_t i = 0; i < listeners_count; ++i) {
+		if(listeners[i].owner >= 0 && listeners[i].owner != worker_index) {
+			close(listeners[i].fd);
+			continue;
+		}
+		
+		if(listeners[i].owner >= 0 && cpu >= 0) {
+			steer_incoming_cpu(listeners[i].fd, cpu);
+		}
+		
+		event.events = EPOLLIN;
+		event.data.fd = listeners[i].fd;
+		
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listeners[i].fd, &event) < 0) {
+			perror("epoll_ctl");
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	
+	struct epoll_event events[EVENTS_BATCH];
+	
+	while(1) {	
+		/* Yielded connections can continue without waiting for events
+		 */
+		int32_t timeout = (count_yielded_connections() > 0) ? 0 : -1;
+		int32_t ready = epoll_wait(epoll_fd, events, EVENTS_BATCH, timeout);
+		
+		if(ready < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			
+			perror("epoll_wait");
+			exit(EXIT_FAILURE);
+		}
+		
+		for(int32_t i = 0; i < ready; ++i) {
+			int32_t fd = events[i].data.fd;
+			
+			if(fd == completion_fd) {
+				complete_offload_jobs();
+				continue;
+			}
+			
+			if(fd == path_filter_fd) {
+				handle_path_filter_events();
+				continue;
+			}
+			
+			if(fd == date_timer_fd) {
+				uint64_t expirations;
+				
+				if(read(date_timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+					refresh_date_header();
+				}
+				
+				continue;
+			}
+			
+			if(fd == signal_fd) {
+				struct signalfd_siginfo info;
+				
+				while(read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+					if(info.ssi_signo == SIGHUP) {
+						rebuild_path_filter();
+					}
+					else if(info.ssi_signo == SIGUSR1) {
+						print_timing_histograms();
+					}
+					else {
+						/* Terminating worker leaves hit counts for
+						 * the warm-up of the next start
+						 */
+						save_hit_snapshot(worker_index);
+						exit(EXIT_SUCCESS);
+					}
+				}
+				
+				continue;
+			}
+			
+			connection_t *conn = get_connection(fd);
+			
+			if(conn == NULL) {
+				struct listener_entry *listener = NULL;
+				
+				/* Connection deleted earlier in the batch (by completion of its
+				 * offloaded job or another connection's turn) leaves a stale event
+				 * behind, its descriptor is not a listening socket
+				 */
+				if(!handle_upstream_event(fd) && (listener = find_listener(fd)) != NULL) {
+					accept_connections(fd, listener->tls);
+				}
+			}
+			else if(conn->yielded) {
+				/* Continues in its turn
+				 */
+				continue;
+			}
+			else if(conn->state == CONNECTION_HANDSHAKE) {
+				continue_handshake(conn);
+			}
+			else if(conn->state == CONNECTION_SENDING || conn->state == CONNECTION_RECEIVING ||
+					conn->state == CONNECTION_HTTP2) {
+				advance_connection(conn);
+			}
+			else if(conn->state == CONNECTION_READING) {
+				handle_readable(conn);
+			}
+		}
+		
+		/* Every connection which yielded before this iteration gets one
+		 * quantum, in the order they yielded (connections yielding again
+		 * wait for the next iteration)
+		 */
+		for(int32_t turns = count_yielded_connections(); turns > 0; --turns) {
+			advance_connection(take_yielded_connection());
+		}
+	}
+}
+
+
+
+static
+void forward_signal(int32_t signal_number) {
+	if(signal_number == SIGHUP) {
+		reload_requested = 1;
+	}
+	else {
+		histograms_requested = 1;
+	}
+}
+
+
+
+/* Passes signals received by the supervisor on to the workers
+ */
+static
+void forward_requests(const pid_t *worker_pids) {
+	if(reload_requested) {
+		reload_requested = 0;
+		refresh_archives();
+		
+		for(int32_t worker = 0; worker < workers_count; ++worker) {
+			kill(worker_pids[worker], SIGHUP);
+		}
+	}
+	
+	if(histograms_requested) {
+		histograms_requested = 0;
+		
+		for(int32_t worker = 0; worker < workers_count; ++worker) {
+			kill(worker_pids[worker], SIGUSR1);
+		}
+	}
+}
+
+
+
+static
+time_t monotonic_seconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	return now.tv_sec;
+}
+
+
+
+static
+pid_t start_worker(int32_t worker_index) {
+	pid_t pid = fork();
+	
+	if(pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	
+	if(pid == 0) {
+		/* Do not outlive the supervising process
+		 */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		
+		run_worker(worker_index);
+		exit(EXIT_SUCCESS);
+	}
+	
+	return pid;
+}
+
+
+
+/* Tells the service manager (systemd Type=notify unit) that the server
+ * is ready, if it has been started by one
+ */
+static
+void notify_ready(void) {
+	const char *socket_path = getenv("NOTIFY_SOCKET");
+	
+	if(socket_path == NULL || (socket_path[0] != '/' && socket_path[0] != '@')) {
+		return;
+	}
+	
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	
+	size_t path_length = strlen(socket_path);
+	
+	if(path_length >= sizeof(address.sun_path)) {
+		return;
+	}
+	
+	memcpy(address.sun_path, socket_path, path_length);
+	
+	/* Abstract socket address
+	 */
+	if(address.sun_path[0] == '@') {
+		address.sun_path[0] = '\0';
+	}
+	
+	int32_t notify_socket = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	
+	if(notify_socket < 0) {
+		perror("Creating notification socket");
+		return;
+	}
+	
+	static const char ready_message[] = "READY=1";
+	
+	if(sendto(notify_socket, ready_message, sizeof(ready_message) - 1, 0, (struct sockaddr *) &address,
+			  offsetof(struct sockaddr_un, sun_path) + path_length) < 0) {
+		perror("Notifying service manager");
+	}
+	
+	close(notify_socket);
+}
+
+
+
+/* Parses non-negative decimal number making up the whole argument
+ */
+static
+int32_t parse_number_argument(const char *argument, long long *target) {
+	if(*argument == '\0') {
+		return -1;
+	}
+	
+	char *end = NULL;
+	errno = 0;
+	long long parsed = strtoll(argument, &end, 10);
+	
+	if(errno != 0 || *end != '\0' || parsed < 0) {
+		return -1;
+	}
+	
+	*target = parsed;
+	return 0;
+}
+
+
+
+static
+void print_usage(const char *program_name) {
+	fprintf(stderr, "Usage: %s [-t tuning-options] [-w workers] [-j offload-threads] [-b copy-buffer-size] [-q send-quantum] [-c] [-p] [-u] [-d cache-options] [-C certificate -K key] [-s slow-request-us] [-W warm-up-options] [-V virtual-hosts-file] [-r rate-limit-options] [-L limiter-options] [-S stats-segment] <catalogue> <corelated-servers-file> <optional listen addresses...>\n", program_name);
+	fprintf(stderr, "Listen address: [tls:]<port> | [tls:]<ipv4>:<port> | [tls:][<ipv6>]:<port> | [tls:]unix:<path>, "
+					"TCP ones optionally suffixed with @<interface>\n");
+	fprintf(stderr, "Tuning options: defer_accept=<s>,fastopen=<queue>,nodelay=<0|1>,cork=<0|1>,"
+					"sndbuf=<bytes>,rcvbuf=<bytes>,busy_poll=<us>\n");
+	fprintf(stderr, "Cache options (proxy mode only): dir=<path>,size=<bytes>,ttl=<s>\n");
+	fprintf(stderr, "Warm-up options: threads=<n>,preload=<bytes>,lock=<bytes>,snapshot=<path>\n");
+	fprintf(stderr, "Rate limit options: rate=<requests/s>,burst=<requests>,clients=<n>\n");
+	fprintf(stderr, "Limiter options: initial=<n>,min=<n>,max=<n>,tolerance=<percent>\n");
+	fprintf(stderr, "Virtual hosts file: lines of <host> <catalogue> <corelated-servers-file>\n");
+	fprintf(stderr, "Catalogue: directory or archive packed by serwer-pack\n");
+	fprintf(stderr, "Stats segment: shm_open() name (e.g. /serwer) of live counters read by serwer-top\n");
+}
+
+
+
+/* Main function of the server, responsible for creating server socket and accepting messages
+ * from clients that are connecting to the server
+ */
+int main(int argc, char *argv[]) {
+	/* Parse server options preceding positional arguments
+	 */
+	int32_t option;
+	long long number;
+	
+	const char *certificate_file = NULL;
+	const char *key_file = NULL;
+	const char *vhosts_file = NULL;
+	const char *stats_name = NULL;
+	
+	while((option = getopt(argc, argv, "t:w:j:b:cpud:C:K:s:W:q:V:r:L:S:")) != -1) {
+		switch(option) {
+			case 't':
+				if(parse_tcp_tuning(optarg) < 0) {
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'w':
+				if(parse_number_argument(optarg, &number) < 0 || number < 1 || number > MAX_WORKERS) {
+					fprintf(stderr, "Number of workers has to be in range [1, %d]\n", MAX_WORKERS);
+					exit(EXIT_FAILURE);
+				}
+				
+				workers_count = (int32_t) number;
+				break;
+			case 'j':
+				if(parse_number_argument(optarg, &number) < 0 || number < 1 || number > MAX_OFFLOAD_THREADS) {
+					fprintf(stderr, "Number of offload threads has to be in range [1, %d]\n", MAX_OFFLOAD_THREADS);
+					exit(EXIT_FAILURE);
+				}
+				
+				offload_threads_count = (int32_t) number;
+				break;
+			case 'b':
+				if(parse_number_argument(optarg, &number) < 0 || set_copy_buffer_size(number) < 0) {
+					fprintf(stderr, "Copy buffer size has to be in range [%d, %d]\n",
+							MIN_COPY_BUFFER_SIZE, MAX_COPY_BUFFER_SIZE);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'c':
+				force_copy_path();
+				break;
+			case 'p':
+				enable_proxy();
+				break;
+			case 'u':
+				uploads_enabled = true;
+				break;
+			case 'd':
+				if(parse_cache_options(optarg) < 0) {
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'C':
+				certificate_file = optarg;
+				break;
+			case 'K':
+				key_file = optarg;
+				break;
+			case 'q':
+				if(parse_number_argument(optarg, &number) < 0 || set_send_quantum(number) < 0) {
+					fprintf(stderr, "Send quantum has to be a non-negative number of bytes\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'r':
+				if(parse_rate_limit_options(optarg) < 0) {
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'L':
+				if(parse_limiter_options(optarg) < 0) {
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'V':
+				vhosts_file = optarg;
+				break;
+			case 'S':
+				stats_name = optarg;
+				break;
+			case 'W':
+				if(parse_warmup_options(optarg) < 0) {
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 's':
+				if(parse_number_argument(optarg, &number) < 0) {
+					fprintf(stderr, "Slow request threshold has to be a non-negative number of microseconds\n");
+					exit(EXIT_FAILURE);
+				}
+				
+				if(set_slow_request_threshold(number) < 0) {
+					exit(EXIT_FAILURE);
+				}
+				break;
+			default:
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	
+	if(is_cache_enabled() && !is_proxy_enabled()) {
+		fprintf(stderr, "Cache (-d) requires proxy mode (-p)\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	/* TLS context is created before the workers are started so that
+	 * they share session ticket keys
+	 */
+	bool tls_initialised = false;
+	
+	if(certificate_file != NULL || key_file != NULL) {
+		if(certificate_file == NULL || key_file == NULL || init_tls(certificate_file, key_file) < 0) {
+			fprintf(stderr, "Initialising TLS failed\n");
+			exit(EXIT_FAILURE);
+		}
+		
+		tls_initialised = true;
+	}
+	
+	init_timing();
+	
+	/* Token buckets are shared by all the workers, so that the limit
+	 * applies to the client whichever worker accepts its connections
+	 */
+	if(is_rate_limit_enabled() && init_rate_limit() < 0) {
+		perror("Creating rate limit table");
+		exit(EXIT_FAILURE);
+	}
+	
+	/* Workers inherit the mapping of the statistics segment
+	 */
+	if(stats_name != NULL && init_stats(stats_name, workers_count) < 0) {
+		exit(EXIT_FAILURE);
+	}
+	
+	int32_t positional_count = argc - optind;
+	char **positional = argv + optind;
+	
+	/* Check if either too few or too many arguments have been provided
+	 * to server exeuction command
+	 */
+	if(positional_count < 2 || positional_count > 2 + MAX_LISTENERS) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	
+	
+	/* Save character strings denoting respectively the catalogue path
+	 * and name of corelated servers file
+	 */
+	corelated_servers_file = positional[1];
+	
+	vhost_t *default_vhost = set_default_vhost(positional[0], corelated_servers_file);
+	
+	if(default_vhost == NULL) {
+		fprintf(stderr, "Invalid catalogue or corelated servers file\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	catalogue_path = default_vhost->catalogue_path;
+	
+	
+	if(vhosts_file != NULL && load_vhosts(vhosts_file) < 0) {
+		exit(EXIT_FAILURE);
+	}
+	
+	struct sigaction act;
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = SIG_IGN;
+	act.sa_flags = SA_RESTART;
+	
+	if(sigaction(SIGPIPE, &act, NULL) != 0) {
+		perror("sigaction");
+		exit(EXIT_FAILURE);
+	}
+		
+	/* Listening sockets are opened only after the warm-up, so that no
+	 * connection reaches the server (and no health check succeeds)
+	 * while the caches are cold
+	 */
+	if(is_warmup_enabled() && default_vhost->archive == NULL) {
+		warm_up_catalogue(catalogue_path, workers_count);
+	}
+	
+	/* Open listening sockets for every listen address provided as program
+	 * argument, or the default port if none was provided. With several workers
+	 * each of them gets its own SO_REUSEPORT socket for TCP addresses, while
+	 * Unix domain sockets are shared
+	 */
+	const char *default_listener = DEFAULT_SERVER_PORT;
+	const char **listen_specs = (positional_count > 2) ? (const char **) (positional + 2) : &default_listener;
+	int32_t listen_specs_count = (positional_count > 2) ? positional_count - 2 : 1;
+	
+	for(int32_t i = 0; i < listen_specs_count; ++i) {
+		bool tls;
+		const char *spec = strip_tls_prefix(listen_specs[i], &tls);
+		
+		if(tls && !tls_initialised) {
+			fprintf(stderr, "TLS listener %s requires certificate (-C) and key (-K)\n", listen_specs[i]);
+			exit(EXIT_FAILURE);
+		}
+		
+		bool shared = (workers_count == 1 || is_unix_listen_spec(spec));
+		int32_t copies = shared ? 1 : workers_count;
+		
+		for(int32_t worker = 0; worker < copies; ++worker) {
+			int32_t server_socket = open_listener(spec, SERVER_QUEUE_LENGTH, !shared);
+			
+			if(server_socket < 0) {
+				exit(EXIT_FAILURE);
+			}
+			
+			tune_listener(server_socket);
+			
+			listeners[listeners_count].fd = server_socket;
+			listeners[listeners_count].owner = shared ? -1 : worker;
+			listeners[listeners_count].tls = tls;
+			listeners_count++;
+		}
+		
+		printf("Listening on %s\n", listen_specs[i]);
+	}
+	
+	
+	notify_ready();
+	
+	if(workers_count == 1) {
+		run_worker(-1);
+	}
+	
+	
+	/* SIGHUP and SIGUSR1 interrupt waitpid() (no SA_RESTART) and are
+	 * passed to the workers
+	 */
+	act.sa_handler = forward_signal;
+	act.sa_flags = 0;
+	
+	if(sigaction(SIGHUP, &act, NULL) != 0 || sigaction(SIGUSR1, &act, NULL) != 0) {
+		perror("sigaction");
+		exit(EXIT_FAILURE);
+	}
+	
+	
+	/* Start the workers and restart any of them that terminates
+	 */
+	pid_t worker_pids[MAX_WORKERS];
+	time_t start_times[MAX_WORKERS];
+	int32_t quick_restarts[MAX_WORKERS] = { 0 };
+	
+	for(int32_t worker = 0; worker < workers_count; ++worker) {
+		worker_pids[worker] = start_worker(worker);
+		start_times[worker] = monotonic_seconds();
+	}
+	
+	while(1) {
+		int32_t status;
+		pid_t pid = waitpid(-1, &status, 0);
+		
+		if(pid < 0) {
+			if(errno == EINTR) {
+				forward_requests(worker_pids);
+				continue;
+			}
+			
+			perror("waitpid");
+			exit(EXIT_FAILURE);
+		}
+		
+		for(int32_t worker = 0; worker < workers_count; ++worker) {
+			if(worker_pids[worker] != pid) {
+				continue;
+			}
+			
+			/* Worker failing right after its start (e.g. while setting up
+			 * its event loop) most likely fails again the same way
+			 */
+			if(monotonic_seconds() - start_times[worker] < MIN_WORKER_LIFETIME) {
+				quick_restarts[worker]++;
+			}
+			else {
+				quick_restarts[worker] = 0;
+			}
+			
+			if(quick_restarts[worker] >= MAX_QUICK_RESTARTS) {
+				fprintf(stderr, "Worker %d (pid %d) terminated %d times in a row within %d s of its start, giving up\n",
+						worker, (int) pid, quick_restarts[worker], MIN_WORKER_LIFETIME);
+				
+				for(int32_t other = 0; other < workers_count; ++other) {
+					if(other != worker) {
+						kill(worker_pids[other], SIGTERM);
+					}
+				}
+				
+				exit(EXIT_FAILURE);
+			}
+			
+			fprintf(stderr, "Worker %d (pid %d) terminated, restarting\n", worker, (int) pid);
+			reset_worker_connections(worker);
+			
+			if(quick_restarts[worker] > 0) {
+				/* Signals interrupting the delay are forwarded once
+				 * the worker is running again
+				 */
+				struct timespec delay = { 1 << (quick_restarts[worker] - 1), 0 };
+				
+				while(nanosleep(&delay, &delay) < 0 && errno == EINTR);
+			}
+			
+			refresh_archives();
+			worker_pids[worker] = start_worker(worker);
+			start_times[worker] = monotonic_seconds();
+			
+			forward_requests(worker_pids);
+		}
+	}
+	
+	
+	
+	/* Close the server sockets
+	 */
+	for(int32_t i = 0; i < listeners_count; ++i) {
+		if(close(listeners[i].fd) == -1) {
+			perror("Closing server socket");
+			exit(EXIT_FAILURE);
+		}
 	}
 	
 
@@ -0,0 +1,402 @@
+#!/usr/bin/env python3
+"""
+Soak and stress run of the server. Starts a single worker on a temporary
+catalogue and drives it from many concurrent clients with a mix of valid,
+malformed, pipelined, half-sent and reset requests (HTTP/1.1 and h2c) for
+the whole duration. Resident memory, open descriptors and p99 latency of
+valid requests are sampled every interval, and the run fails when they
+drift from the baseline taken after the warm-up, when the server dies or
+when a connection hangs. Run from the directory holding the serwer binary:
+
+  make soak
+  python3 soak/soak.py --duration 600 --clients 64
+"""
+
+import argparse
+import os
+import random
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+SMALL_BODY = b"hello soak\n"
+MEDIUM_SIZE = 200 * 1024
+LARGE_SIZE = 8 * 1024 * 1024
+
+# HTTP/2 client preface with empty SETTINGS frame
+H2_PREFACE = b"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" + bytes([0, 0, 0, 4, 0, 0, 0, 0, 0])
+
+
+def make_catalogue(root):
+    catalogue = os.path.join(root, "catalogue")
+    os.makedirs(os.path.join(catalogue, "dir"))
+
+    with open(os.path.join(catalogue, "small.txt"), "wb") as f:
+        f.write(SMALL_BODY)
+    with open(os.path.join(catalogue, "medium.bin"), "wb") as f:
+        f.write(os.urandom(MEDIUM_SIZE))
+    with open(os.path.join(catalogue, "large.bin"), "wb") as f:
+        f.write(os.urandom(LARGE_SIZE))
+    with open(os.path.join(catalogue, "empty.txt"), "wb"):
+        pass
+    with open(os.path.join(catalogue, "dir", "nested.txt"), "wb") as f:
+        f.write(SMALL_BODY)
+
+    corelated = os.path.join(root, "corelated.txt")
+
+    with open(corelated, "w") as f:
+        f.write("/moved.txt\t192.0.2.1\t80\n")
+
+    return catalogue, corelated
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+class Reader:
+    """Reads responses from a connection, keeping bytes of the pipelined ones."""
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.data = b""
+
+    def fill(self, what):
+        chunk = self.sock.recv(1 << 20)
+        if not chunk:
+            raise ConnectionError(f"closed {what}")
+        self.data += chunk
+
+    def response(self, head_only=False):
+        """Reads one response with Content-Length body, returns its status."""
+        while b"\r\n\r\n" not in self.data:
+            self.fill("before response head")
+
+        head, _, self.data = self.data.partition(b"\r\n\r\n")
+        lines = head.split(b"\r\n")
+        status = int(lines[0].split()[1])
+        length = 0
+
+        for line in lines[1:]:
+            name, _, value = line.partition(b":")
+            if name.strip().lower() == b"content-length":
+                length = int(value)
+
+        if head_only:
+            return status
+
+        while len(self.data) < length:
+            self.fill("in response body")
+
+        self.data = self.data[length:]
+        return status
+
+
+def reset(sock):
+    """Closes with RST instead of FIN."""
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.latencies = []
+        self.counts = {}
+        self.failures = []
+
+    def record(self, kind, latency=None):
+        with self.lock:
+            self.counts[kind] = self.counts.get(kind, 0) + 1
+            if latency is not None:
+                self.latencies.append(latency)
+
+    def fail(self, message):
+        with self.lock:
+            self.failures.append(message)
+
+    def take_latencies(self):
+        with self.lock:
+            latencies, self.latencies = self.latencies, []
+        return latencies
+
+
+VALID = [
+    ("GET", "/small.txt", 200), ("HEAD", "/small.txt", 200), ("GET", "/medium.bin", 200),
+    ("GET", "/empty.txt", 200), ("GET", "/dir/nested.txt", 200), ("GET", "/moved.txt", 302),
+    ("GET", "/missing.txt", 404), ("GET", "/dir/", 404),
+    ("GET", "/small.txt?query=1", 200), ("GET", "/%73mall.txt", 200),
+]
+
+MALFORMED = [
+    b"GARBAGE\r\n\r\n",
+    b"GET /small.txt HTTP/9.9\r\n\r\n",
+    b"GET small.txt HTTP/1.1\r\n\r\n",
+    b"GET /%zz HTTP/1.1\r\n\r\n",
+    b"GET /small.txt HTTP/1.1\r\nContent-Length: abc\r\n\r\n",
+    b"GET /small.txt HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n",
+    b"GET /small.txt HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 3\r\n\r\n",
+    b"GET /" + b"a" * 9000 + b" HTTP/1.1\r\n\r\n",
+    b"\x00\x01\x02\xff\r\n\r\n",
+    b"BREW /small.txt HTTP/1.1\r\n\r\n",
+]
+
+
+def valid_request(port, stats, timeout):
+    method, path, expected = random.choice(VALID)
+    started = time.monotonic()
+
+    with socket.create_connection(("127.0.0.1", port), timeout=timeout) as sock:
+        sock.sendall(f"{method} {path} HTTP/1.1\r\nHost: soak\r\n\r\n".encode())
+
+        status = Reader(sock).response(head_only=method == "HEAD")
+
+    if status != expected:
+        stats.fail(f"{method} {path}: status {status}, expected {expected}")
+
+    stats.record("valid", time.monotonic() - started)
+
+
+def pipelined_requests(port, stats, timeout):
+    requests = [random.choice(VALID) for _ in range(random.randint(2, 16))]
+    requests = [r for r in requests if r[0] == "GET"] or [VALID[0]]
+
+    with socket.create_connection(("127.0.0.1", port), timeout=timeout) as sock:
+        sock.sendall(b"".join(f"GET {path} HTTP/1.1\r\n\r\n".encode() for _, path, _ in requests))
+
+        reader = Reader(sock)
+
+        for _, path, expected in requests:
+            status = reader.response()
+            if status != expected:
+                stats.fail(f"pipelined GET {path}: status {status}, expected {expected}")
+
+    stats.record("pipelined")
+
+
+def malformed_request(port, stats, timeout):
+    with socket.create_connection(("127.0.0.1", port), timeout=timeout) as sock:
+        sock.sendall(random.choice(MALFORMED))
+        Reader(sock).response()
+
+    stats.record("malformed")
+
+
+def reset_mid_request(port, stats, timeout):
+    with socket.create_connection(("127.0.0.1", port), timeout=timeout) as sock:
+        choice = random.random()
+
+        if choice < 0.4:
+            sock.sendall(b"GET /medium.bin HTTP/1.1\r\nHo")
+        elif choice < 0.7:
+            sock.sendall(b"PUT /upload.txt HTTP/1.1\r\nContent-Length: 100000\r\n\r\n" + b"x" * 1000)
+        else:
+            sock.sendall(b"GET /large.bin HTTP/1.1\r\n\r\n")
+            sock.recv(4096)
+
+        reset(sock)
+
+    stats.record("reset")
+
+
+def upload_request(port, stats, timeout):
+    body = os.urandom(random.randint(0, 64 * 1024))
+    name = f"/uploads-{random.randint(0, 15)}.bin"
+
+    with socket.create_connection(("127.0.0.1", port), timeout=timeout) as sock:
+        sock.sendall(f"PUT {name} HTTP/1.1\r\nContent-Length: {len(body)}\r\nConnection: close\r\n\r\n".encode() + body)
+        status = Reader(sock).response()
+
+    if status not in (201, 204):
+        stats.fail(f"PUT {name}: status {status}")
+
+    stats.record("upload")
+
+
+def http2_connection(port, stats, timeout):
+    with socket.create_connection(("127.0.0.1", port), timeout=timeout) as sock:
+        if random.random() < 0.5:
+            sock.sendall(b"GET /small.txt HTTP/1.1\r\nHost: soak\r\nConnection: Upgrade, HTTP2-Settings\r\n"
+                         b"Upgrade: h2c\r\nHTTP2-Settings: AAMAAABkAAQCAAAAAAIAAAAA\r\n\r\n" + H2_PREFACE)
+        else:
+            sock.sendall(H2_PREFACE + os.urandom(random.randint(0, 256)))
+
+        sock.recv(65536)
+
+        if random.random() < 0.5:
+            reset(sock)
+
+    stats.record("http2")
+
+
+TRAFFIC = [
+    (0.40, valid_request), (0.15, pipelined_requests), (0.15, malformed_request),
+    (0.15, reset_mid_request), (0.05, upload_request), (0.10, http2_connection),
+]
+
+
+def client(port, stats, deadline, timeout):
+    while time.monotonic() < deadline:
+        draw = random.random()
+
+        for weight, action in TRAFFIC:
+            draw -= weight
+            if draw < 0:
+                break
+
+        try:
+            action(port, stats, timeout)
+        except socket.timeout:
+            stats.fail(f"{action.__name__}: connection hung for {timeout}s")
+        except ConnectionRefusedError:
+            stats.fail(f"{action.__name__}: connection refused")
+            time.sleep(0.1)
+        except OSError:
+            # Resets and closes are expected answers to malformed and
+            # aborted requests
+            stats.record("closed")
+
+
+def sample(pid):
+    with open(f"/proc/{pid}/status") as f:
+        rss = int(f.read().split("VmRSS:")[1].split()[0])
+
+    return rss, len(os.listdir(f"/proc/{pid}/fd"))
+
+
+def descriptors(pid):
+    targets = {}
+
+    for fd in os.listdir(f"/proc/{pid}/fd"):
+        try:
+            targets[fd] = os.readlink(f"/proc/{pid}/fd/{fd}")
+        except OSError:
+            pass
+
+    return targets
+
+
+def percentile(values, fraction):
+    if not values:
+        return 0.0
+
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * fraction))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Soak run tracking memory, descriptor and latency drift")
+    parser.add_argument("--server", default="./serwer")
+    parser.add_argument("--duration", type=float, default=300, help="seconds of load after the warm-up")
+    parser.add_argument("--warmup", type=float, default=10, help="seconds of load before the baseline")
+    parser.add_argument("--interval", type=float, default=10, help="seconds between samples")
+    parser.add_argument("--clients", type=int, default=32)
+    parser.add_argument("--timeout", type=float, default=10, help="seconds after which a connection hangs")
+    parser.add_argument("--rss-growth", type=int, default=4096, help="allowed RSS growth in KiB")
+    parser.add_argument("--fd-growth", type=int, default=0, help="allowed growth of idle descriptors")
+    parser.add_argument("--p99-factor", type=float, default=3.0, help="allowed p99 growth factor")
+    parser.add_argument("--p99-floor", type=float, default=20.0, help="p99 (ms) below which drift is ignored")
+    args = parser.parse_args()
+
+    root = tempfile.mkdtemp(prefix="serwer-soak-")
+    catalogue, corelated = make_catalogue(root)
+    port = free_port()
+
+    server = subprocess.Popen([args.server, "-w", "1", "-u", catalogue, corelated, f"127.0.0.1:{port}"],
+                              stdout=subprocess.DEVNULL)
+    failures = []
+
+    try:
+        # Descriptors before the load are counted once the worker has
+        # answered its first request and closed the connection
+        for _ in range(100):
+            try:
+                valid_request(port, Stats(), args.timeout)
+                break
+            except OSError:
+                time.sleep(0.05)
+
+        time.sleep(1)
+        idle_fds = descriptors(server.pid)
+        stats = Stats()
+        deadline = time.monotonic() + args.warmup + args.duration
+        clients = [threading.Thread(target=client, args=(port, stats, deadline, args.timeout), daemon=True)
+                   for _ in range(args.clients)]
+
+        for thread in clients:
+            thread.start()
+
+        time.sleep(args.warmup)
+        stats.take_latencies()
+        baseline_rss = sample(server.pid)[0]
+        baseline_p99 = None
+        worst_p99 = 0.0
+
+        print(f"{'elapsed':>8} {'rss KiB':>9} {'fds':>5} {'requests':>9} {'p99 ms':>8}")
+
+        while time.monotonic() < deadline and server.poll() is None:
+            time.sleep(min(args.interval, max(0.0, deadline - time.monotonic())))
+
+            if server.poll() is not None:
+                break
+
+            rss, fds = sample(server.pid)
+            latencies = stats.take_latencies()
+            p99 = percentile(latencies, 0.99) * 1000
+
+            if baseline_p99 is None and latencies:
+                baseline_p99 = p99
+            worst_p99 = max(worst_p99, p99)
+
+            elapsed = args.duration - (deadline - time.monotonic())
+            print(f"{elapsed:8.0f} {rss:9d} {fds:5d} {len(latencies):9d} {p99:8.1f}", flush=True)
+
+        for thread in clients:
+            thread.join()
+
+        if server.poll() is not None:
+            failures.append(f"server exited with status {server.returncode}")
+        else:
+            # Connections closed by the clients are given time to be reaped
+            time.sleep(2)
+            rss, fds = sample(server.pid)
+            print(f"idle: rss {rss} KiB (baseline {baseline_rss}), fds {fds} (before load {len(idle_fds)})")
+
+            if rss - baseline_rss > args.rss_growth:
+                failures.append(f"RSS grew by {rss - baseline_rss} KiB (allowed {args.rss_growth})")
+            if fds - len(idle_fds) > args.fd_growth:
+                leaked = [f"{fd} -> {target}" for fd, target in descriptors(server.pid).items()
+                          if idle_fds.get(fd) != target]
+                failures.append(f"{fds - len(idle_fds)} descriptors leaked: {', '.join(leaked)}")
+
+        if baseline_p99 is not None and worst_p99 > args.p99_floor and worst_p99 > baseline_p99 * args.p99_factor:
+            failures.append(f"p99 drifted from {baseline_p99:.1f} ms to {worst_p99:.1f} ms")
+
+        print("traffic:", ", ".join(f"{kind} {count}" for kind, count in sorted(stats.counts.items())))
+
+        for message in sorted(set(stats.failures))[:20]:
+            failures.append(message)
+    finally:
+        if server.poll() is None:
+            server.terminate()
+            server.wait()
+        shutil.rmtree(root, ignore_errors=True)
+
+    if failures:
+        for message in failures:
+            print("FAIL:", message)
+        return 1
+
+    print("PASS")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
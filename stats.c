@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "stats.h"
+
+
+
+static struct worker_stats private_stats;
+static struct stats_segment *segment = NULL;
+
+struct worker_stats *worker_stats = &private_stats;
+
+
+
+int32_t init_stats(const char *name, int32_t workers_count) {
+	size_t size = sizeof(struct stats_segment) + workers_count * sizeof(struct worker_stats);
+	int32_t fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+	if(fd < 0) {
+		perror(name);
+		return -1;
+	}
+
+	/* Segment left behind by previous run is cleared
+	 */
+	if(ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0) {
+		perror(name);
+		close(fd);
+		return -1;
+	}
+
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(map == MAP_FAILED) {
+		perror(name);
+		return -1;
+	}
+
+	segment = map;
+	segment->workers_count = workers_count;
+	segment->supervisor_pid = getpid();
+	segment->started_at = time(NULL);
+
+	/* Magic is written last, readers ignore the segment until then
+	 */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(segment->magic, STATS_MAGIC, sizeof(segment->magic));
+
+	return 0;
+}
+
+
+
+void select_worker_stats(int32_t worker_index) {
+	if(segment != NULL && worker_index < segment->workers_count) {
+		worker_stats = &segment->workers[worker_index];
+	}
+}
+
+
+
+void reset_worker_connections(int32_t worker_index) {
+	if(segment != NULL && worker_index < segment->workers_count) {
+		__atomic_store_n(&segment->workers[worker_index].connections_active, 0, __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,104 @@
+#ifndef STATS_H
+#define STATS_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+
+/* Statistics segment published with shm_open() under the name passed to
+ * the -S server option and read by serwer-top. Every worker counts its
+ * events into its own block (padded to whole cache lines, so that the
+ * workers never share one) with relaxed atomic additions.
+ */
+#define STATS_MAGIC 				 "SIKSTAT1"
+#define STATS_MAX_WORKERS 			 64
+
+
+
+/* Classes of response status counted separately, index 0 collects
+ * statuses which are not 1xx to 5xx
+ */
+#define STATS_STATUS_CLASSES 		 6
+
+
+
+struct worker_stats {
+	/* Requests parsed (HTTP/1.1 request heads and HTTP/2 streams)
+	 * and responses queued by status class
+	 */
+	uint64_t requests;
+	uint64_t statuses[STATS_STATUS_CLASSES];
+
+	/* Bytes written to client sockets
+	 */
+	uint64_t bytes_sent;
+
+	uint64_t connections_accepted;
+	uint64_t connections_active;
+
+	/* Reverse-proxy cache lookups and corelated servers file
+	 * lookups of files missing from the catalogue
+	 */
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t corelated_lookups;
+} __attribute__((aligned(64)));
+
+
+
+struct stats_segment {
+	char magic[8];
+	int32_t workers_count;
+	int32_t supervisor_pid;
+	int64_t started_at;
+
+	struct worker_stats workers[];
+};
+
+
+
+/* Block of the calling worker (a private one if no segment has been
+ * created, so that counting never has to check)
+ */
+extern struct worker_stats *worker_stats;
+
+
+
+#define STATS_ADD(counter, amount) 		 __atomic_fetch_add(&worker_stats->counter, (amount), __ATOMIC_RELAXED)
+#define STATS_SUB(counter, amount) 		 __atomic_fetch_sub(&worker_stats->counter, (amount), __ATOMIC_RELAXED)
+
+
+
+/* Counts response whose status starts with passed digit
+ */
+#define STATS_STATUS_INDEX(digit) 		 (((digit) >= '1' && (digit) <= '5') ? (digit) - '0' : 0)
+#define STATS_RESPONSE(digit) 			 STATS_ADD(statuses[STATS_STATUS_INDEX(digit)], 1)
+
+
+
+/* Creates (or reuses and clears) the segment of passed name for passed number
+ * of workers, has to be called before they are started. Returns 0 on success
+ * and -1 on error (reason is printed).
+ */
+int32_t init_stats(const char *, int32_t);
+
+
+
+/* Makes the calling worker count into the block of passed index
+ * of the segment (if there is one)
+ */
+void select_worker_stats(int32_t);
+
+
+
+/* Clears the number of active connections of terminated worker
+ * of passed index before it is restarted
+ */
+void reset_worker_connections(int32_t);
+
+
+
+#endif /* STATS_H */
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "tcp_tuning.h"
+
+
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 			 46
+#endif
+
+
+
+struct tcp_tuning_t {
+	int32_t defer_accept;
+	int32_t fastopen_queue;
+	int32_t nodelay;
+	int32_t cork;
+	int32_t send_buffer;
+	int32_t receive_buffer;
+	int32_t busy_poll;
+};
+
+
+
+/* Default profile: accept() only fires once the request has arrived,
+ * TFO is available to clients which support it, small writes are not
+ * delayed by Nagle and each response is corked so that headers and the
+ * beginning of the body share segments
+ */
+static struct tcp_tuning_t tuning = {
+	.defer_accept = 5,
+	.fastopen_queue = 256,
+	.nodelay = 1,
+	.cork = 1,
+	.send_buffer = 0,
+	.receive_buffer = 0,
+	.busy_poll = 0
+};
+
+
+
+enum {
+	OPTION_DEFER_ACCEPT = 0,
+	OPTION_FASTOPEN,
+	OPTION_NODELAY,
+	OPTION_CORK,
+	OPTION_SNDBUF,
+	OPTION_RCVBUF,
+	OPTION_BUSY_POLL
+};
+
+
+
+static char *const option_names[] = {
+	[OPTION_DEFER_ACCEPT] = "defer_accept",
+	[OPTION_FASTOPEN] = "fastopen",
+	[OPTION_NODELAY] = "nodelay",
+	[OPTION_CORK] = "cork",
+	[OPTION_SNDBUF] = "sndbuf",
+	[OPTION_RCVBUF] = "rcvbuf",
+	[OPTION_BUSY_POLL] = "busy_poll",
+	NULL
+};
+
+
+
+static
+int32_t parse_option_value(const char *value, int32_t *target) {
+	if(value == NULL || *value == '\0') {
+		return -1;
+	}
+
+	char *end = NULL;
+	errno = 0;
+	long parsed = strtol(value, &end, 10);
+
+	if(errno != 0 || *end != '\0' || parsed < 0 || parsed > INT32_MAX) {
+		return -1;
+	}
+
+	*target = (int32_t) parsed;
+	return 0;
+}
+
+
+
+int32_t parse_tcp_tuning(char *options) {
+	char *value = NULL;
+
+	while(*options != '\0') {
+		int32_t *target = NULL;
+
+		switch(getsubopt(&options, option_names, &value)) {
+			case OPTION_DEFER_ACCEPT:
+				target = &tuning.defer_accept;
+				break;
+			case OPTION_FASTOPEN:
+				target = &tuning.fastopen_queue;
+				break;
+			case OPTION_NODELAY:
+				target = &tuning.nodelay;
+				break;
+			case OPTION_CORK:
+				target = &tuning.cork;
+				break;
+			case OPTION_SNDBUF:
+				target = &tuning.send_buffer;
+				break;
+			case OPTION_RCVBUF:
+				target = &tuning.receive_buffer;
+				break;
+			case OPTION_BUSY_POLL:
+				target = &tuning.busy_poll;
+				break;
+			default:
+				fprintf(stderr, "Unknown socket tuning option: %s\n", value);
+				return -1;
+		}
+
+		if(parse_option_value(value, target) < 0) {
+			fprintf(stderr, "Invalid socket tuning option value: %s\n", value == NULL ? "(none)" : value);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+
+static
+bool is_tcp_socket(int32_t socket_desc) {
+	int32_t domain = 0;
+	socklen_t length = sizeof(domain);
+
+	if(getsockopt(socket_desc, SOL_SOCKET, SO_DOMAIN, &domain, &length) < 0) {
+		return false;
+	}
+
+	return (domain == AF_INET || domain == AF_INET6);
+}
+
+
+
+static
+void set_option(int32_t socket_desc, int32_t level, int32_t name, int32_t value, const char *description) {
+	if(setsockopt(socket_desc, level, name, &value, sizeof(value)) < 0) {
+		fprintf(stderr, "setsockopt %s: %s\n", description, strerror(errno));
+	}
+}
+
+
+
+void tune_listener(int32_t socket_desc) {
+	if(!is_tcp_socket(socket_desc)) {
+		return;
+	}
+
+	if(tuning.defer_accept > 0) {
+		set_option(socket_desc, IPPROTO_TCP, TCP_DEFER_ACCEPT, tuning.defer_accept, "TCP_DEFER_ACCEPT");
+	}
+
+	if(tuning.fastopen_queue > 0) {
+		set_option(socket_desc, IPPROTO_TCP, TCP_FASTOPEN, tuning.fastopen_queue, "TCP_FASTOPEN");
+	}
+
+	/* Buffer sizes are set on the listener so that accepted sockets inherit
+	 * them and the window scale advertised in SYN-ACK matches
+	 */
+	if(tuning.send_buffer > 0) {
+		set_option(socket_desc, SOL_SOCKET, SO_SNDBUF, tuning.send_buffer, "SO_SNDBUF");
+	}
+
+	if(tuning.receive_buffer > 0) {
+		set_option(socket_desc, SOL_SOCKET, SO_RCVBUF, tuning.receive_buffer, "SO_RCVBUF");
+	}
+}
+
+
+
+void tune_connection(int32_t socket_desc) {
+	if(!is_tcp_socket(socket_desc)) {
+		return;
+	}
+
+	if(tuning.nodelay) {
+		set_option(socket_desc, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	}
+
+	if(tuning.busy_poll > 0) {
+		set_option(socket_desc, SOL_SOCKET, SO_BUSY_POLL, tuning.busy_poll, "SO_BUSY_POLL");
+	}
+}
+
+
+
+/* Cork failures are ignored on purpose - on Unix domain sockets
+ * the option does not exist and there is nothing to hold back
+ */
+void cork_response(int32_t socket_desc) {
+	if(tuning.cork) {
+		int32_t on = 1;
+		setsockopt(socket_desc, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	}
+}
+
+
+
+void uncork_response(int32_t socket_desc) {
+	if(tuning.cork) {
+		int32_t off = 0;
+		setsockopt(socket_desc, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+	}
+}
@@ -0,0 +1,55 @@
+#ifndef TCP_TUNING_H
+#define TCP_TUNING_H
+
+
+
+#include <stdint.h>
+
+
+
+/* Parses comma separated list of socket tuning options (as passed
+ * to the -t server option) and stores them as the tuning profile
+ * used for all subsequently tuned sockets. Recognised options:
+ * defer_accept=<seconds>   TCP_DEFER_ACCEPT on listeners (0 disables)
+ * fastopen=<queue length>  TCP_FASTOPEN on listeners (0 disables)
+ * nodelay=<0|1>            TCP_NODELAY on accepted connections
+ * cork=<0|1>               TCP_CORK held for the duration of each response
+ * sndbuf=<bytes>           SO_SNDBUF (0 keeps kernel default / autotuning)
+ * rcvbuf=<bytes>           SO_RCVBUF (0 keeps kernel default / autotuning)
+ * busy_poll=<microseconds> SO_BUSY_POLL on accepted connections (0 disables)
+ * Returns 0 on success and -1 on unknown option or invalid value.
+ */
+int32_t parse_tcp_tuning(char *);
+
+
+
+/* Applies listener part of the tuning profile to passed listening socket.
+ * Unix domain sockets are left untouched. Failures are reported on stderr
+ * but are not fatal.
+ */
+void tune_listener(int32_t);
+
+
+
+/* Applies per-connection part of the tuning profile to an accepted
+ * client socket
+ */
+void tune_connection(int32_t);
+
+
+
+/* Marks the beginning of a response, with cork enabled partial frames
+ * (status line, headers) are held by the kernel until the response ends
+ */
+void cork_response(int32_t);
+
+
+
+/* Marks the end of a response, flushing whatever has been held back
+ * since cork_response()
+ */
+void uncork_response(int32_t);
+
+
+
+#endif /* TCP_TUNING_H */
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "timing.h"
+
+
+
+#ifdef WITH_TIMING
+
+
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define USE_TSC
+#endif
+
+
+
+/* Histogram buckets are powers of two of nanoseconds, the last
+ * one collects everything from about 2 seconds up
+ */
+#define HISTOGRAM_BUCKETS 			 32
+
+
+
+static const char *phase_names[PHASES_COUNT] = {
+	[PHASE_REQUEST_LINE] = "request-line",
+	[PHASE_HEADERS] = "headers",
+	[PHASE_RESOLVE] = "resolve",
+	[PHASE_CORELATED] = "corelated",
+	[PHASE_HEADER_SEND] = "header-send",
+	[PHASE_BODY_SEND] = "body-send"
+};
+
+
+
+static long slow_request_threshold = DEFAULT_SLOW_REQUEST_THRESHOLD;
+
+
+
+/* Nanoseconds per clock tick, measured against CLOCK_MONOTONIC
+ */
+static double tick_nanoseconds = 1.0;
+
+
+
+/* Histograms of the worker, the last row is the whole request
+ */
+static uint64_t histograms[PHASES_COUNT + 1][HISTOGRAM_BUCKETS];
+static uint64_t total_nanoseconds[PHASES_COUNT + 1];
+
+
+
+static
+uint64_t read_clock(void) {
+#ifdef USE_TSC
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+
+
+int32_t set_slow_request_threshold(long threshold) {
+	slow_request_threshold = threshold;
+	return 0;
+}
+
+
+
+void init_timing(void) {
+#ifdef USE_TSC
+	struct timespec begin, end;
+	struct timespec interval = { 0, 20000000 };
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	uint64_t ticks_begin = read_clock();
+
+	nanosleep(&interval, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	uint64_t ticks_end = read_clock();
+
+	double elapsed = (end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec);
+
+	if(ticks_end > ticks_begin) {
+		tick_nanoseconds = elapsed / (ticks_end - ticks_begin);
+	}
+#endif
+}
+
+
+
+void start_request_timing(request_timing_t *timing) {
+	timing->start = read_clock();
+	timing->last = timing->start;
+	timing->next_phase = 0;
+	timing->stamped_phases = 0;
+
+	memset(timing->phase_ticks, 0, sizeof(timing->phase_ticks));
+}
+
+
+
+void end_request_phase(request_timing_t *timing, int32_t phase) {
+	if(timing->start == 0 || phase < timing->next_phase) {
+		return;
+	}
+
+	uint64_t now = read_clock();
+
+	timing->phase_ticks[phase] = now - timing->last;
+	timing->last = now;
+	timing->next_phase = phase + 1;
+	timing->stamped_phases |= (1u << phase);
+}
+
+
+
+static
+void record_duration(int32_t row, uint64_t nanoseconds) {
+	int32_t bucket = 0;
+
+	while(bucket < HISTOGRAM_BUCKETS - 1 && (nanoseconds >> (bucket + 1)) != 0) {
+		bucket++;
+	}
+
+	histograms[row][bucket]++;
+	total_nanoseconds[row] += nanoseconds;
+}
+
+
+
+void finish_request_timing(request_timing_t *timing, const char *path, size_t path_length) {
+	if(timing->start == 0) {
+		return;
+	}
+
+	end_request_phase(timing, PHASE_BODY_SEND);
+
+	uint64_t phase_nanoseconds[PHASES_COUNT];
+	uint64_t request_nanoseconds = (uint64_t) ((timing->last - timing->start) * tick_nanoseconds);
+
+	for(int32_t phase = 0; phase < PHASES_COUNT; ++phase) {
+		phase_nanoseconds[phase] = (uint64_t) (timing->phase_ticks[phase] * tick_nanoseconds);
+
+		if(timing->stamped_phases & (1u << phase)) {
+			record_duration(phase, phase_nanoseconds[phase]);
+		}
+	}
+
+	record_duration(PHASES_COUNT, request_nanoseconds);
+	timing->start = 0;
+
+	if(slow_request_threshold <= 0 || request_nanoseconds / 1000 < (uint64_t) slow_request_threshold) {
+		return;
+	}
+
+	char breakdown[256];
+	size_t length = 0;
+
+	for(int32_t phase = 0; phase < PHASES_COUNT && length < sizeof(breakdown); ++phase) {
+		if(!(timing->stamped_phases & (1u << phase))) {
+			continue;
+		}
+
+		length += snprintf(breakdown + length, sizeof(breakdown) - length, " %s=%lluus", phase_names[phase],
+						   (unsigned long long) (phase_nanoseconds[phase] / 1000));
+	}
+
+	fprintf(stderr, "Slow request %.*s: %lluus,%s\n", (int) path_length, path,
+			(unsigned long long) (request_nanoseconds / 1000), breakdown);
+}
+
+
+
+static
+void print_histogram(const char *name, int32_t row) {
+	uint64_t count = 0;
+
+	for(int32_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+		count += histograms[row][bucket];
+	}
+
+	fprintf(stderr, "  %s: %llu requests, mean %lluus\n", name, (unsigned long long) count,
+			(unsigned long long) (count == 0 ? 0 : total_nanoseconds[row] / count / 1000));
+
+	for(int32_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+		if(histograms[row][bucket] != 0) {
+			fprintf(stderr, "    < %lluns: %llu\n", 2ull << bucket, (unsigned long long) histograms[row][bucket]);
+		}
+	}
+}
+
+
+
+void print_timing_histograms(void) {
+	fprintf(stderr, "Request phase latencies (worker pid %d):\n", (int) getpid());
+
+	for(int32_t phase = 0; phase < PHASES_COUNT; ++phase) {
+		print_histogram(phase_names[phase], phase);
+	}
+
+	print_histogram("total", PHASES_COUNT);
+}
+
+
+
+#else /* WITH_TIMING */
+
+
+
+int32_t set_slow_request_threshold(long threshold) {
+	(void) threshold;
+
+	fprintf(stderr, "Server has been built without timing support\n");
+	return -1;
+}
+
+
+
+void init_timing(void) {
+}
+
+
+
+void print_timing_histograms(void) {
+	fprintf(stderr, "Server has been built without timing support\n");
+}
+
+
+
+void start_request_timing(request_timing_t *timing) {
+	(void) timing;
+}
+
+
+
+void end_request_phase(request_timing_t *timing, int32_t phase) {
+	(void) timing;
+	(void) phase;
+}
+
+
+
+void finish_request_timing(request_timing_t *timing, const char *path, size_t path_length) {
+	(void) timing;
+	(void) path;
+	(void) path_length;
+}
+
+
+
+#endif /* WITH_TIMING */
@@ -0,0 +1,105 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+
+/* Phases of request processing, each of them lasts from the end of the
+ * previous one (or the start of request processing) to its own end
+ */
+#define PHASE_REQUEST_LINE 			0 	/* parsing request line */
+#define PHASE_HEADERS 				1 	/* parsing headers */
+#define PHASE_RESOLVE 				2 	/* realpath(), open() and stat() on the offload pool */
+#define PHASE_CORELATED 			3 	/* corelated servers file lookup */
+#define PHASE_HEADER_SEND 			4 	/* writing status line and headers */
+#define PHASE_BODY_SEND 			5 	/* writing the body */
+#define PHASES_COUNT 				6
+
+
+
+/* Requests taking longer than this (in microseconds) are
+ * written to the slow request log by default
+ */
+#define DEFAULT_SLOW_REQUEST_THRESHOLD 	 100000
+
+
+
+typedef struct request_timing_t request_timing_t;
+
+
+
+/* Timestamps of a single request, in clock ticks
+ */
+struct request_timing_t {
+	/* Start of request processing, 0 when no request is being timed
+	 */
+	uint64_t start;
+	uint64_t last;
+
+	/* Phases are stamped in order, a phase stamped repeatedly
+	 * (or out of order) keeps its first stamp
+	 */
+	int32_t next_phase;
+
+	/* Bit mask of phases the request went through, skipped ones
+	 * are not added to the histograms
+	 */
+	uint32_t stamped_phases;
+
+	uint64_t phase_ticks[PHASES_COUNT];
+};
+
+
+
+/* Sets threshold (in microseconds, 0 disables the log) of the slow request log.
+ * Returns 0 on success and -1 when the server has been built without timing
+ * support.
+ */
+int32_t set_slow_request_threshold(long);
+
+
+
+/* Calibrates the clock, called before the workers are started
+ */
+void init_timing(void);
+
+
+
+/* Prints per-phase latency histograms of the calling worker to standard error
+ */
+void print_timing_histograms(void);
+
+
+
+void start_request_timing(request_timing_t *);
+void end_request_phase(request_timing_t *, int32_t);
+
+
+
+/* Ends the last phase, adds the phases to the histograms and logs the request
+ * with passed path (and its length) if it exceeded the slow request threshold
+ */
+void finish_request_timing(request_timing_t *, const char *, size_t);
+
+
+
+/* Timing is compiled in with WITH_TIMING only, otherwise the stamps
+ * (including evaluation of their arguments) disappear
+ */
+#ifdef WITH_TIMING
+#define TIMING_START(timing) 					start_request_timing(timing)
+#define TIMING_PHASE(timing, phase) 			end_request_phase((timing), (phase))
+#define TIMING_FINISH(timing, path, length) 	finish_request_timing((timing), (path), (length))
+#else
+#define TIMING_START(timing) 					((void) 0)
+#define TIMING_PHASE(timing, phase) 			((void) 0)
+#define TIMING_FINISH(timing, path, length) 	((void) 0)
+#endif /* WITH_TIMING */
+
+
+
+#endif /* TIMING_H */
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "tls.h"
+
+
+
+#ifdef WITH_TLS
+
+
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+
+
+/* Number of session tickets issued after each full
+ * TLSv1.3 handshake
+ */
+#define SESSION_TICKETS 		 2
+
+
+
+static SSL_CTX *tls_context = NULL;
+
+
+
+int32_t init_tls(const char *certificate_file, const char *key_file) {
+	tls_context = SSL_CTX_new(TLS_server_method());
+
+	if(tls_context == NULL) {
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+
+	SSL_CTX_set_min_proto_version(tls_context, TLS1_2_VERSION);
+
+	/* Kernel TLS lets the body go through sendfile() after the handshake,
+	 * the library silently falls back when the kernel does not support it
+	 */
+	SSL_CTX_set_options(tls_context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+
+	/* Session resumption: stateless tickets (keys are generated with the context,
+	 * so they are shared by all workers forked afterwards) and a server side
+	 * session cache for clients which do not support tickets
+	 */
+	SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_num_tickets(tls_context, SESSION_TICKETS);
+
+	SSL_CTX_set_mode(tls_context, SSL_MODE_ENABLE_PARTIAL_WRITE |
+								  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+								  SSL_MODE_RELEASE_BUFFERS);
+
+	if(SSL_CTX_use_certificate_chain_file(tls_context, certificate_file) != 1 ||
+	   SSL_CTX_use_PrivateKey_file(tls_context, key_file, SSL_FILETYPE_PEM) != 1 ||
+	   SSL_CTX_check_private_key(tls_context) != 1) {
+
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(tls_context);
+		tls_context = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+void *new_tls_session(int32_t client_socket) {
+	if(tls_context == NULL) {
+		return NULL;
+	}
+
+	SSL *ssl = SSL_new(tls_context);
+
+	if(ssl == NULL) {
+		return NULL;
+	}
+
+	if(SSL_set_fd(ssl, client_socket) != 1) {
+		SSL_free(ssl);
+		return NULL;
+	}
+
+	SSL_set_accept_state(ssl);
+	return ssl;
+}
+
+
+
+void delete_tls_session(void *session) {
+	SSL *ssl = session;
+
+	/* Socket is non-blocking - send close_notify if it fits,
+	 * do not wait for the peer's one
+	 */
+	if(SSL_is_init_finished(ssl)) {
+		SSL_shutdown(ssl);
+	}
+
+	SSL_free(ssl);
+	ERR_clear_error();
+}
+
+
+
+/* Translates result of failed SSL_* call into errno convention used
+ * by the connection layer
+ */
+static
+ssize_t failed_operation(SSL *ssl, int32_t result, bool *wants_write) {
+	int32_t error = SSL_get_error(ssl, result);
+
+	switch(error) {
+		case SSL_ERROR_WANT_READ:
+			if(wants_write != NULL) {
+				*wants_write = false;
+			}
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_WANT_WRITE:
+			if(wants_write != NULL) {
+				*wants_write = true;
+			}
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		default:
+			ERR_clear_error();
+			errno = EIO;
+			return -1;
+	}
+}
+
+
+
+int32_t tls_handshake(void *session, bool *wants_write) {
+	SSL *ssl = session;
+	int32_t result = SSL_do_handshake(ssl);
+
+	if(result == 1) {
+		return 1;
+	}
+
+	if(failed_operation(ssl, result, wants_write) < 0 && errno == EAGAIN) {
+		return 0;
+	}
+
+	return -1;
+}
+
+
+
+bool tls_kernel_send(void *session) {
+	return BIO_get_ktls_send(SSL_get_wbio((SSL *) session));
+}
+
+
+
+ssize_t tls_read(void *session, void *buffer, size_t length) {
+	SSL *ssl = session;
+	size_t read_bytes = 0;
+
+	int32_t result = SSL_read_ex(ssl, buffer, length, &read_bytes);
+
+	if(result == 1) {
+		return read_bytes;
+	}
+
+	return failed_operation(ssl, result, NULL);
+}
+
+
+
+ssize_t tls_write(void *session, const void *buffer, size_t length) {
+	SSL *ssl = session;
+	size_t written = 0;
+
+	int32_t result = SSL_write_ex(ssl, buffer, length, &written);
+
+	if(result == 1) {
+		return written;
+	}
+
+	if(failed_operation(ssl, result, NULL) == 0) {
+		errno = EPIPE;
+	}
+
+	return -1;
+}
+
+
+
+ssize_t tls_sendfile(void *session, int32_t fd, off_t offset, size_t length) {
+	SSL *ssl = session;
+
+	ossl_ssize_t sent = SSL_sendfile(ssl, fd, offset, length, 0);
+
+	if(sent >= 0) {
+		return sent;
+	}
+
+	if(failed_operation(ssl, (int32_t) sent, NULL) == 0) {
+		errno = EPIPE;
+	}
+
+	return -1;
+}
+
+
+
+bool tls_has_pending(void *session) {
+	return (SSL_pending((SSL *) session) > 0);
+}
+
+
+
+#else /* WITH_TLS */
+
+
+
+int32_t init_tls(const char *certificate_file, const char *key_file) {
+	(void) certificate_file;
+	(void) key_file;
+
+	fprintf(stderr, "Server has been built without TLS support\n");
+	return -1;
+}
+
+
+
+void *new_tls_session(int32_t client_socket) {
+	(void) client_socket;
+	return NULL;
+}
+
+
+
+void delete_tls_session(void *session) {
+	(void) session;
+}
+
+
+
+int32_t tls_handshake(void *session, bool *wants_write) {
+	(void) session;
+	(void) wants_write;
+	return -1;
+}
+
+
+
+bool tls_kernel_send(void *session) {
+	(void) session;
+	return false;
+}
+
+
+
+ssize_t tls_read(void *session, void *buffer, size_t length) {
+	(void) session;
+	(void) buffer;
+	(void) length;
+
+	errno = EIO;
+	return -1;
+}
+
+
+
+ssize_t tls_write(void *session, const void *buffer, size_t length) {
+	(void) session;
+	(void) buffer;
+	(void) length;
+
+	errno = EIO;
+	return -1;
+}
+
+
+
+ssize_t tls_sendfile(void *session, int32_t fd, off_t offset, size_t length) {
+	(void) session;
+	(void) fd;
+	(void) offset;
+	(void) length;
+
+	errno = EIO;
+	return -1;
+}
+
+
+
+bool tls_has_pending(void *session) {
+	(void) session;
+	return false;
+}
+
+
+
+#endif /* WITH_TLS */
@@ -0,0 +1,74 @@
+#ifndef TLS_H
+#define TLS_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+
+
+/* Creates TLS context shared by all connections accepted on TLS listeners
+ * from certificate chain and private key files (PEM). Has to be called
+ * before workers are started, so that they share session ticket keys and
+ * sessions resumed on any of them. Returns 0 on success and -1 on failure
+ * (or when the server has been built without TLS support).
+ */
+int32_t init_tls(const char *, const char *);
+
+
+
+/* Creates TLS session for accepted client socket. Returns NULL
+ * on failure
+ */
+void *new_tls_session(int32_t);
+
+
+
+/* Closes TLS session (best effort close_notify) and
+ * deallocates it
+ */
+void delete_tls_session(void *);
+
+
+
+/* Advances server side handshake. Returns 1 once it has completed,
+ * 0 when it has to wait for the socket (wants_write is set when the
+ * socket has to become writable) and -1 on failure.
+ */
+int32_t tls_handshake(void *, bool *);
+
+
+
+/* Checks whether handshake negotiated kernel TLS for sending, in which
+ * case tls_sendfile() keeps the body transfer zero-copy
+ */
+bool tls_kernel_send(void *);
+
+
+
+/* read() / write() counterparts - return -1 with errno set to EAGAIN
+ * when the operation has to wait for the socket, -1 with errno set to
+ * EIO on TLS failure, and 0 from tls_read() on closed connection
+ */
+ssize_t tls_read(void *, void *, size_t);
+ssize_t tls_write(void *, const void *, size_t);
+
+
+
+/* sendfile() counterpart for sessions with kernel TLS, sends up to
+ * given number of bytes from the file at given offset
+ */
+ssize_t tls_sendfile(void *, int32_t, off_t, size_t);
+
+
+
+/* Checks whether session holds decrypted bytes which have not been
+ * read yet (the socket will not report them as readable)
+ */
+bool tls_has_pending(void *);
+
+
+
+#endif /* TLS_H */
@@ -0,0 +1,228 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stats.h"
+
+
+
+/* Live view of the statistics segment of a running server: rates of every
+ * worker over the last interval and totals since the server was started
+ */
+
+
+
+static
+void print_usage(const char *program_name) {
+	fprintf(stderr, "Usage: %s [-i interval-seconds] [-n iterations] <stats-segment>\n", program_name);
+	fprintf(stderr, "Stats segment: name passed to the -S server option (e.g. /serwer)\n");
+}
+
+
+
+/* Copies counters of the workers, each of them read atomically
+ */
+static
+void take_sample(const struct stats_segment *segment, struct worker_stats *sample) {
+	for(int32_t i = 0; i < segment->workers_count; ++i) {
+		const uint64_t *counters = (const uint64_t *) &segment->workers[i];
+		uint64_t *copy = (uint64_t *) &sample[i];
+
+		for(size_t j = 0; j < sizeof(struct worker_stats) / sizeof(uint64_t); ++j) {
+			copy[j] = __atomic_load_n(&counters[j], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+
+static
+void add_counters(struct worker_stats *total, const struct worker_stats *worker) {
+	uint64_t *sum = (uint64_t *) total;
+	const uint64_t *counters = (const uint64_t *) worker;
+
+	for(size_t j = 0; j < sizeof(struct worker_stats) / sizeof(uint64_t); ++j) {
+		sum[j] += counters[j];
+	}
+}
+
+
+
+static
+void print_row(const char *label, const struct worker_stats *now, const struct worker_stats *before, double interval) {
+	uint64_t cache_lookups = (now->cache_hits - before->cache_hits) + (now->cache_misses - before->cache_misses);
+
+	printf("%-7s %9.0f %8.0f %8.0f %8.0f %8.0f %9.2f %7llu %9.0f ",
+		   label,
+		   (now->requests - before->requests) / interval,
+		   (now->statuses[2] - before->statuses[2]) / interval,
+		   (now->statuses[3] - before->statuses[3]) / interval,
+		   (now->statuses[4] - before->statuses[4]) / interval,
+		   (now->statuses[5] - before->statuses[5]) / interval,
+		   (now->bytes_sent - before->bytes_sent) / interval / (1 << 20),
+		   (unsigned long long) now->connections_active,
+		   (now->connections_accepted - before->connections_accepted) / interval);
+
+	if(cache_lookups > 0) {
+		printf("%6.1f%% ", 100.0 * (now->cache_hits - before->cache_hits) / cache_lookups);
+	}
+	else {
+		printf("%7s ", "-");
+	}
+
+	printf("%10.0f\n", (now->corelated_lookups - before->corelated_lookups) / interval);
+}
+
+
+
+static
+void print_screen(const struct stats_segment *segment, const struct worker_stats *now,
+				  const struct worker_stats *before, double interval, bool clear) {
+
+	int32_t workers_count = segment->workers_count;
+	time_t current = time(NULL);
+	long uptime = (long) (current - segment->started_at);
+	bool running = (kill(segment->supervisor_pid, 0) == 0 || errno == EPERM);
+
+	if(clear) {
+		printf("\033[H\033[2J");
+	}
+
+	printf("serwer pid %d%s, up %ldh%02ldm%02lds, %d worker%s, interval %.1fs\n\n",
+		   segment->supervisor_pid, running ? "" : " (not running)",
+		   uptime / 3600, uptime / 60 % 60, uptime % 60,
+		   workers_count, (workers_count == 1) ? "" : "s", interval);
+
+	printf("%-7s %9s %8s %8s %8s %8s %9s %7s %9s %7s %10s\n",
+		   "worker", "req/s", "2xx/s", "3xx/s", "4xx/s", "5xx/s", "MiB/s", "conns", "accept/s", "cache", "corel/s");
+
+	struct worker_stats total_now;
+	struct worker_stats total_before;
+	memset(&total_now, 0, sizeof(total_now));
+	memset(&total_before, 0, sizeof(total_before));
+
+	for(int32_t i = 0; i < workers_count; ++i) {
+		char label[16];
+		snprintf(label, sizeof(label), "%d", i);
+
+		print_row(label, &now[i], &before[i], interval);
+
+		add_counters(&total_now, &now[i]);
+		add_counters(&total_before, &before[i]);
+	}
+
+	print_row("total", &total_now, &total_before, interval);
+
+	printf("\nSince start: %llu requests (%llu 2xx, %llu 3xx, %llu 4xx, %llu 5xx), %.1f MiB sent, "
+		   "%llu connections, %llu cache hits, %llu corelated lookups\n",
+		   (unsigned long long) total_now.requests,
+		   (unsigned long long) total_now.statuses[2], (unsigned long long) total_now.statuses[3],
+		   (unsigned long long) total_now.statuses[4], (unsigned long long) total_now.statuses[5],
+		   total_now.bytes_sent / (double) (1 << 20),
+		   (unsigned long long) total_now.connections_accepted,
+		   (unsigned long long) total_now.cache_hits,
+		   (unsigned long long) total_now.corelated_lookups);
+
+	fflush(stdout);
+}
+
+
+
+int main(int argc, char *argv[]) {
+	double interval = 1.0;
+	long iterations = -1;
+	int32_t option;
+
+	while((option = getopt(argc, argv, "i:n:")) != -1) {
+		switch(option) {
+			case 'i':
+				interval = strtod(optarg, NULL);
+
+				if(interval < 0.1) {
+					fprintf(stderr, "Interval has to be at least 0.1 second\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'n':
+				iterations = strtol(optarg, NULL, 10);
+				break;
+			default:
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if(optind != argc - 1) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	const char *name = argv[optind];
+	int32_t fd = shm_open(name, O_RDONLY, 0);
+
+	if(fd < 0) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat statbuf;
+
+	if(fstat(fd, &statbuf) < 0) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+
+	const struct stats_segment *segment = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(segment == MAP_FAILED) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+
+	if((size_t) statbuf.st_size < sizeof(struct stats_segment) ||
+	   memcmp(segment->magic, STATS_MAGIC, sizeof(segment->magic)) != 0 ||
+	   segment->workers_count < 1 || segment->workers_count > STATS_MAX_WORKERS ||
+	   (size_t) statbuf.st_size < sizeof(struct stats_segment) + segment->workers_count * sizeof(struct worker_stats)) {
+
+		fprintf(stderr, "%s: not a statistics segment of the server\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	struct worker_stats *before = calloc(segment->workers_count, sizeof(struct worker_stats));
+	struct worker_stats *now = calloc(segment->workers_count, sizeof(struct worker_stats));
+
+	if(before == NULL || now == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	bool clear = isatty(STDOUT_FILENO);
+	struct timespec delay = { (time_t) interval, (long) ((interval - (time_t) interval) * 1e9) };
+
+	take_sample(segment, before);
+
+	while(iterations != 0) {
+		nanosleep(&delay, NULL);
+		take_sample(segment, now);
+
+		print_screen(segment, now, before, interval, clear);
+
+		struct worker_stats *swap = before;
+		before = now;
+		now = swap;
+
+		if(iterations > 0) {
+			iterations--;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "upload.h"
+
+
+
+/* Capacity requested for the pipe the body is spliced through
+ */
+#define UPLOAD_PIPE_SIZE 		 (1 << 20)
+
+
+
+/* Name of temporary file within the target directory, '~' is not allowed
+ * in request paths so the file can not be requested while being written
+ */
+#define TEMP_FILE_TEMPLATE 		 ".put~XXXXXX"
+
+
+
+/* Chunk sizes with more hexadecimal digits are rejected
+ */
+#define MAX_CHUNK_DIGITS 			15
+
+
+
+/* States of body decoding
+ */
+#define UPLOAD_DATA 				0 	/* body bytes (or data of a chunk) */
+#define CHUNK_SIZE 					1 	/* chunk size digits */
+#define CHUNK_EXTENSION 			2 	/* chunk extensions, ignored */
+#define CHUNK_SIZE_LF 				3 	/* LF ending chunk size line */
+#define CHUNK_DATA_CR 				4 	/* CRLF following chunk data */
+#define CHUNK_DATA_LF 				5
+#define CHUNK_TRAILER 				6 	/* trailer fields, ignored */
+#define CHUNK_TRAILER_LF 			7
+#define UPLOAD_DONE 				8
+
+
+
+upload_t *new_upload(int32_t client_socket, const char *path, const char *catalogue_path,
+					 off_t length, bool chunked) {
+
+	upload_t *upload = calloc(1, sizeof(upload_t));
+
+	if(upload == NULL) {
+		return NULL;
+	}
+
+	upload->client_socket = client_socket;
+	upload->path = path;
+	upload->catalogue_path = catalogue_path;
+	upload->fd = -1;
+	upload->pipe_fds[0] = -1;
+	upload->pipe_fds[1] = -1;
+	upload->chunked = chunked;
+
+	if(chunked) {
+		upload->chunk_state = CHUNK_SIZE;
+	}
+	else {
+		upload->chunk_state = (length > 0) ? UPLOAD_DATA : UPLOAD_DONE;
+		upload->remaining = length;
+	}
+
+	return upload;
+}
+
+
+
+void delete_upload(upload_t *upload) {
+	if(upload->fd >= 0) {
+		close(upload->fd);
+	}
+
+	if(upload->pipe_fds[0] >= 0) {
+		close(upload->pipe_fds[0]);
+		close(upload->pipe_fds[1]);
+	}
+
+	/* Not committed (or failed to be committed)
+	 */
+	if(upload->temp_path != NULL) {
+		unlink(upload->temp_path);
+	}
+
+	free(upload->temp_path);
+	free(upload->target_path);
+	free(upload);
+}
+
+
+
+static
+bool is_within_catalogue(const char *catalogue_path, const char *path) {
+	size_t length = strlen(catalogue_path);
+
+	return (strncmp(catalogue_path, path, length) == 0 && (path[length] == '/' || path[length] == '\0'));
+}
+
+
+
+void open_upload_file(offload_job_t *job) {
+	upload_t *upload = (upload_t *) job;
+
+	const char *separator = strrchr(upload->path, '/');
+	const char *name = separator + 1;
+
+	if(*name == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		upload->status = -2;
+		return;
+	}
+
+	char directory[PATH_MAX];
+	size_t directory_length = separator - upload->path;
+
+	if(directory_length >= sizeof(directory)) {
+		upload->status = -2;
+		return;
+	}
+
+	memcpy(directory, upload->path, directory_length);
+	directory[directory_length] = '\0';
+
+	errno = 0;
+	char *directory_realpath = realpath(directory, NULL);
+
+	if(directory_realpath == NULL) {
+		upload->status = (errno == ENOMEM) ? -1 : -2;
+		return;
+	}
+
+	if(!is_within_catalogue(upload->catalogue_path, directory_realpath)) {
+		free(directory_realpath);
+		upload->status = -2;
+		return;
+	}
+
+	size_t target_size = strlen(directory_realpath) + strlen(name) + 2;
+	size_t temp_size = strlen(directory_realpath) + sizeof(TEMP_FILE_TEMPLATE) + 1;
+
+	upload->target_path = malloc(target_size);
+	upload->temp_path = malloc(temp_size);
+
+	if(upload->target_path == NULL || upload->temp_path == NULL) {
+		free(directory_realpath);
+		free(upload->temp_path);
+		upload->temp_path = NULL;
+		upload->status = -1;
+		return;
+	}
+
+	snprintf(upload->target_path, target_size, "%s/%s", directory_realpath, name);
+	snprintf(upload->temp_path, temp_size, "%s/%s", directory_realpath, TEMP_FILE_TEMPLATE);
+	free(directory_realpath);
+
+	struct stat statbuf;
+
+	if(stat(upload->target_path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
+		free(upload->temp_path);
+		upload->temp_path = NULL;
+		upload->status = -2;
+		return;
+	}
+
+	upload->fd = mkostemp(upload->temp_path, O_CLOEXEC);
+
+	if(upload->fd < 0) {
+		free(upload->temp_path);
+		upload->temp_path = NULL;
+		upload->status = -1;
+		return;
+	}
+
+	fchmod(upload->fd, 0644);
+	upload->status = 0;
+}
+
+
+
+void commit_upload_file(offload_job_t *job) {
+	upload_t *upload = (upload_t *) job;
+
+	upload->replaced = (access(upload->target_path, F_OK) == 0);
+
+	if(rename(upload->temp_path, upload->target_path) < 0) {
+		upload->status = -1;
+		return;
+	}
+
+	free(upload->temp_path);
+	upload->temp_path = NULL;
+	upload->status = 0;
+}
+
+
+
+static
+int32_t hex_digit_value(char c) {
+	if(c >= '0' && c <= '9') {
+		return c - '0';
+	}
+
+	if(c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+
+	if(c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+
+	return -1;
+}
+
+
+
+/* Advances chunked coding framing over one byte. Returns -1
+ * if the byte is not allowed in the current state
+ */
+static
+int32_t decode_framing_byte(upload_t *upload, char c) {
+	switch(upload->chunk_state) {
+		case CHUNK_SIZE:
+			if(hex_digit_value(c) >= 0 && upload->chunk_digits < MAX_CHUNK_DIGITS) {
+				upload->remaining = upload->remaining * 16 + hex_digit_value(c);
+				upload->chunk_digits++;
+				return 0;
+			}
+
+			if(upload->chunk_digits == 0) {
+				return -1;
+			}
+
+			if(c == ';' || c == ' ' || c == '\t') {
+				upload->chunk_state = CHUNK_EXTENSION;
+			}
+			else if(c == '\r') {
+				upload->chunk_state = CHUNK_SIZE_LF;
+			}
+			else {
+				return -1;
+			}
+
+			return 0;
+		case CHUNK_EXTENSION:
+			if(c == '\r') {
+				upload->chunk_state = CHUNK_SIZE_LF;
+			}
+			else if(c == '\n') {
+				return -1;
+			}
+
+			return 0;
+		case CHUNK_SIZE_LF:
+			if(c != '\n') {
+				return -1;
+			}
+
+			/* Last chunk is followed by (possibly empty) trailer
+			 */
+			upload->chunk_state = (upload->remaining > 0) ? UPLOAD_DATA : CHUNK_TRAILER;
+			upload->trailer_line_length = 0;
+			return 0;
+		case CHUNK_DATA_CR:
+			upload->chunk_state = CHUNK_DATA_LF;
+			return (c == '\r') ? 0 : -1;
+		case CHUNK_DATA_LF:
+			upload->chunk_state = CHUNK_SIZE;
+			upload->remaining = 0;
+			upload->chunk_digits = 0;
+			return (c == '\n') ? 0 : -1;
+		case CHUNK_TRAILER:
+			if(c == '\r') {
+				upload->chunk_state = CHUNK_TRAILER_LF;
+			}
+			else if(c == '\n') {
+				return -1;
+			}
+			else {
+				upload->trailer_line_length++;
+			}
+
+			return 0;
+		case CHUNK_TRAILER_LF:
+			if(c != '\n') {
+				return -1;
+			}
+
+			upload->chunk_state = (upload->trailer_line_length == 0) ? UPLOAD_DONE : CHUNK_TRAILER;
+			upload->trailer_line_length = 0;
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+
+
+int32_t receive_upload_body(connection_t *conn, upload_t *upload) {
+	/* Plaintext bodies are spliced from the socket into the file
+	 */
+	if(conn->tls == NULL && upload->pipe_fds[0] < 0) {
+		if(pipe2(upload->pipe_fds, O_CLOEXEC) < 0) {
+			upload->pipe_fds[0] = -1;
+			upload->pipe_fds[1] = -1;
+			return -1;
+		}
+
+		fcntl(upload->pipe_fds[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+	}
+
+	while(upload->chunk_state != UPLOAD_DONE) {
+		if(upload->chunk_state == UPLOAD_DATA) {
+			if(upload->remaining == 0) {
+				upload->chunk_state = upload->chunked ? CHUNK_DATA_CR : UPLOAD_DONE;
+				continue;
+			}
+
+			ssize_t moved = receive_into_file(conn, upload->fd, &upload->written, upload->remaining, upload->pipe_fds);
+
+			if(moved == -2) {
+				return 0;
+			}
+
+			/* Client closed the connection before sending the whole body
+			 */
+			if(moved <= 0) {
+				return -1;
+			}
+
+			upload->remaining -= moved;
+			continue;
+		}
+
+		/* Framing of chunked coding is read into connection input,
+		 * which may bring chunk data along
+		 */
+		if(conn->input_length == 0) {
+			ssize_t read_bytes = fill_input(conn);
+
+			if(read_bytes == -2) {
+				return 0;
+			}
+
+			if(read_bytes <= 0) {
+				return -1;
+			}
+		}
+
+		size_t consumed = 0;
+
+		while(consumed < conn->input_length && upload->chunk_state != UPLOAD_DATA &&
+			  upload->chunk_state != UPLOAD_DONE) {
+
+			if(decode_framing_byte(upload, conn->input[consumed]) < 0) {
+				return -2;
+			}
+
+			consumed++;
+		}
+
+		consume_input(conn, consumed);
+	}
+
+	return 1;
+}
@@ -0,0 +1,111 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "connection.h"
+#include "offload_pool.h"
+
+
+
+/* Body of PUT request being stored in the catalogue. The body is written into
+ * a temporary file created next to the target (named so that it can never be
+ * requested, see check_request_path_characters()), which is renamed over the
+ * target once the whole body has been received. The structure doubles as the
+ * offload job opening and committing the file.
+ */
+typedef struct upload_t upload_t;
+
+
+
+struct upload_t {
+	offload_job_t job;
+
+	int32_t client_socket;
+
+	/* Catalogue path concatenated with requested path, and the catalogue
+	 * path itself (both have to stay valid until the upload completes)
+	 */
+	const char *path;
+	const char *catalogue_path;
+
+	/* Result of the last job, status is one of:
+	 *  0 <---> success
+	 * -1 <---> memory / file system error (http 500)
+	 * -2 <---> target outside the catalogue, in a missing directory
+	 *          or being a directory (http 404)
+	 */
+	int32_t status;
+
+	/* Target file existed before the upload was committed
+	 */
+	bool replaced;
+
+	int32_t fd;
+	char *temp_path;
+	char *target_path;
+
+	/* Body framing - fixed length (remaining bytes of it) or chunked
+	 * transfer coding, decoded as the body arrives
+	 */
+	bool chunked;
+	int32_t chunk_state;
+	off_t remaining;
+	int32_t chunk_digits;
+	int32_t trailer_line_length;
+
+	/* Number of body bytes written to the file
+	 */
+	off_t written;
+
+	/* Pipe the body is spliced through from the socket into the
+	 * file, -1 for TLS connections
+	 */
+	int32_t pipe_fds[2];
+};
+
+
+
+/* Creates upload of body with passed length (ignored for chunked one) for the
+ * client socket and path (catalogue path concatenated with requested path).
+ * Returns NULL on memory error.
+ */
+upload_t *new_upload(int32_t, const char *, const char *, off_t, bool);
+
+
+
+/* Closes the file and pipe, removes temporary file which has not been
+ * committed and deallocates the upload
+ */
+void delete_upload(upload_t *);
+
+
+
+/* Resolves directory of the target within the catalogue and creates the
+ * temporary file in it (offload_job_t run callback)
+ */
+void open_upload_file(offload_job_t *);
+
+
+
+/* Renames complete temporary file over the target
+ * (offload_job_t run callback)
+ */
+void commit_upload_file(offload_job_t *);
+
+
+
+/* Moves as much of the body as is available from the connection into
+ * the file, decoding chunked transfer coding. Returns 1 once the whole
+ * body has been received, 0 when the socket has to become readable,
+ * -1 on connection error (or premature end of the body) and -2 on
+ * malformed chunked body (http 400).
+ */
+int32_t receive_upload_body(connection_t *, upload_t *);
+
+
+
+#endif /* UPLOAD_H */
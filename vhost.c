@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include "vhost.h"
+
+
+
+/* Maximum length of host name (without port)
+ */
+#define MAX_HOST_LENGTH 			 255
+
+
+
+static vhost_t default_vhost;
+static bool default_vhost_set = false;
+
+
+
+/* Sites loaded from the file, and open addressing table of them keyed by
+ * hash of the host name (power of two size, at most half of slots used)
+ */
+static vhost_t **vhosts = NULL;
+static size_t vhosts_count = 0;
+static size_t vhosts_capacity = 0;
+
+static vhost_t **vhost_slots = NULL;
+static size_t vhost_slots_count = 0;
+
+
+
+/* FNV-1a hash of host name, letters are hashed in lowercase
+ */
+static
+uint64_t hash_host(const char *host, size_t length) {
+	uint64_t hash = 14695981039346656037ull;
+
+	for(size_t i = 0; i < length; ++i) {
+		hash ^= (unsigned char) tolower((unsigned char) host[i]);
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+
+
+/* Strips port and the trailing dot of fully qualified name from host
+ * name of passed length, returns the length of what remains
+ */
+static
+size_t strip_host(const char *host, size_t length) {
+	if(length > 0 && host[0] == '[') {
+		const char *end = memchr(host, ']', length);
+
+		return (end == NULL) ? length : (size_t) (end - host) + 1;
+	}
+
+	const char *colon = memchr(host, ':', length);
+
+	if(colon != NULL) {
+		length = colon - host;
+	}
+
+	if(length > 0 && host[length - 1] == '.') {
+		length--;
+	}
+
+	return length;
+}
+
+
+
+static
+void delete_vhost_archive(vhost_t *vhost) {
+	if(vhost->archive != NULL) {
+		close_archive(vhost->archive);
+	}
+
+	free(vhost->archive_path);
+}
+
+
+
+static
+int32_t init_vhost(vhost_t *vhost, const char *catalogue, const char *corelated_servers_file) {
+	vhost->catalogue_path = realpath(catalogue, NULL);
+
+	if(vhost->catalogue_path == NULL) {
+		perror(catalogue);
+		return -1;
+	}
+
+	vhost->catalogue_length = strlen(vhost->catalogue_path);
+
+	/* Path of the archive is kept as passed, so that replacing
+	 * a symbolic link deploys another archive as well
+	 */
+	vhost->archive_path = NULL;
+	vhost->archive = NULL;
+
+	if(is_archive_path(catalogue)) {
+		vhost->archive_path = strdup(catalogue);
+
+		if(vhost->archive_path == NULL || stat(catalogue, &vhost->archive_stat) < 0 ||
+		   (vhost->archive = open_archive(catalogue)) == NULL) {
+
+			free(vhost->archive_path);
+			free(vhost->catalogue_path);
+			return -1;
+		}
+
+		vhost->archive_checked = time(NULL);
+	}
+
+	vhost->corelated_servers_file = strdup(corelated_servers_file);
+
+	if(vhost->corelated_servers_file == NULL) {
+		delete_vhost_archive(vhost);
+		free(vhost->catalogue_path);
+		return -1;
+	}
+
+	/* Rules are compiled before the workers are started, which
+	 * share them until the file changes
+	 */
+	vhost->redirects = NULL;
+
+	if(stat(corelated_servers_file, &vhost->redirects_stat) < 0 ||
+	   (vhost->redirects = load_redirect_index(corelated_servers_file)) == NULL) {
+
+		perror(corelated_servers_file);
+		free(vhost->corelated_servers_file);
+		delete_vhost_archive(vhost);
+		free(vhost->catalogue_path);
+		return -1;
+	}
+
+	vhost->redirects_checked = time(NULL);
+	return 0;
+}
+
+
+
+vhost_t *set_default_vhost(const char *catalogue, const char *corelated_servers_file) {
+	default_vhost.host = NULL;
+	default_vhost.host_length = 0;
+
+	if(init_vhost(&default_vhost, catalogue, corelated_servers_file) < 0) {
+		return NULL;
+	}
+
+	default_vhost_set = true;
+	return &default_vhost;
+}
+
+
+
+vhost_t *get_default_vhost(void) {
+	return default_vhost_set ? &default_vhost : NULL;
+}
+
+
+
+static
+vhost_t *find_loaded_vhost(const char *host, size_t length) {
+	if(vhost_slots_count == 0) {
+		return NULL;
+	}
+
+	size_t slot = hash_host(host, length) & (vhost_slots_count - 1);
+
+	while(vhost_slots[slot] != NULL) {
+		vhost_t *vhost = vhost_slots[slot];
+
+		if(vhost->host_length == length && strncasecmp(vhost->host, host, length) == 0) {
+			return vhost;
+		}
+
+		slot = (slot + 1) & (vhost_slots_count - 1);
+	}
+
+	return NULL;
+}
+
+
+
+/* Rebuilds the table of sites so that it has at least twice as many slots
+ * as there are sites
+ */
+static
+int32_t build_vhost_slots(void) {
+	size_t slots_count = 16;
+
+	while(slots_count < 2 * vhosts_count) {
+		slots_count *= 2;
+	}
+
+	vhost_t **slots = calloc(slots_count, sizeof(vhost_t *));
+
+	if(slots == NULL) {
+		return -1;
+	}
+
+	for(size_t i = 0; i < vhosts_count; ++i) {
+		size_t slot = hash_host(vhosts[i]->host, vhosts[i]->host_length) & (slots_count - 1);
+
+		while(slots[slot] != NULL) {
+			slot = (slot + 1) & (slots_count - 1);
+		}
+
+		slots[slot] = vhosts[i];
+	}
+
+	free(vhost_slots);
+	vhost_slots = slots;
+	vhost_slots_count = slots_count;
+
+	return 0;
+}
+
+
+
+static
+int32_t add_vhost(const char *host, const char *catalogue, const char *corelated_servers_file) {
+	size_t host_length = strip_host(host, strlen(host));
+
+	if(host_length == 0 || host_length > MAX_HOST_LENGTH) {
+		fprintf(stderr, "Invalid virtual host name %s\n", host);
+		return -1;
+	}
+
+	if(find_loaded_vhost(host, host_length) != NULL) {
+		fprintf(stderr, "Duplicate virtual host %s\n", host);
+		return -1;
+	}
+
+	if(vhosts_count == vhosts_capacity) {
+		size_t capacity = (vhosts_capacity == 0) ? 16 : 2 * vhosts_capacity;
+		vhost_t **resized = realloc(vhosts, capacity * sizeof(vhost_t *));
+
+		if(resized == NULL) {
+			return -1;
+		}
+
+		vhosts = resized;
+		vhosts_capacity = capacity;
+	}
+
+	vhost_t *vhost = malloc(sizeof(vhost_t));
+
+	if(vhost == NULL) {
+		return -1;
+	}
+
+	vhost->host = strndup(host, host_length);
+
+	if(vhost->host == NULL) {
+		free(vhost);
+		return -1;
+	}
+
+	for(size_t i = 0; i < host_length; ++i) {
+		vhost->host[i] = tolower((unsigned char) vhost->host[i]);
+	}
+
+	vhost->host_length = host_length;
+
+	if(init_vhost(vhost, catalogue, corelated_servers_file) < 0) {
+		free(vhost->host);
+		free(vhost);
+		return -1;
+	}
+
+	vhosts[vhosts_count++] = vhost;
+
+	/* Table is grown before it gets more than half full
+	 */
+	if(2 * vhosts_count > vhost_slots_count) {
+		return build_vhost_slots();
+	}
+
+	size_t slot = hash_host(vhost->host, host_length) & (vhost_slots_count - 1);
+
+	while(vhost_slots[slot] != NULL) {
+		slot = (slot + 1) & (vhost_slots_count - 1);
+	}
+
+	vhost_slots[slot] = vhost;
+	return 0;
+}
+
+
+
+int32_t load_vhosts(const char *path) {
+	FILE *file = fopen(path, "r");
+
+	if(file == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	char *line = NULL;
+	size_t line_size = 0;
+	int32_t line_number = 0;
+	int32_t ret_val = 0;
+
+	while(ret_val == 0 && getline(&line, &line_size, file) != -1) {
+		line_number++;
+
+		char *save_pointer;
+		char *host = strtok_r(line, " \t\r\n", &save_pointer);
+
+		if(host == NULL || host[0] == '#') {
+			continue;
+		}
+
+		char *catalogue = strtok_r(NULL, " \t\r\n", &save_pointer);
+		char *corelated_servers_file = strtok_r(NULL, " \t\r\n", &save_pointer);
+
+		if(corelated_servers_file == NULL || strtok_r(NULL, " \t\r\n", &save_pointer) != NULL) {
+			fprintf(stderr, "%s:%d: expected <host> <catalogue> <corelated-servers-file>\n", path, line_number);
+			ret_val = -1;
+		}
+		else if(add_vhost(host, catalogue, corelated_servers_file) < 0) {
+			fprintf(stderr, "%s:%d: invalid virtual host\n", path, line_number);
+			ret_val = -1;
+		}
+	}
+
+	free(line);
+	fclose(file);
+
+	return ret_val;
+}
+
+
+
+vhost_t *find_vhost(const char *host, size_t length) {
+	if(host != NULL) {
+		vhost_t *vhost = find_loaded_vhost(host, strip_host(host, length));
+
+		if(vhost != NULL) {
+			return vhost;
+		}
+	}
+
+	return get_default_vhost();
+}
+
+
+
+static
+bool is_same_file(const struct stat *first, const struct stat *second) {
+	return (first->st_dev == second->st_dev && first->st_ino == second->st_ino &&
+			first->st_size == second->st_size &&
+			first->st_mtim.tv_sec == second->st_mtim.tv_sec &&
+			first->st_mtim.tv_nsec == second->st_mtim.tv_nsec);
+}
+
+
+
+const redirect_index_t *get_redirect_index(vhost_t *vhost) {
+	time_t now = time(NULL);
+
+	if(now == vhost->redirects_checked) {
+		return vhost->redirects;
+	}
+
+	vhost->redirects_checked = now;
+
+	/* File which can not be read (e.g. while being replaced)
+	 * leaves the rules compiled before in place
+	 */
+	struct stat statbuf;
+
+	if(stat(vhost->corelated_servers_file, &statbuf) < 0 || is_same_file(&statbuf, &vhost->redirects_stat)) {
+		return vhost->redirects;
+	}
+
+	redirect_index_t *redirects = load_redirect_index(vhost->corelated_servers_file);
+
+	if(redirects == NULL) {
+		perror(vhost->corelated_servers_file);
+		return vhost->redirects;
+	}
+
+	delete_redirect_index(vhost->redirects);
+	vhost->redirects = redirects;
+	vhost->redirects_stat = statbuf;
+
+	return redirects;
+}
+
+
+
+archive_t *get_archive(vhost_t *vhost) {
+	if(vhost->archive == NULL) {
+		return NULL;
+	}
+
+	time_t now = time(NULL);
+
+	if(now == vhost->archive_checked) {
+		return vhost->archive;
+	}
+
+	vhost->archive_checked = now;
+
+	/* Archive is deployed by renaming the new one over the old one. Responses
+	 * being sent hold duplicates of the descriptor of the old archive, which
+	 * can be closed right away.
+	 */
+	struct stat statbuf;
+
+	if(stat(vhost->archive_path, &statbuf) < 0 || is_same_file(&statbuf, &vhost->archive_stat)) {
+		return vhost->archive;
+	}
+
+	archive_t *archive = open_archive(vhost->archive_path);
+
+	if(archive == NULL) {
+		return vhost->archive;
+	}
+
+	close_archive(vhost->archive);
+	vhost->archive = archive;
+	vhost->archive_stat = statbuf;
+
+	return archive;
+}
+
+
+
+void refresh_archives(void) {
+	if(default_vhost_set) {
+		get_archive(&default_vhost);
+	}
+
+	for(size_t i = 0; i < vhosts_count; ++i) {
+		get_archive(vhosts[i]);
+	}
+}
@@ -0,0 +1,111 @@
+#ifndef VHOST_H
+#define VHOST_H
+
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "filesearch.h"
+#include "archive.h"
+
+
+
+/* Site served by the server, selected by the Host header of the request.
+ * The default one is made of the catalogue and corelated servers file
+ * passed as program arguments and serves requests for unknown hosts.
+ */
+typedef struct vhost_t vhost_t;
+
+
+
+struct vhost_t {
+	/* Host name in lowercase, without port (NULL for the default site)
+	 */
+	char *host;
+	size_t host_length;
+
+	/* Resolved path of the catalogue
+	 */
+	char *catalogue_path;
+	size_t catalogue_length;
+
+	/* Archive the catalogue has been packed into (NULL for directory
+	 * catalogues), opened again once the file passed as catalogue is
+	 * replaced (checked at most once a second), together with identity
+	 * of the opened file
+	 */
+	char *archive_path;
+	archive_t *archive;
+	struct stat archive_stat;
+	time_t archive_checked;
+
+	/* Rules of corelated servers file, compiled again once the file is
+	 * changed (checked at most once a second), together with identity
+	 * of the file they have been compiled from
+	 */
+	char *corelated_servers_file;
+	redirect_index_t *redirects;
+	struct stat redirects_stat;
+	time_t redirects_checked;
+};
+
+
+
+/* Sets catalogue and corelated servers file of the default site.
+ * Returns the site or NULL if the catalogue can not be resolved or
+ * the file can not be read (reason is printed).
+ */
+vhost_t *set_default_vhost(const char *, const char *);
+
+
+
+/* Returns the default site
+ */
+vhost_t *get_default_vhost(void);
+
+
+
+/* Loads sites from passed file, every line of which consists of host name,
+ * catalogue and corelated servers file separated by whitespace. Empty lines
+ * and lines starting with '#' are skipped. Returns 0 on success and -1 on
+ * malformed line, duplicate host or invalid catalogue or file.
+ */
+int32_t load_vhosts(const char *);
+
+
+
+/* Finds site for passed value of Host header (of passed length, port is
+ * ignored and case does not matter), the default site if none matches
+ */
+vhost_t *find_vhost(const char *, size_t);
+
+
+
+/* Returns compiled rules of corelated servers file of passed site,
+ * compiling them again if the file has changed
+ */
+const redirect_index_t *get_redirect_index(vhost_t *);
+
+
+
+/* Returns archive of passed site (NULL if its catalogue is a directory),
+ * opening it again if the file has been replaced
+ */
+archive_t *get_archive(vhost_t *);
+
+
+
+/* Opens again archives of all sites which have been replaced, so that
+ * the supervising process does not keep the old ones (and their disk
+ * space) and restarted workers start with the new ones
+ */
+void refresh_archives(void);
+
+
+
+#endif /* VHOST_H */
@@ -0,0 +1,802 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "warmup.h"
+
+
+
+/* Maximum number of distinct files loaded from the snapshots
+ */
+#define MAX_SNAPSHOT_ENTRIES 		 65536
+
+
+
+/* Size of the hit table of a worker (power of two), paths
+ * beyond three quarters of it are not counted
+ */
+#define HIT_TABLE_SIZE 			 8192
+
+
+
+enum {
+	OPTION_THREADS = 0,
+	OPTION_PRELOAD,
+	OPTION_LOCK,
+	OPTION_SNAPSHOT
+};
+
+
+
+static char *const option_names[] = {
+	[OPTION_THREADS] = "threads",
+	[OPTION_PRELOAD] = "preload",
+	[OPTION_LOCK] = "lock",
+	[OPTION_SNAPSHOT] = "snapshot",
+	NULL
+};
+
+
+
+static bool warmup_enabled = false;
+static long long threads_count = DEFAULT_WARMUP_THREADS;
+static long long preload_size = DEFAULT_WARMUP_PRELOAD;
+static long long lock_size = 0;
+static const char *snapshot_path = NULL;
+
+
+
+/* File listed in the snapshots together with its total hit count,
+ * path is relative to the catalogue (as requested by clients)
+ */
+struct hot_file {
+	char *path;
+	unsigned long long hits;
+};
+
+
+
+/* Hot files sorted by hit count (in descending order), and the same
+ * files sorted by path, which the walk looks them up in
+ */
+static struct hot_file *hot_files = NULL;
+static struct hot_file **hot_files_by_path = NULL;
+static size_t hot_files_count = 0;
+
+static atomic_size_t next_hot_file;
+
+
+
+static const char *warmup_catalogue = NULL;
+
+/* Remaining amounts of content to preload and to lock
+ */
+static atomic_llong preload_left;
+static atomic_llong lock_left;
+static atomic_bool lock_failed;
+
+static atomic_llong directories_walked;
+static atomic_llong files_found;
+static atomic_llong bytes_preloaded;
+static atomic_llong bytes_locked;
+
+
+
+/* Directories (relative to the catalogue) waiting to be walked and number
+ * of threads walking a directory, which may find further ones
+ */
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_cond = PTHREAD_COND_INITIALIZER;
+static char **pending_directories = NULL;
+static size_t pending_count = 0;
+static size_t pending_capacity = 0;
+static int32_t busy_threads = 0;
+
+
+
+/* Hit counts of the calling worker
+ */
+struct hit_entry {
+	char *path;
+	unsigned long long hits;
+};
+
+static struct hit_entry hit_table[HIT_TABLE_SIZE];
+static int32_t hit_entries_count = 0;
+
+
+
+static
+int32_t parse_option_number(const char *value, long long *target) {
+	if(value == NULL || *value == '\0') {
+		return -1;
+	}
+
+	char *end = NULL;
+	errno = 0;
+	long long parsed = strtoll(value, &end, 10);
+
+	if(errno != 0 || *end != '\0' || parsed < 0) {
+		return -1;
+	}
+
+	*target = parsed;
+	return 0;
+}
+
+
+
+int32_t parse_warmup_options(char *options) {
+	char *value = NULL;
+
+	while(*options != '\0') {
+		int32_t status = -1;
+
+		switch(getsubopt(&options, option_names, &value)) {
+			case OPTION_THREADS:
+				status = parse_option_number(value, &threads_count);
+
+				if(threads_count < 1 || threads_count > MAX_WARMUP_THREADS) {
+					status = -1;
+				}
+				break;
+			case OPTION_PRELOAD:
+				status = parse_option_number(value, &preload_size);
+				break;
+			case OPTION_LOCK:
+				status = parse_option_number(value, &lock_size);
+				break;
+			case OPTION_SNAPSHOT:
+				if(value != NULL && *value != '\0') {
+					snapshot_path = value;
+					status = 0;
+				}
+				break;
+			default:
+				fprintf(stderr, "Unknown warm-up option: %s\n", value);
+				return -1;
+		}
+
+		if(status < 0) {
+			fprintf(stderr, "Invalid warm-up option value: %s\n", value == NULL ? "(none)" : value);
+			return -1;
+		}
+	}
+
+	warmup_enabled = true;
+	return 0;
+}
+
+
+
+bool is_warmup_enabled(void) {
+	return warmup_enabled;
+}
+
+
+
+/* Writes name of snapshot file of the worker with passed
+ * index into the buffer of passed size
+ */
+static
+int32_t get_snapshot_file_name(char *buffer, size_t size, int32_t worker_index) {
+	int32_t length;
+
+	if(worker_index < 0) {
+		length = snprintf(buffer, size, "%s", snapshot_path);
+	}
+	else {
+		length = snprintf(buffer, size, "%s.%d", snapshot_path, worker_index);
+	}
+
+	return (length < 0 || (size_t) length >= size) ? -1 : 0;
+}
+
+
+
+/* Appends lines of the snapshot file ("<hits> <path>") to the hot files,
+ * a missing file is not an error
+ */
+static
+void load_snapshot_file(const char *file_name, size_t *capacity) {
+	FILE *file = fopen(file_name, "r");
+
+	if(file == NULL) {
+		if(errno != ENOENT) {
+			perror(file_name);
+		}
+
+		return;
+	}
+
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+
+	while((length = getline(&line, &line_size, file)) > 0 && hot_files_count < MAX_SNAPSHOT_ENTRIES) {
+		if(line[length - 1] == '\n') {
+			line[length - 1] = '\0';
+		}
+
+		char *path = NULL;
+		errno = 0;
+		unsigned long long hits = strtoull(line, &path, 10);
+
+		if(errno != 0 || path == line || *path != ' ' || path[1] != '/') {
+			continue;
+		}
+
+		if(hot_files_count == *capacity) {
+			size_t new_capacity = (*capacity == 0) ? 256 : *capacity * 2;
+			struct hot_file *resized = realloc(hot_files, new_capacity * sizeof(struct hot_file));
+
+			if(resized == NULL) {
+				break;
+			}
+
+			hot_files = resized;
+			*capacity = new_capacity;
+		}
+
+		hot_files[hot_files_count].path = strdup(path + 1);
+
+		if(hot_files[hot_files_count].path == NULL) {
+			break;
+		}
+
+		hot_files[hot_files_count].hits = hits;
+		hot_files_count++;
+	}
+
+	free(line);
+	fclose(file);
+}
+
+
+
+static
+int compare_paths(const void *a, const void *b) {
+	const struct hot_file *first = a;
+	const struct hot_file *second = b;
+
+	return strcmp(first->path, second->path);
+}
+
+
+
+static
+int compare_hits(const void *a, const void *b) {
+	const struct hot_file *first = a;
+	const struct hot_file *second = b;
+
+	if(first->hits != second->hits) {
+		return (first->hits < second->hits) ? 1 : -1;
+	}
+
+	return strcmp(first->path, second->path);
+}
+
+
+
+static
+int compare_path_pointers(const void *a, const void *b) {
+	return compare_paths(*(const struct hot_file **) a, *(const struct hot_file **) b);
+}
+
+
+
+/* Loads snapshots of all the workers, merging counts of the same path
+ */
+static
+void load_hot_files(int32_t workers_count) {
+	char file_name[PATH_MAX];
+	size_t capacity = 0;
+
+	if(workers_count == 1) {
+		if(get_snapshot_file_name(file_name, sizeof(file_name), -1) == 0) {
+			load_snapshot_file(file_name, &capacity);
+		}
+	}
+	else {
+		for(int32_t worker = 0; worker < workers_count; ++worker) {
+			if(get_snapshot_file_name(file_name, sizeof(file_name), worker) == 0) {
+				load_snapshot_file(file_name, &capacity);
+			}
+		}
+	}
+
+	if(hot_files_count == 0) {
+		return;
+	}
+
+	qsort(hot_files, hot_files_count, sizeof(struct hot_file), compare_paths);
+
+	size_t merged_count = 1;
+
+	for(size_t i = 1; i < hot_files_count; ++i) {
+		if(strcmp(hot_files[i].path, hot_files[merged_count - 1].path) == 0) {
+			hot_files[merged_count - 1].hits += hot_files[i].hits;
+			free(hot_files[i].path);
+		}
+		else {
+			hot_files[merged_count++] = hot_files[i];
+		}
+	}
+
+	hot_files_count = merged_count;
+	qsort(hot_files, hot_files_count, sizeof(struct hot_file), compare_hits);
+
+	hot_files_by_path = malloc(hot_files_count * sizeof(struct hot_file *));
+
+	if(hot_files_by_path != NULL) {
+		for(size_t i = 0; i < hot_files_count; ++i) {
+			hot_files_by_path[i] = &hot_files[i];
+		}
+
+		qsort(hot_files_by_path, hot_files_count, sizeof(struct hot_file *), compare_path_pointers);
+	}
+}
+
+
+
+static
+void free_hot_files(void) {
+	for(size_t i = 0; i < hot_files_count; ++i) {
+		free(hot_files[i].path);
+	}
+
+	free(hot_files);
+	free(hot_files_by_path);
+
+	hot_files = NULL;
+	hot_files_by_path = NULL;
+	hot_files_count = 0;
+}
+
+
+
+static
+bool is_hot_file(const char *path) {
+	if(hot_files_by_path == NULL) {
+		return false;
+	}
+
+	struct hot_file key = { (char *) path, 0 };
+	struct hot_file *key_pointer = &key;
+
+	return (bsearch(&key_pointer, hot_files_by_path, hot_files_count, sizeof(struct hot_file *),
+					compare_path_pointers) != NULL);
+}
+
+
+
+/* Takes passed amount from the budget if there is enough left
+ */
+static
+bool claim_budget(atomic_llong *budget, long long amount) {
+	long long left = atomic_load(budget);
+
+	while(left >= amount) {
+		if(atomic_compare_exchange_weak(budget, &left, left - amount)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+
+/* Maps the file populating its pages, which returns once the whole content
+ * is in the page cache. Mapping locked in memory is left in place.
+ */
+static
+void populate_file(int32_t fd, off_t size, bool lock) {
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+
+	if(mapping == MAP_FAILED) {
+		return;
+	}
+
+	if(lock) {
+		if(mlock(mapping, size) == 0) {
+			atomic_fetch_add(&bytes_locked, size);
+			return;
+		}
+
+		if(!atomic_exchange(&lock_failed, true)) {
+			perror("Locking warm-up working set");
+		}
+	}
+
+	munmap(mapping, size);
+	atomic_fetch_add(&bytes_preloaded, size);
+}
+
+
+
+static
+bool is_within_catalogue(const char *path) {
+	size_t length = strlen(warmup_catalogue);
+
+	return (strncmp(warmup_catalogue, path, length) == 0 && (path[length] == '/' || path[length] == '\0'));
+}
+
+
+
+static
+void warm_hot_file(const struct hot_file *file) {
+	char path[PATH_MAX];
+
+	if(snprintf(path, sizeof(path), "%s%s", warmup_catalogue, file->path) >= (int) sizeof(path)) {
+		return;
+	}
+
+	/* Snapshot is not trusted to stay within the catalogue
+	 */
+	char *resolved_path = realpath(path, NULL);
+
+	if(resolved_path == NULL) {
+		return;
+	}
+
+	int32_t fd = -1;
+
+	if(is_within_catalogue(resolved_path)) {
+		fd = open(resolved_path, O_RDONLY | O_CLOEXEC);
+	}
+
+	free(resolved_path);
+
+	struct stat statbuf;
+
+	if(fd < 0) {
+		return;
+	}
+
+	if(fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) || statbuf.st_size == 0) {
+		close(fd);
+		return;
+	}
+
+	if(!atomic_load(&lock_failed) && claim_budget(&lock_left, statbuf.st_size)) {
+		populate_file(fd, statbuf.st_size, true);
+	}
+	else if(claim_budget(&preload_left, statbuf.st_size)) {
+		populate_file(fd, statbuf.st_size, false);
+	}
+
+	close(fd);
+}
+
+
+
+static
+void push_directory(char *relative_path) {
+	pthread_mutex_lock(&walk_lock);
+
+	if(pending_count == pending_capacity) {
+		size_t new_capacity = (pending_capacity == 0) ? 64 : pending_capacity * 2;
+		char **resized = realloc(pending_directories, new_capacity * sizeof(char *));
+
+		/* Warm-up is best effort, the directory is skipped
+		 */
+		if(resized == NULL) {
+			pthread_mutex_unlock(&walk_lock);
+			free(relative_path);
+			return;
+		}
+
+		pending_directories = resized;
+		pending_capacity = new_capacity;
+	}
+
+	pending_directories[pending_count++] = relative_path;
+
+	pthread_cond_signal(&walk_cond);
+	pthread_mutex_unlock(&walk_lock);
+}
+
+
+
+/* Stats every entry of the directory (path relative to the catalogue, empty
+ * for the catalogue itself) and reads ahead files which are not hot ones while
+ * there is preload budget left. Symbolic links are not followed into
+ * directories, so that the walk can not loop.
+ */
+static
+void walk_directory(const char *relative_path) {
+	char path[PATH_MAX];
+
+	if(snprintf(path, sizeof(path), "%s%s", warmup_catalogue, relative_path) >= (int) sizeof(path)) {
+		return;
+	}
+
+	DIR *directory = opendir(path);
+
+	if(directory == NULL) {
+		return;
+	}
+
+	atomic_fetch_add(&directories_walked, 1);
+
+	int32_t directory_fd = dirfd(directory);
+	struct dirent *entry;
+
+	while((entry = readdir(directory)) != NULL) {
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+
+		struct stat statbuf;
+
+		if(fstatat(directory_fd, entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+			continue;
+		}
+
+		/* Target of the link is served like any other file
+		 */
+		if(S_ISLNK(statbuf.st_mode) &&
+		   (fstatat(directory_fd, entry->d_name, &statbuf, 0) < 0 || !S_ISREG(statbuf.st_mode))) {
+			continue;
+		}
+
+		char child_path[PATH_MAX];
+
+		if(snprintf(child_path, sizeof(child_path), "%s/%s", relative_path, entry->d_name) >= (int) sizeof(child_path)) {
+			continue;
+		}
+
+		if(S_ISDIR(statbuf.st_mode)) {
+			char *pending_path = strdup(child_path);
+
+			if(pending_path != NULL) {
+				push_directory(pending_path);
+			}
+
+			continue;
+		}
+
+		if(!S_ISREG(statbuf.st_mode)) {
+			continue;
+		}
+
+		atomic_fetch_add(&files_found, 1);
+
+		if(statbuf.st_size == 0 || is_hot_file(child_path) || !claim_budget(&preload_left, statbuf.st_size)) {
+			continue;
+		}
+
+		int32_t fd = openat(directory_fd, entry->d_name, O_RDONLY | O_CLOEXEC);
+
+		if(fd >= 0) {
+			if(readahead(fd, 0, statbuf.st_size) == 0) {
+				atomic_fetch_add(&bytes_preloaded, statbuf.st_size);
+			}
+
+			close(fd);
+		}
+	}
+
+	closedir(directory);
+}
+
+
+
+static
+void *run_hot_files_thread(void *arg) {
+	(void) arg;
+
+	size_t index;
+
+	while((index = atomic_fetch_add(&next_hot_file, 1)) < hot_files_count) {
+		warm_hot_file(&hot_files[index]);
+	}
+
+	return NULL;
+}
+
+
+
+static
+void *run_walk_thread(void *arg) {
+	(void) arg;
+
+	while(true) {
+		pthread_mutex_lock(&walk_lock);
+
+		while(pending_count == 0 && busy_threads > 0) {
+			pthread_cond_wait(&walk_cond, &walk_lock);
+		}
+
+		/* No directory is left and none can be found anymore
+		 */
+		if(pending_count == 0) {
+			pthread_mutex_unlock(&walk_lock);
+			return NULL;
+		}
+
+		char *relative_path = pending_directories[--pending_count];
+		busy_threads++;
+
+		pthread_mutex_unlock(&walk_lock);
+
+		walk_directory(relative_path);
+		free(relative_path);
+
+		pthread_mutex_lock(&walk_lock);
+		busy_threads--;
+
+		if(busy_threads == 0 && pending_count == 0) {
+			pthread_cond_broadcast(&walk_cond);
+		}
+
+		pthread_mutex_unlock(&walk_lock);
+	}
+}
+
+
+
+/* Runs passed function on the warm-up threads and waits for all of them
+ */
+static
+void run_warmup_threads(void *(*function)(void *)) {
+	pthread_t threads[MAX_WARMUP_THREADS];
+	int32_t started = 0;
+
+	for(int32_t i = 0; i < threads_count; ++i) {
+		if(pthread_create(&threads[started], NULL, function, NULL) != 0) {
+			break;
+		}
+
+		started++;
+	}
+
+	/* Calling thread does the work alone if none could be started
+	 */
+	if(started == 0) {
+		function(NULL);
+	}
+
+	for(int32_t i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+
+
+void warm_up_catalogue(const char *catalogue_path, int32_t workers_count) {
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	warmup_catalogue = catalogue_path;
+
+	atomic_store(&preload_left, preload_size);
+	atomic_store(&lock_left, lock_size);
+	atomic_store(&next_hot_file, 0);
+
+	if(snapshot_path != NULL) {
+		load_hot_files(workers_count);
+	}
+
+	/* Hottest files take the budgets first
+	 */
+	run_warmup_threads(run_hot_files_thread);
+
+	char *root = strdup("");
+
+	if(root != NULL) {
+		push_directory(root);
+		run_warmup_threads(run_walk_thread);
+	}
+
+	free(pending_directories);
+	pending_directories = NULL;
+	pending_capacity = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("Warm-up finished in %.2fs: %lld directories, %lld files, %zu hot files, "
+		   "%lld bytes preloaded, %lld bytes locked\n",
+		   (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9,
+		   (long long) atomic_load(&directories_walked), (long long) atomic_load(&files_found), hot_files_count,
+		   (long long) atomic_load(&bytes_preloaded), (long long) atomic_load(&bytes_locked));
+
+	free_hot_files();
+}
+
+
+
+static
+uint32_t hash_path(const char *path, size_t length) {
+	uint32_t hash = 2166136261u;
+
+	for(size_t i = 0; i < length; ++i) {
+		hash = (hash ^ (unsigned char) path[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+
+
+void record_file_hit(const char *path, size_t length) {
+	if(snapshot_path == NULL) {
+		return;
+	}
+
+	uint32_t slot = hash_path(path, length) & (HIT_TABLE_SIZE - 1);
+
+	while(hit_table[slot].path != NULL) {
+		if(strncmp(hit_table[slot].path, path, length) == 0 && hit_table[slot].path[length] == '\0') {
+			hit_table[slot].hits++;
+			return;
+		}
+
+		slot = (slot + 1) & (HIT_TABLE_SIZE - 1);
+	}
+
+	if(hit_entries_count >= HIT_TABLE_SIZE / 4 * 3) {
+		return;
+	}
+
+	hit_table[slot].path = strndup(path, length);
+
+	if(hit_table[slot].path != NULL) {
+		hit_table[slot].hits = 1;
+		hit_entries_count++;
+	}
+}
+
+
+
+void save_hit_snapshot(int32_t worker_index) {
+	/* Worker which has not served anything keeps the previous snapshot
+	 */
+	if(snapshot_path == NULL || hit_entries_count == 0) {
+		return;
+	}
+
+	char file_name[PATH_MAX];
+	char temp_name[PATH_MAX];
+
+	if(get_snapshot_file_name(file_name, sizeof(file_name), worker_index) < 0 ||
+	   snprintf(temp_name, sizeof(temp_name), "%s.tmp-%d", file_name, (int) getpid()) >= (int) sizeof(temp_name)) {
+
+		fprintf(stderr, "Snapshot file name is too long\n");
+		return;
+	}
+
+	/* Written aside and renamed, so that the previous snapshot
+	 * survives failure
+	 */
+	FILE *file = fopen(temp_name, "w");
+
+	if(file == NULL) {
+		perror(temp_name);
+		return;
+	}
+
+	for(int32_t slot = 0; slot < HIT_TABLE_SIZE; ++slot) {
+		if(hit_table[slot].path != NULL) {
+			fprintf(file, "%llu %s\n", hit_table[slot].hits, hit_table[slot].path);
+		}
+	}
+
+	if(fclose(file) != 0 || rename(temp_name, file_name) < 0) {
+		perror(file_name);
+		unlink(temp_name);
+	}
+}
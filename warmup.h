@@ -0,0 +1,67 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+
+/* Default number of threads walking the catalogue and default
+ * amount of file content read into the page cache
+ */
+#define DEFAULT_WARMUP_THREADS 		 4
+#define DEFAULT_WARMUP_PRELOAD 		 (256 << 20)
+
+#define MAX_WARMUP_THREADS 			 64
+
+
+
+/* Parses comma separated list of warm-up options (as passed to the -W server
+ * option), which also enables the warm-up. Recognised options:
+ * threads=<n>        threads walking the catalogue in parallel
+ * preload=<bytes>    amount of file content read into the page cache, hottest
+ *                    files first, then files in the order they are found
+ * lock=<bytes>       amount of content of the hottest files locked in memory
+ * snapshot=<path>    file the hit counts of served files are saved into when
+ *                    a worker terminates, and which orders the files by
+ *                    hotness on the next start
+ * Returns 0 on success and -1 on unknown option or invalid value.
+ */
+int32_t parse_warmup_options(char *);
+
+
+
+/* Checks whether the warm-up has been configured
+ */
+bool is_warmup_enabled(void);
+
+
+
+/* Walks passed catalogue in parallel, bringing inodes of all the files into
+ * the kernel caches, and reads content of the hottest files (according to
+ * the snapshots saved by passed number of workers) into the page cache, and
+ * locks part of it in memory. Returns once the warm-up has finished.
+ * Locked mappings stay in place for the lifetime of the process.
+ */
+void warm_up_catalogue(const char *, int32_t);
+
+
+
+/* Counts request for file of passed path (relative to the catalogue)
+ * and length served by the calling worker, if snapshot is configured
+ */
+void record_file_hit(const char *, size_t);
+
+
+
+/* Saves hit counts of the calling worker with passed index (-1 for
+ * the only worker) into its snapshot file, if snapshot is configured
+ */
+void save_hit_snapshot(int32_t);
+
+
+
+#endif /* WARMUP_H */